@@ -0,0 +1,256 @@
+
+
+#ifndef _AGGREGATE_H_
+#define _AGGREGATE_H_
+
+// Aggregates and sampling
+// SELECT COUNT(*), COUNT(expr), SUM(expr), AVG(expr), MIN(expr) or MAX(expr) runs the normal pipeline of the query,
+// which outputs the aggregated expression for every qualifying row. The output of every morsel is aggregated on its
+// own and the partial aggregates are combined, the result is a single row (or no rows for the MIN or MAX of nothing).
+// FROM table TABLESAMPLE (p PERCENT) scans a random p% of the blocks of the table, a block is a chunk of the buffer
+// manager (see buffer.h) or of the delta. The other blocks are never pinned, so they are not read from disk either.
+// REPEATABLE (seed) selects the same blocks for the same seed (as long as the table does not change). A sample of a
+// table that is not empty always has at least one block: if no block is selected, the block with the lowest hash is.
+// An aggregate over a sample is estimated from the sampled blocks (a cluster sample of equally sized blocks, so the
+// blocks are the units of the estimate, not the morsels), the result has the columns estimate, lower and upper: the
+// estimate and its 95% confidence interval. COUNT and SUM are ratio estimates (qualifying rows or sum per row of the
+// table, scaled to all rows), AVG is the ratio of the sum and the count of the sampled blocks. The variance is
+// estimated from the spread of the blocks, so with a single sampled block (and more blocks in the table) it is unknown
+// and the interval is (-inf, inf); if all blocks are sampled the interval is the estimate itself. MIN and MAX are the
+// minimum and maximum of the sample, they have no interval (NaN).
+
+#include <limits.h>
+#include <math.h>
+
+#define SAMPLE_CONFIDENCE_Z 1.96  // the 97.5% quantile of the normal distribution, for 95% confidence intervals
+
+typedef struct {
+    size_t blocks;   // amount of blocks of the table before sampling
+    lng rows;        // amount of rows of the table
+} SampleInfo;
+
+typedef struct {
+    lng count;
+    lng lsum;       // sum of integer values
+    dbl dsum;       // sum of floating point values, or of the integer values as doubles
+    lng lmin, lmax;
+    dbl dmin, dmax;
+} PartialAggregate;
+
+static uint64_t SampleHash(uint64_t x) {
+    // splitmix64 finalizer
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Returns the index of the first morsel after the block (consecutive morsels with the same inputs) that starts at i
+static size_t BlockEnd(MorselList *list, size_t i) {
+    size_t end = i + 1;
+    while (end < list->count && list->morsels[end].inputs == list->morsels[i].inputs) {
+        end++;
+    }
+    return end;
+}
+
+// Keeps the morsels of a random percent% of the blocks of the table (but at least one block), the morsels of the
+// other blocks are removed from the list. A negative seed selects a different sample every time.
+// Must be called before the morsels are run
+static void SampleMorsels(MorselList *list, double percent, lng seed, SampleInfo *info) {
+    if (seed < 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seed = (lng) (now.tv_sec * 1000000000LL + now.tv_nsec);
+    }
+    uint64_t threshold = percent >= 100 ? UINT64_MAX : (uint64_t) (percent / 100 * 18446744073709551616.0);
+    uint64_t seed_hash = SampleHash((uint64_t) seed);
+    // the block with the lowest hash is sampled if the threshold selects no block
+    uint64_t lowest = UINT64_MAX;
+    info->blocks = 0;
+    info->rows = 0;
+    for(size_t i = 0; i < list->count; i = BlockEnd(list, i)) {
+        uint64_t hash = SampleHash(seed_hash ^ info->blocks++);
+        if (hash < lowest) lowest = hash;
+    }
+    if (lowest > threshold) threshold = lowest;
+    size_t kept = 0;
+    for(size_t block = 0, i = 0; i < list->count; block++) {
+        size_t end = BlockEnd(list, i);
+        bool sampled = SampleHash(seed_hash ^ block) <= threshold;
+        if (!sampled) free(list->morsels[i].inputs);
+        for(; i < end; i++) {
+            info->rows += list->morsels[i].end - list->morsels[i].start;
+            if (sampled) list->morsels[kept++] = list->morsels[i];
+        }
+    }
+    list->count = kept;
+}
+
+static bool IsIntegerType(int type) {
+    return type == TYPE_int || type == TYPE_lng;
+}
+
+// Aggregates the first output of a morsel
+static void AggregateOutput(QueryOutput *output, int type, PartialAggregate *partial) {
+    memset(partial, 0, sizeof(PartialAggregate));
+    partial->count = output->count;
+    partial->lmin = LLONG_MAX;
+    partial->lmax = LLONG_MIN;
+    partial->dmin = INFINITY;
+    partial->dmax = -INFINITY;
+    for(lng i = 0; i < output->count; i++) {
+        lng l = 0;
+        dbl d;
+        switch(type) {
+            case TYPE_int: l = ((int*) output->data[0])[i]; d = (dbl) l; break;
+            case TYPE_lng: l = ((lng*) output->data[0])[i]; d = (dbl) l; break;
+            case TYPE_flt: d = ((flt*) output->data[0])[i]; break;
+            default: d = ((dbl*) output->data[0])[i]; break;
+        }
+        partial->lsum += l;
+        partial->dsum += d;
+        if (l < partial->lmin) partial->lmin = l;
+        if (l > partial->lmax) partial->lmax = l;
+        if (d < partial->dmin) partial->dmin = d;
+        if (d > partial->dmax) partial->dmax = d;
+    }
+}
+
+static Column *CreateAggregateColumn(const char *name, int type, void *value, bool empty) {
+    unsigned char size = GetTypeSize(type);
+    void *data = malloc(size);
+    memcpy(data, value, size);
+    Column *column = CreateColumn((double*) data, empty ? 0 : 1);
+    column->type = type;
+    column->elsize = size;
+    free(column->name);
+    column->name = strdup(name);
+    return column;
+}
+
+// Combines the partial aggregates of the morsels into the result of the aggregate
+// type is the type of the aggregated expression, sample is NULL if all blocks of the table were scanned
+static Table *ComputeAggregate(MorselList *list, int aggregate, int type, SampleInfo *sample) {
+    size_t n = list->count;
+    PartialAggregate *partials = (PartialAggregate*) malloc((n + 1) * sizeof(PartialAggregate));
+    PartialAggregate total;
+    memset(&total, 0, sizeof(PartialAggregate));
+    total.lmin = LLONG_MAX;
+    total.lmax = LLONG_MIN;
+    total.dmin = INFINITY;
+    total.dmax = -INFINITY;
+    lng rows = 0;
+    for(size_t i = 0; i < n; i++) {
+        AggregateOutput(&list->morsels[i].output, type, &partials[i]);
+        total.count += partials[i].count;
+        total.lsum += partials[i].lsum;
+        total.dsum += partials[i].dsum;
+        if (partials[i].lmin < total.lmin) total.lmin = partials[i].lmin;
+        if (partials[i].lmax > total.lmax) total.lmax = partials[i].lmax;
+        if (partials[i].dmin < total.dmin) total.dmin = partials[i].dmin;
+        if (partials[i].dmax > total.dmax) total.dmax = partials[i].dmax;
+        rows += list->morsels[i].end - list->morsels[i].start;
+    }
+
+    Column *column;
+    if (!sample) {
+        bool integer = IsIntegerType(type);
+        lng l;
+        dbl d;
+        switch(aggregate) {
+            case AGGREGATE_count:
+                column = CreateAggregateColumn("count", TYPE_lng, &total.count, false);
+                break;
+            case AGGREGATE_sum:
+                column = integer ? CreateAggregateColumn("sum", TYPE_lng, &total.lsum, false) :
+                    CreateAggregateColumn("sum", TYPE_dbl, &total.dsum, false);
+                break;
+            case AGGREGATE_avg:
+                d = total.count > 0 ? (integer ? (dbl) total.lsum : total.dsum) / total.count : NAN;
+                column = CreateAggregateColumn("avg", TYPE_dbl, &d, false);
+                break;
+            default:
+            {
+                bool minimum = aggregate == AGGREGATE_min;
+                const char *name = minimum ? "min" : "max";
+                if (integer) {
+                    l = minimum ? total.lmin : total.lmax;
+                    if (type == TYPE_int) {
+                        int value = (int) l;
+                        column = CreateAggregateColumn(name, type, &value, total.count == 0);
+                    } else {
+                        column = CreateAggregateColumn(name, type, &l, total.count == 0);
+                    }
+                } else {
+                    d = minimum ? total.dmin : total.dmax;
+                    if (type == TYPE_flt) {
+                        flt value = (flt) d;
+                        column = CreateAggregateColumn(name, type, &value, total.count == 0);
+                    } else {
+                        column = CreateAggregateColumn(name, type, &d, total.count == 0);
+                    }
+                }
+                break;
+            }
+        }
+        free(partials);
+        return CreateTable("Result", column);
+    }
+
+    // estimate from the sampled blocks: y is the value of the aggregate for a block, x the auxiliary variable
+    // (the rows of the block, or the qualifying rows for AVG) whose total is known or is estimated as well
+    dbl *block_x = (dbl*) calloc(n + 1, sizeof(dbl));
+    dbl *block_y = (dbl*) calloc(n + 1, sizeof(dbl));
+    size_t blocks = 0;
+    for(size_t i = 0; i < n; blocks++) {
+        for(size_t end = BlockEnd(list, i); i < end; i++) {
+            block_x[blocks] += aggregate == AGGREGATE_avg ? (dbl) partials[i].count :
+                (dbl) (list->morsels[i].end - list->morsels[i].start);
+            block_y[blocks] += aggregate == AGGREGATE_count ? (dbl) partials[i].count : partials[i].dsum;
+        }
+    }
+    dbl estimate, variance = INFINITY;
+    dbl f = sample->blocks > 0 ? (dbl) blocks / sample->blocks : 1;
+    dbl sum_x = aggregate == AGGREGATE_avg ? (dbl) total.count : (dbl) rows;
+    dbl sum_y = aggregate == AGGREGATE_count ? (dbl) total.count : total.dsum;
+    // without rows in the sample the sum is zero as well, but the average of nothing is unknown
+    dbl ratio = sum_x > 0 ? sum_y / sum_x : (aggregate == AGGREGATE_avg ? NAN : 0);
+    if (aggregate == AGGREGATE_min || aggregate == AGGREGATE_max) {
+        estimate = total.count > 0 ? (aggregate == AGGREGATE_min ? total.dmin : total.dmax) : NAN;
+        variance = NAN;
+    } else {
+        dbl residuals = 0;
+        for(size_t i = 0; i < blocks; i++) {
+            residuals += (block_y[i] - ratio * block_x[i]) * (block_y[i] - ratio * block_x[i]);
+        }
+        if (f >= 1) {
+            variance = 0;
+        } else if (blocks >= 2) {
+            variance = (1 - f) / blocks * residuals / (blocks - 1);
+        }
+        if (aggregate == AGGREGATE_avg) {
+            // variance of the ratio: divided by the square of the mean count of the blocks
+            dbl mean_x = sum_x / blocks;
+            estimate = ratio;
+            if (variance > 0 && isfinite(variance)) variance = variance / (mean_x * mean_x);
+        } else {
+            // variance of the total: the sampled blocks represent all blocks of the table
+            estimate = ratio * sample->rows;
+            if (variance > 0 && isfinite(variance)) variance = variance * sample->blocks * sample->blocks;
+        }
+    }
+    free(block_x);
+    free(block_y);
+    dbl error = SAMPLE_CONFIDENCE_Z * sqrt(variance);
+    dbl lower = estimate - error, upper = estimate + error;
+    Column *columns = CreateAggregateColumn("estimate", TYPE_dbl, &estimate, false);
+    columns->next = CreateAggregateColumn("lower", TYPE_dbl, &lower, false);
+    columns->next->next = CreateAggregateColumn("upper", TYPE_dbl, &upper, false);
+    free(partials);
+    return CreateTable("Result", columns);
+}
+
+#endif
@@ -0,0 +1,285 @@
+
+
+#ifndef _ASYNCIO_H_
+#define _ASYNCIO_H_
+
+// Asynchronous file reads, used by the buffer manager to read chunks ahead of the scans (see buffer.h)
+// Reads are submitted to io_uring by a single I/O thread that reaps their completions. io_uring is used through
+// the raw system calls, so there is no dependency on liburing. If the kernel does not support io_uring (or it is
+// disabled with -no-io-uring) the reads are done with pread by a small pool of I/O threads instead.
+// The callback of a read is called on an I/O thread, once the read has finished or failed.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define ASYNC_IO_THREADS 4
+#define ASYNC_IO_ENTRIES 64
+
+typedef void (*AsyncCallback)(void *arg, bool success);
+
+typedef struct _AsyncRead {
+    const char *path;
+    void *data;
+    size_t bytes;
+    off_t offset;
+    AsyncCallback callback;
+    void *arg;
+    int fd;
+    size_t done;        // amount of bytes that have been read
+    struct iovec iov;   // remaining part of the read (io_uring)
+    struct _AsyncRead *next;
+} AsyncRead;
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} AsyncRing;
+
+static bool async_io_uring = true;  // -no-io-uring
+static bool async_started = false;
+static bool async_stopping = false;
+static bool async_uses_uring = false;
+static AsyncRead *async_head = NULL;
+static AsyncRead *async_tail = NULL;
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t async_threads[ASYNC_IO_THREADS];
+static size_t async_thread_count = 0;
+static AsyncRing async_ring;
+
+// Takes the next queued read, called with async_lock held
+static AsyncRead *AsyncDequeue(void) {
+    AsyncRead *read = async_head;
+    if (read) {
+        async_head = read->next;
+        if (!async_head) async_tail = NULL;
+    }
+    return read;
+}
+
+static void AsyncFinish(AsyncRead *read, bool success) {
+    if (read->fd >= 0) close(read->fd);
+    read->callback(read->arg, success);
+    free(read);
+}
+
+static void *AsyncPreadThread(void *arg) {
+    (void) arg;
+    while (true) {
+        pthread_mutex_lock(&async_lock);
+        while (!async_head && !async_stopping) {
+            pthread_cond_wait(&async_cond, &async_lock);
+        }
+        AsyncRead *read = AsyncDequeue();
+        pthread_mutex_unlock(&async_lock);
+        if (!read) return NULL;
+        read->fd = open(read->path, O_RDONLY);
+        bool success = read->fd >= 0;
+        while (success && read->done < read->bytes) {
+            ssize_t count = pread(read->fd, (char*) read->data + read->done, read->bytes - read->done, read->offset + read->done);
+            if (count < 0 && errno == EINTR) continue;
+            success = count > 0;
+            if (success) read->done += count;
+        }
+        AsyncFinish(read, success);
+    }
+}
+
+static bool AsyncSetupRing(AsyncRing *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int) syscall(__NR_io_uring_setup, ASYNC_IO_ENTRIES, &params);
+    if (ring->fd < 0) return false;
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_size > sq_size) sq_size = cq_size;
+    char *sq = (char*) mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !single) {
+        cq = (char*) mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = (struct io_uring_sqe*) mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        // the mappings are released when the process exits
+        close(ring->fd);
+        return false;
+    }
+    ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return true;
+}
+
+static void AsyncSubmitRead(AsyncRing *ring, AsyncRead *read, size_t slot) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    read->iov.iov_base = (char*) read->data + read->done;
+    read->iov.iov_len = read->bytes - read->done;
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = read->fd;
+    sqe->off = read->offset + read->done;
+    sqe->addr = (uint64_t) (uintptr_t) &read->iov;
+    sqe->len = 1;
+    sqe->user_data = slot;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *AsyncRingThread(void *arg) {
+    AsyncRing *ring = (AsyncRing*) arg;
+    AsyncRead *slots[ASYNC_IO_ENTRIES];  // reads that are in flight, the slot is the user data of the request
+    size_t in_flight = 0;
+    memset(slots, 0, sizeof(slots));
+    AsyncRead *retry = NULL;  // partial reads that have to be submitted again
+    while (true) {
+        unsigned submit = 0;
+        pthread_mutex_lock(&async_lock);
+        while (!async_head && !retry && in_flight == 0 && !async_stopping) {
+            pthread_cond_wait(&async_cond, &async_lock);
+        }
+        if (!async_head && !retry && in_flight == 0) {
+            pthread_mutex_unlock(&async_lock);
+            return NULL;
+        }
+        // the completion queue is twice the size of the submission queue, so it cannot overflow
+        while (in_flight + submit < ASYNC_IO_ENTRIES && (retry || async_head)) {
+            AsyncRead *read = retry;
+            if (read) {
+                retry = read->next;
+            } else {
+                read = AsyncDequeue();
+                read->fd = open(read->path, O_RDONLY);
+                if (read->fd < 0) {
+                    pthread_mutex_unlock(&async_lock);
+                    AsyncFinish(read, false);
+                    pthread_mutex_lock(&async_lock);
+                    continue;
+                }
+            }
+            size_t slot = 0;
+            while (slots[slot]) slot++;
+            slots[slot] = read;
+            AsyncSubmitRead(ring, read, slot);
+            submit++;
+        }
+        pthread_mutex_unlock(&async_lock);
+        in_flight += submit;
+        if (in_flight == 0) continue;
+
+        // entries that were not consumed by an interrupted call are submitted again
+        unsigned pending = *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            // the ring is broken: fail the reads in flight, and read the remaining requests with pread
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+            for(size_t i = 0; i < ASYNC_IO_ENTRIES; i++) {
+                if (slots[i]) AsyncFinish(slots[i], false);
+            }
+            while (retry) {
+                AsyncRead *read = retry;
+                retry = read->next;
+                AsyncFinish(read, false);
+            }
+            return AsyncPreadThread(NULL);
+        }
+        unsigned head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            AsyncRead *read = slots[cqe->user_data];
+            int result = cqe->res;
+            slots[cqe->user_data] = NULL;
+            head++;
+            in_flight--;
+            if (result == -EINTR || result == -EAGAIN) {
+                read->next = retry;
+                retry = read;
+            } else if (result <= 0) {
+                AsyncFinish(read, false);
+            } else if ((read->done += result) < read->bytes) {
+                read->next = retry;
+                retry = read;
+            } else {
+                AsyncFinish(read, true);
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+// Starts the I/O threads, called with async_lock held
+static void AsyncStart(void) {
+    async_started = true;
+    if (async_io_uring && AsyncSetupRing(&async_ring)) {
+        if (pthread_create(&async_threads[0], NULL, AsyncRingThread, &async_ring) == 0) {
+            async_uses_uring = true;
+            async_thread_count = 1;
+            return;
+        }
+        close(async_ring.fd);
+    }
+    for(size_t i = 0; i < ASYNC_IO_THREADS; i++) {
+        if (pthread_create(&async_threads[async_thread_count], NULL, AsyncPreadThread, NULL) == 0) {
+            async_thread_count++;
+        }
+    }
+}
+
+// Reads bytes bytes at offset of the file into data, and calls callback(arg, success) when the read has finished
+// Returns false (without calling the callback) if the read could not be queued
+static bool AsyncReadFile(const char *path, void *data, size_t bytes, off_t offset, AsyncCallback callback, void *arg) {
+    AsyncRead *read = (AsyncRead*) calloc(1, sizeof(AsyncRead));
+    if (!read) return false;
+    read->path = path;
+    read->data = data;
+    read->bytes = bytes;
+    read->offset = offset;
+    read->callback = callback;
+    read->arg = arg;
+    read->fd = -1;
+    pthread_mutex_lock(&async_lock);
+    if (!async_started) AsyncStart();
+    if (async_stopping || async_thread_count == 0) {
+        pthread_mutex_unlock(&async_lock);
+        free(read);
+        return false;
+    }
+    if (async_tail) {
+        async_tail->next = read;
+    } else {
+        async_head = read;
+    }
+    async_tail = read;
+    pthread_cond_broadcast(&async_cond);
+    pthread_mutex_unlock(&async_lock);
+    return true;
+}
+
+// Waits for all queued reads and stops the I/O threads
+static void AsyncShutdown(void) {
+    pthread_mutex_lock(&async_lock);
+    async_stopping = true;
+    pthread_cond_broadcast(&async_cond);
+    pthread_mutex_unlock(&async_lock);
+    for(size_t i = 0; i < async_thread_count; i++) {
+        pthread_join(async_threads[i], NULL);
+    }
+    async_thread_count = 0;
+    if (async_uses_uring) close(async_ring.fd);
+}
+
+#endif
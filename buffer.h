@@ -0,0 +1,345 @@
+
+
+#ifndef _BUFFER_H_
+#define _BUFFER_H_
+
+// Buffer manager for column data
+// The columns of a table are divided into chunks of BUFFER_CHUNK_SIZE rows, which are read from the column file
+// when a query needs them and stay in memory until they are evicted.
+// The total size of the chunks in memory is limited by the memory budget (-memory), when a chunk does not fit
+// chunks that are not pinned are evicted with the CLOCK algorithm: a chunk that was used since the clock hand
+// passed it last gets a second chance.
+// Queries pin the chunks of a morsel while it runs (see PinMorsel in morsel.h), so a pinned chunk is never evicted.
+// If every chunk is pinned, a load exceeds the budget rather than failing the query.
+// Chunks are pinned while holding the table lock for reading, the size of a column only changes while holding
+// it for writing (see BufferResizeColumn), so a pinned chunk always matches the column file.
+// Scans read chunks ahead of the workers with asynchronous reads (see PrefetchChunk and asyncio.h), so the I/O of
+// the next chunks overlaps with the execution of the current ones. Chunk buffers are aligned to BUFFER_ALIGNMENT.
+// The columns of a PAX table do not have chunks of their own: a chunk of such a column is the mini-page of the
+// column in the row group with the same index, so all the columns of a row group are read (and evicted) together.
+
+#include <fcntl.h>
+
+#define BUFFER_CHUNK_SIZE 65536
+#define BUFFER_ALIGNMENT 4096
+
+typedef struct _BufferChunk {
+    void *data;       // NULL if the chunk is not in memory
+    size_t bytes;
+    size_t frame;     // index in buffer_frames
+    int pins;
+    bool referenced;  // used since the clock hand passed
+    bool loading;     // being read, data is already set for asynchronous reads
+} BufferChunk;
+
+typedef struct {
+    Column *column;
+    size_t chunk;
+} BufferFrame;
+
+static size_t buffer_budget = 0;  // maximum size of all chunks in memory, 0 means unlimited
+static size_t buffer_used = 0;
+static size_t buffer_peak = 0;   // high-water mark of buffer_used
+static lng buffer_loads = 0;
+static lng buffer_evictions = 0;
+static lng buffer_prefetches = 0;
+// resident (or loading) chunks, the clock hand moves over this array
+static BufferFrame *buffer_frames = NULL;
+static size_t buffer_frame_count = 0;
+static size_t buffer_frame_capacity = 0;
+static size_t buffer_clock = 0;
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t buffer_loaded = PTHREAD_COND_INITIALIZER;
+
+static size_t BufferChunkCount(lng rows) {
+    return (rows + BUFFER_CHUNK_SIZE - 1) / BUFFER_CHUNK_SIZE;
+}
+
+static lng BufferChunkRows(Column *column, size_t chunk) {
+    lng rows = column->size - (lng) chunk * BUFFER_CHUNK_SIZE;
+    return rows < BUFFER_CHUNK_SIZE ? rows : BUFFER_CHUNK_SIZE;
+}
+
+// Parses a size such as 512M or 16G, returns 0 if the size is invalid
+static size_t ParseMemorySize(const char *str) {
+    char *end;
+    double size = strtod(str, &end);
+    switch(toupper(*end)) {
+        case 'T': size *= 1024;  // fallthrough
+        case 'G': size *= 1024;  // fallthrough
+        case 'M': size *= 1024;  // fallthrough
+        case 'K': size *= 1024; end++; break;
+        case '\0': break;
+        default: return 0;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    return *end == '\0' && size > 0 ? (size_t) size : 0;
+}
+
+// Called with buffer_lock held
+static void BufferEnsureChunks(Column *column) {
+    size_t count = BufferChunkCount(column->size);
+    if (column->chunk_count >= count) return;
+    column->chunks = (BufferChunk*) realloc(column->chunks, count * sizeof(BufferChunk));
+    memset(column->chunks + column->chunk_count, 0, (count - column->chunk_count) * sizeof(BufferChunk));
+    column->chunk_count = count;
+}
+
+// Called with buffer_lock held
+static void BufferRemoveFrame(size_t frame) {
+    buffer_frames[frame] = buffer_frames[--buffer_frame_count];
+    if (frame < buffer_frame_count) {
+        buffer_frames[frame].column->chunks[buffer_frames[frame].chunk].frame = frame;
+    }
+}
+
+// Frees the data of an unpinned chunk, called with buffer_lock held
+static void BufferDropChunk(Column *column, size_t index) {
+    BufferChunk *chunk = &column->chunks[index];
+    if (!chunk->data) return;
+    free(chunk->data);
+    buffer_used -= chunk->bytes;
+    BufferRemoveFrame(chunk->frame);
+    chunk->data = NULL;
+    chunk->referenced = false;
+}
+
+// Evicts chunks until the given amount of bytes fits in the budget, called with buffer_lock held
+static void BufferEvict(size_t bytes) {
+    size_t scanned = 0;
+    // after two rounds every chunk has lost its second chance, so the remaining chunks are all pinned
+    while (buffer_budget > 0 && buffer_used + bytes > buffer_budget && scanned < 2 * buffer_frame_count) {
+        if (buffer_clock >= buffer_frame_count) buffer_clock = 0;
+        BufferFrame *frame = &buffer_frames[buffer_clock];
+        BufferChunk *chunk = &frame->column->chunks[frame->chunk];
+        scanned++;
+        if (chunk->pins > 0 || chunk->loading) {
+            buffer_clock++;
+        } else if (chunk->referenced) {
+            chunk->referenced = false;
+            buffer_clock++;
+        } else {
+            // the last frame moves into the position of the hand, so the hand stays
+            BufferDropChunk(frame->column, frame->chunk);
+            buffer_evictions++;
+        }
+    }
+}
+
+static void *BufferAllocate(size_t bytes) {
+    void *data;
+    return posix_memalign(&data, BUFFER_ALIGNMENT, bytes > 0 ? bytes : 1) == 0 ? data : NULL;
+}
+
+// Accounts for a chunk that is about to be read and adds it to the frames, called with buffer_lock held
+static void BufferReserveChunk(Column *column, size_t index, size_t bytes) {
+    BufferChunk *chunk = &column->chunks[index];
+    chunk->loading = true;
+    chunk->bytes = bytes;
+    buffer_used += bytes;
+    if (buffer_used > buffer_peak) buffer_peak = buffer_used;
+    buffer_loads++;
+    if (buffer_frame_count == buffer_frame_capacity) {
+        buffer_frame_capacity = buffer_frame_capacity == 0 ? 1024 : buffer_frame_capacity * 2;
+        buffer_frames = (BufferFrame*) realloc(buffer_frames, buffer_frame_capacity * sizeof(BufferFrame));
+    }
+    chunk->frame = buffer_frame_count;
+    buffer_frames[buffer_frame_count].column = column;
+    buffer_frames[buffer_frame_count].chunk = index;
+    buffer_frame_count++;
+}
+
+static bool BufferReadChunk(Column *column, size_t index, void *data, size_t bytes) {
+    int fd = open(column->data_location, O_RDONLY);
+    if (fd < 0) {
+        printf("Unable to open file %s\n", column->data_location);
+        return false;
+    }
+    off_t offset = (off_t) index * BUFFER_CHUNK_SIZE * column->elsize;
+    size_t total = 0;
+    while (total < bytes) {
+        ssize_t read = pread(fd, (char*) data + total, bytes - total, offset + total);
+        if (read <= 0) {
+            printf("Read incorrect number of bytes from file %s, expected %zu bytes but read %zu bytes.\n", column->data_location, bytes, total);
+            close(fd);
+            return false;
+        }
+        total += read;
+    }
+    close(fd);
+    return true;
+}
+
+// Returns the data of a chunk of a column, reading it from the column file if it is not in memory
+// The chunk stays in memory until it is unpinned, returns NULL if the chunk could not be read
+static void *PinChunk(Column *column, size_t index) {
+    if (column->row_groups) {
+        // the mini-page of the column starts after those of the columns before it
+        char *row_group = (char*) PinChunk(column->row_groups, index);
+        return row_group ? row_group + BufferChunkRows(column, index) * column->pax_offset : NULL;
+    }
+    pthread_mutex_lock(&buffer_lock);
+    BufferEnsureChunks(column);
+    while (column->chunks[index].loading) {
+        pthread_cond_wait(&buffer_loaded, &buffer_lock);
+    }
+    BufferChunk *chunk = &column->chunks[index];
+    chunk->pins++;
+    chunk->referenced = true;
+    if (chunk->data) {
+        void *data = chunk->data;
+        pthread_mutex_unlock(&buffer_lock);
+        return data;
+    }
+    // reserve the memory and read the chunk without holding the lock
+    size_t bytes = BufferChunkRows(column, index) * column->elsize;
+    BufferEvict(bytes);
+    BufferReserveChunk(column, index, bytes);
+    pthread_mutex_unlock(&buffer_lock);
+
+    void *data = BufferAllocate(bytes);
+    bool success = data && BufferReadChunk(column, index, data, bytes);
+
+    pthread_mutex_lock(&buffer_lock);
+    chunk = &column->chunks[index];
+    chunk->loading = false;
+    chunk->data = data;
+    if (!success) {
+        BufferDropChunk(column, index);
+        chunk->pins--;
+        data = NULL;
+    }
+    pthread_cond_broadcast(&buffer_loaded);
+    pthread_mutex_unlock(&buffer_lock);
+    return data;
+}
+
+static void BufferPrefetched(void *arg, bool success) {
+    BufferFrame *frame = (BufferFrame*) arg;
+    pthread_mutex_lock(&buffer_lock);
+    frame->column->chunks[frame->chunk].loading = false;
+    if (!success) {
+        // the chunk is read again (and the error is reported) when a query pins it
+        BufferDropChunk(frame->column, frame->chunk);
+    }
+    pthread_cond_broadcast(&buffer_loaded);
+    pthread_mutex_unlock(&buffer_lock);
+    free(frame);
+}
+
+// Starts reading a chunk of a column in the background, if it is not in memory yet and it fits in the budget
+// Must be called while holding the table lock for reading
+static void PrefetchChunk(Column *column, size_t index) {
+    if (column->row_groups) {
+        PrefetchChunk(column->row_groups, index);
+        return;
+    }
+    pthread_mutex_lock(&buffer_lock);
+    BufferEnsureChunks(column);
+    BufferChunk *chunk = &column->chunks[index];
+    size_t bytes = BufferChunkRows(column, index) * column->elsize;
+    if (chunk->data || chunk->loading) {
+        pthread_mutex_unlock(&buffer_lock);
+        return;
+    }
+    // reading ahead never exceeds the budget
+    BufferEvict(bytes);
+    BufferFrame *frame = (BufferFrame*) malloc(sizeof(BufferFrame));
+    void *data = BufferAllocate(bytes);
+    if (!frame || !data || (buffer_budget > 0 && buffer_used + bytes > buffer_budget)) {
+        pthread_mutex_unlock(&buffer_lock);
+        free(frame);
+        free(data);
+        return;
+    }
+    BufferReserveChunk(column, index, bytes);
+    chunk->data = data;
+    chunk->referenced = true;
+    buffer_prefetches++;
+    frame->column = column;
+    frame->chunk = index;
+    off_t offset = (off_t) index * BUFFER_CHUNK_SIZE * column->elsize;
+    if (!AsyncReadFile(column->data_location, data, bytes, offset, BufferPrefetched, frame)) {
+        chunk->loading = false;
+        BufferDropChunk(column, index);
+        free(frame);
+    }
+    pthread_mutex_unlock(&buffer_lock);
+}
+
+static void UnpinChunk(Column *column, size_t index) {
+    if (column->row_groups) {
+        UnpinChunk(column->row_groups, index);
+        return;
+    }
+    pthread_mutex_lock(&buffer_lock);
+    column->chunks[index].pins--;
+    pthread_mutex_unlock(&buffer_lock);
+}
+
+// Copies the rows [start, end) of a column into data, returns false if the column could not be read
+// Must be called while holding the table lock for reading
+static bool BufferCopyColumn(Column *column, lng start, lng end, void *data) {
+    for(lng row = start; row < end; ) {
+        size_t index = row / BUFFER_CHUNK_SIZE;
+        lng offset = row - (lng) index * BUFFER_CHUNK_SIZE;
+        lng rows = BufferChunkRows(column, index) - offset;
+        if (rows > end - row) rows = end - row;
+        char *chunk = (char*) PinChunk(column, index);
+        if (!chunk) return false;
+        memcpy((char*) data + (row - start) * column->elsize, chunk + offset * column->elsize, rows * column->elsize);
+        UnpinChunk(column, index);
+        row += rows;
+    }
+    return true;
+}
+
+// Sets the amount of rows of a column after rows were appended to its file
+// The last chunk is dropped if it was not full, since it now has more rows on disk
+// Must be called while holding the table lock for writing (so no chunk of the column is pinned)
+static void BufferResizeColumn(Column *column, lng size) {
+    pthread_mutex_lock(&buffer_lock);
+    if (column->size % BUFFER_CHUNK_SIZE != 0 && column->chunk_count > 0) {
+        size_t last = column->size / BUFFER_CHUNK_SIZE;
+        // a chunk that is read ahead can still be loading after the query that started the read has finished
+        while (column->chunks[last].loading) {
+            pthread_cond_wait(&buffer_loaded, &buffer_lock);
+        }
+        BufferDropChunk(column, last);
+    }
+    column->size = size;
+    BufferEnsureChunks(column);
+    pthread_mutex_unlock(&buffer_lock);
+}
+
+// Frees all chunks of a column, must be called while holding the table lock for writing (so no chunk is pinned)
+static void BufferDropColumn(Column *column) {
+    pthread_mutex_lock(&buffer_lock);
+    for(size_t i = 0; i < column->chunk_count; i++) {
+        while (column->chunks[i].loading) {
+            pthread_cond_wait(&buffer_loaded, &buffer_lock);
+        }
+        BufferDropChunk(column, i);
+    }
+    free(column->chunks);
+    column->chunks = NULL;
+    column->chunk_count = 0;
+    pthread_mutex_unlock(&buffer_lock);
+}
+
+// Returns the bytes of the chunks of a column that are in memory
+static size_t BufferResidentBytes(Column *column) {
+    if (column->row_groups) {
+        // the share of the column in the row groups that are in memory
+        return BufferResidentBytes(column->row_groups) / column->row_groups->elsize * column->elsize;
+    }
+    size_t bytes = 0;
+    pthread_mutex_lock(&buffer_lock);
+    for(size_t i = 0; i < column->chunk_count; i++) {
+        if (column->chunks[i].data) bytes += column->chunks[i].bytes;
+    }
+    pthread_mutex_unlock(&buffer_lock);
+    return bytes;
+}
+
+#endif
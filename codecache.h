@@ -0,0 +1,158 @@
+
+
+#ifndef _CODECACHE_H_
+#define _CODECACHE_H_
+
+// Persistent cache of compiled machine code
+// The machine code of a query is stored in the cache directory (-code-cache dir), in a file named by a hash of
+// the generated LLVM IR (before optimization), the optimization passes and the LLVM version. The IR is the normalized
+// shape of the query: it contains the types of the columns and the expressions, but not the text of the query.
+// Constants are compiled into the kernels, so they are part of the key as well, and so is the CPU that the code is
+// generated for (the target-cpu and target-features attributes of the functions, see -target-cpu).
+// On a hit the pass pipeline is skipped and MCJIT loads the object file instead of generating code
+// (see LLVMSetFileObjectCache in target_machine.cpp), so the cache also survives restarts.
+// Objects are written to a temporary file and renamed, so concurrent processes can share the directory.
+// Once the directory exceeds -code-cache-size the least recently used objects are removed.
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <llvm/Config/llvm-config.h>
+
+#define CODE_CACHE_TRIM_INTERVAL 64
+#define CODE_CACHE_KEY_LENGTH 33
+
+static bool code_cache_enabled = true;
+static char *code_cache_directory = "Tables/.codecache";
+static size_t code_cache_size = 256 * 1024 * 1024;
+static lng code_cache_hits = 0;
+static lng code_cache_misses = 0;
+static bool code_cache_created = false;  // the cache directory is created on first use
+static pthread_mutex_t code_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+    char *path;
+    off_t size;
+    time_t used;
+} CodeCacheEntry;
+
+// FNV-1a style hash with the given (odd) multiplier
+static uint64_t CodeCacheHash(uint64_t hash, uint64_t multiplier, const char *str) {
+    for(; *str; str++) {
+        hash ^= (unsigned char) *str;
+        hash *= multiplier;
+    }
+    return hash;
+}
+
+// Creates the cache directory (and its parents), returns false if it could not be created
+static bool CodeCacheCreateDirectory(const char *directory) {
+    char *path = strdup(directory);
+    for(char *ptr = path + 1; ; ptr++) {
+        if (*ptr != '/' && *ptr != '\0') continue;
+        char c = *ptr;
+        *ptr = '\0';
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            printf("Failed to create code cache directory %s: %s\n", path, strerror(errno));
+            free(path);
+            return false;
+        }
+        *ptr = c;
+        if (c == '\0') break;
+    }
+    free(path);
+    return true;
+}
+
+static int CompareCodeCacheEntries(const void *a, const void *b) {
+    time_t used_a = ((CodeCacheEntry*) a)->used, used_b = ((CodeCacheEntry*) b)->used;
+    return used_a < used_b ? -1 : used_a > used_b;
+}
+
+// Removes the least recently used objects until the cache fits in code_cache_size
+// Other processes can remove the same files at the same time, so failures are ignored
+static void CodeCacheTrim(void) {
+    DIR *directory = opendir(code_cache_directory);
+    if (!directory) return;
+    size_t count = 0, capacity = 64;
+    CodeCacheEntry *entries = (CodeCacheEntry*) malloc(capacity * sizeof(CodeCacheEntry));
+    size_t total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length <= 2 || strcmp(entry->d_name + length - 2, ".o") != 0) continue;
+        char path[1000];
+        snprintf(path, 1000, "%s/%s", code_cache_directory, entry->d_name);
+        struct stat info;
+        if (stat(path, &info) != 0) continue;
+        if (count == capacity) {
+            capacity *= 2;
+            entries = (CodeCacheEntry*) realloc(entries, capacity * sizeof(CodeCacheEntry));
+        }
+        entries[count].path = strdup(path);
+        entries[count].size = info.st_size;
+        entries[count].used = info.st_mtime;
+        total += info.st_size;
+        count++;
+    }
+    closedir(directory);
+    qsort(entries, count, sizeof(CodeCacheEntry), CompareCodeCacheEntries);
+    for(size_t i = 0; i < count; i++) {
+        if (total > code_cache_size && unlink(entries[i].path) == 0) {
+            total -= entries[i].size;
+        }
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+// Computes the key of the machine code of a module: 32 hex digits (and a terminator) are written to key
+// pipeline describes the optimizations of the query (see OptimizationProfile)
+static void CodeCacheKey(LLVMModuleRef module, const char *pipeline, char *key) {
+    char *ir = LLVMPrintModuleToString(module);
+    const char *settings = LLVM_VERSION_STRING;
+    // two 64-bit hashes with different multipliers, so collisions are not a concern
+    uint64_t hashes[2] = { 0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL };
+    uint64_t multipliers[2] = { 0x100000001b3ULL, 0x9e3779b97f4a7c15ULL };
+    for(size_t i = 0; i < 2; i++) {
+        hashes[i] = CodeCacheHash(hashes[i], multipliers[i], settings);
+        hashes[i] = CodeCacheHash(hashes[i], multipliers[i], pipeline);
+        hashes[i] = CodeCacheHash(hashes[i], multipliers[i], ir);
+    }
+    LLVMDisposeMessage(ir);
+    snprintf(key, CODE_CACHE_KEY_LENGTH, "%016" PRIx64 "%016" PRIx64, hashes[0], hashes[1]);
+}
+
+// Returns the path of the cached object of a key (which does not have to exist yet), or NULL if the cache is disabled
+// Sets *hit if the object is in the cache
+static char *CodeCacheLookup(const char *key, bool *hit) {
+    *hit = false;
+    if (!code_cache_enabled) return NULL;
+    pthread_mutex_lock(&code_cache_lock);
+    if (!code_cache_created) {
+        if (!CodeCacheCreateDirectory(code_cache_directory)) {
+            code_cache_enabled = false;
+            pthread_mutex_unlock(&code_cache_lock);
+            return NULL;
+        }
+        code_cache_created = true;
+    }
+    pthread_mutex_unlock(&code_cache_lock);
+
+    size_t length = strlen(code_cache_directory) + CODE_CACHE_KEY_LENGTH + 8;
+    char *path = (char*) malloc(length);
+    snprintf(path, length, "%s/%s.o", code_cache_directory, key);
+
+    // the modification time of an object is the last time it was used
+    *hit = utime(path, NULL) == 0;
+    pthread_mutex_lock(&code_cache_lock);
+    if (*hit) {
+        code_cache_hits++;
+    } else if (code_cache_misses++ % CODE_CACHE_TRIM_INTERVAL == 0) {
+        CodeCacheTrim();
+    }
+    pthread_mutex_unlock(&code_cache_lock);
+    return path;
+}
+
+#endif
@@ -0,0 +1,886 @@
+
+
+#ifndef _CODEGEN_H_
+#define _CODEGEN_H_
+
+// LLVM IR generation for query pipelines
+// Every pipeline is compiled into a function (kernel) that processes the rows [start, end) of its input columns:
+//     lng kernel(void **inputs, lng start, lng end, QueryOutput *output, ..., lng limit)
+// "inputs" holds a pointer to the data of every input column (indexed by row number)
+// The kernel writes the value of every output expression for every qualifying row to output->data,
+// and returns the amount of rows it has written
+// Scan kernels without a limit process VECTOR_WIDTH rows at a time with vector instructions (see GenerateScanKernel)
+
+// internal operations, numbered after the operations of the parser
+#define OPTYPE_rowid 100  // internal: the row number of the current row
+#define OPTYPE_key 101    // internal: a join key, normalized to a 64-bit integer
+
+#define TYPE_bool 6     // type of comparisons and boolean operators, only used for intermediates
+
+#define VECTOR_WIDTH 8  // rows per iteration of the vector loop of a scan kernel
+
+// how the vector loop writes the qualifying rows of a vector to the output
+#define COMPRESS_STORE 0    // llvm.masked.compressstore (AVX-512)
+#define COMPRESS_PERMUTE 1  // permute the qualifying rows to the front with a table of permutations (AVX2)
+#define COMPRESS_LANES 2    // store every lane and only advance the output for qualifying rows
+
+// arms of a CASE that cost more than this are only evaluated if a row needs them, cheaper arms are always
+// evaluated and chosen with a select (see GenerateCase)
+#define CASE_BRANCH_COST 32
+
+static bool simd_kernels = true;  // -no-simd
+static bool vector_math_library = false;  // glibc's vector math library (libmvec) is loaded, see GenerateMathCall
+
+typedef struct {
+    Operation_BASE
+    Operation *child;
+    bool floating;  // normalize the key as a double (if either side of the equi-join is a floating point type)
+} KeyOperation;
+
+typedef struct {
+    void **data;    // an array for every output expression
+    lng count;
+    lng capacity;
+    size_t output_count;
+    unsigned char *elsize;
+} QueryOutput;
+
+typedef struct {
+    LLVMContextRef context;
+    LLVMModuleRef module;
+    LLVMBuilderRef builder;
+    LLVMValueRef function;
+    // columns that are read at the current row
+    ColumnList *inputs;
+    LLVMValueRef *input_data;
+    LLVMValueRef row;
+    // if not zero, expressions are evaluated for vector_width consecutive rows starting at row
+    unsigned vector_width;
+    // columns that are read at the current build row (only used in join probes)
+    ColumnList *build_inputs;
+    LLVMValueRef *build_data;
+    LLVMValueRef build_row;
+} Codegen;
+
+static Operation *CreateRowIdOperation(void) {
+    Operation *op = malloc(sizeof(Operation));
+    op->type = OPTYPE_rowid;
+    return op;
+}
+
+static Operation *CreateKeyOperation(Operation *child, bool floating) {
+    KeyOperation *op = malloc(sizeof(KeyOperation));
+    op->type = OPTYPE_key;
+    op->child = child;
+    op->floating = floating;
+    return (Operation*) op;
+}
+
+static bool IsFloatingType(int type) {
+    return type == TYPE_flt || type == TYPE_dbl;
+}
+
+static bool IsComparison(int optype) {
+    return optype >= OPTYPE_lt && optype <= OPTYPE_ge;
+}
+
+static bool IsBooleanOperator(int optype) {
+    return optype == OPTYPE_and || optype == OPTYPE_or;
+}
+
+// Rank of a type in arithmetic conversions, the result of a binary operation has the type with the highest rank
+static int TypeRank(int type) {
+    switch(type) {
+        case TYPE_bool: return 0;
+        case TYPE_int: return 1;
+        case TYPE_lng: return 2;
+        case TYPE_flt: return 3;
+        case TYPE_dbl: return 4;
+    }
+    return -1;
+}
+
+static int CommonType(int a, int b) {
+    return TypeRank(a) >= TypeRank(b) ? a : b;
+}
+
+static int GetConstantType(double value) {
+    if (value == (double) (lng) value) {
+        return value >= -2147483648.0 && value <= 2147483647.0 ? TYPE_int : TYPE_lng;
+    }
+    return TYPE_dbl;
+}
+
+static int GetOperationType(Operation *op);
+
+// Type of the arguments and the result of a function
+//   abs, floor, ceil, min, max: the (common) type of the arguments
+//   sqrt, exp, log, pow: flt if the arguments are flt, dbl otherwise
+static int GetFunctionType(FunctionOperation *op) {
+    int type = TYPE_bool;
+    for(size_t i = 0; i < op->argument_count; i++) {
+        type = CommonType(type, GetOperationType(op->arguments[i]));
+    }
+    if (type == TYPE_bool) type = TYPE_int;
+    switch(op->function) {
+        case FUNCTION_sqrt:
+        case FUNCTION_pow:
+        case FUNCTION_exp:
+        case FUNCTION_log:
+            return type == TYPE_flt ? TYPE_flt : TYPE_dbl;
+    }
+    return type;
+}
+
+static int GetOperationType(Operation *op) {
+    switch(op->type) {
+        case OPTYPE_const:
+            return GetConstantType(((ConstantOperation*)op)->value);
+        case OPTYPE_colmn:
+            return ((ColumnOperation*)op)->column->type;
+        case OPTYPE_binop:
+        {
+            BinaryOperation *binop = (BinaryOperation*) op;
+            if (IsComparison(binop->optype) || IsBooleanOperator(binop->optype)) {
+                return TYPE_bool;
+            }
+            int type = CommonType(GetOperationType(binop->left), GetOperationType(binop->right));
+            // arithmetic on booleans is done on integers
+            return type == TYPE_bool ? TYPE_int : type;
+        }
+        case OPTYPE_func:
+            return GetFunctionType((FunctionOperation*) op);
+        case OPTYPE_case:
+        {
+            // without ELSE the result is 0 (false)
+            CaseOperation *case_op = (CaseOperation*) op;
+            int type = case_op->otherwise ? GetOperationType(case_op->otherwise) : TYPE_bool;
+            for(size_t i = 0; i < case_op->count; i++) {
+                type = CommonType(type, GetOperationType(case_op->results[i]));
+            }
+            return type;
+        }
+        case OPTYPE_rowid:
+        case OPTYPE_key:
+            return TYPE_lng;
+    }
+    return -1;
+}
+
+// Type of an expression when it is written to a result column (booleans are stored as integers)
+static int GetResultType(Operation *op) {
+    int type = GetOperationType(op);
+    return type == TYPE_bool ? TYPE_int : type;
+}
+
+static unsigned char GetTypeSize(int type) {
+    return elsize[type - TYPE_int];
+}
+
+static LLVMTypeRef CodegenType(Codegen *cg, int type) {
+    switch(type) {
+        case TYPE_int:
+            return LLVMInt32TypeInContext(cg->context);
+        case TYPE_lng:
+            return LLVMInt64TypeInContext(cg->context);
+        case TYPE_flt:
+            return LLVMFloatTypeInContext(cg->context);
+        case TYPE_dbl:
+            return LLVMDoubleTypeInContext(cg->context);
+        case TYPE_bool:
+            return LLVMInt1TypeInContext(cg->context);
+    }
+    return NULL;
+}
+
+// Type of the value of an expression, a vector of the type if the code generator generates vector code
+static LLVMTypeRef CodegenValueType(Codegen *cg, int type) {
+    LLVMTypeRef scalar = CodegenType(cg, type);
+    return cg->vector_width > 0 ? LLVMVectorType(scalar, cg->vector_width) : scalar;
+}
+
+static LLVMValueRef CodegenConstant(Codegen *cg, int type, double value) {
+    LLVMValueRef constant = IsFloatingType(type) ? LLVMConstReal(CodegenType(cg, type), value) : LLVMConstInt(CodegenType(cg, type), (lng) value, 1);
+    if (cg->vector_width == 0) return constant;
+    LLVMValueRef lanes[VECTOR_WIDTH];
+    for(unsigned i = 0; i < cg->vector_width; i++) {
+        lanes[i] = constant;
+    }
+    return LLVMConstVector(lanes, cg->vector_width);
+}
+
+static LLVMTypeRef CodegenInt64(Codegen *cg) {
+    return LLVMInt64TypeInContext(cg->context);
+}
+
+static LLVMTypeRef CodegenBytePointer(Codegen *cg) {
+    return LLVMPointerType(LLVMInt8TypeInContext(cg->context), 0);
+}
+
+// LLVM type of QueryOutput, we only access the first three members
+static LLVMTypeRef CodegenOutputType(Codegen *cg) {
+    LLVMTypeRef members[] = { LLVMPointerType(CodegenBytePointer(cg), 0), CodegenInt64(cg), CodegenInt64(cg) };
+    return LLVMStructTypeInContext(cg->context, members, 3, 0);
+}
+
+static Codegen *CodegenCreate(const char *name) {
+    Codegen *cg = (Codegen*) calloc(1, sizeof(Codegen));
+    // every query gets its own context, so queries can be compiled concurrently
+    cg->context = LLVMContextCreate();
+    cg->module = LLVMModuleCreateWithNameInContext(name, cg->context);
+    LLVMOptimizeModuleForTarget(cg->module);
+    cg->builder = LLVMCreateBuilderInContext(cg->context);
+    return cg;
+}
+
+// Disposes of the builder, the module is owned by the execution engine after compilation
+static void CodegenDestroy(Codegen *cg) {
+    LLVMDisposeBuilder(cg->builder);
+    free(cg->input_data);
+    free(cg->build_data);
+    free(cg);
+}
+
+static LLVMValueRef GenerateConvert(Codegen *cg, LLVMValueRef value, int from, int to) {
+    if (from == to) return value;
+    LLVMBuilderRef builder = cg->builder;
+    LLVMTypeRef type = CodegenValueType(cg, to);
+    if (to == TYPE_bool) {
+        // non-zero values are true
+        if (IsFloatingType(from)) {
+            return LLVMBuildFCmp(builder, LLVMRealUNE, value, CodegenConstant(cg, from, 0), "bool");
+        }
+        return LLVMBuildICmp(builder, LLVMIntNE, value, CodegenConstant(cg, from, 0), "bool");
+    }
+    if (from == TYPE_bool) {
+        return IsFloatingType(to) ? LLVMBuildUIToFP(builder, value, type, "conv") : LLVMBuildZExt(builder, value, type, "conv");
+    }
+    if (IsFloatingType(from) && IsFloatingType(to)) {
+        return to == TYPE_dbl ? LLVMBuildFPExt(builder, value, type, "conv") : LLVMBuildFPTrunc(builder, value, type, "conv");
+    }
+    if (IsFloatingType(from)) {
+        return LLVMBuildFPToSI(builder, value, type, "conv");
+    }
+    if (IsFloatingType(to)) {
+        return LLVMBuildSIToFP(builder, value, type, "conv");
+    }
+    return to == TYPE_lng ? LLVMBuildSExt(builder, value, type, "conv") : LLVMBuildTrunc(builder, value, type, "conv");
+}
+
+// Loads the typed data pointers of a list of columns from an array of void pointers
+static LLVMValueRef *GenerateColumnPointers(Codegen *cg, LLVMValueRef array, ColumnList *columns) {
+    size_t count = GetColCount(columns);
+    LLVMValueRef *pointers = (LLVMValueRef*) calloc(count + 1, sizeof(LLVMValueRef));
+    for(size_t i = 0; i < count; i++, columns = columns->next) {
+        LLVMValueRef index = LLVMConstInt(CodegenInt64(cg), i, 0);
+        LLVMValueRef address = LLVMBuildInBoundsGEP2(cg->builder, CodegenBytePointer(cg), array, &index, 1, "&inputs[i]");
+        LLVMValueRef pointer = LLVMBuildLoad2(cg->builder, CodegenBytePointer(cg), address, "inputs[i]");
+        pointers[i] = LLVMBuildBitCast(cg->builder, pointer, LLVMPointerType(CodegenType(cg, columns->column->type), 0), columns->column->name);
+    }
+    return pointers;
+}
+
+// Loads the typed pointers of the output arrays of a QueryOutput
+static void GenerateOutputPointers(Codegen *cg, LLVMValueRef output, OperationList *outputs, LLVMValueRef *pointers) {
+    LLVMValueRef data_address = LLVMBuildStructGEP2(cg->builder, CodegenOutputType(cg), output, 0, "&output->data");
+    LLVMValueRef data = LLVMBuildLoad2(cg->builder, LLVMPointerType(CodegenBytePointer(cg), 0), data_address, "output->data");
+    for(size_t i = 0; outputs; i++, outputs = outputs->next) {
+        LLVMValueRef index = LLVMConstInt(CodegenInt64(cg), i, 0);
+        LLVMValueRef address = LLVMBuildInBoundsGEP2(cg->builder, CodegenBytePointer(cg), data, &index, 1, "&output->data[i]");
+        LLVMValueRef pointer = LLVMBuildLoad2(cg->builder, CodegenBytePointer(cg), address, "output->data[i]");
+        pointers[i] = LLVMBuildBitCast(cg->builder, pointer, LLVMPointerType(CodegenType(cg, GetResultType(outputs->operation)), 0), "result");
+    }
+}
+
+static LLVMValueRef GenerateOperation(Codegen *cg, Operation *op);
+static LLVMValueRef GenerateCondition(Codegen *cg, Operation *op);
+
+static LLVMValueRef GenerateColumn(Codegen *cg, ColumnOperation *op) {
+    Column *column = op->column;
+    LLVMValueRef data = NULL, row = NULL;
+    size_t i = 0;
+    for(ColumnList *list = cg->inputs; list && !data; list = list->next, i++) {
+        if (list->column == column) {
+            data = cg->input_data[i];
+            row = cg->row;
+        }
+    }
+    i = 0;
+    for(ColumnList *list = cg->build_inputs; list && !data; list = list->next, i++) {
+        if (list->column == column) {
+            data = cg->build_data[i];
+            row = cg->build_row;
+        }
+    }
+    assert(data);
+    LLVMTypeRef type = CodegenType(cg, column->type);
+    LLVMValueRef address = LLVMBuildInBoundsGEP2(cg->builder, type, data, &row, 1, "&column[row]");
+    if (cg->vector_width == 0) {
+        return LLVMBuildLoad2(cg->builder, type, address, column->name);
+    }
+    // the rows [row, row + vector_width) with a single (unaligned) load
+    LLVMTypeRef vector_type = CodegenValueType(cg, column->type);
+    address = LLVMBuildBitCast(cg->builder, address, LLVMPointerType(vector_type, 0), "&column[row:]");
+    LLVMValueRef load = LLVMBuildLoad2(cg->builder, vector_type, address, column->name);
+    LLVMSetAlignment(load, GetTypeSize(column->type));
+    return load;
+}
+
+static LLVMValueRef GenerateArithmetic(Codegen *cg, int optype, int type, LLVMValueRef left, LLVMValueRef right) {
+    LLVMBuilderRef builder = cg->builder;
+    bool floating = IsFloatingType(type);
+    switch(optype) {
+        case OPTYPE_add:
+            return floating ? LLVMBuildFAdd(builder, left, right, "add") : LLVMBuildAdd(builder, left, right, "add");
+        case OPTYPE_sub:
+            return floating ? LLVMBuildFSub(builder, left, right, "sub") : LLVMBuildSub(builder, left, right, "sub");
+        case OPTYPE_mul:
+            return floating ? LLVMBuildFMul(builder, left, right, "mul") : LLVMBuildMul(builder, left, right, "mul");
+        case OPTYPE_div:
+        {
+            if (floating) return LLVMBuildFDiv(builder, left, right, "div");
+            // integer division by zero traps, so we divide by one instead and return zero
+            // the minimum divided by -1 traps as well, x / -1 is computed as -x (which wraps for the minimum)
+            LLVMValueRef zero = CodegenConstant(cg, type, 0);
+            LLVMValueRef is_zero = LLVMBuildICmp(builder, LLVMIntEQ, right, zero, "is_zero");
+            LLVMValueRef is_minus_one = LLVMBuildICmp(builder, LLVMIntEQ, right, CodegenConstant(cg, type, -1), "is_minus_one");
+            LLVMValueRef trivial = LLVMBuildOr(builder, is_zero, is_minus_one, "trivial");
+            LLVMValueRef divisor = LLVMBuildSelect(builder, trivial, CodegenConstant(cg, type, 1), right, "divisor");
+            LLVMValueRef result = LLVMBuildSDiv(builder, left, divisor, "div");
+            result = LLVMBuildSelect(builder, is_minus_one, LLVMBuildNeg(builder, left, "neg"), result, "div");
+            return LLVMBuildSelect(builder, is_zero, zero, result, "div");
+        }
+        case OPTYPE_mod:
+        {
+            if (floating) return LLVMBuildFRem(builder, left, right, "mod");
+            // the remainder of a division by zero is zero as well, and x % -1 (which traps for the minimum) is always zero
+            LLVMValueRef one = CodegenConstant(cg, type, 1);
+            LLVMValueRef is_zero = LLVMBuildICmp(builder, LLVMIntEQ, right, CodegenConstant(cg, type, 0), "is_zero");
+            LLVMValueRef is_minus_one = LLVMBuildICmp(builder, LLVMIntEQ, right, CodegenConstant(cg, type, -1), "is_minus_one");
+            LLVMValueRef divisor = LLVMBuildSelect(builder, LLVMBuildOr(builder, is_zero, is_minus_one, "trivial"), one, right, "divisor");
+            return LLVMBuildSRem(builder, left, divisor, "mod");
+        }
+    }
+    assert(0);
+    return NULL;
+}
+
+static LLVMValueRef GenerateComparison(Codegen *cg, int optype, int type, LLVMValueRef left, LLVMValueRef right) {
+    if (IsFloatingType(type)) {
+        LLVMRealPredicate predicate;
+        switch(optype) {
+            case OPTYPE_lt: predicate = LLVMRealOLT; break;
+            case OPTYPE_le: predicate = LLVMRealOLE; break;
+            case OPTYPE_eq: predicate = LLVMRealOEQ; break;
+            case OPTYPE_ne: predicate = LLVMRealUNE; break;
+            case OPTYPE_gt: predicate = LLVMRealOGT; break;
+            default: predicate = LLVMRealOGE; break;
+        }
+        return LLVMBuildFCmp(cg->builder, predicate, left, right, "cmp");
+    }
+    // booleans are compared unsigned: as a signed i1 true is -1, which would order it below false
+    bool is_unsigned = type == TYPE_bool;
+    LLVMIntPredicate predicate;
+    switch(optype) {
+        case OPTYPE_lt: predicate = is_unsigned ? LLVMIntULT : LLVMIntSLT; break;
+        case OPTYPE_le: predicate = is_unsigned ? LLVMIntULE : LLVMIntSLE; break;
+        case OPTYPE_eq: predicate = LLVMIntEQ; break;
+        case OPTYPE_ne: predicate = LLVMIntNE; break;
+        case OPTYPE_gt: predicate = is_unsigned ? LLVMIntUGT : LLVMIntSGT; break;
+        default: predicate = is_unsigned ? LLVMIntUGE : LLVMIntSGE; break;
+    }
+    return LLVMBuildICmp(cg->builder, predicate, left, right, "cmp");
+}
+
+static LLVMValueRef GenerateIntrinsic(Codegen *cg, const char *name, LLVMTypeRef *types, size_t type_count, LLVMValueRef *args, unsigned arg_count, const char *result) {
+    unsigned id = LLVMLookupIntrinsicID(name, strlen(name));
+    LLVMValueRef function = LLVMGetIntrinsicDeclaration(cg->module, id, types, type_count);
+    return LLVMBuildCall2(cg->builder, LLVMIntrinsicGetType(cg->context, id, types, type_count), function, args, arg_count, result);
+}
+
+// Calls exp, log or pow (llvm.name) on the arguments
+// Vectors are passed to the AVX2 variants of glibc's vector math library if it is loaded, otherwise the code
+// generator calls the scalar function for every lane. In scalar code the loop vectorizer can do the same (see
+// LLVMAddTargetMachinePasses).
+static LLVMValueRef GenerateMathCall(Codegen *cg, const char *name, int type, LLVMValueRef *args, unsigned arg_count) {
+    LLVMTypeRef value_type = CodegenValueType(cg, type);
+    if (cg->vector_width != VECTOR_WIDTH || !vector_math_library || !LLVMTargetHasFeature("avx2")) {
+        char intrinsic[32];
+        snprintf(intrinsic, sizeof(intrinsic), "llvm.%s", name);
+        return GenerateIntrinsic(cg, intrinsic, &value_type, 1, args, arg_count, name);
+    }
+    // 256-bit vectors: 8 floats, or two halves of 4 doubles
+    unsigned lanes = type == TYPE_flt ? 8 : 4;
+    char symbol[32];
+    snprintf(symbol, sizeof(symbol), "_ZGVdN%u%s_%s%s", lanes, arg_count == 2 ? "vv" : "v", name, type == TYPE_flt ? "f" : "");
+    LLVMTypeRef part_type = LLVMVectorType(CodegenType(cg, type), lanes);
+    LLVMTypeRef param_types[] = { part_type, part_type };
+    LLVMTypeRef function_type = LLVMFunctionType(part_type, param_types, arg_count, 0);
+    LLVMValueRef function = LLVMGetNamedFunction(cg->module, symbol);
+    if (!function) function = LLVMAddFunction(cg->module, symbol, function_type);
+    LLVMTypeRef int32_type = LLVMInt32TypeInContext(cg->context);
+    LLVMValueRef parts[VECTOR_WIDTH];
+    for(unsigned first = 0; first < VECTOR_WIDTH; first += lanes) {
+        LLVMValueRef part_args[MAX_FUNCTION_ARGUMENTS];
+        for(unsigned i = 0; i < arg_count; i++) {
+            part_args[i] = args[i];
+            if (lanes < VECTOR_WIDTH) {
+                LLVMValueRef indices[VECTOR_WIDTH];
+                for(unsigned lane = 0; lane < lanes; lane++) {
+                    indices[lane] = LLVMConstInt(int32_type, first + lane, 0);
+                }
+                part_args[i] = LLVMBuildShuffleVector(cg->builder, args[i], LLVMGetUndef(value_type), LLVMConstVector(indices, lanes), "part");
+            }
+        }
+        parts[first / lanes] = LLVMBuildCall2(cg->builder, function_type, function, part_args, arg_count, name);
+    }
+    if (lanes == VECTOR_WIDTH) return parts[0];
+    LLVMValueRef indices[VECTOR_WIDTH];
+    for(unsigned lane = 0; lane < VECTOR_WIDTH; lane++) {
+        indices[lane] = LLVMConstInt(int32_type, lane, 0);
+    }
+    return LLVMBuildShuffleVector(cg->builder, parts[0], parts[1], LLVMConstVector(indices, VECTOR_WIDTH), name);
+}
+
+static LLVMValueRef GenerateFunction(Codegen *cg, FunctionOperation *op) {
+    int type = GetFunctionType(op);
+    LLVMTypeRef value_type = CodegenValueType(cg, type);
+    bool floating = IsFloatingType(type);
+    LLVMValueRef args[MAX_FUNCTION_ARGUMENTS];
+    for(size_t i = 0; i < op->argument_count; i++) {
+        args[i] = GenerateConvert(cg, GenerateOperation(cg, op->arguments[i]), GetOperationType(op->arguments[i]), type);
+    }
+    switch(op->function) {
+        case FUNCTION_abs:
+            if (floating) return GenerateIntrinsic(cg, "llvm.fabs", &value_type, 1, args, 1, "abs");
+            // abs of the minimum value is the minimum value
+            args[1] = LLVMConstInt(LLVMInt1TypeInContext(cg->context), 0, 0);
+            return GenerateIntrinsic(cg, "llvm.abs", &value_type, 1, args, 2, "abs");
+        case FUNCTION_sqrt:
+            return GenerateIntrinsic(cg, "llvm.sqrt", &value_type, 1, args, 1, "sqrt");
+        case FUNCTION_floor:
+            return floating ? GenerateIntrinsic(cg, "llvm.floor", &value_type, 1, args, 1, "floor") : args[0];
+        case FUNCTION_ceil:
+            return floating ? GenerateIntrinsic(cg, "llvm.ceil", &value_type, 1, args, 1, "ceil") : args[0];
+        case FUNCTION_min:
+            return GenerateIntrinsic(cg, floating ? "llvm.minnum" : "llvm.smin", &value_type, 1, args, 2, "min");
+        case FUNCTION_max:
+            return GenerateIntrinsic(cg, floating ? "llvm.maxnum" : "llvm.smax", &value_type, 1, args, 2, "max");
+        case FUNCTION_pow:
+            return GenerateMathCall(cg, "pow", type, args, 2);
+        case FUNCTION_exp:
+            return GenerateMathCall(cg, "exp", type, args, 1);
+        case FUNCTION_log:
+            return GenerateMathCall(cg, "log", type, args, 1);
+    }
+    assert(0);
+    return NULL;
+}
+
+// Rough cost of evaluating an expression, in simple instructions
+static int OperationCost(Operation *op) {
+    if (!op) return 0;
+    switch(op->type) {
+        case OPTYPE_binop:
+        {
+            BinaryOperation *binop = (BinaryOperation*) op;
+            int cost = binop->optype == OPTYPE_div || binop->optype == OPTYPE_mod ? 20 : 1;
+            return cost + OperationCost(binop->left) + OperationCost(binop->right);
+        }
+        case OPTYPE_func:
+        {
+            FunctionOperation *function = (FunctionOperation*) op;
+            int cost = 1;
+            switch(function->function) {
+                case FUNCTION_sqrt: cost = 20; break;
+                case FUNCTION_pow:
+                case FUNCTION_exp:
+                case FUNCTION_log: cost = 50; break;
+            }
+            for(size_t i = 0; i < function->argument_count; i++) {
+                cost += OperationCost(function->arguments[i]);
+            }
+            return cost;
+        }
+        case OPTYPE_case:
+        {
+            CaseOperation *case_op = (CaseOperation*) op;
+            int cost = OperationCost(case_op->otherwise);
+            for(size_t i = 0; i < case_op->count; i++) {
+                cost += 1 + OperationCost(case_op->conditions[i]) + OperationCost(case_op->results[i]);
+            }
+            return cost;
+        }
+        case OPTYPE_key:
+            return 1 + OperationCost(((KeyOperation*) op)->child);
+    }
+    return 1;
+}
+
+// Evaluates an expression only if taken is true (for any lane of a vector), the result is zero otherwise
+static LLVMValueRef GenerateGuardedOperation(Codegen *cg, Operation *op, int type, LLVMValueRef taken) {
+    LLVMBuilderRef builder = cg->builder;
+    if (cg->vector_width > 0) {
+        LLVMTypeRef mask_type = LLVMTypeOf(taken);
+        taken = GenerateIntrinsic(cg, "llvm.vector.reduce.or", &mask_type, 1, &taken, 1, "any");
+    }
+    LLVMBasicBlockRef skip = LLVMGetInsertBlock(builder);
+    LLVMBasicBlockRef evaluate = LLVMAppendBasicBlockInContext(cg->context, cg->function, "case_evaluate");
+    LLVMBasicBlockRef merge = LLVMAppendBasicBlockInContext(cg->context, cg->function, "case_merge");
+    LLVMBuildCondBr(builder, taken, evaluate, merge);
+    LLVMPositionBuilderAtEnd(builder, evaluate);
+    LLVMValueRef value = GenerateConvert(cg, GenerateOperation(cg, op), GetOperationType(op), type);
+    // the expression can have added blocks of its own
+    evaluate = LLVMGetInsertBlock(builder);
+    LLVMBuildBr(builder, merge);
+    LLVMPositionBuilderAtEnd(builder, merge);
+    LLVMValueRef result = LLVMBuildPhi(builder, CodegenValueType(cg, type), "case_result");
+    LLVMValueRef values[] = { value, CodegenConstant(cg, type, 0) };
+    LLVMBasicBlockRef blocks[] = { evaluate, skip };
+    LLVMAddIncoming(result, values, blocks, 2);
+    return result;
+}
+
+// CASE compiles to a chain of selects, so rows (and lanes of vectors) do not branch on their conditions
+// All conditions are evaluated first. Cheap results are always evaluated, expensive results (e.g. a pow or a
+// division) are only evaluated if a row takes their branch.
+static LLVMValueRef GenerateCase(Codegen *cg, CaseOperation *op) {
+    LLVMBuilderRef builder = cg->builder;
+    int type = GetOperationType((Operation*) op);
+    LLVMValueRef *conditions = (LLVMValueRef*) malloc((op->count + 1) * sizeof(LLVMValueRef));
+    LLVMValueRef *taken = (LLVMValueRef*) malloc((op->count + 1) * sizeof(LLVMValueRef));
+    LLVMValueRef remaining = CodegenConstant(cg, TYPE_bool, 1);
+    for(size_t i = 0; i < op->count; i++) {
+        // a row takes the first branch with a true condition
+        conditions[i] = GenerateCondition(cg, op->conditions[i]);
+        taken[i] = LLVMBuildAnd(builder, remaining, conditions[i], "taken");
+        remaining = LLVMBuildAnd(builder, remaining, LLVMBuildNot(builder, conditions[i], "not"), "remaining");
+    }
+    LLVMValueRef value;
+    if (!op->otherwise) {
+        value = CodegenConstant(cg, type, 0);
+    } else if (OperationCost(op->otherwise) > CASE_BRANCH_COST) {
+        value = GenerateGuardedOperation(cg, op->otherwise, type, remaining);
+    } else {
+        value = GenerateConvert(cg, GenerateOperation(cg, op->otherwise), GetOperationType(op->otherwise), type);
+    }
+    for(size_t i = op->count; i-- > 0;) {
+        LLVMValueRef result;
+        if (OperationCost(op->results[i]) > CASE_BRANCH_COST) {
+            result = GenerateGuardedOperation(cg, op->results[i], type, taken[i]);
+        } else {
+            result = GenerateConvert(cg, GenerateOperation(cg, op->results[i]), GetOperationType(op->results[i]), type);
+        }
+        value = LLVMBuildSelect(builder, conditions[i], result, value, "case");
+    }
+    free(conditions);
+    free(taken);
+    return value;
+}
+
+static LLVMValueRef GenerateBinaryOperation(Codegen *cg, BinaryOperation *op) {
+    int left_type = GetOperationType(op->left);
+    int right_type = GetOperationType(op->right);
+    LLVMValueRef left = GenerateOperation(cg, op->left);
+    LLVMValueRef right = GenerateOperation(cg, op->right);
+    if (IsBooleanOperator(op->optype)) {
+        // both sides are evaluated (there are no side effects), so the condition does not need a branch
+        left = GenerateConvert(cg, left, left_type, TYPE_bool);
+        right = GenerateConvert(cg, right, right_type, TYPE_bool);
+        return op->optype == OPTYPE_and ? LLVMBuildAnd(cg->builder, left, right, "and") : LLVMBuildOr(cg->builder, left, right, "or");
+    }
+    int type = CommonType(left_type, right_type);
+    if (type == TYPE_bool && !IsComparison(op->optype)) type = TYPE_int;
+    left = GenerateConvert(cg, left, left_type, type);
+    right = GenerateConvert(cg, right, right_type, type);
+    if (IsComparison(op->optype)) {
+        return GenerateComparison(cg, op->optype, type, left, right);
+    }
+    return GenerateArithmetic(cg, op->optype, type, left, right);
+}
+
+static LLVMValueRef GenerateOperation(Codegen *cg, Operation *op) {
+    switch(op->type) {
+        case OPTYPE_const:
+        {
+            double value = ((ConstantOperation*)op)->value;
+            return CodegenConstant(cg, GetConstantType(value), value);
+        }
+        case OPTYPE_colmn:
+            return GenerateColumn(cg, (ColumnOperation*) op);
+        case OPTYPE_binop:
+            return GenerateBinaryOperation(cg, (BinaryOperation*) op);
+        case OPTYPE_func:
+            return GenerateFunction(cg, (FunctionOperation*) op);
+        case OPTYPE_case:
+            return GenerateCase(cg, (CaseOperation*) op);
+        case OPTYPE_rowid:
+        {
+            if (cg->vector_width == 0) return cg->row;
+            // <row, row + 1, ..., row + vector_width - 1>
+            LLVMValueRef lanes[VECTOR_WIDTH];
+            for(unsigned i = 0; i < cg->vector_width; i++) {
+                lanes[i] = LLVMConstInt(CodegenInt64(cg), i, 0);
+            }
+            LLVMValueRef row = LLVMBuildInsertElement(cg->builder, LLVMGetUndef(CodegenValueType(cg, TYPE_lng)), cg->row,
+                LLVMConstInt(LLVMInt32TypeInContext(cg->context), 0, 0), "row");
+            row = LLVMBuildShuffleVector(cg->builder, row, LLVMGetUndef(CodegenValueType(cg, TYPE_lng)),
+                LLVMConstNull(LLVMVectorType(LLVMInt32TypeInContext(cg->context), cg->vector_width)), "rows");
+            return LLVMBuildAdd(cg->builder, row, LLVMConstVector(lanes, cg->vector_width), "rows");
+        }
+        case OPTYPE_key:
+        {
+            KeyOperation *key = (KeyOperation*) op;
+            int type = GetOperationType(key->child);
+            LLVMValueRef value = GenerateOperation(cg, key->child);
+            if (!key->floating) {
+                return GenerateConvert(cg, value, type, TYPE_lng);
+            }
+            // compare floating point keys by their bits, adding zero turns -0.0 into 0.0
+            value = GenerateConvert(cg, value, type, TYPE_dbl);
+            value = LLVMBuildFAdd(cg->builder, value, CodegenConstant(cg, TYPE_dbl, 0), "normalize");
+            return LLVMBuildBitCast(cg->builder, value, CodegenValueType(cg, TYPE_lng), "key");
+        }
+    }
+    assert(0);
+    return NULL;
+}
+
+static LLVMValueRef GenerateCondition(Codegen *cg, Operation *op) {
+    return GenerateConvert(cg, GenerateOperation(cg, op), GetOperationType(op), TYPE_bool);
+}
+
+// Stores the value of every output expression at output[index]
+static void GenerateOutputStore(Codegen *cg, OperationList *outputs, LLVMValueRef *output_data, LLVMValueRef index) {
+    for(size_t i = 0; outputs; i++, outputs = outputs->next) {
+        Operation *op = outputs->operation;
+        int type = GetResultType(op);
+        LLVMValueRef value = GenerateConvert(cg, GenerateOperation(cg, op), GetOperationType(op), type);
+        LLVMValueRef address = LLVMBuildInBoundsGEP2(cg->builder, CodegenType(cg, type), output_data[i], &index, 1, "&output[count]");
+        LLVMBuildStore(cg->builder, value, address);
+    }
+}
+
+static LLVMValueRef GenerateIncrement(Codegen *cg, LLVMValueRef address, const char *name) {
+    LLVMValueRef value = LLVMBuildLoad2(cg->builder, CodegenInt64(cg), address, name);
+    LLVMValueRef incremented = LLVMBuildAdd(cg->builder, value, LLVMConstInt(CodegenInt64(cg), 1, 0), "increment");
+    LLVMBuildStore(cg->builder, incremented, address);
+    return value;
+}
+
+static LLVMValueRef GeneratePopCount(Codegen *cg, LLVMValueRef value) {
+    LLVMTypeRef type = CodegenInt64(cg);
+    return GenerateIntrinsic(cg, "llvm.ctpop", &type, 1, &value, 1, "popcount");
+}
+
+// Returns the table of permutations that move the selected values of a 256-bit vector of lanes values to the front:
+// entry[mask] holds the 32-bit indices of the selected values (a 64-bit value spans two indices), followed by zeros
+static LLVMValueRef GeneratePermutationTable(Codegen *cg, unsigned lanes) {
+    const char *name = lanes == 8 ? "permutations32" : "permutations64";
+    LLVMValueRef table = LLVMGetNamedGlobal(cg->module, name);
+    if (table) return table;
+    LLVMTypeRef int32_type = LLVMInt32TypeInContext(cg->context);
+    LLVMTypeRef entry_type = LLVMVectorType(int32_type, 8);
+    size_t count = (size_t) 1 << lanes;
+    LLVMValueRef *entries = (LLVMValueRef*) malloc(count * sizeof(LLVMValueRef));
+    for(size_t mask = 0; mask < count; mask++) {
+        LLVMValueRef indices[8];
+        unsigned selected = 0;
+        for(unsigned lane = 0; lane < lanes; lane++) {
+            if (!(mask & (1 << lane))) continue;
+            for(unsigned part = 0; part < 8 / lanes; part++) {
+                indices[selected++] = LLVMConstInt(int32_type, lane * (8 / lanes) + part, 0);
+            }
+        }
+        while (selected < 8) {
+            indices[selected++] = LLVMConstInt(int32_type, 0, 0);
+        }
+        entries[mask] = LLVMConstVector(indices, 8);
+    }
+    table = LLVMAddGlobal(cg->module, LLVMArrayType(entry_type, count), name);
+    LLVMSetInitializer(table, LLVMConstArray(entry_type, entries, count));
+    LLVMSetGlobalConstant(table, 1);
+    LLVMSetLinkage(table, LLVMPrivateLinkage);
+    free(entries);
+    return table;
+}
+
+// Stores the lanes of a vector value at output[count], output[count + 1], ...
+// If mask is set only the selected lanes are stored (bits holds the mask as a 64-bit integer), the lanes up to
+// output[count + vector_width] can be overwritten
+static void GenerateVectorStore(Codegen *cg, int type, LLVMValueRef value, LLVMValueRef mask, LLVMValueRef bits, LLVMValueRef output, LLVMValueRef count, int method) {
+    LLVMBuilderRef builder = cg->builder;
+    LLVMTypeRef scalar_type = CodegenType(cg, type);
+    LLVMTypeRef vector_type = LLVMTypeOf(value);
+    unsigned width = cg->vector_width;
+    LLVMValueRef address = LLVMBuildInBoundsGEP2(builder, scalar_type, output, &count, 1, "&output[count]");
+    if (!mask) {
+        LLVMValueRef store = LLVMBuildStore(builder, value, LLVMBuildBitCast(builder, address, LLVMPointerType(vector_type, 0), "&output[count:]"));
+        LLVMSetAlignment(store, GetTypeSize(type));
+        return;
+    }
+    if (method == COMPRESS_STORE) {
+        LLVMValueRef args[] = { value, address, mask };
+        GenerateIntrinsic(cg, "llvm.masked.compressstore", &vector_type, 1, args, 3, "");
+        return;
+    }
+    LLVMTypeRef int32_type = LLVMInt32TypeInContext(cg->context);
+    LLVMValueRef offset = LLVMConstInt(CodegenInt64(cg), 0, 0);
+    if (method == COMPRESS_LANES) {
+        for(unsigned i = 0; i < width; i++) {
+            LLVMValueRef lane = LLVMConstInt(int32_type, i, 0);
+            LLVMValueRef lane_address = LLVMBuildInBoundsGEP2(builder, scalar_type, address, &offset, 1, "&output[count + offset]");
+            LLVMBuildStore(builder, LLVMBuildExtractElement(builder, value, lane, "lane"), lane_address);
+            LLVMValueRef selected = LLVMBuildZExt(builder, LLVMBuildExtractElement(builder, mask, lane, "selected"), CodegenInt64(cg), "selected");
+            offset = LLVMBuildAdd(builder, offset, selected, "offset");
+        }
+        return;
+    }
+    // COMPRESS_PERMUTE: every 256-bit part of the vector is permuted with vpermd, and stored behind the previous part
+    unsigned lanes = 32 / GetTypeSize(type);
+    LLVMValueRef table = GeneratePermutationTable(cg, lanes);
+    LLVMTypeRef permutation_type = LLVMVectorType(int32_type, 8);
+    LLVMTypeRef part_type = LLVMVectorType(scalar_type, lanes);
+    LLVMValueRef zero = LLVMConstInt(CodegenInt64(cg), 0, 0);
+    for(unsigned first = 0; first < width; first += lanes) {
+        LLVMValueRef part = value;
+        if (lanes < width) {
+            LLVMValueRef indices[VECTOR_WIDTH];
+            for(unsigned i = 0; i < lanes; i++) {
+                indices[i] = LLVMConstInt(int32_type, first + i, 0);
+            }
+            part = LLVMBuildShuffleVector(builder, value, LLVMGetUndef(vector_type), LLVMConstVector(indices, lanes), "part");
+        }
+        LLVMValueRef part_bits = LLVMBuildLShr(builder, bits, LLVMConstInt(CodegenInt64(cg), first, 0), "part_bits");
+        part_bits = LLVMBuildAnd(builder, part_bits, LLVMConstInt(CodegenInt64(cg), (1 << lanes) - 1, 0), "part_bits");
+        LLVMValueRef table_index[] = { zero, part_bits };
+        LLVMValueRef permutation_address = LLVMBuildInBoundsGEP2(builder, LLVMGetElementType(LLVMTypeOf(table)), table, table_index, 2, "&permutations[bits]");
+        LLVMValueRef permutation = LLVMBuildLoad2(builder, permutation_type, permutation_address, "permutation");
+        LLVMValueRef args[] = { LLVMBuildBitCast(builder, part, permutation_type, "part"), permutation };
+        LLVMValueRef permuted = GenerateIntrinsic(cg, "llvm.x86.avx2.permd", NULL, 0, args, 2, "permuted");
+        LLVMValueRef part_address = LLVMBuildInBoundsGEP2(builder, scalar_type, address, &offset, 1, "&output[count + offset]");
+        part_address = LLVMBuildBitCast(builder, part_address, LLVMPointerType(part_type, 0), "&output[count + offset:]");
+        LLVMValueRef store = LLVMBuildStore(builder, LLVMBuildBitCast(builder, permuted, part_type, "compressed"), part_address);
+        LLVMSetAlignment(store, GetTypeSize(type));
+        offset = LLVMBuildAdd(builder, offset, GeneratePopCount(cg, part_bits), "offset");
+    }
+}
+
+// Generates a scan kernel:
+//     lng name(void **inputs, lng start, lng end, QueryOutput *output, lng limit)
+// that writes the outputs of every row in [start, end) that satisfies "where" (if any) behind the output->count
+// rows in the output, and returns the new amount of rows in the output
+// If "limited" is set the loop exits as soon as the output has limit rows, otherwise limit is ignored
+// output->capacity must be at least output->count + end - start (or limit)
+// Without a limit the rows are first processed VECTOR_WIDTH at a time: the columns are loaded as vectors, the
+// condition produces a mask and the qualifying rows of every output are compressed into the output (see
+// GenerateVectorStore). The remaining rows are processed one at a time.
+static LLVMValueRef GenerateScanKernel(Codegen *cg, const char *name, OperationList *outputs, Operation *where, bool limited) {
+    LLVMTypeRef int64_type = CodegenInt64(cg);
+    LLVMTypeRef param_types[] = { LLVMPointerType(CodegenBytePointer(cg), 0), int64_type, int64_type, LLVMPointerType(CodegenOutputType(cg), 0), int64_type };
+    LLVMTypeRef prototype = LLVMFunctionType(int64_type, param_types, 5, 0);
+    LLVMValueRef function = LLVMAddFunction(cg->module, name, prototype);
+    cg->function = function;
+
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(cg->context, function, "entry");
+    bool vectorize = simd_kernels && !limited;
+    LLVMBasicBlockRef vector_condition = vectorize ? LLVMAppendBasicBlockInContext(cg->context, function, "vector_condition") : NULL;
+    LLVMBasicBlockRef vector_body = vectorize ? LLVMAppendBasicBlockInContext(cg->context, function, "vector_body") : NULL;
+    LLVMBasicBlockRef condition = LLVMAppendBasicBlockInContext(cg->context, function, "condition");
+    LLVMBasicBlockRef body = LLVMAppendBasicBlockInContext(cg->context, function, "body");
+    LLVMBasicBlockRef store = LLVMAppendBasicBlockInContext(cg->context, function, "store");
+    LLVMBasicBlockRef increment = LLVMAppendBasicBlockInContext(cg->context, function, "increment");
+    LLVMBasicBlockRef end = LLVMAppendBasicBlockInContext(cg->context, function, "end");
+
+    size_t output_count = 0;
+    for(OperationList *list = outputs; list; list = list->next) {
+        output_count++;
+    }
+    LLVMValueRef *output_data = (LLVMValueRef*) calloc(output_count + 1, sizeof(LLVMValueRef));
+
+    LLVMValueRef index_addr, count_addr;
+    LLVMPositionBuilderAtEnd(cg->builder, entry);
+    {
+        free(cg->input_data);
+        cg->input_data = GenerateColumnPointers(cg, LLVMGetParam(function, 0), cg->inputs);
+        GenerateOutputPointers(cg, LLVMGetParam(function, 3), outputs, output_data);
+        index_addr = LLVMBuildAlloca(cg->builder, int64_type, "index");
+        LLVMBuildStore(cg->builder, LLVMGetParam(function, 1), index_addr);
+        // the rows are written behind the rows that are already in the output
+        count_addr = LLVMBuildAlloca(cg->builder, int64_type, "count");
+        LLVMValueRef output_count = LLVMBuildStructGEP2(cg->builder, CodegenOutputType(cg), LLVMGetParam(function, 3), 1, "&output->count");
+        LLVMBuildStore(cg->builder, LLVMBuildLoad2(cg->builder, int64_type, output_count, "output->count"), count_addr);
+        LLVMBuildBr(cg->builder, vectorize ? vector_condition : condition);
+    }
+    if (vectorize) {
+        int method = LLVMTargetHasFeature("avx512f") ? COMPRESS_STORE : LLVMTargetHasFeature("avx2") ? COMPRESS_PERMUTE : COMPRESS_LANES;
+        LLVMValueRef width = LLVMConstInt(int64_type, VECTOR_WIDTH, 0);
+        LLVMPositionBuilderAtEnd(cg->builder, vector_condition);
+        LLVMValueRef index = LLVMBuildLoad2(cg->builder, int64_type, index_addr, "[index]");
+        LLVMValueRef next = LLVMBuildAdd(cg->builder, index, width, "next");
+        LLVMBuildCondBr(cg->builder, LLVMBuildICmp(cg->builder, LLVMIntSLE, next, LLVMGetParam(function, 2), "next <= end"), vector_body, condition);
+
+        LLVMPositionBuilderAtEnd(cg->builder, vector_body);
+        cg->row = index;
+        cg->vector_width = VECTOR_WIDTH;
+        LLVMValueRef mask = NULL, bits = NULL;
+        LLVMValueRef selected = width;
+        if (where) {
+            mask = GenerateCondition(cg, where);
+            bits = LLVMBuildBitCast(cg->builder, mask, LLVMIntTypeInContext(cg->context, VECTOR_WIDTH), "bits");
+            bits = LLVMBuildZExt(cg->builder, bits, int64_type, "bits");
+            selected = GeneratePopCount(cg, bits);
+        }
+        LLVMValueRef count = LLVMBuildLoad2(cg->builder, int64_type, count_addr, "[count]");
+        size_t i = 0;
+        for(OperationList *list = outputs; list; list = list->next, i++) {
+            int type = GetResultType(list->operation);
+            LLVMValueRef value = GenerateConvert(cg, GenerateOperation(cg, list->operation), GetOperationType(list->operation), type);
+            GenerateVectorStore(cg, type, value, mask, bits, output_data[i], count, method);
+        }
+        cg->vector_width = 0;
+        LLVMBuildStore(cg->builder, LLVMBuildAdd(cg->builder, count, selected, "count"), count_addr);
+        LLVMBuildStore(cg->builder, next, index_addr);
+        LLVMBuildBr(cg->builder, vector_condition);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, condition);
+    {
+        LLVMValueRef index = LLVMBuildLoad2(cg->builder, int64_type, index_addr, "[index]");
+        LLVMValueRef cond = LLVMBuildICmp(cg->builder, LLVMIntSLT, index, LLVMGetParam(function, 2), "index < end");
+        if (limited) {
+            // stop scanning as soon as enough rows qualify
+            LLVMValueRef count = LLVMBuildLoad2(cg->builder, int64_type, count_addr, "[count]");
+            LLVMValueRef below_limit = LLVMBuildICmp(cg->builder, LLVMIntSLT, count, LLVMGetParam(function, 4), "count < limit");
+            cond = LLVMBuildAnd(cg->builder, cond, below_limit, "continue");
+        }
+        LLVMBuildCondBr(cg->builder, cond, body, end);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, body);
+    {
+        cg->row = LLVMBuildLoad2(cg->builder, int64_type, index_addr, "[index]");
+        if (where) {
+            LLVMBuildCondBr(cg->builder, GenerateCondition(cg, where), store, increment);
+        } else {
+            LLVMBuildBr(cg->builder, store);
+        }
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, store);
+    {
+        LLVMValueRef count = GenerateIncrement(cg, count_addr, "[count]");
+        GenerateOutputStore(cg, outputs, output_data, count);
+        LLVMBuildBr(cg->builder, increment);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, increment);
+    {
+        GenerateIncrement(cg, index_addr, "[index]");
+        LLVMBuildBr(cg->builder, condition);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, end);
+    {
+        LLVMBuildRet(cg->builder, LLVMBuildLoad2(cg->builder, int64_type, count_addr, "[count]"));
+    }
+    free(output_data);
+    return function;
+}
+
+#endif
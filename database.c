@@ -8,6 +8,7 @@
 #include <llvm-c/Transforms/IPO.h>
 #include <llvm-c/Transforms/Scalar.h>
 #include <llvm-c/Transforms/Vectorize.h>
+#include <llvm-c/Transforms/Utils.h>
 
 #include <inttypes.h>
 #include <stdio.h>
@@ -18,98 +19,477 @@
 #include <ctype.h>
 
 #include "table.h"
+#include "asyncio.h"
+#include "buffer.h"
 #include "parser.h"
+#include "delta.h"
+#include "loader.h"
+#include "pax.h"
 
 #include "target_machine.h"
+#include "codecache.h"
+#include "jitcache.h"
+#include "passes.h"
+#include "perfcounters.h"
+
+#include "codegen.h"
+#include "imprint.h"
+#include "morsel.h"
+#include "hashjoin.h"
+#include "sort.h"
+#include "sharedscan.h"
+#include "aggregate.h"
+#include "resultcache.h"
+#include "stats.h"
+#include "server.h"
+#include "script.h"
 
 static void Initialize(void);
 static char* ReadQuery(void);
 static Table *ExecuteQuery(Query *query);
 static void Cleanup(void); 
-static LLVMPassManagerRef InitializePassManager(LLVMModuleRef module);
 
-static bool enable_optimizations = false;
 static bool print_result = true;
 static bool print_llvm = true;
 static bool execute_statement = false;
 static char* statement;
+static size_t thread_count = 0;
+static bool shared_scans = true;
+static char *target_cpu = "native";
+static size_t load_ahead_size = 64 * 1024 * 1024;  // -load-ahead, 0 with -no-load-ahead
 
-static Table*
-ExecuteQuery(Query *query) {
-    // TODO: Implement the execution engine of the database
-
-    // This function takes a Query object as input, and should return a table
-    // The query object has the following structure:
-    /*
-     *  typedef struct {
-     *      Operation *select;
-     *      char *table;
-     *      Operation *where;
-     *      ColumnList *columns;
-     *  } Query;
-     */
-    // "select" is the operation that describe the SELECT part of the query
-    //   for simplicity, we only allow one statement in the SELECT clause
-    // "table" is just the table name in the FROM clause
-    // "where" is the operation that describes the WHERE condition
-    // "columns" is a list of all columns that are part of the query
-
-    // Both "Select" and "Where" are an Operation structure,
-    // this structure contains the Operation that has to be performed
-    // An operation is one of the following types:
-    // 
-    // 1) ConstantOperation (op->type == OPTYPE_const)
-    //    Holds a constant double value: ((ConstantOperation*)op)->value
-    // 2) ColumnOperation (op->type == OPTYPE_colmn)
-    //    Holds a reference to a column that occurs in the table
-    //      ((ColumnOperation*)op)->column
-    //    - The column stores an array of doubles in column->data
-    //    - The amount of values in the column is available in column->size
-    // 3) BinaryOperation (op->type == OPTYPE_binop)
-    //    Holds an actual binary operation
-    //    - The type of the operation is stored in ((BinaryOperation*)op)->optype
-    //       a list of supported types can be found at the top of parser.h
-    //       note that there are no "difficult" operations (i.e. no pipeline breakers)
-    //    - The LHS of the operation ((BinaryOperation*)op)->left
-    //    - The RHS of the operation ((BinaryOperation*)op)->right
-    //    Binary operations can be nested to create complex expressions
-    //      i.e. ->left can be a BinaryOperation as well
-
-    // To correctly answer queries, you should handle both query->select and 
-    //   query->where using JIT compilation
-
-    // Hint: Write a function to handle to handle a specific query in C,
-    //  I recommend starting with only selections
-    //  such as 'SELECT x+y+z FROM demo;'
-    // then use the command "clang file.c -S -emit-llvm -o -"
-    // to compile the C function to LLVM IR to get an idea of how to do it in LLVM
-
-    // note that your function will have to accept an arbitrary amount of input columns
-    // (how would you do that in C?)
-
-    // For a simple for-loop implementation using LLVM JIT Compilation, see llvmtest.c
-    // You can copy most of the code from there as a start to your execution engine
-
-    // For now, we implement a basic engine that only implements selection
-
-     (void) InitializePassManager;
-     (void) LLVMOptimizeModuleForTarget;
-
-    if (query->where != NULL) {
-        fprintf(stdout, "Error: WHERE operation is currently not supported.\n");
+// Verifies, optimizes and compiles all functions in the module of the code generator
+// The module is optimized with the profile of the query, or of the session if the query does not have one
+// Returns a reference to the compiled query, which owns the context of the module unless the query was already
+// compiled in this session (see jitcache.h), or NULL if the query could not be compiled
+static CompiledQuery*
+CompileQuery(Codegen *cg, Query *query) {
+    char *error = NULL;
+    if (LLVMVerifyModule(cg->module, LLVMReturnStatusAction, &error) != 0) {
+        fprintf(stdout, "Error: Generated invalid code: %s\n", error);
+        LLVMDisposeMessage(error);
+        return NULL;
+    }
+    LLVMDisposeMessage(error);
+    OptimizationProfile *profile = query->optimize ? GetOptimizationProfile(query->optimize) : SessionProfile();
+    if (!profile) return NULL;
+    // before the lookup, so the CPU is part of the key of the code cache
+    LLVMAddTargetAttributes(cg->module);
+    char key[CODE_CACHE_KEY_LENGTH];
+    CodeCacheKey(cg->module, profile->description, key);
+    // a profiled query is always compiled, so every pass is timed
+    CompiledQuery *compiled = query->profile ? NULL : JITCacheLookup(key);
+    if (compiled) {
+        if (print_llvm) {
+            LLVMDumpModule(cg->module);
+        }
+        return compiled;
+    }
+    bool cached;
+    char *cache_path = CodeCacheLookup(key, &cached);
+    // a cached object was already optimized when it was compiled
+    if (!cached) {
+        OptimizeModule(cg->module, profile, query->profile);
+    } else if (query->profile) {
+        fprintf(stdout, "Optimization profile %s: loaded the compiled query from the code cache\n", profile->name);
+    }
+    if (print_llvm) {
+        LLVMDumpModule(cg->module);
+    }
+    if (cache_path) {
+        // the object cache reads and writes the file named by the module identifier
+        LLVMSetModuleIdentifier(cg->module, cache_path, strlen(cache_path));
+        free(cache_path);
+    }
+    struct LLVMMCJITCompilerOptions options;
+    LLVMInitializeMCJITCompilerOptions(&options, sizeof(options));
+    options.OptLevel = profile->codegen_level;
+    // counts the JIT memory of the query (see \stats)
+    LLVMMCJITMemoryManagerRef memory = LLVMCreateCountingMemoryManager();
+    options.MCJMM = memory;
+    LLVMExecutionEngineRef engine;
+    if (LLVMCreateMCJITCompilerForModule(&engine, cg->module, &options, sizeof(options), &error) != 0) {
+        fprintf(stdout, "Error: Failed to create execution engine: %s\n", error);
+        LLVMDisposeMessage(error);
+        return NULL;
+    }
+    if (cache_path) {
+        LLVMSetFileObjectCache(engine);
+    }
+    if (query->profile) {
+        // MCJIT generates the machine code when the address of the first function is requested
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        LLVMValueRef function = LLVMGetFirstFunction(cg->module);
+        while (function && LLVMIsDeclaration(function)) {
+            function = LLVMGetNextFunction(function);
+        }
+        if (function) LLVMGetFunctionAddress(engine, LLVMGetValueName(function));
+        fprintf(stdout, "  %-24s %10.3f\n", cached ? "Loading machine code" : "Code generation", ElapsedMilliseconds(&start));
+    }
+    return CreateCompiledQuery(key, cg->context, engine, memory);
+}
+
+// Reads the first chunks of the input columns of a query in the background while the query is compiled
+typedef struct {
+    Table *tables[2];               // the scanned table, or the build and probe tables of a join
+    ColumnList *columns[2];
+    ImprintPredicate *predicates;   // the imprint predicates of a scan
+    size_t predicate_count;
+    pthread_t thread;
+    bool started;
+} ColumnLoader;
+
+// A query whose kernels have been generated and compiled, but that has not run yet
+// Compilation is separate from execution, so a script can compile the next queries while a query runs (see script.h)
+typedef struct _PreparedQuery {
+    Query *query;
+    OperationList outputs;      // the SELECT expression, followed by the ORDER BY expression (if any)
+    OperationList order;
+    lng limit;                  // the LIMIT that is pushed into the pipeline, or -1
+    ColumnList *inputs;         // the input columns of the scan kernel
+    CompiledQuery *compiled;
+    JoinPlan *plan;             // the plan of a join, or NULL for a scan
+    OperationList build_key;    // outputs of the build kernel of a join: the key and the row number
+    OperationList build_rowid;
+    ScanKernel scan;            // the scan kernel, or the build kernel of a join
+    ProbeKernel probe;
+    ImprintPredicate imprint_predicates[IMPRINT_MAX_PREDICATES];  // comparisons of the scan that can use imprints
+    size_t imprint_predicate_count;
+    ColumnLoader loader;
+    double compile_ms;          // the time it took to compile the query, part of its cost in the result cache
+    PerfCounters perf;          // the performance counters of the phases of the query (-perf-counters)
+    lng tuples;                 // rows and bytes that are read by the kernels
+    lng bytes;
+} PreparedQuery;
+
+static lng CountMorselRows(MorselList *list) {
+    lng rows = 0;
+    for(size_t i = 0; i < list->count; i++) {
+        rows += list->morsels[i].end - list->morsels[i].start;
+    }
+    return rows;
+}
+
+static lng RowWidth(ColumnList *columns) {
+    lng width = 0;
+    for(; columns; columns = columns->next) {
+        width += columns->column->elsize;
+    }
+    return width;
+}
+
+static void *LoadColumns(void *arg) {
+    ColumnLoader *loader = (ColumnLoader*) arg;
+    size_t bytes = load_ahead_size;
+    // the chunks that are read ahead should not push each other out before the query runs
+    if (buffer_budget > 0 && bytes > buffer_budget / 4) bytes = buffer_budget / 4;
+    size_t table_count = loader->tables[1] ? 2 : 1;
+    for(size_t i = 0; i < table_count; i++) {
+        Table *table = loader->tables[i];
+        pthread_rwlock_rdlock(&table->lock);
+        ImprintFilter filter;
+        // building a missing imprint reads the column as well, it overlaps with the compilation too
+        bool filtered = i == 0 && CreateImprintFilter(&filter, loader->predicates, loader->predicate_count);
+        PrefetchColumns(table, loader->columns[i], filtered ? &filter : NULL, bytes / table_count);
+        pthread_rwlock_unlock(&table->lock);
+    }
+    return NULL;
+}
+
+// Starts reading the columns of a query while it is compiled (up to -load-ahead bytes), so the I/O of a cold query
+// overlaps with code generation and optimization instead of starting when the query runs. The reads are asynchronous
+// (see PrefetchChunk), the scan pins the chunks and waits for the reads that have not finished yet.
+static void StartColumnLoader(ColumnLoader *loader, Table *table, ColumnList *columns, Table *second, ColumnList *second_columns) {
+    loader->tables[0] = table;
+    loader->columns[0] = columns;
+    loader->tables[1] = second;
+    loader->columns[1] = second_columns;
+    loader->started = load_ahead_size > 0 && pthread_create(&loader->thread, NULL, LoadColumns, loader) == 0;
+}
+
+// Waits until the reads of the columns of a query have been started
+static void WaitColumnLoader(ColumnLoader *loader) {
+    if (loader->started) pthread_join(loader->thread, NULL);
+    loader->started = false;
+}
+
+// Generates and compiles the kernels of a query, returns NULL if the query could not be compiled
+static PreparedQuery*
+PrepareQuery(Query *query) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    PreparedQuery *prepared = (PreparedQuery*) calloc(1, sizeof(PreparedQuery));
+    if (perf_counters_enabled) {
+        // the query can be compiled and executed by different threads, so the counters are opened for every phase
+        PerfOpen(&prepared->perf);
+        PerfStart(&prepared->perf);
+    }
+    prepared->query = query;
+    prepared->order.operation = query->order;
+    prepared->outputs.operation = query->select;
+    prepared->outputs.next = query->order ? &prepared->order : NULL;
+    // without ORDER BY the LIMIT is pushed into the pipeline, which stops as soon as enough rows qualify
+    // (an aggregate always needs all rows)
+    prepared->limit = query->order || query->aggregate ? -1 : query->limit;
+    Codegen *cg;
+    if (query->join_table) {
+        prepared->plan = PlanJoin(query);
+        if (!prepared->plan) {
+            if (perf_counters_enabled) PerfClose(&prepared->perf);
+            free(prepared);
+            return NULL;
+        }
+        JoinPlan *plan = prepared->plan;
+        StartColumnLoader(&prepared->loader, plan->build_table, plan->build_columns, plan->probe_table, plan->probe_columns);
+        cg = CodegenCreate("join");
+        prepared->build_key.operation = plan->build_key;
+        prepared->build_key.next = &prepared->build_rowid;
+        prepared->build_rowid.operation = CreateRowIdOperation();
+        cg->inputs = plan->build_columns;
+        GenerateScanKernel(cg, "build", &prepared->build_key, plan->build_filter, false);
+        cg->inputs = plan->probe_columns;
+        cg->build_inputs = plan->build_columns;
+        GenerateProbeKernel(cg, "probe", &prepared->outputs, plan, prepared->limit >= 0);
+    } else {
+        Table *table = GetTable(query->table);
+        cg = CodegenCreate("query");
+        cg->inputs = GetTableColumns(query->columns, table);
+        CollectImprintPredicates(query->where, prepared->imprint_predicates, &prepared->imprint_predicate_count);
+        // a sample only reads some of the chunks, they are chosen when it runs
+        if (query->sample <= 0) {
+            prepared->loader.predicates = prepared->imprint_predicates;
+            prepared->loader.predicate_count = prepared->imprint_predicate_count;
+            StartColumnLoader(&prepared->loader, table, cg->inputs, NULL, NULL);
+        }
+        GenerateScanKernel(cg, "scan", &prepared->outputs, query->where, prepared->limit >= 0);
+    }
+    CompiledQuery *compiled = CompileQuery(cg, query);
+    // the module and its context belong to the compiled query if it was compiled now, they are disposed otherwise
+    LLVMContextRef context = cg->context;
+    LLVMModuleRef module = cg->module;
+    bool owned = compiled && compiled->context == context;
+    if (!owned) LLVMDisposeModule(module);
+    prepared->inputs = cg->inputs;
+    CodegenDestroy(cg);
+    if (!owned) LLVMContextDispose(context);
+    if (!compiled) {
+        WaitColumnLoader(&prepared->loader);
+        if (perf_counters_enabled) PerfClose(&prepared->perf);
+        free(prepared);
+        return NULL;
+    }
+    prepared->compiled = compiled;
+    // MCJIT generates the machine code here, so it is part of the compilation
+    LLVMExecutionEngineRef engine = compiled->engine;
+    if (query->join_table) {
+        prepared->scan = (ScanKernel) LLVMGetFunctionAddress(engine, "build");
+        prepared->probe = (ProbeKernel) LLVMGetFunctionAddress(engine, "probe");
+    } else {
+        prepared->scan = (ScanKernel) LLVMGetFunctionAddress(engine, "scan");
+    }
+    if (owned) CacheCompiledQuery(compiled, module);
+    prepared->compile_ms = ElapsedMilliseconds(&start);
+    if (perf_counters_enabled) {
+        PerfStop(&prepared->perf, PERF_compile);
+        PerfClose(&prepared->perf);
+    }
+    return prepared;
+}
+
+// Runs the join of the query, and returns the probe morsels with their outputs
+static MorselList*
+ExecuteJoin(PreparedQuery *prepared) {
+    JoinPlan *plan = prepared->plan;
+    lng limit = prepared->limit;
+    ProbeState probe;
+    probe.kernel = prepared->probe;
+    probe.outputs = &prepared->outputs;
+
+    // always lock the tables in the same order
+    Table *first = plan->build_table < plan->probe_table ? plan->build_table : plan->probe_table;
+    Table *second = first == plan->build_table ? plan->probe_table : plan->build_table;
+    pthread_rwlock_rdlock(&first->lock);
+    pthread_rwlock_rdlock(&second->lock);
+
+    // build: the probe reads the build columns by row number, so the columns are copied with the rows of the delta behind them
+    lng build_rows = GetRowCount(plan->build_table);
+    void **build_inputs = MaterializeColumns(plan->build_table, plan->build_columns);
+    if (!build_inputs) {
+        pthread_rwlock_unlock(&second->lock);
+        pthread_rwlock_unlock(&first->lock);
+        return NULL;
+    }
+    size_t build_column_count = GetColCount(plan->build_columns);
+    MorselList *build_morsels = CreateMorselList();
+    void **morsel_inputs = (void**) malloc((build_column_count + 1) * sizeof(void*));
+    memcpy(morsel_inputs, build_inputs, build_column_count * sizeof(void*));
+    AddMorsels(build_morsels, morsel_inputs, 0, build_rows);
+    if (build_morsels->count == 0) free(morsel_inputs);
+    ScanState build;
+    build.kernel = prepared->scan;
+    build.outputs = &prepared->build_key;
+    build.filter = NULL;
+    RunMorsels(build_morsels, RunScanMorsel, &build, thread_count, -1);
+    Table *pairs = CollectOutputs(build_morsels, &prepared->build_key, -1);
+    FreeMorselList(build_morsels);
+    probe.build_inputs = build_inputs;
+    probe.hash_table = BuildHashTable((lng*) pairs->columns->data, (lng*) pairs->columns->next->data, pairs->columns->size, thread_count);
+    free(pairs->columns->next->data);
+    free(pairs->columns->data);
+
+    // probe
+    MorselList *probe_morsels = CreateMorselList();
+    AddTableMorsels(probe_morsels, plan->probe_table, plan->probe_columns);
+    RunMorsels(probe_morsels, RunProbeMorsel, &probe, thread_count, limit);
+    prepared->tuples = build_rows + CountMorselRows(probe_morsels);
+    prepared->bytes = build_rows * RowWidth(plan->build_columns) + CountMorselRows(probe_morsels) * RowWidth(plan->probe_columns);
+
+    pthread_rwlock_unlock(&second->lock);
+    pthread_rwlock_unlock(&first->lock);
+
+    FreeHashTable(probe.hash_table);
+    for(size_t i = 0; i < build_column_count; i++) {
+        free(build_inputs[i]);
+    }
+    free(build_inputs);
+    if (probe_morsels->failed) {
+        printf("Failed to read the columns of table %s.\n", plan->probe_table->name);
+        FreeMorselList(probe_morsels);
+        return NULL;
+    }
+    return probe_morsels;
+}
+
+// Runs the scan of the query, and returns the morsels with their outputs
+// With TABLESAMPLE only the morsels of the sampled blocks are run and returned, and sample is set
+static MorselList*
+ExecuteScan(PreparedQuery *prepared, SampleInfo *sample) {
+    Query *query = prepared->query;
+    lng limit = prepared->limit;
+    Table *table = GetTable(query->table);
+    ScanState scan;
+    scan.kernel = prepared->scan;
+    scan.outputs = &prepared->outputs;
+
+    // every morsel is processed by the compiled scan, the scan covers both the columns and
+    // the rows that were appended to the table but not yet merged
+    pthread_rwlock_rdlock(&table->lock);
+    MorselList *morsels = CreateMorselList();
+    size_t column_morsels = AddTableMorsels(morsels, table, prepared->inputs);
+    ImprintFilter filter;
+    if (CreateImprintFilter(&filter, prepared->imprint_predicates, prepared->imprint_predicate_count)) {
+        // chunks without any qualifying cache line are not pinned, so they are not read either
+        for(size_t i = 0; i < column_morsels; i++) {
+            Morsel *morsel = &morsels->morsels[i];
+            lng offset = morsel->chunk * BUFFER_CHUNK_SIZE;
+            if (!ImprintCandidates(&filter, offset + morsel->start, offset + morsel->end)) {
+                morsel->chunk = -1;
+                morsel->end = morsel->start;
+            }
+        }
+        scan.filter = &filter;
+    } else {
+        scan.filter = NULL;
+    }
+    if (query->sample > 0) {
+        // a sample does not cover all column morsels, so it can not attach to a shared scan
+        SampleMorsels(morsels, query->sample, query->sample_seed, sample);
+        RunMorsels(morsels, RunScanMorsel, &scan, thread_count, limit);
+    } else if (shared_scans && limit < 0) {
+        // concurrent queries on the same table share one pass over its columns
+        RunSharedScan(table, morsels, column_morsels, RunScanMorsel, &scan, thread_count);
+    } else {
+        RunMorsels(morsels, RunScanMorsel, &scan, thread_count, limit);
+    }
+    pthread_rwlock_unlock(&table->lock);
+    if (morsels->failed) {
+        // a partial result would look like a correct answer
+        printf("Failed to read the columns of table %s.\n", table->name);
+        FreeMorselList(morsels);
         return NULL;
     }
+    // morsels that were skipped by a LIMIT or an imprint have no rows
+    prepared->tuples = CountMorselRows(morsels);
+    prepared->bytes = prepared->tuples * RowWidth(prepared->inputs);
+    return morsels;
+}
 
-    Operation* select = query->select;
-    Column *column = NULL;
-    if (select->type != OPTYPE_colmn) {
-        fprintf(stdout, "Error: Currently only supports column selections.\n");
+// Runs a compiled query and frees it, returns the result table or NULL if the query failed
+// The result is added to the result cache (see resultcache.h)
+static Table*
+ExecutePreparedQuery(PreparedQuery *prepared) {
+    Query *query = prepared->query;
+    Table *tables[2];
+    lng versions[2];
+    // the versions are read before the tables are, so a result is never cached under a newer version
+    bool cacheable = ResultCacheTables(query, tables, versions);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (perf_counters_enabled) {
+        PerfOpen(&prepared->perf);
+        PerfStart(&prepared->perf);
+    }
+    WaitColumnLoader(&prepared->loader);
+    SampleInfo sample;
+    MorselList *morsels = query->join_table ? ExecuteJoin(prepared) : ExecuteScan(prepared, &sample);
+    Table *result;
+    if (!morsels) {
+        if (perf_counters_enabled) PerfClose(&prepared->perf);
+        ReleaseCompiledQuery(prepared->compiled);
+        free(prepared);
         return NULL;
+    }
+    if (perf_counters_enabled) {
+        PerfStop(&prepared->perf, PERF_execute);
+        PerfStart(&prepared->perf);
+    }
+    if (query->aggregate) {
+        result = ComputeAggregate(morsels, query->aggregate, GetResultType(query->select), query->sample > 0 ? &sample : NULL);
+    } else if (query->order) {
+        result = SortOutputs(morsels, &prepared->outputs, GetResultType(query->order), query->descending, query->limit, thread_count);
     } else {
-        ColumnOperation *colop = (ColumnOperation*) select;
-        column = CreateColumn(colop->column->data, colop->column->size);
+        result = CollectOutputs(morsels, &prepared->outputs, query->limit);
+    }
+    FreeMorselList(morsels);
+    if (perf_counters_enabled) {
+        PerfStop(&prepared->perf, PERF_finish);
+        PerfClose(&prepared->perf);
+        PrintPerfCounters(&prepared->perf, prepared->tuples, prepared->bytes);
     }
-    return CreateTable("Result", column);
+    double elapsed = ElapsedMilliseconds(&start);
+    StatsRecordQuery(query, prepared->compile_ms, elapsed);
+    if (cacheable) {
+        ResultCacheInsert(query, tables, versions, result, prepared->compile_ms + elapsed);
+    }
+    ReleaseCompiledQuery(prepared->compiled);
+    free(prepared);
+    return result;
+}
+
+// Runs a compiled query and frees it, returns the cached result of the query if there is one
+static Table*
+RunPreparedQuery(PreparedQuery *prepared) {
+    Table *result = ResultCacheLookup(prepared->query);
+    if (!result) return ExecutePreparedQuery(prepared);
+    StatsRecordCacheHit(prepared->query);
+    WaitColumnLoader(&prepared->loader);
+    ReleaseCompiledQuery(prepared->compiled);
+    free(prepared);
+    return result;
+}
+
+static Table*
+ExecuteQuery(Query *query) {
+    // a cached result does not have to be compiled either
+    Table *result = ResultCacheLookup(query);
+    if (result) {
+        StatsRecordCacheHit(query);
+        return result;
+    }
+    PreparedQuery *prepared = PrepareQuery(query);
+    if (!prepared) return NULL;
+    return ExecutePreparedQuery(prepared);
 }
 
 int main(int argc, char** argv) {
@@ -117,14 +497,41 @@ int main(int argc, char** argv) {
         char *arg = argv[i];
         if (strcmp(arg, "--help") == 0) {
             fprintf(stdout, "RembranDB Options.\n");
-            fprintf(stdout, "  -opt              Enable  LLVM optimizations.\n");
+            fprintf(stdout, "  -opt              Enable  LLVM optimizations (same as -opt-profile full).\n");
+            fprintf(stdout, "  -opt-profile p    Optimize queries with profile p: none, fast, full or a list of passes.\n");
             fprintf(stdout, "  -no-print         Do not print query results.\n");
             fprintf(stdout, "  -no-llvm          Do not print LLVM instructions.\n");
             fprintf(stdout, "  -s \"stmnt\"        Execute \"stmnt\" and exit.\n");
+            fprintf(stdout, "  -f script.sql     Execute the statements in script.sql and exit, compiling queries ahead.\n");
+            fprintf(stdout, "  -threads n        Use n threads (default: number of cores).\n");
+            fprintf(stdout, "  -merge-threshold n  Merge appended rows into the columns after n rows.\n");
+            fprintf(stdout, "  -socket path      Serve clients on the Unix domain socket \"path\".\n");
+            fprintf(stdout, "  -port n           Serve clients on TCP port n of the loopback interface.\n");
+            fprintf(stdout, "  -sessions n       Serve the requests of up to n clients concurrently (default: 8).\n");
+            fprintf(stdout, "  -no-shared-scans  Do not share scans between concurrent queries.\n");
+            fprintf(stdout, "  -memory size      Keep at most size (e.g. 512M, 16G) of column data in memory (default: 75%% of RAM).\n");
+            fprintf(stdout, "  -no-io-uring      Read ahead with a pool of pread threads instead of io_uring.\n");
+            fprintf(stdout, "  -load-ahead size  Read up to size of the columns of a query while it is compiled (default: 64M).\n");
+            fprintf(stdout, "  -no-load-ahead    Do not read the columns of a query before it runs.\n");
+            fprintf(stdout, "  -code-cache dir   Cache compiled queries in dir (default: Tables/.codecache).\n");
+            fprintf(stdout, "  -code-cache-size size  Keep at most size of compiled queries in the cache (default: 256M).\n");
+            fprintf(stdout, "  -no-code-cache    Do not cache compiled queries on disk.\n");
+            fprintf(stdout, "  -jit-cache-size size  Keep at most size of compiled queries in memory (default: 32M).\n");
+            fprintf(stdout, "  -no-jit-cache     Dispose of compiled queries after they have run.\n");
+            fprintf(stdout, "  -result-cache-size size  Keep at most size of query results in memory (default: 64M).\n");
+            fprintf(stdout, "  -result-cache-min-cost ms  Only cache results that took at least ms to compute (default: 1).\n");
+            fprintf(stdout, "  -no-result-cache  Do not cache query results.\n");
+            fprintf(stdout, "  -perf-counters    Report hardware performance counters of every query (disables the result cache).\n");
+            fprintf(stdout, "  -target-cpu cpu   Generate code for cpu: native (default), portable (x86-64-v2/v3/v4) or a CPU name.\n");
+            fprintf(stdout, "  -no-simd          Do not generate vector loops for scans (leave vectorization to the optimizer).\n");
+            fprintf(stdout, "  -no-imprints      Do not use column imprints to skip data in range predicates.\n");
             return 0;
         } else if (strcmp(arg, "-opt") == 0) {
             fprintf(stdout, "Optimizations enabled.\n");
-            enable_optimizations = true;
+            default_profile = GetOptimizationProfile("full");
+        } else if (strcmp(arg, "-opt-profile") == 0 && i + 1 < argc) {
+            default_profile = GetOptimizationProfile(argv[++i]);
+            if (!default_profile) exit(1);
         } else if (strcmp(arg, "-no-print") == 0) {
             fprintf(stdout, "Printing output disabled.\n");
             print_result = false;
@@ -133,6 +540,75 @@ int main(int argc, char** argv) {
             print_llvm = false;
         } else if (strcmp(arg, "-s") == 0) {
             execute_statement = true;
+        } else if (strcmp(arg, "-f") == 0 && i + 1 < argc) {
+            script_file = argv[++i];
+        } else if (strcmp(arg, "-threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if (strcmp(arg, "-merge-threshold") == 0 && i + 1 < argc) {
+            delta_merge_threshold = atoll(argv[++i]);
+        } else if (strcmp(arg, "-socket") == 0 && i + 1 < argc) {
+            server_socket = argv[++i];
+        } else if (strcmp(arg, "-port") == 0 && i + 1 < argc) {
+            server_port = atoi(argv[++i]);
+        } else if (strcmp(arg, "-sessions") == 0 && i + 1 < argc) {
+            server_sessions = atoi(argv[++i]);
+            if (server_sessions == 0) server_sessions = 1;
+        } else if (strcmp(arg, "-no-shared-scans") == 0) {
+            shared_scans = false;
+        } else if (strcmp(arg, "-code-cache") == 0 && i + 1 < argc) {
+            code_cache_directory = argv[++i];
+        } else if (strcmp(arg, "-code-cache-size") == 0 && i + 1 < argc) {
+            code_cache_size = ParseMemorySize(argv[++i]);
+            if (code_cache_size == 0) {
+                fprintf(stdout, "Invalid code cache size \"%s\".\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(arg, "-no-code-cache") == 0) {
+            code_cache_enabled = false;
+        } else if (strcmp(arg, "-jit-cache-size") == 0 && i + 1 < argc) {
+            jit_cache_size = ParseMemorySize(argv[++i]);
+            if (jit_cache_size == 0) {
+                fprintf(stdout, "Invalid JIT cache size \"%s\".\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(arg, "-no-jit-cache") == 0) {
+            jit_cache_enabled = false;
+        } else if (strcmp(arg, "-result-cache-size") == 0 && i + 1 < argc) {
+            result_cache_size = ParseMemorySize(argv[++i]);
+            if (result_cache_size == 0) {
+                fprintf(stdout, "Invalid result cache size \"%s\".\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(arg, "-result-cache-min-cost") == 0 && i + 1 < argc) {
+            result_cache_min_cost = atof(argv[++i]);
+        } else if (strcmp(arg, "-no-result-cache") == 0) {
+            result_cache_enabled = false;
+        } else if (strcmp(arg, "-perf-counters") == 0) {
+            // measured queries always run
+            perf_counters_enabled = true;
+            result_cache_enabled = false;
+        } else if (strcmp(arg, "-target-cpu") == 0 && i + 1 < argc) {
+            target_cpu = argv[++i];
+        } else if (strcmp(arg, "-no-simd") == 0) {
+            simd_kernels = false;
+        } else if (strcmp(arg, "-no-imprints") == 0) {
+            imprints_enabled = false;
+        } else if (strcmp(arg, "-no-io-uring") == 0) {
+            async_io_uring = false;
+        } else if (strcmp(arg, "-load-ahead") == 0 && i + 1 < argc) {
+            load_ahead_size = ParseMemorySize(argv[++i]);
+            if (load_ahead_size == 0) {
+                fprintf(stdout, "Invalid load-ahead size \"%s\".\n", argv[i]);
+                exit(1);
+            }
+        } else if (strcmp(arg, "-no-load-ahead") == 0) {
+            load_ahead_size = 0;
+        } else if (strcmp(arg, "-memory") == 0 && i + 1 < argc) {
+            buffer_budget = ParseMemorySize(argv[++i]);
+            if (buffer_budget == 0) {
+                fprintf(stdout, "Invalid memory size \"%s\".\n", argv[i]);
+                exit(1);
+            }
         } else if (execute_statement) {
             statement = arg;
         } else {
@@ -140,15 +616,49 @@ int main(int argc, char** argv) {
             exit(1);
         }
     }
-    if (!execute_statement) {
+    if (buffer_budget == 0) {
+        long pages = sysconf(_SC_PHYS_PAGES);
+        long page_size = sysconf(_SC_PAGE_SIZE);
+        if (pages > 0 && page_size > 0) {
+            buffer_budget = (size_t) pages * page_size / 4 * 3;
+        }
+    }
+    if (script_file) {
+        // the queries of a script are compiled out of order, so their code is not printed
+        print_llvm = false;
+    }
+    if (thread_count == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cores > 0 ? cores : 1;
+    }
+    if (!execute_statement && !script_file) {
         fprintf(stdout, "# RembranDB server v0.0.0.1\n");
-        fprintf(stdout, "# Serving table \"demo\", with no support for multithreading\n");
-        fprintf(stdout, "# Did not find any available memory (didn't look for any either)\n");
-        fprintf(stdout, "# Not listening to any connection requests.\n");
+        fprintf(stdout, "# Serving tables from directory \"Tables\", running queries on %zu thread%s\n", thread_count,
+            thread_count == 1 ? "" : "s");
+        if (buffer_budget > 0) {
+            fprintf(stdout, "# Keeping up to %.1f MB of column data in memory\n", buffer_budget / (1024.0 * 1024.0));
+        } else {
+            fprintf(stdout, "# Did not find any available memory (didn't look for any either)\n");
+        }
+        if (!server_socket && server_port == 0) {
+            fprintf(stdout, "# Not listening to any connection requests.\n");
+        }
         fprintf(stdout, "# RembranDB/SQL module loaded\n");
     }
     Initialize();
 
+    if (script_file) {
+        bool success = RunScript(script_file, thread_count, print_result);
+        Cleanup();
+        return success ? 0 : 1;
+    }
+    if (!execute_statement && (server_socket || server_port > 0)) {
+        // server mode: clients send statements over a socket instead of stdin
+        bool started = RunServer(thread_count);
+        Cleanup();
+        return started ? 0 : 1;
+    }
+
     while(true) {
         char *query_string;
         if (!execute_statement) {
@@ -162,18 +672,62 @@ int main(int argc, char** argv) {
             PrintTables();
             continue;
         }
+        if (strncmp(query_string, "\\stats", 6) == 0) {
+            // \stats, \stats json or \stats json file
+            char *arguments = query_string + 6;
+            while (isspace(*arguments)) arguments++;
+            if (strncmp(arguments, "json", 4) == 0) {
+                char *path = arguments + 4;
+                while (isspace(*path)) path++;
+                FILE *out = *path ? fopen(path, "w") : stdout;
+                if (!out) {
+                    fprintf(stdout, "Failed to open %s: %s\n", path, strerror(errno));
+                } else {
+                    PrintStats(out, true);
+                    if (out != stdout) fclose(out);
+                }
+            } else {
+                PrintStats(stdout, false);
+            }
+            if (execute_statement) break;
+            continue;
+        }
         Query *query = ParseQuery(query_string);
-        
-        if (query) {
-            clock_t tic = clock();
+
+        if (query && query->type == QUERY_copy) {
+            // wall clock time, clock() would add up the CPU time of all threads
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            CopyTable(query->table, query->file, thread_count);
+
+            fprintf(stdout, "Total Runtime: %f seconds\n", ElapsedMilliseconds(&start) / 1000);
+        } else if (query && query->type == QUERY_set) {
+            OptimizationProfile *profile = GetOptimizationProfile(query->optimize);
+            if (profile) {
+                session_profile = profile;
+                fprintf(stdout, "Optimization profile set to %s.\n", profile->name);
+            }
+        } else if (query && query->type == QUERY_insert) {
+            Table *table = GetTable(query->table);
+            if (DeltaAppend(table, query->columns, query->values, query->rows)) {
+                fprintf(stdout, "Inserted %lld rows into table %s.\n", query->rows, table->name);
+            }
+        } else if (query && query->type == QUERY_index) {
+            CreateImprints(GetTable(query->table), query->columns);
+        } else if (query && query->type == QUERY_layout) {
+            ConvertTableLayout(GetTable(query->table), query->layout);
+        } else if (query) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
             Table *tbl = ExecuteQuery(query);
-            clock_t toc = clock();
 
-            fprintf(stdout, "Total Runtime: %f seconds\n", (double)(toc - tic) / CLOCKS_PER_SEC);
+            fprintf(stdout, "Total Runtime: %f seconds\n", ElapsedMilliseconds(&start) / 1000);
 
             if (print_result) {
                 PrintTable(tbl);
             }
+            // a session can run for a long time, so results are not kept
+            if (tbl) FreeResult(tbl);
         }
         if (execute_statement) break;
     }
@@ -181,44 +735,6 @@ int main(int argc, char** argv) {
     Cleanup();
 }
 
-static LLVMPassManagerRef InitializePassManager(LLVMModuleRef module) {
-    LLVMPassManagerRef passManager = LLVMCreateFunctionPassManagerForModule(module);
-    // This set of passes was copied from the Julia people (who probably know what they're doing)
-    // Julia Passes: https://github.com/JuliaLang/julia/blob/master/src/jitlayers.cpp
-
-    LLVMAddTargetMachinePasses(passManager);
-    LLVMAddCFGSimplificationPass(passManager);
-    LLVMAddPromoteMemoryToRegisterPass(passManager);
-    LLVMAddInstructionCombiningPass(passManager);
-    LLVMAddScalarReplAggregatesPass(passManager);
-    LLVMAddScalarReplAggregatesPassSSA(passManager);
-    LLVMAddInstructionCombiningPass(passManager);
-    LLVMAddJumpThreadingPass(passManager);
-    LLVMAddInstructionCombiningPass(passManager);
-    LLVMAddReassociatePass(passManager);
-    LLVMAddEarlyCSEPass(passManager);
-    LLVMAddLoopIdiomPass(passManager);
-    LLVMAddLoopRotatePass(passManager);
-    LLVMAddLICMPass(passManager);
-    LLVMAddLoopUnswitchPass(passManager);
-    LLVMAddInstructionCombiningPass(passManager);
-    LLVMAddIndVarSimplifyPass(passManager);
-    LLVMAddLoopDeletionPass(passManager);
-    LLVMAddLoopUnrollPass(passManager);
-    LLVMAddLoopVectorizePass(passManager);
-    LLVMAddInstructionCombiningPass(passManager);
-    LLVMAddGVNPass(passManager);
-    LLVMAddMemCpyOptPass(passManager);
-    LLVMAddSCCPPass(passManager);
-    LLVMAddInstructionCombiningPass(passManager);
-    LLVMAddSLPVectorizePass(passManager);
-    LLVMAddAggressiveDCEPass(passManager);
-    LLVMAddInstructionCombiningPass(passManager);
-
-    LLVMInitializeFunctionPassManager(passManager);
-    return passManager;
-}
-
 static void Initialize(void) {
     // LLVM boilerplate initialization code
     LLVMLinkInMCJIT();
@@ -226,17 +742,32 @@ static void Initialize(void) {
     LLVMInitializeAllTargetMCs();
     LLVMInitializeAllAsmPrinters();
     LLVMInitializeAllAsmParsers();
-    // Load data, demo table = small table (20 entries per column)
-    InitializeTable("demo");
+    // the target machine is shared by all queries, so it is created before queries can run concurrently
+    const char *target = LLVMSelectTargetCPU(target_cpu);
+    if (!execute_statement && !script_file) {
+        fprintf(stdout, "# Generating code for %s\n", target);
+    }
+    LLVMInitializeTargetOptimizer();
+    vector_math_library = LLVMLoadVectorMathLibrary();
+    // Tables are loaded lazily from the Tables directory when they are first referenced
 }
 
 static char *
 ReadQuery(void) {
-    char *buffer = malloc(5000 * sizeof(char));
+    size_t buffer_size = 5000;
+    char *buffer = malloc(buffer_size * sizeof(char));
     size_t buffer_pos = 0;
-    char c;
+    int c;
     printf("> ");
     while((c = getchar()) != EOF) {
+        // the newline after the ; of the previous statement, so a meta-command on the next line is recognized
+        if (buffer_pos == 0 && isspace(c)) continue;
+        if (buffer_pos + 1 >= buffer_size) {
+            // batched inserts can be arbitrarily long
+            buffer_size *= 2;
+            buffer = realloc(buffer, buffer_size * sizeof(char));
+        }
+        buffer[buffer_pos] = '\0';
         if (c == '\n') {
             if (buffer[0] == '\\') {
                 return buffer;
@@ -257,5 +788,8 @@ ReadQuery(void) {
 
 static void 
 Cleanup(void) {
-
+    // make sure rows that were appended but not yet merged are written to the column files
+    DeltaShutdown();
+    AsyncShutdown();
+    FlushJITCache();
 }
@@ -0,0 +1,297 @@
+
+
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+// Write-optimized delta store for INSERT INTO table VALUES (...)
+// Appended rows are stored in a linked list of fixed-size chunks per table, one array per column in every chunk
+// Chunks are never moved or resized, so appends never block readers:
+//  - appenders write the values of new rows past the published row count, and then publish the new row count
+//  - readers only look at rows below the row count they observed
+// Once the delta passes the merge threshold, a background thread appends the delta to the column files
+// and then (briefly holding the table lock for writing) moves the merged rows into the in-memory columns
+
+#define DELTA_CHUNK_SIZE 65536
+
+struct _DeltaChunk;
+typedef struct _DeltaChunk DeltaChunk;
+struct _DeltaChunk {
+    lng start;          // delta row of the first row in this chunk
+    void **data;        // an array of DELTA_CHUNK_SIZE values for every column (in the order of table->columns)
+    DeltaChunk *next;
+};
+
+typedef struct _Delta {
+    pthread_mutex_t append_lock;  // serializes appenders (and the removal of merged chunks)
+    pthread_mutex_t merge_lock;   // serializes merges (and other writers of the column files, such as COPY)
+    DeltaChunk *head;
+    DeltaChunk *tail;
+    lng merged;                   // delta rows that have been merged into the columns, protected by the table lock
+    lng count;                    // delta rows that have been appended, read and written atomically
+    size_t column_count;
+    bool merge_scheduled;
+} Delta;
+
+static lng delta_merge_threshold = 100000;
+
+static pthread_t delta_merge_thread;
+static bool delta_merge_thread_started = false;
+static pthread_mutex_t delta_merge_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t delta_merge_queue_cond = PTHREAD_COND_INITIALIZER;
+static Table **delta_merge_queue = NULL;
+static size_t delta_merge_queue_size = 0;
+
+static size_t GetColumnIndex(Table *table, Column *column) {
+    size_t index = 0;
+    for(Column *c = table->columns; c && c != column; c = c->next) {
+        index++;
+    }
+    return index;
+}
+
+static Delta *GetDelta(Table *table) {
+    Delta *delta = __atomic_load_n(&table->delta, __ATOMIC_ACQUIRE);
+    if (delta) return delta;
+    delta = (Delta*) calloc(1, sizeof(Delta));
+    pthread_mutex_init(&delta->append_lock, NULL);
+    pthread_mutex_init(&delta->merge_lock, NULL);
+    for(Column *c = table->columns; c; c = c->next) {
+        delta->column_count++;
+    }
+    Delta *expected = NULL;
+    if (!__atomic_compare_exchange_n(&table->delta, &expected, delta, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // another thread created the delta first
+        free(delta);
+        return expected;
+    }
+    return delta;
+}
+
+// Returns the amount of appended rows that are visible to a reader
+// Must be called while holding the table lock (for reading), the rows in [delta->merged, DeltaCount(delta)) are unmerged
+static lng DeltaCount(Delta *delta) {
+    return delta ? __atomic_load_n(&delta->count, __ATOMIC_ACQUIRE) : 0;
+}
+
+// Returns the amount of unmerged rows of a table, must be called while holding the table lock
+static lng DeltaRows(Table *table) {
+    Delta *delta = __atomic_load_n(&table->delta, __ATOMIC_ACQUIRE);
+    return delta ? DeltaCount(delta) - delta->merged : 0;
+}
+
+// Stores a value that was parsed for the type of the column (see ParseInsertValue)
+static void StoreValue(Column *column, void *data, lng index, InsertValue value) {
+    switch(column->type) {
+        case TYPE_int:
+            ((int*)data)[index] = (int) value.integer;
+            break;
+        case TYPE_lng:
+            ((lng*)data)[index] = value.integer;
+            break;
+        case TYPE_flt:
+            ((flt*)data)[index] = (flt) value.real;
+            break;
+        case TYPE_dbl:
+            ((dbl*)data)[index] = value.real;
+            break;
+    }
+}
+
+// Copies the unmerged rows [start, end) of a column into result
+// Must be called while holding the table lock (for reading)
+static void DeltaCopyColumn(Table *table, Column *column, lng start, lng end, char *result) {
+    Delta *delta = __atomic_load_n(&table->delta, __ATOMIC_ACQUIRE);
+    size_t column_index = GetColumnIndex(table, column);
+    for(DeltaChunk *chunk = delta->head; chunk && start < end; chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE)) {
+        lng chunk_end = chunk->start + DELTA_CHUNK_SIZE;
+        if (chunk_end <= start) continue;
+        lng copy_end = chunk_end < end ? chunk_end : end;
+        memcpy(result, (char*) chunk->data[column_index] + (start - chunk->start) * column->elsize, (copy_end - start) * column->elsize);
+        result += (copy_end - start) * column->elsize;
+        start = copy_end;
+    }
+}
+
+static void DeltaScheduleMerge(Table *table);
+
+// Appends rows to the delta of a table
+// columns holds the columns in the order in which they appear in values, values holds rows * column_count values
+static bool DeltaAppend(Table *table, ColumnList *columns, InsertValue *values, lng rows) {
+    // the statement does not interleave with a COPY or ALTER TABLE of the table
+    pthread_mutex_lock(&table->writer_lock);
+    if (table->layout == LAYOUT_pax) {
+        printf("Table %s has the PAX layout, use ALTER TABLE %s SET LAYOUT COLUMNAR first.\n", table->name, table->name);
+        pthread_mutex_unlock(&table->writer_lock);
+        return false;
+    }
+    Delta *delta = GetDelta(table);
+    size_t column_count = GetColCount(columns);
+    if (column_count != delta->column_count) {
+        printf("Expected values for all %zu columns of table %s.\n", delta->column_count, table->name);
+        pthread_mutex_unlock(&table->writer_lock);
+        return false;
+    }
+    size_t *column_index = (size_t*) malloc(column_count * sizeof(size_t));
+    ColumnList *list = columns;
+    for(size_t i = 0; i < column_count; i++, list = list->next) {
+        column_index[i] = GetColumnIndex(table, list->column);
+    }
+
+    pthread_mutex_lock(&delta->append_lock);
+    lng count = delta->count;
+    for(lng row = 0; row < rows; row++, count++) {
+        if (!delta->tail || count == delta->tail->start + DELTA_CHUNK_SIZE) {
+            DeltaChunk *chunk = (DeltaChunk*) calloc(1, sizeof(DeltaChunk));
+            chunk->start = count;
+            chunk->data = (void**) malloc(column_count * sizeof(void*));
+            Column *column = table->columns;
+            for(size_t i = 0; i < column_count; i++, column = column->next) {
+                chunk->data[i] = malloc(DELTA_CHUNK_SIZE * column->elsize);
+            }
+            // publish the chunk only after it is fully initialized
+            if (delta->tail) {
+                __atomic_store_n(&delta->tail->next, chunk, __ATOMIC_RELEASE);
+            } else {
+                __atomic_store_n(&delta->head, chunk, __ATOMIC_RELEASE);
+            }
+            delta->tail = chunk;
+        }
+        list = columns;
+        for(size_t i = 0; i < column_count; i++, list = list->next) {
+            StoreValue(list->column, delta->tail->data[column_index[i]], count - delta->tail->start, values[row * column_count + i]);
+        }
+    }
+    // publish the new rows to the readers
+    __atomic_store_n(&delta->count, count, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&table->version, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&delta->append_lock);
+    pthread_mutex_unlock(&table->writer_lock);
+    free(column_index);
+
+    if (count - __atomic_load_n(&delta->merged, __ATOMIC_ACQUIRE) >= delta_merge_threshold) {
+        DeltaScheduleMerge(table);
+    }
+    return true;
+}
+
+// Merges the delta of a table into its columns (both the column files and the in-memory columns)
+static void DeltaMerge(Table *table) {
+    Delta *delta = __atomic_load_n(&table->delta, __ATOMIC_ACQUIRE);
+    if (!delta) return;
+    pthread_mutex_lock(&delta->merge_lock);
+    // merges are the only writers of delta->merged and they hold the merge lock, so we can read it without the table lock
+    lng start = delta->merged;
+    lng end = DeltaCount(delta);
+    if (start == end) {
+        pthread_mutex_unlock(&delta->merge_lock);
+        return;
+    }
+    lng rows = end - start;
+
+    // append the rows to the column files, readers only read the first column->size values of a file
+    size_t buffer_size = 0;
+    for(Column *column = table->columns; column; column = column->next) {
+        buffer_size = max(buffer_size, rows * column->elsize);
+    }
+    char *buffer = malloc(buffer_size);
+    for(Column *column = table->columns; column; column = column->next) {
+        DeltaCopyColumn(table, column, start, end, buffer);
+        FILE *fp = fopen(column->data_location, "r+");
+        if (fp == NULL || fseek(fp, column->size * column->elsize, SEEK_SET) != 0 ||
+            fwrite(buffer, column->elsize, rows, fp) != (size_t) rows) {
+            printf("Failed to merge appended rows into file %s.\n", column->data_location);
+            if (fp) fclose(fp);
+            free(buffer);
+            pthread_mutex_unlock(&delta->merge_lock);
+            return;
+        }
+        fclose(fp);
+    }
+
+    // the rows are now part of the columns, they are read from the files on the next use
+    pthread_rwlock_wrlock(&table->lock);
+    for(Column *column = table->columns; column; column = column->next) {
+        BufferResizeColumn(column, column->size + rows);
+    }
+    __atomic_store_n(&delta->merged, end, __ATOMIC_RELEASE);
+    // free the chunks that have been fully merged
+    pthread_mutex_lock(&delta->append_lock);
+    while (delta->head && delta->head->start + DELTA_CHUNK_SIZE <= end && delta->head != delta->tail) {
+        DeltaChunk *chunk = delta->head;
+        delta->head = chunk->next;
+        for(size_t i = 0; i < delta->column_count; i++) {
+            free(chunk->data[i]);
+        }
+        free(chunk->data);
+        free(chunk);
+    }
+    pthread_mutex_unlock(&delta->append_lock);
+    pthread_rwlock_unlock(&table->lock);
+
+    WriteTableMetadata(table);
+    pthread_mutex_unlock(&delta->merge_lock);
+    free(buffer);
+}
+
+static void *DeltaMergeThread(void *arg) {
+    (void) arg;
+    while (true) {
+        pthread_mutex_lock(&delta_merge_queue_lock);
+        while (delta_merge_queue_size == 0) {
+            pthread_cond_wait(&delta_merge_queue_cond, &delta_merge_queue_lock);
+        }
+        Table *table = delta_merge_queue[--delta_merge_queue_size];
+        pthread_mutex_unlock(&delta_merge_queue_lock);
+        if (!table) break; // shutdown
+        DeltaMerge(table);
+        __atomic_store_n(&table->delta->merge_scheduled, false, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void DeltaEnqueue(Table *table) {
+    pthread_mutex_lock(&delta_merge_queue_lock);
+    delta_merge_queue = (Table**) realloc(delta_merge_queue, (delta_merge_queue_size + 1) * sizeof(Table*));
+    delta_merge_queue[delta_merge_queue_size++] = table;
+    pthread_cond_signal(&delta_merge_queue_cond);
+    pthread_mutex_unlock(&delta_merge_queue_lock);
+}
+
+static void DeltaScheduleMerge(Table *table) {
+    if (__atomic_exchange_n(&table->delta->merge_scheduled, true, __ATOMIC_ACQ_REL)) {
+        return; // already scheduled
+    }
+    pthread_mutex_lock(&delta_merge_queue_lock);
+    if (!delta_merge_thread_started) {
+        pthread_create(&delta_merge_thread, NULL, DeltaMergeThread, NULL);
+        delta_merge_thread_started = true;
+    }
+    pthread_mutex_unlock(&delta_merge_queue_lock);
+    DeltaEnqueue(table);
+}
+
+// Stops the merge thread and merges all remaining deltas, so no appended rows are lost on exit
+static void DeltaShutdown(void) {
+    if (delta_merge_thread_started) {
+        // the shutdown marker goes to the bottom of the queue, so the thread first finishes the pending merges
+        pthread_mutex_lock(&delta_merge_queue_lock);
+        delta_merge_queue = (Table**) realloc(delta_merge_queue, (delta_merge_queue_size + 1) * sizeof(Table*));
+        memmove(delta_merge_queue + 1, delta_merge_queue, delta_merge_queue_size * sizeof(Table*));
+        delta_merge_queue[0] = NULL;
+        delta_merge_queue_size++;
+        pthread_cond_signal(&delta_merge_queue_cond);
+        pthread_mutex_unlock(&delta_merge_queue_lock);
+        pthread_join(delta_merge_thread, NULL);
+        delta_merge_thread_started = false;
+    }
+    size_t table_count;
+    Table **tables = GetLoadedTables(&table_count);
+    for(size_t i = 0; i < table_count; i++) {
+        if (tables[i]->delta) {
+            DeltaMerge(tables[i]);
+        }
+    }
+    free(tables);
+}
+
+#endif
@@ -0,0 +1,452 @@
+
+
+#ifndef _HASHJOIN_H_
+#define _HASHJOIN_H_
+
+// Hash join between two tables: FROM a JOIN b ON a.k = b.k (or FROM a, b WHERE a.k = b.k)
+// The join condition and the WHERE clause are split into their conjuncts:
+//  - the first equality between an expression on one table and an expression on the other is the join key
+//  - conjuncts on a single table are evaluated on that side before the hash table is built or probed
+//  - the remaining conjuncts are evaluated for every match
+// The smaller table is the build side. A compiled scan over the build side produces (key, row) pairs that are
+// radix-partitioned into an open-addressing hash table per partition, each partition is small enough to stay in cache.
+// The probe is a single compiled pipeline: filter, hash, lookup, residual filter and projection are fused in one loop.
+
+// Amount of entries per partition, at a load factor of at most 0.5 a partition takes up at most 256KB
+#define JOIN_PARTITION_ENTRIES 8192
+#define JOIN_EMPTY_SLOT -1
+
+typedef struct {
+    lng *slots;           // (key, row) pairs, a row of JOIN_EMPTY_SLOT marks an empty slot
+    lng *offsets;         // index of the first slot of every partition
+    lng *masks;           // amount of slots - 1 of every partition
+    lng partition_mask;   // amount of partitions - 1
+} JoinHashTable;
+
+typedef struct {
+    Table *probe_table;
+    Table *build_table;
+    ColumnList *probe_columns;  // input columns of the probe pipeline
+    ColumnList *build_columns;  // input columns of the build pipeline (read at the matching row in the probe)
+    Operation *probe_key;
+    Operation *build_key;
+    Operation *probe_filter;    // conjuncts that only use the probe table (or NULL)
+    Operation *build_filter;    // conjuncts that only use the build table (or NULL)
+    Operation *residual;        // conjuncts that use both tables (or NULL)
+} JoinPlan;
+
+typedef lng (*ProbeKernel)(void **inputs, lng start, lng end, QueryOutput *output, void **build_inputs,
+    lng *slots, lng *offsets, lng *masks, lng partition_mask, void (*grow)(QueryOutput*, lng), lng limit);
+
+// MurmurHash3 finalizer, the probe kernel generates the same function in LLVM IR
+static inline uint64_t HashKey(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key;
+}
+
+// The partition is taken from the high bits of the hash, the slot within the partition from the low bits
+#define JOIN_PARTITION_SHIFT 40
+
+static bool ReferencesTable(Operation *op, Table *table) {
+    if (!op) return false;
+    if (op->type == OPTYPE_binop) {
+        return ReferencesTable(((BinaryOperation*)op)->left, table) || ReferencesTable(((BinaryOperation*)op)->right, table);
+    }
+    if (op->type == OPTYPE_func) {
+        FunctionOperation *function = (FunctionOperation*) op;
+        for(size_t i = 0; i < function->argument_count; i++) {
+            if (ReferencesTable(function->arguments[i], table)) return true;
+        }
+        return false;
+    }
+    if (op->type == OPTYPE_case) {
+        CaseOperation *case_op = (CaseOperation*) op;
+        for(size_t i = 0; i < case_op->count; i++) {
+            if (ReferencesTable(case_op->conditions[i], table) || ReferencesTable(case_op->results[i], table)) return true;
+        }
+        return ReferencesTable(case_op->otherwise, table);
+    }
+    return op->type == OPTYPE_colmn && ((ColumnOperation*)op)->table == table;
+}
+
+static void CollectConjuncts(Operation *op, OperationList **list) {
+    if (!op) return;
+    if (op->type == OPTYPE_binop && ((BinaryOperation*)op)->optype == OPTYPE_and) {
+        CollectConjuncts(((BinaryOperation*)op)->left, list);
+        CollectConjuncts(((BinaryOperation*)op)->right, list);
+        return;
+    }
+    OperationList *entry = (OperationList*) calloc(1, sizeof(OperationList));
+    entry->operation = op;
+    entry->next = *list;
+    *list = entry;
+}
+
+static Operation *AddConjunct(Operation *conjunction, Operation *op) {
+    return conjunction ? CreateBinaryOperation("AND", OPTYPE_and, conjunction, op) : op;
+}
+
+// Returns the columns of the list that belong to the table
+static ColumnList *GetTableColumns(ColumnList *columns, Table *table) {
+    ColumnList *result = NULL;
+    for(; columns; columns = columns->next) {
+        if (columns->column && GetColumn(table, columns->column->name) == columns->column) {
+            ColumnList *entry = (ColumnList*) malloc(sizeof(ColumnList));
+            entry->column = columns->column;
+            entry->next = result;
+            result = entry;
+        }
+    }
+    return result;
+}
+
+static lng GetRowCount(Table *table) {
+    return (table->columns ? table->columns->size : 0) + DeltaRows(table);
+}
+
+static JoinPlan *PlanJoin(Query *query) {
+    Table *left = GetTable(query->table);
+    Table *right = GetTable(query->join_table);
+    OperationList *conjuncts = NULL;
+    CollectConjuncts(query->join_condition, &conjuncts);
+    CollectConjuncts(query->where, &conjuncts);
+
+    JoinPlan *plan = (JoinPlan*) calloc(1, sizeof(JoinPlan));
+    // the smaller table is the build side
+    bool build_left = GetRowCount(left) < GetRowCount(right);
+    plan->build_table = build_left ? left : right;
+    plan->probe_table = build_left ? right : left;
+    for(OperationList *entry = conjuncts; entry; entry = entry->next) {
+        Operation *op = entry->operation;
+        bool probe = ReferencesTable(op, plan->probe_table);
+        bool build = ReferencesTable(op, plan->build_table);
+        if (!plan->probe_key && probe && build && op->type == OPTYPE_binop && ((BinaryOperation*)op)->optype == OPTYPE_eq) {
+            BinaryOperation *eq = (BinaryOperation*) op;
+            if (!ReferencesTable(eq->left, plan->build_table) && !ReferencesTable(eq->right, plan->probe_table)) {
+                plan->probe_key = eq->left;
+                plan->build_key = eq->right;
+                continue;
+            }
+            if (!ReferencesTable(eq->left, plan->probe_table) && !ReferencesTable(eq->right, plan->build_table)) {
+                plan->probe_key = eq->right;
+                plan->build_key = eq->left;
+                continue;
+            }
+        }
+        if (probe && build) {
+            plan->residual = AddConjunct(plan->residual, op);
+        } else if (build) {
+            plan->build_filter = AddConjunct(plan->build_filter, op);
+        } else {
+            plan->probe_filter = AddConjunct(plan->probe_filter, op);
+        }
+    }
+    if (!plan->probe_key) {
+        fprintf(stdout, "Error: Joins require an equality condition between %s and %s.\n", left->name, right->name);
+        return NULL;
+    }
+    bool floating = IsFloatingType(GetOperationType(plan->probe_key)) || IsFloatingType(GetOperationType(plan->build_key));
+    plan->probe_key = CreateKeyOperation(plan->probe_key, floating);
+    plan->build_key = CreateKeyOperation(plan->build_key, floating);
+    plan->probe_columns = GetTableColumns(query->columns, plan->probe_table);
+    plan->build_columns = GetTableColumns(query->columns, plan->build_table);
+    return plan;
+}
+
+// Returns a copy of the data of the columns, including the unmerged rows of the delta of the table
+// The columns are read through the buffer manager, returns NULL if they could not be read
+// Must be called while holding the table lock for reading
+static void **MaterializeColumns(Table *table, ColumnList *columns) {
+    size_t column_count = GetColCount(columns);
+    void **data = (void**) calloc(column_count + 1, sizeof(void*));
+    lng delta_rows = DeltaRows(table);
+    for(size_t i = 0; i < column_count; i++, columns = columns->next) {
+        Column *column = columns->column;
+        data[i] = malloc((column->size + delta_rows) * column->elsize + 1);
+        if (!BufferCopyColumn(column, 0, column->size, data[i])) {
+            for(size_t j = 0; j <= i; j++) {
+                free(data[j]);
+            }
+            free(data);
+            return NULL;
+        }
+        if (delta_rows > 0) {
+            lng merged = table->delta->merged;
+            DeltaCopyColumn(table, column, merged, merged + delta_rows, (char*) data[i] + column->size * column->elsize);
+        }
+    }
+    return data;
+}
+
+typedef struct {
+    JoinHashTable *hash_table;
+    lng *keys;    // (key, row) pairs ordered by partition
+    lng *rows;
+    lng *partition_start;
+} JoinBuildState;
+
+static void BuildPartition(void *state, size_t partition) {
+    JoinBuildState *build = (JoinBuildState*) state;
+    JoinHashTable *hash_table = build->hash_table;
+    lng *slots = hash_table->slots + 2 * hash_table->offsets[partition];
+    lng mask = hash_table->masks[partition];
+    for(lng i = 0; i <= mask; i++) {
+        slots[2 * i + 1] = JOIN_EMPTY_SLOT;
+    }
+    for(lng i = build->partition_start[partition]; i < build->partition_start[partition + 1]; i++) {
+        lng slot = HashKey(build->keys[i]) & mask;
+        while (slots[2 * slot + 1] != JOIN_EMPTY_SLOT) {
+            slot = (slot + 1) & mask;
+        }
+        slots[2 * slot] = build->keys[i];
+        slots[2 * slot + 1] = build->rows[i];
+    }
+}
+
+// Builds the partitioned hash table from count (key, row) pairs
+static JoinHashTable *BuildHashTable(lng *keys, lng *rows, lng count, size_t thread_count) {
+    JoinHashTable *hash_table = (JoinHashTable*) calloc(1, sizeof(JoinHashTable));
+    lng partition_count = 1;
+    while (partition_count * JOIN_PARTITION_ENTRIES < count && partition_count < (1 << 16)) {
+        partition_count *= 2;
+    }
+    hash_table->partition_mask = partition_count - 1;
+
+    // radix-partition the pairs by the high bits of their hash
+    lng *partition_start = (lng*) calloc(partition_count + 1, sizeof(lng));
+    for(lng i = 0; i < count; i++) {
+        partition_start[((HashKey(keys[i]) >> JOIN_PARTITION_SHIFT) & hash_table->partition_mask) + 1]++;
+    }
+    hash_table->offsets = (lng*) malloc(partition_count * sizeof(lng));
+    hash_table->masks = (lng*) malloc(partition_count * sizeof(lng));
+    lng slot_count = 0;
+    for(lng p = 0; p < partition_count; p++) {
+        lng capacity = 1;
+        while (capacity < 2 * partition_start[p + 1]) {
+            capacity *= 2;
+        }
+        hash_table->offsets[p] = slot_count;
+        hash_table->masks[p] = capacity - 1;
+        slot_count += capacity;
+        partition_start[p + 1] += partition_start[p];
+    }
+    JoinBuildState build;
+    build.hash_table = hash_table;
+    build.partition_start = partition_start;
+    build.keys = (lng*) malloc((count + 1) * sizeof(lng));
+    build.rows = (lng*) malloc((count + 1) * sizeof(lng));
+    lng *position = (lng*) malloc(partition_count * sizeof(lng));
+    memcpy(position, partition_start, partition_count * sizeof(lng));
+    for(lng i = 0; i < count; i++) {
+        lng p = (HashKey(keys[i]) >> JOIN_PARTITION_SHIFT) & hash_table->partition_mask;
+        build.keys[position[p]] = keys[i];
+        build.rows[position[p]] = rows[i];
+        position[p]++;
+    }
+    free(position);
+
+    // the partitions are independent, so they are built in parallel
+    hash_table->slots = (lng*) malloc(2 * slot_count * sizeof(lng));
+    RunParallel(partition_count, BuildPartition, &build, thread_count);
+    free(build.keys);
+    free(build.rows);
+    free(partition_start);
+    return hash_table;
+}
+
+static void FreeHashTable(JoinHashTable *hash_table) {
+    free(hash_table->slots);
+    free(hash_table->offsets);
+    free(hash_table->masks);
+    free(hash_table);
+}
+
+static LLVMValueRef GenerateHash(Codegen *cg, LLVMValueRef key) {
+    LLVMTypeRef int64_type = CodegenInt64(cg);
+    LLVMValueRef shift = LLVMConstInt(int64_type, 33, 0);
+    key = LLVMBuildXor(cg->builder, key, LLVMBuildLShr(cg->builder, key, shift, ""), "");
+    key = LLVMBuildMul(cg->builder, key, LLVMConstInt(int64_type, 0xff51afd7ed558ccdULL, 0), "");
+    key = LLVMBuildXor(cg->builder, key, LLVMBuildLShr(cg->builder, key, shift, ""), "");
+    key = LLVMBuildMul(cg->builder, key, LLVMConstInt(int64_type, 0xc4ceb9fe1a85ec53ULL, 0), "");
+    return LLVMBuildXor(cg->builder, key, LLVMBuildLShr(cg->builder, key, shift, ""), "hash");
+}
+
+static LLVMValueRef GenerateLoadIndex(Codegen *cg, LLVMValueRef array, LLVMValueRef index, const char *name) {
+    LLVMValueRef address = LLVMBuildInBoundsGEP2(cg->builder, CodegenInt64(cg), array, &index, 1, "");
+    return LLVMBuildLoad2(cg->builder, CodegenInt64(cg), address, name);
+}
+
+// Generates the probe kernel (see ProbeKernel), cg->inputs must hold the probe columns and cg->build_inputs the build columns
+// If "limited" is set the probe stops as soon as limit rows have been written
+static LLVMValueRef GenerateProbeKernel(Codegen *cg, const char *name, OperationList *outputs, JoinPlan *plan, bool limited) {
+    LLVMTypeRef int64_type = CodegenInt64(cg);
+    LLVMTypeRef int64ptr_type = LLVMPointerType(int64_type, 0);
+    LLVMTypeRef output_ptr_type = LLVMPointerType(CodegenOutputType(cg), 0);
+    LLVMTypeRef grow_params[] = { output_ptr_type, int64_type };
+    LLVMTypeRef grow_type = LLVMFunctionType(LLVMVoidTypeInContext(cg->context), grow_params, 2, 0);
+    LLVMTypeRef param_types[] = {
+        LLVMPointerType(CodegenBytePointer(cg), 0), int64_type, int64_type, output_ptr_type,
+        LLVMPointerType(CodegenBytePointer(cg), 0), int64ptr_type, int64ptr_type, int64ptr_type, int64_type,
+        LLVMPointerType(grow_type, 0), int64_type };
+    LLVMTypeRef prototype = LLVMFunctionType(int64_type, param_types, 11, 0);
+    LLVMValueRef function = LLVMAddFunction(cg->module, name, prototype);
+    cg->function = function;
+    LLVMValueRef output = LLVMGetParam(function, 3);
+
+    LLVMBasicBlockRef entry = LLVMAppendBasicBlockInContext(cg->context, function, "entry");
+    LLVMBasicBlockRef condition = LLVMAppendBasicBlockInContext(cg->context, function, "condition");
+    LLVMBasicBlockRef body = LLVMAppendBasicBlockInContext(cg->context, function, "body");
+    LLVMBasicBlockRef probe = LLVMAppendBasicBlockInContext(cg->context, function, "probe");
+    LLVMBasicBlockRef lookup = LLVMAppendBasicBlockInContext(cg->context, function, "lookup");
+    LLVMBasicBlockRef check = LLVMAppendBasicBlockInContext(cg->context, function, "check");
+    LLVMBasicBlockRef match = LLVMAppendBasicBlockInContext(cg->context, function, "match");
+    LLVMBasicBlockRef store = LLVMAppendBasicBlockInContext(cg->context, function, "store");
+    LLVMBasicBlockRef grow = LLVMAppendBasicBlockInContext(cg->context, function, "grow");
+    LLVMBasicBlockRef write = LLVMAppendBasicBlockInContext(cg->context, function, "write");
+    LLVMBasicBlockRef advance = LLVMAppendBasicBlockInContext(cg->context, function, "advance");
+    LLVMBasicBlockRef increment = LLVMAppendBasicBlockInContext(cg->context, function, "increment");
+    LLVMBasicBlockRef end = LLVMAppendBasicBlockInContext(cg->context, function, "end");
+
+    LLVMValueRef index_addr, count_addr, slot_addr;
+    LLVMPositionBuilderAtEnd(cg->builder, entry);
+    {
+        free(cg->input_data);
+        free(cg->build_data);
+        cg->input_data = GenerateColumnPointers(cg, LLVMGetParam(function, 0), cg->inputs);
+        cg->build_data = GenerateColumnPointers(cg, LLVMGetParam(function, 4), cg->build_inputs);
+        index_addr = LLVMBuildAlloca(cg->builder, int64_type, "index");
+        LLVMBuildStore(cg->builder, LLVMGetParam(function, 1), index_addr);
+        count_addr = LLVMBuildAlloca(cg->builder, int64_type, "count");
+        LLVMBuildStore(cg->builder, LLVMConstInt(int64_type, 0, 0), count_addr);
+        slot_addr = LLVMBuildAlloca(cg->builder, int64_type, "slot");
+        LLVMBuildBr(cg->builder, condition);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, condition);
+    {
+        LLVMValueRef index = LLVMBuildLoad2(cg->builder, int64_type, index_addr, "[index]");
+        LLVMValueRef cond = LLVMBuildICmp(cg->builder, LLVMIntSLT, index, LLVMGetParam(function, 2), "index < end");
+        LLVMBuildCondBr(cg->builder, cond, body, end);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, body);
+    {
+        // filter the probe side before touching the hash table
+        cg->row = LLVMBuildLoad2(cg->builder, int64_type, index_addr, "[index]");
+        if (plan->probe_filter) {
+            LLVMBuildCondBr(cg->builder, GenerateCondition(cg, plan->probe_filter), probe, increment);
+        } else {
+            LLVMBuildBr(cg->builder, probe);
+        }
+    }
+    LLVMValueRef key, offset, mask;
+    LLVMPositionBuilderAtEnd(cg->builder, probe);
+    {
+        key = GenerateOperation(cg, plan->probe_key);
+        LLVMValueRef hash = GenerateHash(cg, key);
+        LLVMValueRef partition = LLVMBuildAnd(cg->builder,
+            LLVMBuildLShr(cg->builder, hash, LLVMConstInt(int64_type, JOIN_PARTITION_SHIFT, 0), ""),
+            LLVMGetParam(function, 8), "partition");
+        offset = GenerateLoadIndex(cg, LLVMGetParam(function, 6), partition, "offset");
+        mask = GenerateLoadIndex(cg, LLVMGetParam(function, 7), partition, "mask");
+        LLVMBuildStore(cg->builder, LLVMBuildAnd(cg->builder, hash, mask, "slot"), slot_addr);
+        LLVMBuildBr(cg->builder, lookup);
+    }
+    LLVMValueRef slot, position, row;
+    LLVMPositionBuilderAtEnd(cg->builder, lookup);
+    {
+        // linear probing until we find an empty slot
+        slot = LLVMBuildLoad2(cg->builder, int64_type, slot_addr, "[slot]");
+        position = LLVMBuildShl(cg->builder, LLVMBuildAdd(cg->builder, offset, slot, ""), LLVMConstInt(int64_type, 1, 0), "position");
+        row = GenerateLoadIndex(cg, LLVMGetParam(function, 5), LLVMBuildAdd(cg->builder, position, LLVMConstInt(int64_type, 1, 0), ""), "row");
+        LLVMValueRef empty = LLVMBuildICmp(cg->builder, LLVMIntEQ, row, LLVMConstInt(int64_type, JOIN_EMPTY_SLOT, 1), "empty");
+        LLVMBuildCondBr(cg->builder, empty, increment, check);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, check);
+    {
+        LLVMValueRef slot_key = GenerateLoadIndex(cg, LLVMGetParam(function, 5), position, "slot_key");
+        LLVMBuildCondBr(cg->builder, LLVMBuildICmp(cg->builder, LLVMIntEQ, slot_key, key, "key == slot_key"), match, advance);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, match);
+    {
+        cg->build_row = row;
+        if (plan->residual) {
+            LLVMBuildCondBr(cg->builder, GenerateCondition(cg, plan->residual), store, advance);
+        } else {
+            LLVMBuildBr(cg->builder, store);
+        }
+    }
+    LLVMValueRef count;
+    LLVMPositionBuilderAtEnd(cg->builder, store);
+    {
+        // a probe row can have any amount of matches, so the output grows when it is full
+        count = LLVMBuildLoad2(cg->builder, int64_type, count_addr, "[count]");
+        LLVMValueRef capacity_address = LLVMBuildStructGEP2(cg->builder, CodegenOutputType(cg), output, 2, "&output->capacity");
+        LLVMValueRef capacity = LLVMBuildLoad2(cg->builder, int64_type, capacity_address, "output->capacity");
+        LLVMBuildCondBr(cg->builder, LLVMBuildICmp(cg->builder, LLVMIntEQ, count, capacity, "full"), grow, write);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, grow);
+    {
+        LLVMValueRef args[] = { output, count };
+        LLVMBuildCall2(cg->builder, grow_type, LLVMGetParam(function, 9), args, 2, "");
+        LLVMBuildBr(cg->builder, write);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, write);
+    {
+        // the output pointers are reloaded for every match, because growing the output moves them
+        size_t output_count = 0;
+        for(OperationList *list = outputs; list; list = list->next) {
+            output_count++;
+        }
+        LLVMValueRef *output_data = (LLVMValueRef*) calloc(output_count + 1, sizeof(LLVMValueRef));
+        GenerateOutputPointers(cg, output, outputs, output_data);
+        GenerateOutputStore(cg, outputs, output_data, count);
+        free(output_data);
+        LLVMValueRef next_count = LLVMBuildAdd(cg->builder, count, LLVMConstInt(int64_type, 1, 0), "count + 1");
+        LLVMBuildStore(cg->builder, next_count, count_addr);
+        if (limited) {
+            LLVMValueRef below_limit = LLVMBuildICmp(cg->builder, LLVMIntSLT, next_count, LLVMGetParam(function, 10), "count < limit");
+            LLVMBuildCondBr(cg->builder, below_limit, advance, end);
+        } else {
+            LLVMBuildBr(cg->builder, advance);
+        }
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, advance);
+    {
+        // keys can occur multiple times, so we continue probing after a match
+        LLVMValueRef next = LLVMBuildAnd(cg->builder, LLVMBuildAdd(cg->builder, slot, LLVMConstInt(int64_type, 1, 0), ""), mask, "next");
+        LLVMBuildStore(cg->builder, next, slot_addr);
+        LLVMBuildBr(cg->builder, lookup);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, increment);
+    {
+        GenerateIncrement(cg, index_addr, "[index]");
+        LLVMBuildBr(cg->builder, condition);
+    }
+    LLVMPositionBuilderAtEnd(cg->builder, end);
+    {
+        LLVMBuildRet(cg->builder, LLVMBuildLoad2(cg->builder, int64_type, count_addr, "[count]"));
+    }
+    return function;
+}
+
+typedef struct {
+    ProbeKernel kernel;
+    OperationList *outputs;
+    void **build_inputs;
+    JoinHashTable *hash_table;
+} ProbeState;
+
+static void RunProbeMorsel(void *state, Morsel *morsel) {
+    ProbeState *probe = (ProbeState*) state;
+    JoinHashTable *hash_table = probe->hash_table;
+    lng capacity = morsel->end - morsel->start;
+    if (morsel->limit >= 0 && morsel->limit < capacity) capacity = morsel->limit;
+    InitializeOutput(&morsel->output, probe->outputs, capacity);
+    morsel->output.count = probe->kernel(morsel->inputs, morsel->start, morsel->end, &morsel->output, probe->build_inputs,
+        hash_table->slots, hash_table->offsets, hash_table->masks, hash_table->partition_mask, GrowQueryOutput, morsel->limit);
+}
+
+#endif
@@ -0,0 +1,384 @@
+
+
+#ifndef _IMPRINT_H_
+#define _IMPRINT_H_
+
+// Column imprints: a secondary index for range predicates on numeric columns
+// The values of a column are divided into at most IMPRINT_BINS bins by an equi-depth histogram of a sample of the
+// column. The imprint has a 64-bit vector for every cache line of the column (16 int/flt or 8 lng/dbl values),
+// bit i is set if a value in the cache line falls in bin i. A comparison between the column and a constant selects
+// the bins that can hold qualifying values, a cache line whose vector has none of those bits can be skipped.
+// The comparisons in the WHERE clause are collected when a scan is compiled (see PrepareQuery), the scan runs its
+// kernel only over the runs of IMPRINT_GRANULE rows that can qualify, and does not read chunks without any of them.
+// Imprints are built when a query first uses them on a column of at least IMPRINT_MIN_ROWS rows, or with
+// CREATE INDEX ON table (column, ...). They are stored next to the column file (Tables/table/column.imprint), and
+// rows that are appended to the column are added to the imprint the next time it is used. -no-imprints disables them.
+
+#include <math.h>
+
+#define IMPRINT_BINS 64
+#define IMPRINT_LINE 64                       // bytes per cache line
+#define IMPRINT_GRANULE 16                    // rows that are skipped together: the cache line of an int or flt column
+#define IMPRINT_MIN_SKIP 256                  // rows that have to be skipped together to stop the scan kernel
+#define IMPRINT_SAMPLE 4096                   // values that are sampled to choose the bins (and blocks to estimate skipping)
+#define IMPRINT_MAX_CANDIDATES 0.75           // an imprint is not used if more of the blocks of IMPRINT_MIN_SKIP rows qualify
+#define IMPRINT_MIN_ROWS (2 * BUFFER_CHUNK_SIZE)
+#define IMPRINT_MAX_PREDICATES 16
+#define IMPRINT_MAGIC 0x31544e4952504d49ULL  // "IMPRINT1"
+
+typedef struct _Imprint {
+    size_t bins;
+    dbl borders[IMPRINT_BINS - 1];  // bin i holds the values in [borders[i - 1], borders[i])
+    lng rows;                       // amount of rows of the column that are in the imprint
+    lng values_per_line;
+    uint64_t *vectors;              // a vector for every cache line
+    lng capacity;                   // amount of allocated vectors
+} Imprint;
+
+// A comparison between a column and a constant in the WHERE clause of a scan
+typedef struct {
+    Column *column;
+    int optype;
+    dbl value;
+} ImprintPredicate;
+
+// The imprints of the columns in the WHERE clause of a running scan, and the bins that can qualify
+typedef struct {
+    Imprint *imprints[IMPRINT_MAX_PREDICATES];
+    uint64_t masks[IMPRINT_MAX_PREDICATES];
+    size_t count;
+} ImprintFilter;
+
+static bool imprints_enabled = true;  // -no-imprints
+static pthread_mutex_t imprint_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ImprintPath(Column *column, char *path, size_t length) {
+    // Tables/table/column.col -> Tables/table/column.imprint
+    size_t base = strlen(column->data_location);
+    if (base > 4 && strcmp(column->data_location + base - 4, ".col") == 0) base -= 4;
+    snprintf(path, length, "%.*s.imprint", (int) base, column->data_location);
+}
+
+static dbl ImprintValue(Column *column, void *data, lng index) {
+    switch(column->type) {
+        case TYPE_int: return ((int*) data)[index];
+        case TYPE_lng: return (dbl) ((lng*) data)[index];
+        case TYPE_flt: return ((flt*) data)[index];
+        default: return ((dbl*) data)[index];
+    }
+}
+
+static size_t ImprintBin(Imprint *imprint, dbl value) {
+    // the first border that is larger than the value (NaN falls in the last bin)
+    size_t low = 0, high = imprint->bins - 1;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (value < imprint->borders[middle]) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+    dbl x = *(const dbl*) a, y = *(const dbl*) b;
+    return x < y ? -1 : x > y;
+}
+
+// Chooses the bins of a new imprint from a sample of the column, returns false if the column could not be read
+static bool ImprintChooseBins(Column *column, Imprint *imprint) {
+    imprint->bins = 1;
+    if (column->size == 0) return true;
+    dbl *sample = (dbl*) malloc(IMPRINT_SAMPLE * sizeof(dbl));
+    size_t count = 0;
+    lng pinned = -1;
+    void *data = NULL;
+    for(size_t i = 0; i < IMPRINT_SAMPLE; i++) {
+        lng row = (lng) ((double) i * column->size / IMPRINT_SAMPLE);
+        lng chunk = row / BUFFER_CHUNK_SIZE;
+        if (chunk != pinned) {
+            if (pinned >= 0) UnpinChunk(column, pinned);
+            data = PinChunk(column, chunk);
+            pinned = data ? chunk : -1;
+            if (!data) break;
+        }
+        dbl value = ImprintValue(column, data, row - chunk * BUFFER_CHUNK_SIZE);
+        if (!isnan(value)) sample[count++] = value;
+    }
+    if (pinned >= 0) UnpinChunk(column, pinned);
+    if (!data) {
+        free(sample);
+        return false;
+    }
+    qsort(sample, count, sizeof(dbl), CompareDoubles);
+    // equi-depth borders, a frequent value can cover several quantiles so duplicates are removed
+    for(size_t i = 1; i < IMPRINT_BINS && count > 0; i++) {
+        dbl border = sample[i * count / IMPRINT_BINS];
+        if (imprint->bins > 1 && border <= imprint->borders[imprint->bins - 2]) continue;
+        if (border <= sample[0]) continue;
+        imprint->borders[imprint->bins - 1] = border;
+        imprint->bins++;
+    }
+    free(sample);
+    return true;
+}
+
+// Adds the rows of the column after the rows that are in the imprint, returns false if the column could not be read
+static bool ImprintExtend(Column *column, Imprint *imprint) {
+    lng lines = (column->size + imprint->values_per_line - 1) / imprint->values_per_line;
+    if (lines > imprint->capacity) {
+        imprint->capacity = lines;
+        imprint->vectors = (uint64_t*) realloc(imprint->vectors, (lines + 1) * sizeof(uint64_t));
+    }
+    // the last cache line can have been partial
+    lng first = imprint->rows / imprint->values_per_line;
+    memset(imprint->vectors + first, 0, (lines - first) * sizeof(uint64_t));
+    for(lng row = first * imprint->values_per_line; row < column->size; ) {
+        lng chunk = row / BUFFER_CHUNK_SIZE;
+        void *data = PinChunk(column, chunk);
+        if (!data) return false;
+        lng end = chunk * BUFFER_CHUNK_SIZE + BufferChunkRows(column, chunk);
+        for(; row < end; row++) {
+            size_t bin = ImprintBin(imprint, ImprintValue(column, data, row - chunk * BUFFER_CHUNK_SIZE));
+            imprint->vectors[row / imprint->values_per_line] |= 1ULL << bin;
+        }
+        UnpinChunk(column, chunk);
+    }
+    imprint->rows = column->size;
+    return true;
+}
+
+// Writes the imprint to a temporary file that is renamed, so readers never see a partial file
+static void ImprintSave(Column *column, Imprint *imprint) {
+    char path[1000], temporary[1010];
+    ImprintPath(column, path, sizeof(path));
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    FILE *fp = fopen(temporary, "w");
+    if (!fp) return;
+    uint64_t header[3] = { IMPRINT_MAGIC, (uint64_t) imprint->rows, imprint->bins };
+    lng lines = (imprint->rows + imprint->values_per_line - 1) / imprint->values_per_line;
+    bool success = fwrite(header, sizeof(header), 1, fp) == 1 &&
+        fwrite(imprint->borders, sizeof(dbl), IMPRINT_BINS - 1, fp) == IMPRINT_BINS - 1 &&
+        fwrite(imprint->vectors, sizeof(uint64_t), lines, fp) == (size_t) lines;
+    success = fclose(fp) == 0 && success;
+    if (!success || rename(temporary, path) != 0) {
+        printf("Failed to write imprint %s.\n", path);
+        unlink(temporary);
+    }
+}
+
+// Reads the stored imprint of a column, returns NULL if there is none or it does not match the column
+static Imprint *ImprintLoad(Column *column) {
+    char path[1000];
+    ImprintPath(column, path, sizeof(path));
+    FILE *fp = fopen(path, "r");
+    if (!fp) return NULL;
+    Imprint *imprint = (Imprint*) calloc(1, sizeof(Imprint));
+    imprint->values_per_line = IMPRINT_LINE / column->elsize;
+    uint64_t header[3];
+    bool success = fread(header, sizeof(header), 1, fp) == 1 && header[0] == IMPRINT_MAGIC &&
+        (lng) header[1] <= column->size && header[2] >= 1 && header[2] <= IMPRINT_BINS &&
+        fread(imprint->borders, sizeof(dbl), IMPRINT_BINS - 1, fp) == IMPRINT_BINS - 1;
+    if (success) {
+        imprint->rows = (lng) header[1];
+        imprint->bins = header[2];
+        imprint->capacity = (imprint->rows + imprint->values_per_line - 1) / imprint->values_per_line;
+        imprint->vectors = (uint64_t*) malloc((imprint->capacity + 1) * sizeof(uint64_t));
+        success = fread(imprint->vectors, sizeof(uint64_t), imprint->capacity, fp) == (size_t) imprint->capacity;
+    }
+    fclose(fp);
+    if (!success) {
+        free(imprint->vectors);
+        free(imprint);
+        return NULL;
+    }
+    return imprint;
+}
+
+// Returns the imprint of a column that covers all of its rows, loading, building or extending it if necessary
+// With rebuild set a new imprint is always built. Returns NULL if the imprint could not be built.
+// Must be called while holding the table lock for reading
+static Imprint *GetImprint(Column *column, bool rebuild) {
+    pthread_mutex_lock(&imprint_lock);
+    Imprint *imprint = column->imprint;
+    if (imprint && !rebuild && imprint->rows == column->size) {
+        pthread_mutex_unlock(&imprint_lock);
+        return imprint;
+    }
+    if (!imprint && !rebuild) {
+        imprint = ImprintLoad(column);
+    }
+    if (!imprint || rebuild) {
+        imprint = (Imprint*) calloc(1, sizeof(Imprint));
+        imprint->values_per_line = IMPRINT_LINE / column->elsize;
+        if (!ImprintChooseBins(column, imprint)) {
+            free(imprint);
+            pthread_mutex_unlock(&imprint_lock);
+            return NULL;
+        }
+    }
+    bool changed = imprint->rows != column->size;
+    if (!ImprintExtend(column, imprint)) {
+        if (imprint != column->imprint) {
+            free(imprint->vectors);
+            free(imprint);
+        }
+        pthread_mutex_unlock(&imprint_lock);
+        return NULL;
+    }
+    if (changed || rebuild) ImprintSave(column, imprint);
+    if (imprint != column->imprint) {
+        // running scans can still use the previous imprint of the column, so it is never freed
+        __atomic_store_n(&column->imprint, imprint, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&imprint_lock);
+    return imprint;
+}
+
+static void AddImprintPredicate(Operation *column, int optype, Operation *constant, ImprintPredicate *predicates, size_t *count) {
+    if (*count == IMPRINT_MAX_PREDICATES || column->type != OPTYPE_colmn || constant->type != OPTYPE_const) return;
+    if (((ColumnOperation*) column)->column->type == TYPE_str) return;
+    predicates[*count].column = ((ColumnOperation*) column)->column;
+    predicates[*count].optype = optype;
+    predicates[*count].value = ((ConstantOperation*) constant)->value;
+    (*count)++;
+}
+
+// Collects the comparisons between a column and a constant in the conjuncts of a WHERE clause
+static void CollectImprintPredicates(Operation *op, ImprintPredicate *predicates, size_t *count) {
+    if (!op || op->type != OPTYPE_binop) return;
+    BinaryOperation *binop = (BinaryOperation*) op;
+    int mirrored = -1;
+    switch(binop->optype) {
+        case OPTYPE_and:
+            CollectImprintPredicates(binop->left, predicates, count);
+            CollectImprintPredicates(binop->right, predicates, count);
+            return;
+        case OPTYPE_lt: mirrored = OPTYPE_gt; break;
+        case OPTYPE_le: mirrored = OPTYPE_ge; break;
+        case OPTYPE_gt: mirrored = OPTYPE_lt; break;
+        case OPTYPE_ge: mirrored = OPTYPE_le; break;
+        case OPTYPE_eq: mirrored = OPTYPE_eq; break;
+        default: return;
+    }
+    AddImprintPredicate(binop->left, binop->optype, binop->right, predicates, count);
+    AddImprintPredicate(binop->right, mirrored, binop->left, predicates, count);
+}
+
+// Returns the bins of the imprint that can hold values v for which "v optype value" holds
+// The values are binned as doubles, so the bounds are inclusive to stay correct for lng values that are rounded
+static uint64_t ImprintMask(Imprint *imprint, int optype, dbl value) {
+    uint64_t mask = 0;
+    for(size_t i = 0; i < imprint->bins; i++) {
+        dbl low = i > 0 ? imprint->borders[i - 1] : -INFINITY;
+        dbl high = i < imprint->bins - 1 ? imprint->borders[i] : INFINITY;
+        bool possible;
+        switch(optype) {
+            case OPTYPE_lt:
+            case OPTYPE_le: possible = low <= value; break;
+            case OPTYPE_gt:
+            case OPTYPE_ge: possible = high > value; break;
+            default: possible = low <= value && value < high; break;
+        }
+        if (possible) mask |= 1ULL << i;
+    }
+    return mask;
+}
+
+// Estimates the fraction of the blocks of IMPRINT_MIN_SKIP rows that have a value in the bins of the mask
+// from (at most) IMPRINT_SAMPLE blocks that are spread over the column
+static double ImprintCandidateFraction(Imprint *imprint, uint64_t mask) {
+    lng lines = (imprint->rows + imprint->values_per_line - 1) / imprint->values_per_line;
+    lng block_lines = IMPRINT_MIN_SKIP / imprint->values_per_line;
+    lng blocks = (lines + block_lines - 1) / block_lines;
+    if (blocks == 0) return 0;
+    lng step = blocks > IMPRINT_SAMPLE ? blocks / IMPRINT_SAMPLE : 1;
+    lng sampled = 0, candidates = 0;
+    for(lng block = 0; block < blocks; block += step) {
+        uint64_t vectors = 0;
+        for(lng line = block * block_lines; line < (block + 1) * block_lines && line < lines; line++) {
+            vectors |= imprint->vectors[line];
+        }
+        sampled++;
+        if (vectors & mask) candidates++;
+    }
+    return (double) candidates / sampled;
+}
+
+// Gets the imprints of the predicates, returns false if none of them can be used
+// Must be called while holding the table lock for reading
+static bool CreateImprintFilter(ImprintFilter *filter, ImprintPredicate *predicates, size_t count) {
+    filter->count = 0;
+    if (!imprints_enabled) return false;
+    for(size_t i = 0; i < count; i++) {
+        Column *column = predicates[i].column;
+        Imprint *imprint = __atomic_load_n(&column->imprint, __ATOMIC_ACQUIRE);
+        if (!imprint && column->size < IMPRINT_MIN_ROWS) continue;
+        imprint = GetImprint(column, false);
+        if (!imprint) continue;
+        uint64_t mask = ImprintMask(imprint, predicates[i].optype, predicates[i].value);
+        // comparisons on the same column are combined
+        size_t j = 0;
+        while (j < filter->count && filter->imprints[j] != imprint) j++;
+        if (j == filter->count) {
+            filter->imprints[filter->count] = imprint;
+            filter->masks[filter->count++] = mask;
+        } else {
+            filter->masks[j] &= mask;
+        }
+    }
+    // an imprint that can not skip much of the column only slows down the scan
+    size_t used = 0;
+    for(size_t i = 0; i < filter->count; i++) {
+        if (ImprintCandidateFraction(filter->imprints[i], filter->masks[i]) > IMPRINT_MAX_CANDIDATES) continue;
+        filter->imprints[used] = filter->imprints[i];
+        filter->masks[used++] = filter->masks[i];
+    }
+    filter->count = used;
+    return filter->count > 0;
+}
+
+// Builds the imprints of the columns of a table (CREATE INDEX), returns false if one of them could not be built
+static bool CreateImprints(Table *table, ColumnList *columns) {
+    bool created = true;
+    pthread_rwlock_rdlock(&table->lock);
+    for(; columns; columns = columns->next) {
+        Imprint *imprint = GetImprint(columns->column, true);
+        if (!imprint) {
+            fprintf(stdout, "Failed to create imprint on %s.%s.\n", table->name, columns->column->name);
+            created = false;
+            continue;
+        }
+        fprintf(stdout, "Created imprint on %s.%s: %zu bins, %lld rows.\n", table->name, columns->column->name,
+            imprint->bins, imprint->rows);
+    }
+    pthread_rwlock_unlock(&table->lock);
+    return created;
+}
+
+// Returns true if one of the rows [row, row + IMPRINT_GRANULE) of the columns can satisfy the predicates
+static bool ImprintCandidate(ImprintFilter *filter, lng row) {
+    for(size_t i = 0; i < filter->count; i++) {
+        Imprint *imprint = filter->imprints[i];
+        lng first = row / imprint->values_per_line;
+        lng last = (row + IMPRINT_GRANULE - 1) / imprint->values_per_line;
+        uint64_t vectors = 0;
+        for(lng line = first; line <= last && line * imprint->values_per_line < imprint->rows; line++) {
+            vectors |= imprint->vectors[line];
+        }
+        if (!(vectors & filter->masks[i])) return false;
+    }
+    return true;
+}
+
+// Returns true if one of the rows [start, end) can satisfy the predicates
+static bool ImprintCandidates(ImprintFilter *filter, lng start, lng end) {
+    for(lng row = start; row < end; row += IMPRINT_GRANULE) {
+        if (ImprintCandidate(filter, row)) return true;
+    }
+    return false;
+}
+
+#endif
@@ -0,0 +1,202 @@
+
+
+#ifndef _JITCACHE_H_
+#define _JITCACHE_H_
+
+// Cache of compiled queries in memory
+// Prepared queries hold a reference to their compiled query (see PrepareQuery). Once the machine code of a query
+// has been generated its module is removed from the execution engine and disposed together with its LLVM context,
+// the engine only keeps the machine code and its symbols. The engine is disposed once the last reference is released
+// and the query is no longer cached, so a long-running REPL or server does not accumulate modules, contexts and
+// machine code pages for every query it has run.
+// Queries are cached by the key of their machine code (see CodeCacheKey), so a query that runs again with the same
+// shape and constants skips optimization and code generation, even when the code cache on disk is disabled. Once
+// the cached queries exceed -jit-cache-size the least recently used ones that are not running are evicted. The size
+// of a query is its machine code and data plus JIT_ENGINE_BYTES, the engine (its target machine and linker) takes
+// far more memory than the kernels of a query. The heap is trimmed every JIT_TRIM_INTERVAL disposed queries, so the
+// memory that LLVM freed is returned to the operating system. -no-jit-cache disposes every query after it has run.
+
+#include <malloc.h>
+
+#define JIT_ENGINE_BYTES (384 * 1024)  // heap used by an MCJIT execution engine (measured with LLVM 14)
+#define JIT_TRIM_INTERVAL 16
+
+typedef struct _CompiledQuery {
+    char key[CODE_CACHE_KEY_LENGTH];
+    LLVMContextRef context;               // NULL once the module has been disposed
+    LLVMExecutionEngineRef engine;        // owns the module until the machine code has been generated
+    LLVMMCJITMemoryManagerRef memory;     // owned by the engine
+    size_t bytes;                         // machine code and data and the engine, known once the code has been generated
+    int refs;
+    bool cached;
+    struct _CompiledQuery *prev, *next;
+} CompiledQuery;
+
+typedef struct {
+    CompiledQuery *head, *tail;  // most recently used first
+    size_t count;
+    size_t bytes;
+    pthread_mutex_t lock;
+} JITCache;
+
+static bool jit_cache_enabled = true;
+static size_t jit_cache_size = 32 * 1024 * 1024;
+static lng jit_cache_hits = 0;
+static lng jit_cache_misses = 0;
+static lng jit_cache_evictions = 0;
+static size_t jit_disposed = 0;  // queries disposed since the heap was last trimmed
+static JITCache jit_cache = { NULL, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// Must be called while holding the lock of the cache
+static void JITCacheUnlink(CompiledQuery *compiled) {
+    if (compiled->prev) compiled->prev->next = compiled->next; else jit_cache.head = compiled->next;
+    if (compiled->next) compiled->next->prev = compiled->prev; else jit_cache.tail = compiled->prev;
+    jit_cache.count--;
+    jit_cache.bytes -= compiled->bytes;
+    compiled->cached = false;
+}
+
+// Must be called while holding the lock of the cache
+static void JITCachePushFront(CompiledQuery *compiled) {
+    compiled->prev = NULL;
+    compiled->next = jit_cache.head;
+    if (jit_cache.head) jit_cache.head->prev = compiled; else jit_cache.tail = compiled;
+    jit_cache.head = compiled;
+    jit_cache.count++;
+    jit_cache.bytes += compiled->bytes;
+    compiled->cached = true;
+}
+
+// Returns a reference to the compiled query of a key, or NULL if it is not cached
+static CompiledQuery *JITCacheLookup(const char *key) {
+    if (!jit_cache_enabled) return NULL;
+    pthread_mutex_lock(&jit_cache.lock);
+    CompiledQuery *compiled = jit_cache.head;
+    while (compiled && strcmp(compiled->key, key) != 0) {
+        compiled = compiled->next;
+    }
+    if (compiled) {
+        JITCacheUnlink(compiled);
+        JITCachePushFront(compiled);
+        compiled->refs++;
+        jit_cache_hits++;
+    } else {
+        jit_cache_misses++;
+    }
+    pthread_mutex_unlock(&jit_cache.lock);
+    return compiled;
+}
+
+// Creates a compiled query with one reference, which owns the context and the engine
+static CompiledQuery *CreateCompiledQuery(const char *key, LLVMContextRef context, LLVMExecutionEngineRef engine,
+                                          LLVMMCJITMemoryManagerRef memory) {
+    CompiledQuery *compiled = (CompiledQuery*) calloc(1, sizeof(CompiledQuery));
+    strcpy(compiled->key, key);
+    compiled->context = context;
+    compiled->engine = engine;
+    compiled->memory = memory;
+    compiled->refs = 1;
+    return compiled;
+}
+
+static void DisposeCompiledQuery(CompiledQuery *compiled) {
+    LLVMDisposeExecutionEngine(compiled->engine);
+    if (compiled->context) LLVMContextDispose(compiled->context);
+    free(compiled);
+}
+
+// Disposes a list of compiled queries (linked by next), and trims the heap every JIT_TRIM_INTERVAL queries
+static void DisposeCompiledQueries(CompiledQuery *list) {
+    size_t count = 0;
+    while (list) {
+        CompiledQuery *next = list->next;
+        DisposeCompiledQuery(list);
+        list = next;
+        count++;
+    }
+    if (count > 0 && __atomic_add_fetch(&jit_disposed, count, __ATOMIC_RELAXED) >= JIT_TRIM_INTERVAL) {
+        __atomic_store_n(&jit_disposed, 0, __ATOMIC_RELAXED);
+        // LLVM frees the module and its context in many small allocations that glibc keeps otherwise
+        malloc_trim(0);
+    }
+}
+
+// Evicts the least recently used queries that are not running until the cache fits, the evicted queries are added
+// to the list. Must be called while holding the lock of the cache
+static void JITCacheEvict(CompiledQuery **disposed) {
+    CompiledQuery *victim = jit_cache.tail;
+    while (victim && jit_cache.bytes > jit_cache_size) {
+        CompiledQuery *prev = victim->prev;
+        if (victim->refs == 0) {
+            JITCacheUnlink(victim);
+            victim->next = *disposed;
+            *disposed = victim;
+            jit_cache_evictions++;
+        }
+        victim = prev;
+    }
+}
+
+// Called once the kernels of a query that was compiled now have been looked up (so its machine code has been
+// generated): disposes its module and context, and adds the query to the cache
+static void CacheCompiledQuery(CompiledQuery *compiled, LLVMModuleRef module) {
+    LLVMModuleRef removed;
+    char *error = NULL;
+    if (LLVMRemoveModule(compiled->engine, module, &removed, &error) == 0) {
+        LLVMDisposeModule(removed);
+        LLVMContextDispose(compiled->context);
+        compiled->context = NULL;
+    }
+    LLVMDisposeMessage(error);
+    compiled->bytes = LLVMJITMemoryOf(compiled->memory) + JIT_ENGINE_BYTES;
+    if (!jit_cache_enabled) return;
+    CompiledQuery *disposed = NULL;
+    pthread_mutex_lock(&jit_cache.lock);
+    // a query that was compiled concurrently by another session keeps its entry
+    CompiledQuery *existing = jit_cache.head;
+    while (existing && strcmp(existing->key, compiled->key) != 0) {
+        existing = existing->next;
+    }
+    if (!existing) {
+        JITCachePushFront(compiled);
+        JITCacheEvict(&disposed);
+    }
+    pthread_mutex_unlock(&jit_cache.lock);
+    DisposeCompiledQueries(disposed);
+}
+
+// Releases a reference to a compiled query, the query is disposed if it is no longer referenced or cached
+static void ReleaseCompiledQuery(CompiledQuery *compiled) {
+    CompiledQuery *disposed = NULL;
+    pthread_mutex_lock(&jit_cache.lock);
+    compiled->refs--;
+    if (compiled->cached) {
+        // queries that were running when the cache filled up can be evicted now
+        JITCacheEvict(&disposed);
+    } else if (compiled->refs == 0) {
+        compiled->next = disposed;
+        disposed = compiled;
+    }
+    pthread_mutex_unlock(&jit_cache.lock);
+    DisposeCompiledQueries(disposed);
+}
+
+// Disposes all cached queries that are not running
+static void FlushJITCache(void) {
+    CompiledQuery *disposed = NULL;
+    pthread_mutex_lock(&jit_cache.lock);
+    CompiledQuery *compiled = jit_cache.head;
+    while (compiled) {
+        CompiledQuery *next = compiled->next;
+        if (compiled->refs == 0) {
+            JITCacheUnlink(compiled);
+            compiled->next = disposed;
+            disposed = compiled;
+        }
+        compiled = next;
+    }
+    pthread_mutex_unlock(&jit_cache.lock);
+    DisposeCompiledQueries(disposed);
+}
+
+#endif
@@ -0,0 +1,561 @@
+
+
+#ifndef _LOADER_H_
+#define _LOADER_H_
+
+// Bulk loader for COPY table FROM 'file.csv'
+// The CSV file is memory mapped and split into one chunk per thread at newline boundaries
+// The load happens in two passes:
+//  1) every thread counts the rows in its chunk, a prefix sum over the counts gives the output offset of every chunk
+//  2) every thread parses its chunk and writes the values directly into the (memory mapped) .col files
+// The first line of the CSV file is the header, it contains the column names optionally followed by a type (e.g. "x:dbl,y:int")
+// Columns without a type are loaded as dbl. If the table already exists, the rows are appended to the table.
+// Blank lines are skipped, integers that do not fit the type of their column are rejected.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    const char *begin;
+    const char *end;
+    lng rows;          // amount of rows in this chunk, without blank lines (pass 1)
+    lng lines;         // amount of lines in this chunk (pass 1)
+    lng offset;        // row offset of the first row of this chunk in the output (pass 2)
+    lng line_offset;   // line of the first line of this chunk in the data (pass 2)
+    size_t column_count;
+    Column **columns;  // columns in the order in which they appear in the CSV file
+    char **output;     // memory mapped output file for every column
+    lng error_line;    // line (relative to the chunk) at which parsing failed, or -1
+    Column *error_column;  // column of which the value is out of range, or NULL if the line could not be parsed
+} CopyChunk;
+
+static const double copy_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// SWAR check if the 8 bytes in val are all ASCII digits
+static inline bool IsEightDigits(uint64_t val) {
+    return (((val & 0xF0F0F0F0F0F0F0F0) | (((val + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) == 0x3333333333333333);
+}
+
+// SWAR conversion of 8 ASCII digits to an integer (little endian)
+static inline uint64_t ParseEightDigits(uint64_t val) {
+    const uint64_t mask = 0x000000FF000000FF;
+    const uint64_t mul1 = 0x000F424000000064; // 100 + (1000000ULL << 32)
+    const uint64_t mul2 = 0x0000271000000001; // 1 + (10000ULL << 32)
+    val -= 0x3030303030303030;
+    val = (val * 10) + (val >> 8);
+    val = (((val & mask) * mul1) + (((val >> 16) & mask) * mul2)) >> 32;
+    return (uint32_t) val;
+}
+
+// Parses a run of digits into *mantissa, returns the amount of digits consumed
+// *mantissa_digits holds the amount of digits already in the mantissa, digits that no longer fit are counted in *dropped
+static inline size_t ParseDigits(const char **ptr, const char *end, uint64_t *mantissa, size_t *mantissa_digits, size_t *dropped) {
+    const char *p = *ptr;
+    while (end - p >= 8 && *mantissa_digits + 8 <= 19) {
+        uint64_t val;
+        memcpy(&val, p, 8);
+        if (!IsEightDigits(val)) break;
+        *mantissa = *mantissa * 100000000 + ParseEightDigits(val);
+        *mantissa_digits += 8;
+        p += 8;
+    }
+    while (p < end && isdigit(*p)) {
+        if (*mantissa_digits < 19) {
+            *mantissa = *mantissa * 10 + (*p - '0');
+            (*mantissa_digits)++;
+        } else {
+            (*dropped)++;
+        }
+        p++;
+    }
+    size_t digits = p - *ptr;
+    *ptr = p;
+    return digits;
+}
+
+// Fallback for values that cannot be parsed exactly using the fast path
+static bool ParseDoubleSlow(const char *begin, const char *end, double *result) {
+    char buffer[128];
+    size_t length = end - begin;
+    if (length >= sizeof(buffer)) return false;
+    memcpy(buffer, begin, length);
+    buffer[length] = '\0';
+    char *parse_end;
+    *result = strtod(buffer, &parse_end);
+    return parse_end == buffer + length;
+}
+
+static bool ParseDouble(const char *begin, const char *end, double *result) {
+    const char *p = begin;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    uint64_t mantissa = 0;
+    size_t mantissa_digits = 0, dropped = 0;
+    size_t digits = ParseDigits(&p, end, &mantissa, &mantissa_digits, &dropped);
+    // integer digits that did not fit in the mantissa scale the value
+    int exponent = (int) dropped;
+    if (p < end && *p == '.') {
+        p++;
+        size_t fraction_dropped = 0;
+        size_t fraction_digits = ParseDigits(&p, end, &mantissa, &mantissa_digits, &fraction_dropped);
+        exponent -= (int) (fraction_digits - fraction_dropped);
+        digits += fraction_digits;
+        dropped += fraction_dropped;
+    }
+    if (digits == 0) return false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool negative_exponent = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative_exponent = *p == '-';
+            p++;
+        }
+        if (p == end || !isdigit(*p)) return false;
+        int explicit_exponent = 0;
+        while (p < end && isdigit(*p)) {
+            if (explicit_exponent < 10000) explicit_exponent = explicit_exponent * 10 + (*p - '0');
+            p++;
+        }
+        exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+    }
+    if (p != end) return false;
+    // the result is exact if the mantissa fits in 53 bits and the power of ten is exactly representable
+    if (dropped == 0 && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        double value = (double) mantissa;
+        value = exponent < 0 ? value / copy_pow10[-exponent] : value * copy_pow10[exponent];
+        *result = negative ? -value : value;
+        return true;
+    }
+    return ParseDoubleSlow(begin, end, result);
+}
+
+// Parses an integer, returns false if it is not an integer or (setting *out_of_range) if it does not fit in a lng
+static bool ParseInteger(const char *begin, const char *end, lng *result, bool *out_of_range) {
+    const char *p = begin;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    uint64_t value = 0;
+    size_t value_digits = 0, dropped = 0;
+    size_t digits = ParseDigits(&p, end, &value, &value_digits, &dropped);
+    if (digits == 0 || p != end) return false;
+    // 19 digits fit in the mantissa, so dropped digits are always out of range
+    if (dropped > 0 || value > (negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX)) {
+        *out_of_range = true;
+        return false;
+    }
+    *result = negative ? (lng) (0 - value) : (lng) value;
+    return true;
+}
+
+// Parses a value of a column into output
+// Returns false if it could not be parsed, *out_of_range is set if it is an integer that does not fit the column
+static bool ParseValue(Column *column, const char *begin, const char *end, char *output, bool *out_of_range) {
+    // ignore surrounding whitespace
+    while (begin < end && (*begin == ' ' || *begin == '\t')) begin++;
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+    switch(column->type) {
+        case TYPE_int:
+        case TYPE_lng:
+        {
+            lng value;
+            if (!ParseInteger(begin, end, &value, out_of_range)) return false;
+            if (column->type == TYPE_int) {
+                if (value < INT32_MIN || value > INT32_MAX) {
+                    *out_of_range = true;
+                    return false;
+                }
+                *((int*) output) = (int) value;
+            } else {
+                *((lng*) output) = value;
+            }
+            return true;
+        }
+        case TYPE_flt:
+        case TYPE_dbl:
+        {
+            double value;
+            if (!ParseDouble(begin, end, &value)) return false;
+            if (column->type == TYPE_flt) {
+                *((flt*) output) = (flt) value;
+            } else {
+                *((dbl*) output) = value;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if a line holds nothing but whitespace, such lines are skipped by both passes
+static bool IsBlankLine(const char *begin, const char *end) {
+    while (begin < end && (*begin == ' ' || *begin == '\t' || *begin == '\r')) begin++;
+    return begin == end;
+}
+
+static void *CopyCountRows(void *arg) {
+    CopyChunk *chunk = (CopyChunk*) arg;
+    const char *p = chunk->begin;
+    lng rows = 0, lines = 0;
+    while (p < chunk->end) {
+        const char *newline = memchr(p, '\n', chunk->end - p);
+        const char *line_end = newline ? newline : chunk->end;
+        lines++;
+        if (!IsBlankLine(p, line_end)) rows++;
+        if (!newline) break;
+        p = newline + 1;
+    }
+    chunk->rows = rows;
+    chunk->lines = lines;
+    return NULL;
+}
+
+static void *CopyParseRows(void *arg) {
+    CopyChunk *chunk = (CopyChunk*) arg;
+    const char *p = chunk->begin;
+    lng row = 0;
+    for(lng line = 0; row < chunk->rows; line++) {
+        const char *line_end = memchr(p, '\n', chunk->end - p);
+        if (!line_end) line_end = chunk->end;
+        if (IsBlankLine(p, line_end)) {
+            p = line_end + 1;
+            continue;
+        }
+        lng output_row = chunk->offset + row;
+        for(size_t i = 0; i < chunk->column_count; i++) {
+            Column *column = chunk->columns[i];
+            const char *value_end = i + 1 == chunk->column_count ? line_end : memchr(p, ',', line_end - p);
+            bool out_of_range = false;
+            if (!value_end || !ParseValue(column, p, value_end, chunk->output[i] + output_row * column->elsize, &out_of_range)) {
+                chunk->error_line = line;
+                chunk->error_column = out_of_range ? column : NULL;
+                return NULL;
+            }
+            p = value_end + 1;
+        }
+        p = line_end + 1;
+        row++;
+    }
+    return NULL;
+}
+
+// Runs the function on every chunk, using one thread per chunk
+static void CopyRunThreads(void *(*function)(void*), CopyChunk *chunks, size_t chunk_count) {
+    pthread_t *threads = (pthread_t*) malloc(chunk_count * sizeof(pthread_t));
+    for(size_t i = 1; i < chunk_count; i++) {
+        pthread_create(&threads[i], NULL, function, &chunks[i]);
+    }
+    function(&chunks[0]);
+    for(size_t i = 1; i < chunk_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// Finds (or creates) the column of every name of the CSV header, returns false if the header does not match the table
+// For existing tables every column of the table must occur in the header exactly once
+static bool CopyResolveColumns(Table *table, bool new_table, char **names, size_t column_count, Column **columns) {
+    size_t table_columns = 0;
+    for(Column *column = table->columns; column; column = column->next) {
+        table_columns++;
+    }
+    for(size_t i = 0; i < column_count; i++) {
+        char *name = names[i];
+        while (isspace(*name)) name++;
+        size_t length = strlen(name);
+        while (length > 0 && isspace(name[length - 1])) name[--length] = '\0';
+        char *type = strchr(name, ':');
+        if (type) *type++ = '\0';
+        for(size_t j = 0; j < i; j++) {
+            if (strcmp(columns[j]->name, name) == 0) {
+                printf("Duplicate column %s in CSV header.\n", name);
+                return false;
+            }
+        }
+        if (new_table) {
+            Column *column = (Column*) calloc(1, sizeof(Column));
+            column->name = strdup(name);
+            if (!SetColumnType(column, type ? type : "dbl")) {
+                printf("Unsupported type %s for column %s.\n", type, name);
+                free(column->name);
+                free(column);
+                return false;
+            }
+            // prepend the column, to get the same order as ReadTable()
+            AddColumn(table, column);
+            columns[i] = column;
+        } else {
+            columns[i] = GetColumn(table, name);
+            if (!columns[i]) {
+                printf("Table %s has no column %s.\n", table->name, name);
+                return false;
+            }
+            if (type && strcmp(type, GetTypeName(columns[i]->type)) != 0) {
+                printf("Column %s has type %s, but the CSV header specifies %s.\n", name, GetTypeName(columns[i]->type), type);
+                return false;
+            }
+        }
+    }
+    if (!new_table && column_count != table_columns) {
+        printf("Expected %zu columns in the CSV header of table %s, but found %zu.\n", table_columns, table->name, column_count);
+        return false;
+    }
+    return true;
+}
+
+// Parses the CSV header and returns the column of every entry (or NULL if it does not match the table)
+static Column **CopyResolveHeader(Table *table, bool new_table, char *header, size_t *column_count) {
+    char **names = split(header, ',', column_count);
+    Column **columns = (Column**) calloc(*column_count, sizeof(Column*));
+    if (!CopyResolveColumns(table, new_table, names, *column_count, columns)) {
+        free(columns);
+        columns = NULL;
+    }
+    free_split(names, *column_count);
+    return columns;
+}
+
+// Resizes the column file to hold rows additional values and maps it into memory
+// Returns a pointer to the start of the newly added values
+static char *CopyMapColumnFile(Column *column, lng rows, size_t *mapped_size) {
+    int fd = open(column->data_location, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        printf("Unable to open file %s\n", column->data_location);
+        return NULL;
+    }
+    size_t old_size = column->size * column->elsize;
+    *mapped_size = old_size + rows * column->elsize;
+    if (ftruncate(fd, *mapped_size) != 0) {
+        printf("Failed to resize file %s: %s\n", column->data_location, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    if (*mapped_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    char *data = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("Failed to map file %s: %s\n", column->data_location, strerror(errno));
+        return NULL;
+    }
+    return data + old_size;
+}
+
+// Loads a CSV file into a table, or into a new table if table is NULL
+// Must be called while holding the writer lock of the table, or copy_create_lock for a new table
+static Table *CopyLoadTable(Table *table, const char *table_name, const char *file_name, size_t thread_count) {
+    if (table && table->layout == LAYOUT_pax) {
+        printf("Table %s has the PAX layout, use ALTER TABLE %s SET LAYOUT COLUMNAR first.\n", table->name, table->name);
+        return NULL;
+    }
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        printf("Failed to open file %s.\n", file_name);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        printf("Failed to read CSV header from file %s.\n", file_name);
+        close(fd);
+        return NULL;
+    }
+    size_t file_size = st.st_size;
+    const char *file = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        printf("Failed to map file %s: %s\n", file_name, strerror(errno));
+        return NULL;
+    }
+    madvise((void*) file, file_size, MADV_SEQUENTIAL);
+    const char *file_end = file + file_size;
+
+    // parse the header
+    const char *header_end = memchr(file, '\n', file_size);
+    if (!header_end) header_end = file_end;
+    char *header;
+    create_substring(&header, (char*) file, 0, header_end - file);
+    const char *data = header_end < file_end ? header_end + 1 : file_end;
+
+    bool new_table = table == NULL;
+    if (new_table) {
+        table = CreateTable(table_name, NULL);
+    }
+    size_t column_count;
+    Column **columns = CopyResolveHeader(table, new_table, header, &column_count);
+    free(header);
+    if (!columns) {
+        munmap((void*) file, file_size);
+        if (new_table) FreeTable(table);
+        return NULL;
+    }
+    if (new_table) {
+        char directory[500];
+        snprintf(directory, 500, "Tables/%s", table->name);
+        mkdir("Tables", 0755);
+        mkdir(directory, 0755);
+        for(Column *column = table->columns; column; column = column->next) {
+            char column_file_name[500];
+            snprintf(column_file_name, 500, "Tables/%s/%s.col", table->name, column->name);
+            column->data_location = strdup(column_file_name);
+            column->size = 0;
+            // an imprint of an earlier table with the same name does not match the new column
+            snprintf(column_file_name, 500, "Tables/%s/%s.imprint", table->name, column->name);
+            unlink(column_file_name);
+        }
+    }
+
+    Delta *delta = table->delta;
+    if (delta) {
+        // merge the appended rows first, and keep the merge thread away from the column files while loading
+        DeltaMerge(table);
+        pthread_mutex_lock(&delta->merge_lock);
+    }
+
+    // split the input into one chunk per thread at newline boundaries
+    size_t data_size = file_end - data;
+    size_t chunk_count = thread_count;
+    if (chunk_count < 1) chunk_count = 1;
+    if (chunk_count > data_size / 4096 + 1) chunk_count = data_size / 4096 + 1;
+    CopyChunk *chunks = (CopyChunk*) calloc(chunk_count, sizeof(CopyChunk));
+    const char *chunk_begin = data;
+    for(size_t i = 0; i < chunk_count; i++) {
+        const char *chunk_end = i + 1 == chunk_count ? file_end : data + data_size / chunk_count * (i + 1);
+        if (chunk_end < chunk_begin) chunk_end = chunk_begin;
+        const char *newline = memchr(chunk_end, '\n', file_end - chunk_end);
+        chunk_end = newline ? newline + 1 : file_end;
+        chunks[i].begin = chunk_begin;
+        chunks[i].end = chunk_end;
+        chunks[i].column_count = column_count;
+        chunks[i].columns = columns;
+        chunks[i].error_line = -1;
+        chunk_begin = chunk_end;
+    }
+
+    // pass 1: count the rows of every chunk
+    CopyRunThreads(CopyCountRows, chunks, chunk_count);
+    lng total_rows = 0, total_lines = 0;
+    for(size_t i = 0; i < chunk_count; i++) {
+        chunks[i].offset = total_rows;
+        chunks[i].line_offset = total_lines;
+        total_rows += chunks[i].rows;
+        total_lines += chunks[i].lines;
+    }
+
+    // pass 2: parse the values directly into the column files
+    char **output = (char**) calloc(column_count, sizeof(char*));
+    size_t *mapped_size = (size_t*) calloc(column_count, sizeof(size_t));
+    bool success = true;
+    for(size_t i = 0; i < column_count; i++) {
+        output[i] = CopyMapColumnFile(columns[i], total_rows, &mapped_size[i]);
+        if (!output[i] && mapped_size[i] > 0) success = false;
+    }
+    if (success && total_rows > 0) {
+        for(size_t i = 0; i < chunk_count; i++) {
+            chunks[i].output = output;
+        }
+        CopyRunThreads(CopyParseRows, chunks, chunk_count);
+        for(size_t i = 0; i < chunk_count; i++) {
+            if (chunks[i].error_line >= 0) {
+                // + 2 for the header and because line numbers start at 1
+                lng line = chunks[i].line_offset + chunks[i].error_line + 2;
+                Column *column = chunks[i].error_column;
+                if (column) {
+                    printf("Value on line %lld of file %s is out of range for column %s (%s).\n", line, file_name,
+                        column->name, GetTypeName(column->type));
+                } else {
+                    printf("Failed to parse line %lld of file %s.\n", line, file_name);
+                }
+                success = false;
+                break;
+            }
+        }
+    }
+    for(size_t i = 0; i < column_count; i++) {
+        if (output[i]) {
+            munmap(output[i] - columns[i]->size * columns[i]->elsize, mapped_size[i]);
+        }
+        if (!success) {
+            // restore the column file to its original size
+            if (truncate(columns[i]->data_location, columns[i]->size * columns[i]->elsize) != 0 || new_table) {
+                unlink(columns[i]->data_location);
+            }
+        }
+    }
+    munmap((void*) file, file_size);
+    free(output);
+    free(mapped_size);
+    free(chunks);
+    free(columns);
+    if (!success) {
+        if (new_table) {
+            char directory[500];
+            snprintf(directory, 500, "Tables/%s", table->name);
+            rmdir(directory);
+            // new tables are only registered once they are loaded
+            FreeTable(table);
+        }
+        if (delta) pthread_mutex_unlock(&delta->merge_lock);
+        return NULL;
+    }
+
+    // the rows were appended on disk, a partial last chunk that is already in memory is dropped
+    pthread_rwlock_wrlock(&table->lock);
+    for(Column *column = table->columns; column; column = column->next) {
+        BufferResizeColumn(column, column->size + total_rows);
+    }
+    __atomic_add_fetch(&table->version, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&table->lock);
+    success = WriteTableMetadata(table);
+    if (delta) pthread_mutex_unlock(&delta->merge_lock);
+    if (!success) {
+        if (new_table) FreeTable(table);
+        return NULL;
+    }
+    if (new_table) {
+        RegisterTable(table);
+    }
+    printf("Loaded %lld rows into table %s.\n", total_rows, table->name);
+    return table;
+}
+
+// COPYs that create a table are serialized, a new table is only registered once it is loaded
+static pthread_mutex_t copy_create_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// COPY table FROM 'file.csv'
+// The statement holds the writer lock of the table from the moment it reads the sizes of the columns until the metadata
+// is written, so concurrent COPY, INSERT and ALTER TABLE statements on the table wait for it
+static Table *CopyTable(const char *table_name, const char *file_name, size_t thread_count) {
+    Table *table = GetTable(table_name);
+    if (!table) {
+        pthread_mutex_lock(&copy_create_lock);
+        // another COPY might have created the table while we waited
+        table = GetTable(table_name);
+        if (!table) {
+            Table *result = CopyLoadTable(NULL, table_name, file_name, thread_count);
+            pthread_mutex_unlock(&copy_create_lock);
+            return result;
+        }
+        pthread_mutex_unlock(&copy_create_lock);
+    }
+    pthread_mutex_lock(&table->writer_lock);
+    Table *result = CopyLoadTable(table, table_name, file_name, thread_count);
+    pthread_mutex_unlock(&table->writer_lock);
+    return result;
+}
+
+#endif
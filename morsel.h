@@ -0,0 +1,369 @@
+
+
+#ifndef _MORSEL_H_
+#define _MORSEL_H_
+
+// Morsel-driven parallel execution
+// The input of a pipeline is split into morsels of at most MORSEL_SIZE rows, the rows of a table consist of
+// the rows in its columns followed by the rows in the chunks of its delta (see delta.h).
+// A morsel over the columns of a table is a chunk of the buffer manager (see buffer.h), its chunks are pinned
+// while the morsel runs. The chunks of the morsels MORSEL_READ_AHEAD rounds of workers ahead are read in the background,
+// so with one worker the I/O for morsel N + 2 overlaps with the execution of morsel N.
+// Worker threads take the next morsel from a shared counter and run the kernel of the pipeline on it,
+// every morsel has its own output buffer so the workers do not have to synchronize.
+// The outputs of all morsels are concatenated in morsel order, so the result is the same for any amount of threads.
+// With a LIMIT the workers track how many rows the finished prefix of morsels has produced, once that reaches the
+// limit the remaining morsels are skipped; a morsel never has to produce more rows than the limit minus that prefix.
+// If the chunks of a morsel can not be read the list is marked as failed and the remaining morsels are skipped, the
+// query then fails instead of returning the outputs of the other morsels.
+
+#define MORSEL_SIZE BUFFER_CHUNK_SIZE
+#define MORSEL_READ_AHEAD 2
+
+typedef struct {
+    void **inputs;  // data of every input column, indexed by row number
+    lng start;
+    lng end;
+    lng limit;      // maximum amount of output rows of this morsel, or -1
+    ColumnList *columns;  // columns of the inputs that have to be pinned (if chunk >= 0)
+    lng chunk;            // chunk of the columns, or -1 if the inputs are always in memory
+    QueryOutput output;
+} Morsel;
+
+typedef struct {
+    Morsel *morsels;
+    size_t count;
+    size_t capacity;
+    bool failed;  // the chunks of a morsel could not be read, so the outputs are incomplete (read and written atomically)
+} MorselList;
+
+typedef void (*MorselFunction)(void *state, Morsel *morsel);
+
+typedef void (*TaskFunction)(void *state, size_t task);
+
+typedef struct {
+    size_t task_count;
+    size_t next;
+    TaskFunction function;
+    void *state;
+} TaskWorkers;
+
+static MorselList *CreateMorselList(void) {
+    return (MorselList*) calloc(1, sizeof(MorselList));
+}
+
+// Splits the rows [start, end) into morsels
+static void AddMorsels(MorselList *list, void **inputs, lng start, lng end) {
+    for(lng morsel_start = start; morsel_start < end; morsel_start += MORSEL_SIZE) {
+        if (list->count == list->capacity) {
+            list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+            list->morsels = (Morsel*) realloc(list->morsels, list->capacity * sizeof(Morsel));
+        }
+        Morsel *morsel = &list->morsels[list->count++];
+        memset(morsel, 0, sizeof(Morsel));
+        morsel->inputs = inputs;
+        morsel->start = morsel_start;
+        morsel->end = morsel_start + MORSEL_SIZE < end ? morsel_start + MORSEL_SIZE : end;
+        morsel->limit = -1;
+        morsel->chunk = -1;
+    }
+}
+
+// Adds the morsels for all rows of a table (including the unmerged rows of its delta)
+// The morsels over the columns come first, returns the amount of them
+// Must be called (and the morsels must be executed) while holding the table lock for reading
+static size_t AddTableMorsels(MorselList *list, Table *table, ColumnList *columns) {
+    size_t column_count = GetColCount(columns);
+    lng size = table->columns ? table->columns->size : 0;
+    size_t column_morsels = BufferChunkCount(size);
+    for(size_t chunk = 0; chunk < column_morsels; chunk++) {
+        // the inputs are set when the chunks are pinned
+        void **inputs = (void**) calloc(column_count + 1, sizeof(void*));
+        AddMorsels(list, inputs, 0, BufferChunkRows(table->columns, chunk));
+        list->morsels[list->count - 1].columns = columns;
+        list->morsels[list->count - 1].chunk = chunk;
+    }
+
+    Delta *delta = __atomic_load_n(&table->delta, __ATOMIC_ACQUIRE);
+    if (!delta) return column_morsels;
+    lng start = delta->merged, end = DeltaCount(delta);
+    for(DeltaChunk *chunk = delta->head; chunk && start < end; chunk = __atomic_load_n(&chunk->next, __ATOMIC_ACQUIRE)) {
+        lng chunk_end = chunk->start + DELTA_CHUNK_SIZE;
+        if (chunk_end <= start) continue;
+        void **chunk_inputs = (void**) malloc((column_count + 1) * sizeof(void*));
+        ColumnList *entry = columns;
+        for(size_t i = 0; i < column_count; i++, entry = entry->next) {
+            chunk_inputs[i] = chunk->data[GetColumnIndex(table, entry->column)];
+        }
+        lng morsel_end = chunk_end < end ? chunk_end : end;
+        AddMorsels(list, chunk_inputs, start - chunk->start, morsel_end - chunk->start);
+        start = morsel_end;
+    }
+    return column_morsels;
+}
+
+static void InitializeOutput(QueryOutput *output, OperationList *outputs, lng capacity) {
+    output->output_count = 0;
+    for(OperationList *list = outputs; list; list = list->next) {
+        output->output_count++;
+    }
+    output->data = (void**) calloc(output->output_count + 1, sizeof(void*));
+    output->elsize = (unsigned char*) calloc(output->output_count + 1, sizeof(unsigned char));
+    output->count = 0;
+    output->capacity = capacity > 0 ? capacity : 1;
+    for(size_t i = 0; outputs; i++, outputs = outputs->next) {
+        output->elsize[i] = GetTypeSize(GetResultType(outputs->operation));
+        output->data[i] = malloc(output->capacity * output->elsize[i]);
+    }
+}
+
+// Called from generated code when an output is full, count is the amount of values in the output
+static void GrowQueryOutput(QueryOutput *output, lng count) {
+    output->count = count;
+    output->capacity *= 2;
+    for(size_t i = 0; i < output->output_count; i++) {
+        output->data[i] = realloc(output->data[i], output->capacity * output->elsize[i]);
+    }
+}
+
+static void FreeOutput(QueryOutput *output) {
+    for(size_t i = 0; i < output->output_count; i++) {
+        free(output->data[i]);
+    }
+    free(output->data);
+    free(output->elsize);
+}
+
+// Pins the chunks of the input columns of a morsel, returns false if they could not be read
+static bool PinMorsel(Morsel *morsel) {
+    if (morsel->chunk < 0) return true;
+    size_t i = 0;
+    for(ColumnList *entry = morsel->columns; entry; entry = entry->next, i++) {
+        morsel->inputs[i] = PinChunk(entry->column, morsel->chunk);
+        if (!morsel->inputs[i]) {
+            ColumnList *pinned = morsel->columns;
+            for(size_t j = 0; j < i; j++, pinned = pinned->next) {
+                UnpinChunk(pinned->column, morsel->chunk);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+static void UnpinMorsel(Morsel *morsel) {
+    if (morsel->chunk < 0) return;
+    for(ColumnList *entry = morsel->columns; entry; entry = entry->next) {
+        UnpinChunk(entry->column, morsel->chunk);
+    }
+}
+
+// Starts reading the chunks of a morsel in the background
+static void PrefetchMorsel(MorselList *list, size_t index) {
+    if (index >= list->count || list->morsels[index].chunk < 0) return;
+    for(ColumnList *entry = list->morsels[index].columns; entry; entry = entry->next) {
+        PrefetchChunk(entry->column, list->morsels[index].chunk);
+    }
+}
+
+// Starts reading the chunks of the columns of a table in the background, in order, until bytes of column data have
+// been requested. Chunks without rows that can satisfy the filter (if there is one) are skipped, since the scan does
+// not read them either. Must be called while holding the table lock for reading
+static void PrefetchColumns(Table *table, ColumnList *columns, ImprintFilter *filter, size_t bytes) {
+    lng size = table->columns ? table->columns->size : 0;
+    size_t requested = 0;
+    for(size_t chunk = 0; chunk < BufferChunkCount(size) && requested < bytes; chunk++) {
+        lng start = (lng) chunk * BUFFER_CHUNK_SIZE, rows = BufferChunkRows(table->columns, chunk);
+        if (filter && !ImprintCandidates(filter, start, start + rows)) continue;
+        for(ColumnList *entry = columns; entry; entry = entry->next) {
+            PrefetchChunk(entry->column, chunk);
+            requested += rows * entry->column->elsize;
+        }
+    }
+}
+
+// Runs the function on a morsel of the list while its chunks are pinned
+// If the chunks cannot be read the morsel is skipped and the list is marked as failed, once a list has failed its
+// other morsels are skipped as well
+static void RunMorsel(MorselList *list, MorselFunction function, void *state, Morsel *morsel) {
+    if (__atomic_load_n(&list->failed, __ATOMIC_RELAXED)) return;
+    if (!PinMorsel(morsel)) {
+        __atomic_store_n(&list->failed, true, __ATOMIC_RELAXED);
+        return;
+    }
+    function(state, morsel);
+    UnpinMorsel(morsel);
+}
+
+static void *TaskWorker(void *arg) {
+    TaskWorkers *workers = (TaskWorkers*) arg;
+    while (true) {
+        size_t task = __atomic_fetch_add(&workers->next, 1, __ATOMIC_RELAXED);
+        if (task >= workers->task_count) break;
+        workers->function(workers->state, task);
+    }
+    return NULL;
+}
+
+// Runs the function for the tasks [0, task_count) using thread_count threads
+static void RunParallel(size_t task_count, TaskFunction function, void *state, size_t thread_count) {
+    TaskWorkers workers = { task_count, 0, function, state };
+    if (thread_count > task_count) thread_count = task_count;
+    pthread_t *threads = (pthread_t*) malloc((thread_count + 1) * sizeof(pthread_t));
+    for(size_t i = 1; i < thread_count; i++) {
+        pthread_create(&threads[i], NULL, TaskWorker, &workers);
+    }
+    TaskWorker(&workers);
+    for(size_t i = 1; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+typedef struct {
+    MorselList *list;
+    MorselFunction function;
+    void *state;
+    lng limit;
+    pthread_mutex_t lock;
+    bool *finished;
+    size_t frontier;  // all morsels before the frontier are finished
+    lng prefix;       // amount of output rows of the morsels before the frontier
+    size_t read_ahead;
+} MorselTasks;
+
+static void RunMorselTask(void *state, size_t task) {
+    MorselTasks *tasks = (MorselTasks*) state;
+    Morsel *morsel = &tasks->list->morsels[task];
+    morsel->limit = -1;
+    if (tasks->limit >= 0) {
+        pthread_mutex_lock(&tasks->lock);
+        bool cancelled = tasks->prefix >= tasks->limit;
+        morsel->limit = tasks->frontier == task ? tasks->limit - tasks->prefix : tasks->limit;
+        if (cancelled) tasks->finished[task] = true;
+        pthread_mutex_unlock(&tasks->lock);
+        if (cancelled) return;
+    }
+    PrefetchMorsel(tasks->list, task + tasks->read_ahead);
+    RunMorsel(tasks->list, tasks->function, tasks->state, morsel);
+    if (tasks->limit >= 0) {
+        pthread_mutex_lock(&tasks->lock);
+        tasks->finished[task] = true;
+        while (tasks->frontier < tasks->list->count && tasks->finished[tasks->frontier]) {
+            tasks->prefix += tasks->list->morsels[tasks->frontier].output.count;
+            tasks->frontier++;
+        }
+        pthread_mutex_unlock(&tasks->lock);
+    }
+}
+
+// Runs the function on every morsel of the list using thread_count threads
+// If limit >= 0 only the first limit output rows (in morsel order) are needed
+static void RunMorsels(MorselList *list, MorselFunction function, void *state, size_t thread_count, lng limit) {
+    MorselTasks tasks;
+    tasks.list = list;
+    tasks.function = function;
+    tasks.state = state;
+    tasks.limit = limit;
+    pthread_mutex_init(&tasks.lock, NULL);
+    tasks.finished = (bool*) calloc(list->count + 1, sizeof(bool));
+    tasks.frontier = 0;
+    tasks.prefix = 0;
+    tasks.read_ahead = MORSEL_READ_AHEAD * (thread_count > 0 ? thread_count : 1);
+    for(size_t i = 0; i < tasks.read_ahead; i++) {
+        PrefetchMorsel(list, i);
+    }
+    RunParallel(list->count, RunMorselTask, &tasks, thread_count);
+    pthread_mutex_destroy(&tasks.lock);
+    free(tasks.finished);
+}
+
+typedef lng (*ScanKernel)(void **inputs, lng start, lng end, QueryOutput *output, lng limit);
+
+typedef struct {
+    ScanKernel kernel;
+    OperationList *outputs;
+    ImprintFilter *filter;  // the imprints of the WHERE clause, or NULL (see imprint.h)
+} ScanState;
+
+static void RunScanMorsel(void *state, Morsel *morsel) {
+    ScanState *scan = (ScanState*) state;
+    lng capacity = morsel->end - morsel->start;
+    if (morsel->limit >= 0 && morsel->limit < capacity) capacity = morsel->limit;
+    InitializeOutput(&morsel->output, scan->outputs, capacity);
+    if (!scan->filter || morsel->chunk < 0) {
+        morsel->output.count = scan->kernel(morsel->inputs, morsel->start, morsel->end, &morsel->output, morsel->limit);
+        return;
+    }
+    // the kernel runs over every run of granules that can qualify, and appends to the output
+    // gaps of less than IMPRINT_MIN_SKIP rows are not worth another call of the kernel, so they are scanned
+    lng offset = morsel->chunk * BUFFER_CHUNK_SIZE;
+    lng row = morsel->start;
+    while (row < morsel->end) {
+        while (row < morsel->end && !ImprintCandidate(scan->filter, offset + row)) {
+            row += IMPRINT_GRANULE - (offset + row) % IMPRINT_GRANULE;
+        }
+        lng end = row, candidate_end = row;
+        while (end < morsel->end && end - candidate_end < IMPRINT_MIN_SKIP) {
+            bool candidate = ImprintCandidate(scan->filter, offset + end);
+            end += IMPRINT_GRANULE - (offset + end) % IMPRINT_GRANULE;
+            if (candidate) candidate_end = end;
+        }
+        end = candidate_end < morsel->end ? candidate_end : morsel->end;
+        if (row >= end) break;
+        morsel->output.count = scan->kernel(morsel->inputs, row, end, &morsel->output, morsel->limit);
+        if (morsel->limit >= 0 && morsel->output.count >= morsel->limit) break;
+        row = end;
+    }
+}
+
+// Concatenates the outputs of all morsels into a result table, up to limit rows (if limit >= 0)
+static Table *CollectOutputs(MorselList *list, OperationList *outputs, lng limit) {
+    lng total = 0;
+    for(size_t i = 0; i < list->count; i++) {
+        total += list->morsels[i].output.count;
+    }
+    if (limit >= 0 && limit < total) total = limit;
+    Column *columns = NULL, *tail = NULL;
+    for(size_t k = 0; outputs; k++, outputs = outputs->next) {
+        int type = GetResultType(outputs->operation);
+        unsigned char size = GetTypeSize(type);
+        char *data = malloc((total > 0 ? total : 1) * size);
+        lng offset = 0;
+        for(size_t i = 0; i < list->count; i++) {
+            QueryOutput *output = &list->morsels[i].output;
+            lng count = output->count < total - offset ? output->count : total - offset;
+            if (count == 0) continue;
+            memcpy(data + offset * size, output->data[k], count * size);
+            offset += count;
+        }
+        Column *column = CreateColumn((double*) data, total);
+        column->type = type;
+        column->elsize = size;
+        if (tail) {
+            tail->next = column;
+        } else {
+            columns = column;
+        }
+        tail = column;
+    }
+    return CreateTable("Result", columns);
+}
+
+static void FreeMorselList(MorselList *list) {
+    void **inputs = NULL;
+    for(size_t i = 0; i < list->count; i++) {
+        if (list->morsels[i].output.data) {
+            FreeOutput(&list->morsels[i].output);
+        }
+        // consecutive morsels share their inputs
+        if (list->morsels[i].inputs != inputs) {
+            inputs = list->morsels[i].inputs;
+            free(inputs);
+        }
+    }
+    free(list->morsels);
+    free(list);
+}
+
+#endif
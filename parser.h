@@ -1,5 +1,6 @@
 
 #include "assert.h"
+#include <errno.h>
 
 #ifndef _PARSER_H_
 #define _PARSER_H_
@@ -7,6 +8,8 @@
 #define OPTYPE_binop 1
 #define OPTYPE_colmn 2
 #define OPTYPE_const 3
+#define OPTYPE_func 4
+#define OPTYPE_case 5
 
 #define OPTYPE_mul 1    // multiplication: *
 #define OPTYPE_div 2    // division: /
@@ -20,6 +23,19 @@
 #define OPTYPE_ge 10    // greater than or equal to: >=
 #define OPTYPE_and 11   // and: &&
 #define OPTYPE_or 12    // or: ||
+#define OPTYPE_mod 13   // remainder: %
+
+#define FUNCTION_abs 1    // abs(x)
+#define FUNCTION_sqrt 2   // sqrt(x)
+#define FUNCTION_floor 3  // floor(x)
+#define FUNCTION_ceil 4   // ceil(x)
+#define FUNCTION_pow 5    // pow(x, y)
+#define FUNCTION_exp 6    // exp(x)
+#define FUNCTION_log 7    // log(x): the natural logarithm
+#define FUNCTION_min 8    // min(x, y)
+#define FUNCTION_max 9    // max(x, y)
+
+#define MAX_FUNCTION_ARGUMENTS 2
 
 static int OperatorType(const char* str);
 
@@ -39,6 +55,7 @@ typedef struct {
     Operation_BASE
     char *name;
     Column *column;
+    Table *table;  // the table the column belongs to
 } ColumnOperation;
 
 typedef struct {
@@ -49,6 +66,49 @@ typedef struct {
     Operation *right;
 } BinaryOperation;
 
+typedef struct {
+    Operation_BASE
+    const char *name;
+    int function;
+    Operation *arguments[MAX_FUNCTION_ARGUMENTS];
+    size_t argument_count;
+} FunctionOperation;
+
+// CASE WHEN condition THEN result [WHEN ...] [ELSE result] END, or IF(condition, result, result)
+typedef struct {
+    Operation_BASE
+    size_t count;           // amount of WHEN branches
+    Operation **conditions;
+    Operation **results;
+    Operation *otherwise;   // result of the ELSE branch, or NULL (the result is 0)
+} CaseOperation;
+
+typedef struct {
+    const char *name;
+    int function;
+    size_t argument_count;
+} FunctionInfo;
+
+static FunctionInfo available_functions[] = {
+    { "abs", FUNCTION_abs, 1 },
+    { "sqrt", FUNCTION_sqrt, 1 },
+    { "floor", FUNCTION_floor, 1 },
+    { "ceil", FUNCTION_ceil, 1 },
+    { "pow", FUNCTION_pow, 2 },
+    { "exp", FUNCTION_exp, 1 },
+    { "log", FUNCTION_log, 1 },
+    { "min", FUNCTION_min, 2 },
+    { "max", FUNCTION_max, 2 },
+};
+
+// Returns the function with the given name (in any case), or NULL if there is no such function
+static FunctionInfo *GetFunctionInfo(const char *name) {
+    for(size_t i = 0; i < sizeof(available_functions) / sizeof(FunctionInfo); i++) {
+        if (strcasecmp(available_functions[i].name, name) == 0) return &available_functions[i];
+    }
+    return NULL;
+}
+
 Operation *CreateConstantOperation(double val) {
     ConstantOperation *op = malloc(sizeof(ConstantOperation));
     op->value = val;
@@ -61,6 +121,7 @@ Operation *CreateColumnOperation(const char *name) {
     op->name = strdup(name);
     op->type = OPTYPE_colmn;
     op->column = NULL;
+    op->table = NULL;
     return (Operation*) op;
 }
 
@@ -74,6 +135,32 @@ Operation *CreateBinaryOperation(const char *name, int optype, Operation *left,
     return (Operation*) op;
 }
 
+Operation *CreateFunctionOperation(FunctionInfo *info, Operation **arguments) {
+    FunctionOperation *op = malloc(sizeof(FunctionOperation));
+    op->name = info->name;
+    op->function = info->function;
+    op->argument_count = info->argument_count;
+    for(size_t i = 0; i < info->argument_count; i++) {
+        op->arguments[i] = arguments[i];
+    }
+    op->type = OPTYPE_func;
+    return (Operation*) op;
+}
+
+Operation *CreateCaseOperation(void) {
+    CaseOperation *op = calloc(1, sizeof(CaseOperation));
+    op->type = OPTYPE_case;
+    return (Operation*) op;
+}
+
+static void AddCaseBranch(CaseOperation *op, Operation *condition, Operation *result) {
+    op->conditions = realloc(op->conditions, (op->count + 1) * sizeof(Operation*));
+    op->results = realloc(op->results, (op->count + 1) * sizeof(Operation*));
+    op->conditions[op->count] = condition;
+    op->results[op->count] = result;
+    op->count++;
+}
+
 struct _ColumnList;
 typedef struct _ColumnList ColumnList;
 
@@ -82,8 +169,9 @@ struct _ColumnList {
     ColumnList *next;
 };
 //scans the relevant columns from an operation
-static ColumnList* GetColumns(Table *table, Operation *op); 
+static ColumnList* GetColumns(Table *table, Table *join_table, Operation *op);
 static ColumnList* UnionColumns(ColumnList *a, ColumnList *b);
+static bool ColumnInList(ColumnList *l, Column *c);
 
 struct _OperationList;
 typedef struct _OperationList OperationList;
@@ -99,11 +187,46 @@ typedef struct {
     ColumnList *columns; //relevant columns to the operation
 } BaseOperation;
 
+#define QUERY_select 1  // SELECT [expr | aggregate(expr)] FROM table [TABLESAMPLE (p)] WHERE [expr] ORDER BY [expr] LIMIT n OPTIMIZE profile
+#define QUERY_copy 2    // COPY table FROM 'file.csv'
+#define QUERY_insert 3  // INSERT INTO table [(column, ...)] VALUES (value, ...), ...
+#define QUERY_set 4     // SET OPTIMIZE profile
+#define QUERY_index 5   // CREATE INDEX [name] ON table (column, ...)
+#define QUERY_layout 6  // ALTER TABLE table SET LAYOUT [PAX | COLUMNAR]
+
+#define AGGREGATE_count 1  // COUNT(*) or COUNT(expr)
+#define AGGREGATE_sum 2    // SUM(expr)
+#define AGGREGATE_avg 3    // AVG(expr)
+#define AGGREGATE_min 4    // MIN(expr)
+#define AGGREGATE_max 5    // MAX(expr)
+
+// A value of INSERT INTO, typed by its column: integer for int and lng columns, real for flt and dbl columns
+typedef union {
+    lng integer;
+    double real;
+} InsertValue;
+
 typedef struct {
+    int type;
     Operation *select;
     char *table;
     Operation *where;
     ColumnList *columns;
+    int aggregate;             // AGGREGATE_* if the SELECT expression is an aggregate, or 0
+    double sample;             // FROM table TABLESAMPLE (p PERCENT): percentage of the blocks that are scanned, or 0
+    lng sample_seed;           // REPEATABLE (seed), or -1 for a different sample every time
+    char *join_table;          // second table in FROM a JOIN b ON [expr] or FROM a, b
+    Operation *join_condition; // the ON condition, or NULL
+    Operation *order;          // the ORDER BY expression, or NULL
+    bool descending;
+    lng limit;                 // maximum amount of result rows, or -1 if there is no LIMIT
+    char *optimize;            // optimization profile (see passes.h), or NULL for the profile of the session
+    bool profile;              // PROFILE SELECT ...: report the time of every optimization pass
+    char *text;                // the text of the statement (see resultcache.h)
+    char *file;
+    InsertValue *values;  // rows * (amount of columns) values to insert, in the order of columns
+    lng rows;
+    int layout;      // ALTER TABLE ... SET LAYOUT: LAYOUT_columnar or LAYOUT_pax
 } Query;
 
 typedef enum {
@@ -116,12 +239,40 @@ typedef enum {
     tok_leftparen = 7,
     tok_rightparen = 8,
     tok_comma = 9,
+    tok_copy = 10,
+    tok_string = 11,
+    tok_insert = 12,
+    tok_into = 13,
+    tok_values = 14,
+    tok_join = 15,
+    tok_on = 16,
+    tok_order = 17,
+    tok_by = 18,
+    tok_asc = 19,
+    tok_desc = 20,
+    tok_limit = 21,
+    tok_set = 22,
+    tok_optimize = 23,
+    tok_profile = 24,
+    tok_case = 25,
+    tok_when = 26,
+    tok_then = 27,
+    tok_else = 28,
+    tok_end = 29,
+    tok_tablesample = 30,
+    tok_percent = 31,
+    tok_repeatable = 32,
+    tok_create = 33,
+    tok_index = 34,
+    tok_alter = 35,
+    tok_table = 36,
     tok_invalid = 126,
     tok_eof = 127
 } Token;
 
-static char* strval = NULL;
-static double numval;
+// the tokenizer state is per thread, so sessions can parse queries concurrently
+static __thread char* strval = NULL;
+static __thread double numval;
 
 static bool IsOperatorCharacter(char c) {
     switch(c) {
@@ -129,6 +280,7 @@ static bool IsOperatorCharacter(char c) {
         case '-':
         case '*':
         case '/':
+        case '%':
         case '>':
         case '<':
         case '=':
@@ -152,6 +304,33 @@ static const char* TokToString(int token) {
         case tok_identifier: return "IDENTIFIER";
         case tok_constant: return "CONSTANT";
         case tok_comma: return ",";
+        case tok_copy: return "COPY";
+        case tok_string: return "STRING";
+        case tok_insert: return "INSERT";
+        case tok_into: return "INTO";
+        case tok_values: return "VALUES";
+        case tok_join: return "JOIN";
+        case tok_on: return "ON";
+        case tok_order: return "ORDER";
+        case tok_by: return "BY";
+        case tok_asc: return "ASC";
+        case tok_desc: return "DESC";
+        case tok_limit: return "LIMIT";
+        case tok_set: return "SET";
+        case tok_optimize: return "OPTIMIZE";
+        case tok_profile: return "PROFILE";
+        case tok_case: return "CASE";
+        case tok_when: return "WHEN";
+        case tok_then: return "THEN";
+        case tok_else: return "ELSE";
+        case tok_end: return "END";
+        case tok_tablesample: return "TABLESAMPLE";
+        case tok_percent: return "PERCENT";
+        case tok_repeatable: return "REPEATABLE";
+        case tok_create: return "CREATE";
+        case tok_index: return "INDEX";
+        case tok_alter: return "ALTER";
+        case tok_table: return "TABLE";
         case tok_eof: return ";";
         case tok_invalid: return "INVALID";
         default: return "TOKEN";
@@ -163,6 +342,7 @@ static int OperatorType(const char *op) {
     // we separate operators by 100 so there is some room in between
     if (strcmp(op, "/") == 0) return OPTYPE_div;
     if (strcmp(op, "*") == 0) return OPTYPE_mul;
+    if (strcmp(op, "%") == 0) return OPTYPE_mod;
     if (strcmp(op, "+") == 0) return OPTYPE_add;
     if (strcmp(op, "-") == 0) return OPTYPE_sub;
     if (strcmp(op, ">=") == 0) return OPTYPE_ge;
@@ -170,6 +350,7 @@ static int OperatorType(const char *op) {
     if (strcmp(op, "<") == 0) return OPTYPE_lt;
     if (strcmp(op, "<=") == 0) return OPTYPE_le;
     if (strcmp(op, "==") == 0) return OPTYPE_eq;
+    if (strcmp(op, "=") == 0) return OPTYPE_eq;
     if (strcmp(op, "!=") == 0) return OPTYPE_ne;
     if (strcmp(op, "<>") == 0) return OPTYPE_ne;
     if (strcmp(op, "&&") == 0) return OPTYPE_and;
@@ -184,6 +365,7 @@ static int OperatorPrecedence(const char *op) {
     // we separate operators by 100 so there is some room in between
     if (strcmp(op, "/") == 0) return 1200;
     if (strcmp(op, "*") == 0) return 1200;
+    if (strcmp(op, "%") == 0) return 1200;
     if (strcmp(op, "+") == 0) return 1100;
     if (strcmp(op, "-") == 0) return 1100;
     if (strcmp(op, ">=") == 0) return 700;
@@ -191,6 +373,7 @@ static int OperatorPrecedence(const char *op) {
     if (strcmp(op, "<") == 0) return 700;
     if (strcmp(op, "<=") == 0) return 700;
     if (strcmp(op, "==") == 0) return 600;
+    if (strcmp(op, "=") == 0) return 600;
     if (strcmp(op, "!=") == 0) return 600;
     if (strcmp(op, "<>") == 0) return 600;
     if (strcmp(op, "&&") == 0) return 400;
@@ -216,7 +399,8 @@ static Token _ParseToken(char *query, size_t *index) {
     if (isalpha(query[*index])) { //identifiers must start with an alphabetic character (can't start with numbers)
         size_t str_start = *index;
         // scan until the current character is no longer a alphabetic character or number
-        while(isalnum(query[*index]))  {
+        // a column name can be qualified with the table name (table.column)
+        while(isalnum(query[*index]) || (query[*index] == '.' && isalpha(query[*index + 1])))  {
             (*index)++;
         }
         create_substring(&strval, query, str_start, *index);
@@ -231,6 +415,84 @@ static Token _ParseToken(char *query, size_t *index) {
         if (strcmp(strval, "WHERE") == 0) {
             return tok_where;
         }
+        if (strcmp(strval, "COPY") == 0) {
+            return tok_copy;
+        }
+        if (strcmp(strval, "INSERT") == 0) {
+            return tok_insert;
+        }
+        if (strcmp(strval, "INTO") == 0) {
+            return tok_into;
+        }
+        if (strcmp(strval, "VALUES") == 0) {
+            return tok_values;
+        }
+        if (strcmp(strval, "JOIN") == 0) {
+            return tok_join;
+        }
+        if (strcmp(strval, "ON") == 0) {
+            return tok_on;
+        }
+        if (strcmp(strval, "ORDER") == 0) {
+            return tok_order;
+        }
+        if (strcmp(strval, "BY") == 0) {
+            return tok_by;
+        }
+        if (strcmp(strval, "ASC") == 0) {
+            return tok_asc;
+        }
+        if (strcmp(strval, "DESC") == 0) {
+            return tok_desc;
+        }
+        if (strcmp(strval, "LIMIT") == 0) {
+            return tok_limit;
+        }
+        if (strcmp(strval, "SET") == 0) {
+            return tok_set;
+        }
+        if (strcmp(strval, "OPTIMIZE") == 0) {
+            return tok_optimize;
+        }
+        if (strcmp(strval, "PROFILE") == 0) {
+            return tok_profile;
+        }
+        if (strcmp(strval, "CASE") == 0) {
+            return tok_case;
+        }
+        if (strcmp(strval, "WHEN") == 0) {
+            return tok_when;
+        }
+        if (strcmp(strval, "THEN") == 0) {
+            return tok_then;
+        }
+        if (strcmp(strval, "ELSE") == 0) {
+            return tok_else;
+        }
+        if (strcmp(strval, "END") == 0) {
+            return tok_end;
+        }
+        if (strcmp(strval, "TABLESAMPLE") == 0) {
+            return tok_tablesample;
+        }
+        if (strcmp(strval, "PERCENT") == 0) {
+            return tok_percent;
+        }
+        if (strcmp(strval, "REPEATABLE") == 0) {
+            return tok_repeatable;
+        }
+        if (strcmp(strval, "CREATE") == 0) {
+            return tok_create;
+        }
+        if (strcmp(strval, "INDEX") == 0) {
+            return tok_index;
+        }
+        if (strcmp(strval, "ALTER") == 0) {
+            return tok_alter;
+        }
+        if (strcmp(strval, "TABLE") == 0) {
+            return tok_table;
+        }
         if (strcmp(strval, "AND") == 0) {
             return tok_operator;
         }
@@ -263,6 +525,17 @@ static Token _ParseToken(char *query, size_t *index) {
             return tok_operator;
         }
     }
+    if (query[*index] == '\'') {
+        // string literal, scan until the closing quote
+        size_t str_start = ++(*index);
+        while(query[*index] != '\'') {
+            if (query[*index] == '\0') return tok_invalid;
+            (*index)++;
+        }
+        create_substring(&strval, query, str_start, *index);
+        (*index)++;
+        return tok_string;
+    }
     // remaining special tokens
     if (query[*index] == '(') {
         (*index)++;
@@ -293,6 +566,59 @@ static Token ParseToken(char *query, size_t *index) {
 }
 
 static Operation *ParseOperation(char *query, size_t *index);
+
+// Parses the rest of CASE WHEN condition THEN result [WHEN ...] [ELSE result] END
+static Operation *ParseCase(char *query, size_t *index) {
+    CaseOperation *op = (CaseOperation*) CreateCaseOperation();
+    while (PeekToken(query, index) == tok_when) {
+        ParseToken(query, index);
+        Operation *condition = ParseOperation(query, index);
+        if (!condition) return NULL;
+        if (ParseToken(query, index) != tok_then) {
+            fprintf(stderr, "Expected THEN.\n");
+            return NULL;
+        }
+        Operation *result = ParseOperation(query, index);
+        if (!result) return NULL;
+        AddCaseBranch(op, condition, result);
+    }
+    if (op->count == 0) {
+        fprintf(stderr, "Expected WHEN.\n");
+        return NULL;
+    }
+    if (PeekToken(query, index) == tok_else) {
+        ParseToken(query, index);
+        op->otherwise = ParseOperation(query, index);
+        if (!op->otherwise) return NULL;
+    }
+    if (ParseToken(query, index) != tok_end) {
+        fprintf(stderr, "Expected END.\n");
+        return NULL;
+    }
+    return (Operation*) op;
+}
+
+// Parses the rest of IF(condition, result, result)
+static Operation *ParseIf(char *query, size_t *index) {
+    Operation *arguments[3];
+    for(size_t i = 0; i < 3; i++) {
+        if (ParseToken(query, index) != (i == 0 ? tok_leftparen : tok_comma)) {
+            fprintf(stderr, "Function IF expects 3 arguments.\n");
+            return NULL;
+        }
+        arguments[i] = ParseOperation(query, index);
+        if (!arguments[i]) return NULL;
+    }
+    if (ParseToken(query, index) != tok_rightparen) {
+        fprintf(stderr, "Function IF expects 3 arguments.\n");
+        return NULL;
+    }
+    CaseOperation *op = (CaseOperation*) CreateCaseOperation();
+    AddCaseBranch(op, arguments[0], arguments[1]);
+    op->otherwise = arguments[2];
+    return (Operation*) op;
+}
+
 static Operation *ParsePrimary(char *query, size_t *index) {
     // parse primary token, this can be either a constant value, identifier or the start of an expression (left parenthesis)
     Token token = ParseToken(query, index);
@@ -300,7 +626,44 @@ static Operation *ParsePrimary(char *query, size_t *index) {
         case tok_constant:
             return CreateConstantOperation(numval);
         case tok_identifier:
-            return CreateColumnOperation(strval);
+        {
+            // peeking overwrites strval
+            char *name = strdup(strval);
+            if (PeekToken(query, index) != tok_leftparen) {
+                Operation *op = CreateColumnOperation(name);
+                free(name);
+                return op;
+            }
+            if (strcasecmp(name, "IF") == 0) {
+                free(name);
+                return ParseIf(query, index);
+            }
+            // function call: name(expr, ...)
+            FunctionInfo *info = GetFunctionInfo(name);
+            if (!info) {
+                fprintf(stderr, "Unknown function %s.\n", name);
+                free(name);
+                return NULL;
+            }
+            free(name);
+            ParseToken(query, index);
+            Operation *arguments[MAX_FUNCTION_ARGUMENTS];
+            for(size_t i = 0; i < info->argument_count; i++) {
+                if (i > 0 && ParseToken(query, index) != tok_comma) {
+                    fprintf(stderr, "Function %s expects %zu arguments.\n", info->name, info->argument_count);
+                    return NULL;
+                }
+                arguments[i] = ParseOperation(query, index);
+                if (!arguments[i]) return NULL;
+            }
+            if (ParseToken(query, index) != tok_rightparen) {
+                fprintf(stderr, "Function %s expects %zu arguments.\n", info->name, info->argument_count);
+                return NULL;
+            }
+            return CreateFunctionOperation(info, arguments);
+        }
+        case tok_case:
+            return ParseCase(query, index);
         case tok_leftparen:
         {
             Operation *op = ParseOperation(query, index);
@@ -431,17 +794,444 @@ SelectStarFromTable(Table *table) {
     return InvertList(collection);
 }
 
+static Query *ParseCopy(char *query, size_t *index, Query *parsed_query) {
+    // COPY table FROM 'file.csv'
+    // the table does not have to exist yet, COPY creates it from the CSV header
+    parsed_query->type = QUERY_copy;
+    if (ParseToken(query, index) != tok_identifier) {
+        fprintf(stderr, "Expected table name after COPY.\n");
+        return NULL;
+    }
+    parsed_query->table = strdup(strval);
+    if (ParseToken(query, index) != tok_from) {
+        fprintf(stderr, "Expected FROM after COPY %s.\n", parsed_query->table);
+        return NULL;
+    }
+    if (ParseToken(query, index) != tok_string) {
+        fprintf(stderr, "Expected file name after FROM.\n");
+        return NULL;
+    }
+    parsed_query->file = strdup(strval);
+    if (ParseToken(query, index) != tok_eof) {
+        fprintf(stderr, "Unexpected token after COPY statement.\n");
+        return NULL;
+    }
+    return parsed_query;
+}
+
+// Parses the name of an optimization profile (none, fast, full) or a quoted list of passes
+static char *ParseProfileName(char *query, size_t *index) {
+    Token token = ParseToken(query, index);
+    if (token != tok_identifier && token != tok_string) {
+        fprintf(stderr, "Expected an optimization profile after OPTIMIZE.\n");
+        return NULL;
+    }
+    return strdup(strval);
+}
+
+static Query *ParseSet(char *query, size_t *index, Query *parsed_query) {
+    // SET OPTIMIZE profile
+    parsed_query->type = QUERY_set;
+    if (ParseToken(query, index) != tok_optimize) {
+        fprintf(stderr, "Expected OPTIMIZE after SET.\n");
+        return NULL;
+    }
+    parsed_query->optimize = ParseProfileName(query, index);
+    if (!parsed_query->optimize) {
+        return NULL;
+    }
+    if (ParseToken(query, index) != tok_eof) {
+        fprintf(stderr, "Unexpected token after SET statement.\n");
+        return NULL;
+    }
+    return parsed_query;
+}
+
+static Query *ParseCreateIndex(char *query, size_t *index, Query *parsed_query) {
+    // CREATE INDEX [name] ON table (column, ...)
+    // the index is an imprint of every column (see imprint.h), the name is ignored
+    parsed_query->type = QUERY_index;
+    if (ParseToken(query, index) != tok_index) {
+        fprintf(stderr, "Expected INDEX after CREATE.\n");
+        return NULL;
+    }
+    Token token = ParseToken(query, index);
+    if (token == tok_identifier) {
+        token = ParseToken(query, index);
+    }
+    if (token != tok_on) {
+        fprintf(stderr, "Expected ON after CREATE INDEX.\n");
+        return NULL;
+    }
+    if (ParseToken(query, index) != tok_identifier) {
+        fprintf(stderr, "Expected table name after ON.\n");
+        return NULL;
+    }
+    parsed_query->table = strdup(strval);
+    Table *table = GetTable(parsed_query->table);
+    if (table == NULL) {
+        fprintf(stderr, "Unrecognized table: %s\n", parsed_query->table);
+        return NULL;
+    }
+    if (ParseToken(query, index) != tok_leftparen) {
+        fprintf(stderr, "Expected column list after CREATE INDEX ON %s.\n", parsed_query->table);
+        return NULL;
+    }
+    ColumnList *columns = NULL, *tail = NULL;
+    while(true) {
+        if (ParseToken(query, index) != tok_identifier) {
+            fprintf(stderr, "Expected column name.\n");
+            return NULL;
+        }
+        Column *column = GetColumn(table, strval);
+        if (!column) {
+            fprintf(stderr, "Unrecognized column name %s\n", strval);
+            return NULL;
+        }
+        if (column->type == TYPE_str) {
+            fprintf(stderr, "Can not create an index on string column %s\n", strval);
+            return NULL;
+        }
+        if (!columns || !ColumnInList(columns, column)) {
+            ColumnList *entry = (ColumnList*) malloc(sizeof(ColumnList));
+            entry->column = column;
+            entry->next = NULL;
+            if (tail) {
+                tail->next = entry;
+            } else {
+                columns = entry;
+            }
+            tail = entry;
+        }
+        token = ParseToken(query, index);
+        if (token == tok_rightparen) break;
+        if (token != tok_comma) {
+            fprintf(stderr, "Expected comma or right parenthesis.\n");
+            return NULL;
+        }
+    }
+    parsed_query->columns = columns;
+    if (ParseToken(query, index) != tok_eof) {
+        fprintf(stderr, "Unexpected token after CREATE INDEX statement.\n");
+        return NULL;
+    }
+    return parsed_query;
+}
+
+static Query *ParseAlterTable(char *query, size_t *index, Query *parsed_query) {
+    // ALTER TABLE table SET LAYOUT [PAX | COLUMNAR]
+    parsed_query->type = QUERY_layout;
+    if (ParseToken(query, index) != tok_table) {
+        fprintf(stderr, "Expected TABLE after ALTER.\n");
+        return NULL;
+    }
+    if (ParseToken(query, index) != tok_identifier) {
+        fprintf(stderr, "Expected table name after ALTER TABLE.\n");
+        return NULL;
+    }
+    parsed_query->table = strdup(strval);
+    if (GetTable(parsed_query->table) == NULL) {
+        fprintf(stderr, "Unrecognized table: %s\n", parsed_query->table);
+        return NULL;
+    }
+    if (ParseToken(query, index) != tok_set || ParseToken(query, index) != tok_identifier || strcmp(strval, "LAYOUT") != 0) {
+        fprintf(stderr, "Expected SET LAYOUT after ALTER TABLE %s.\n", parsed_query->table);
+        return NULL;
+    }
+    if (ParseToken(query, index) != tok_identifier) {
+        fprintf(stderr, "Expected PAX or COLUMNAR after SET LAYOUT.\n");
+        return NULL;
+    }
+    if (strcmp(strval, "PAX") == 0) {
+        parsed_query->layout = LAYOUT_pax;
+    } else if (strcmp(strval, "COLUMNAR") == 0) {
+        parsed_query->layout = LAYOUT_columnar;
+    } else {
+        fprintf(stderr, "Unknown layout %s, expected PAX or COLUMNAR.\n", strval);
+        return NULL;
+    }
+    if (ParseToken(query, index) != tok_eof) {
+        fprintf(stderr, "Unexpected token after ALTER TABLE statement.\n");
+        return NULL;
+    }
+    return parsed_query;
+}
+
+// Parses a (signed) constant of INSERT INTO as a value of the type of its column
+// Integers are parsed exactly (not through a double), values that do not fit an integer column are rejected
+static bool ParseInsertValue(char *query, size_t *index, Column *column, InsertValue *value) {
+    Token token = ParseToken(query, index);
+    bool negative = false;
+    if (token == tok_operator && (strcmp(strval, "-") == 0 || strcmp(strval, "+") == 0)) {
+        negative = strval[0] == '-';
+        token = ParseToken(query, index);
+    }
+    if (token != tok_constant) {
+        fprintf(stderr, "Expected constant value.\n");
+        return false;
+    }
+    if (column->type == TYPE_flt || column->type == TYPE_dbl) {
+        value->real = negative ? -numval : numval;
+        return true;
+    }
+    lng lowest = column->type == TYPE_int ? INT32_MIN : INT64_MIN;
+    lng highest = column->type == TYPE_int ? INT32_MAX : INT64_MAX;
+    if (strchr(strval, '.')) {
+        // a decimal is only accepted if it is a whole number, such as 3.0
+        double real = negative ? -numval : numval;
+        if (real < (double) lowest || real >= (double) highest + 1.0 || real != (double) (lng) real) {
+            fprintf(stderr, "Value %s%s is not a valid %s for column %s.\n", negative ? "-" : "", strval, GetTypeName(column->type), column->name);
+            return false;
+        }
+        value->integer = (lng) real;
+        return true;
+    }
+    errno = 0;
+    unsigned long long magnitude = strtoull(strval, NULL, 10);
+    if (errno == ERANGE || magnitude > (negative ? (unsigned long long) highest + 1 : (unsigned long long) highest)) {
+        fprintf(stderr, "Value %s%s is out of range for column %s (%s).\n", negative ? "-" : "", strval, column->name, GetTypeName(column->type));
+        return false;
+    }
+    value->integer = negative ? (lng) (0 - magnitude) : (lng) magnitude;
+    return true;
+}
+
+static Query *ParseInsert(char *query, size_t *index, Query *parsed_query) {
+    // INSERT INTO table [(column, ...)] VALUES (value, ...), (value, ...)
+    parsed_query->type = QUERY_insert;
+    if (ParseToken(query, index) != tok_into) {
+        fprintf(stderr, "Expected INTO after INSERT.\n");
+        return NULL;
+    }
+    if (ParseToken(query, index) != tok_identifier) {
+        fprintf(stderr, "Expected table name after INSERT INTO.\n");
+        return NULL;
+    }
+    parsed_query->table = strdup(strval);
+    Table *table = GetTable(parsed_query->table);
+    if (table == NULL) {
+        fprintf(stderr, "Unrecognized table: %s\n", parsed_query->table);
+        return NULL;
+    }
+    ColumnList *columns = NULL, *tail = NULL;
+    size_t column_count = 0;
+    Token token = ParseToken(query, index);
+    if (token == tok_leftparen) {
+        // explicit column list
+        while(true) {
+            if (ParseToken(query, index) != tok_identifier) {
+                fprintf(stderr, "Expected column name.\n");
+                return NULL;
+            }
+            Column *column = GetColumn(table, strval);
+            if (!column) {
+                fprintf(stderr, "Unrecognized column name %s\n", strval);
+                return NULL;
+            }
+            if (columns && ColumnInList(columns, column)) {
+                fprintf(stderr, "Duplicate column name %s\n", strval);
+                return NULL;
+            }
+            ColumnList *entry = (ColumnList*) malloc(sizeof(ColumnList));
+            entry->column = column;
+            entry->next = NULL;
+            if (tail) {
+                tail->next = entry;
+            } else {
+                columns = entry;
+            }
+            tail = entry;
+            column_count++;
+            token = ParseToken(query, index);
+            if (token == tok_rightparen) break;
+            if (token != tok_comma) {
+                fprintf(stderr, "Expected comma or right parenthesis.\n");
+                return NULL;
+            }
+        }
+        token = ParseToken(query, index);
+    } else {
+        // all columns in the order of the table file (table->columns is stored in reverse)
+        for(Column *column = table->columns; column; column = column->next) {
+            ColumnList *entry = (ColumnList*) malloc(sizeof(ColumnList));
+            entry->column = column;
+            entry->next = columns;
+            columns = entry;
+            column_count++;
+        }
+    }
+    if (token != tok_values) {
+        fprintf(stderr, "Expected VALUES.\n");
+        return NULL;
+    }
+    parsed_query->columns = columns;
+    size_t capacity = column_count * 16;
+    parsed_query->values = (InsertValue*) malloc(capacity * sizeof(InsertValue));
+    parsed_query->rows = 0;
+    while(true) {
+        if (ParseToken(query, index) != tok_leftparen) {
+            fprintf(stderr, "Expected left parenthesis.\n");
+            return NULL;
+        }
+        if ((parsed_query->rows + 1) * column_count > capacity) {
+            capacity *= 2;
+            parsed_query->values = (InsertValue*) realloc(parsed_query->values, capacity * sizeof(InsertValue));
+        }
+        ColumnList *list = columns;
+        for(size_t i = 0; i < column_count; i++, list = list->next) {
+            if (i > 0 && ParseToken(query, index) != tok_comma) {
+                fprintf(stderr, "Expected %zu values.\n", column_count);
+                return NULL;
+            }
+            if (!ParseInsertValue(query, index, list->column, &parsed_query->values[parsed_query->rows * column_count + i])) {
+                return NULL;
+            }
+        }
+        if (ParseToken(query, index) != tok_rightparen) {
+            fprintf(stderr, "Expected right parenthesis after %zu values.\n", column_count);
+            return NULL;
+        }
+        parsed_query->rows++;
+        token = ParseToken(query, index);
+        if (token == tok_eof) break;
+        if (token != tok_comma) {
+            fprintf(stderr, "Unexpected token %s\n", TokToString(token));
+            return NULL;
+        }
+    }
+    return parsed_query;
+}
+
+// Returns the aggregate with the given name (in any case), or 0 if there is no such aggregate
+static int GetAggregateType(const char *name) {
+    if (strcasecmp(name, "COUNT") == 0) return AGGREGATE_count;
+    if (strcasecmp(name, "SUM") == 0) return AGGREGATE_sum;
+    if (strcasecmp(name, "AVG") == 0) return AGGREGATE_avg;
+    if (strcasecmp(name, "MIN") == 0) return AGGREGATE_min;
+    if (strcasecmp(name, "MAX") == 0) return AGGREGATE_max;
+    return 0;
+}
+
+// Parses a SELECT expression that is an aggregate: COUNT(*), COUNT(expr), SUM(expr), AVG(expr), MIN(expr) or MAX(expr)
+// Returns the expression that is aggregated, or NULL without consuming any tokens if the SELECT expression is not an
+// aggregate (e.g. the function min(x, y)). Sets *error if the aggregate could not be parsed.
+static Operation *ParseAggregate(char *query, size_t *index, int *aggregate, bool *error) {
+    size_t start = *index;
+    int type = ParseToken(query, index) == tok_identifier ? GetAggregateType(strval) : 0;
+    if (!type || ParseToken(query, index) != tok_leftparen) {
+        *index = start;
+        return NULL;
+    }
+    Operation *op;
+    if (type == AGGREGATE_count && PeekToken(query, index) == tok_operator && strcmp(strval, "*") == 0) {
+        // COUNT(*) counts the qualifying rows
+        ParseToken(query, index);
+        op = CreateConstantOperation(1);
+    } else {
+        op = ParseOperation(query, index);
+        if (!op) {
+            *error = true;
+            return NULL;
+        }
+    }
+    if (ParseToken(query, index) != tok_rightparen) {
+        *index = start;
+        return NULL;
+    }
+    Token token = PeekToken(query, index);
+    if (token != tok_from && token != tok_eof) {
+        fprintf(stderr, "Aggregates can not be combined with other expressions.\n");
+        *error = true;
+        return NULL;
+    }
+    *aggregate = type;
+    return op;
+}
+
+// Parses the rest of TABLESAMPLE (p [PERCENT]) [REPEATABLE (seed)], joins can not be sampled
+static bool ParseTableSample(char *query, size_t *index, Query *parsed_query) {
+    if (ParseToken(query, index) != tok_leftparen || ParseToken(query, index) != tok_constant) {
+        fprintf(stderr, "Expected (p PERCENT) after TABLESAMPLE.\n");
+        return false;
+    }
+    if (numval <= 0 || numval > 100) {
+        fprintf(stderr, "The sample percentage must be in (0, 100].\n");
+        return false;
+    }
+    parsed_query->sample = numval;
+    if (PeekToken(query, index) == tok_percent) {
+        ParseToken(query, index);
+    }
+    if (ParseToken(query, index) != tok_rightparen) {
+        fprintf(stderr, "Expected right parenthesis.\n");
+        return false;
+    }
+    if (PeekToken(query, index) == tok_repeatable) {
+        ParseToken(query, index);
+        if (ParseToken(query, index) != tok_leftparen || ParseToken(query, index) != tok_constant ||
+            numval != (double) (lng) numval || ParseToken(query, index) != tok_rightparen) {
+            fprintf(stderr, "Expected (seed) after REPEATABLE.\n");
+            return false;
+        }
+        parsed_query->sample_seed = (lng) numval;
+    }
+    return true;
+}
+
 static Query *ParseQuery(char* query) {
-    // we only accept queries in the form SELECT [expr] FROM table WHERE [expr]
+    // we only accept queries in the form [PROFILE] SELECT [expr] FROM table [JOIN table ON [expr] | TABLESAMPLE (p)] WHERE [expr] ORDER BY [expr] LIMIT n OPTIMIZE profile
+    // or COPY table FROM 'file.csv', or INSERT INTO table VALUES (...), or SET OPTIMIZE profile,
+    // or CREATE INDEX [name] ON table (column, ...)
     Query *parsed_query = (Query*) malloc(sizeof(Query));
-    Table *table;
+    Table *table, *join_table = NULL;
+    parsed_query->type = QUERY_select;
+    parsed_query->text = strdup(query);
     parsed_query->select = NULL;
     parsed_query->table = NULL;
     parsed_query->where = NULL;
+    parsed_query->columns = NULL;
+    parsed_query->aggregate = 0;
+    parsed_query->sample = 0;
+    parsed_query->sample_seed = -1;
+    parsed_query->join_table = NULL;
+    parsed_query->join_condition = NULL;
+    parsed_query->order = NULL;
+    parsed_query->descending = false;
+    parsed_query->limit = -1;
+    parsed_query->optimize = NULL;
+    parsed_query->profile = false;
+    parsed_query->file = NULL;
+    parsed_query->values = NULL;
+    parsed_query->rows = 0;
+    parsed_query->layout = LAYOUT_columnar;
     bool select_all = false;
     size_t index = 0;
     Token token;
     char state = tok_invalid;
+    if (PeekToken(query, &index) == tok_copy) {
+        ParseToken(query, &index);
+        return ParseCopy(query, &index, parsed_query);
+    }
+    if (PeekToken(query, &index) == tok_insert) {
+        ParseToken(query, &index);
+        return ParseInsert(query, &index, parsed_query);
+    }
+    if (PeekToken(query, &index) == tok_set) {
+        ParseToken(query, &index);
+        return ParseSet(query, &index, parsed_query);
+    }
+    if (PeekToken(query, &index) == tok_create) {
+        ParseToken(query, &index);
+        return ParseCreateIndex(query, &index, parsed_query);
+    }
+    if (PeekToken(query, &index) == tok_alter) {
+        ParseToken(query, &index);
+        return ParseAlterTable(query, &index, parsed_query);
+    }
+    if (PeekToken(query, &index) == tok_profile) {
+        ParseToken(query, &index);
+        parsed_query->profile = true;
+    }
     while((token = ParseToken(query, &index)) < tok_invalid) {
         switch(token) {
             case tok_select:
@@ -459,7 +1249,14 @@ static Query *ParseQuery(char* query) {
                     ParseToken(query, &index);
                     select_all = true;
                 } else {
-                    parsed_query->select = ParseOperationList(query, &index)->operation;
+                    bool error = false;
+                    parsed_query->select = ParseAggregate(query, &index, &parsed_query->aggregate, &error);
+                    if (error) {
+                        return NULL;
+                    }
+                    if (!parsed_query->select) {
+                        parsed_query->select = ParseOperationList(query, &index)->operation;
+                    }
                     if (parsed_query->select == NULL) {
                         return NULL;
                     }
@@ -483,6 +1280,40 @@ static Query *ParseQuery(char* query) {
                     fprintf(stderr, "Unrecognized table: %s\n", parsed_query->table);
                     return NULL;
                 }
+                // FROM a JOIN b ON [expr] or FROM a, b (with the join condition in the WHERE clause)
+                token = PeekToken(query, &index);
+                if (token == tok_join || token == tok_comma) {
+                    ParseToken(query, &index);
+                    if (ParseToken(query, &index) != tok_identifier) {
+                        fprintf(stderr, "Expected table name after %s.\n", TokToString(token));
+                        return NULL;
+                    }
+                    parsed_query->join_table = strdup(strval);
+                    join_table = GetTable(parsed_query->join_table);
+                    if (join_table == NULL) {
+                        fprintf(stderr, "Unrecognized table: %s\n", parsed_query->join_table);
+                        return NULL;
+                    }
+                    if (join_table == table) {
+                        fprintf(stderr, "Self-joins are not supported.\n");
+                        return NULL;
+                    }
+                    if (token == tok_join) {
+                        if (ParseToken(query, &index) != tok_on) {
+                            fprintf(stderr, "Expected ON after JOIN %s.\n", parsed_query->join_table);
+                            return NULL;
+                        }
+                        parsed_query->join_condition = ParseOperation(query, &index);
+                        if (parsed_query->join_condition == NULL) {
+                            return NULL;
+                        }
+                    }
+                } else if (token == tok_tablesample) {
+                    ParseToken(query, &index);
+                    if (!ParseTableSample(query, &index, parsed_query)) {
+                        return NULL;
+                    }
+                }
                 break;
             case tok_where:
             {
@@ -504,6 +1335,49 @@ static Query *ParseQuery(char* query) {
                 parsed_query->where = collection->operation;
                 break;
             }
+            case tok_order:
+                if (state != tok_from && state != tok_where) {
+                    fprintf(stderr, "Unexpected ORDER.\n");
+                    return NULL;
+                }
+                state = tok_order;
+                if (ParseToken(query, &index) != tok_by) {
+                    fprintf(stderr, "Expected BY after ORDER.\n");
+                    return NULL;
+                }
+                parsed_query->order = ParseOperation(query, &index);
+                if (parsed_query->order == NULL) {
+                    return NULL;
+                }
+                token = PeekToken(query, &index);
+                if (token == tok_asc || token == tok_desc) {
+                    ParseToken(query, &index);
+                    parsed_query->descending = token == tok_desc;
+                }
+                break;
+            case tok_limit:
+                if (state != tok_from && state != tok_where && state != tok_order) {
+                    fprintf(stderr, "Unexpected LIMIT.\n");
+                    return NULL;
+                }
+                state = tok_limit;
+                if (ParseToken(query, &index) != tok_constant || numval != (double) (lng) numval) {
+                    fprintf(stderr, "Expected a number of rows after LIMIT.\n");
+                    return NULL;
+                }
+                parsed_query->limit = (lng) numval;
+                break;
+            case tok_optimize:
+                if (state != tok_from && state != tok_where && state != tok_order && state != tok_limit) {
+                    fprintf(stderr, "Unexpected OPTIMIZE.\n");
+                    return NULL;
+                }
+                state = tok_optimize;
+                parsed_query->optimize = ParseProfileName(query, &index);
+                if (!parsed_query->optimize) {
+                    return NULL;
+                }
+                break;
             default:
                 fprintf(stderr, "Unexpected token %s\n", TokToString(token));
                 return NULL;
@@ -515,38 +1389,98 @@ static Query *ParseQuery(char* query) {
         free(parsed_query);
         return NULL;
     }
+    if (parsed_query->aggregate && parsed_query->order) {
+        fprintf(stderr, "ORDER BY is not supported for aggregates.\n");
+        return NULL;
+    }
     if (select_all) {
         // get all table columns
         parsed_query->select = SelectStarFromTable(GetTable(parsed_query->table))->operation;
     }
-    ColumnList *select_columns = GetColumns(table, parsed_query->select);
+    ColumnList *select_columns = GetColumns(table, join_table, parsed_query->select);
     if (select_columns == NULL) {
         return NULL;
     }
     ColumnList *where_columns = NULL;
     if (parsed_query->where != NULL) {
-        where_columns = GetColumns(table, parsed_query->where);
+        where_columns = GetColumns(table, join_table, parsed_query->where);
         if (where_columns == NULL) {
             return NULL;
         }
     }
     parsed_query->columns = UnionColumns(select_columns, where_columns);
+    if (parsed_query->join_condition != NULL) {
+        ColumnList *join_columns = GetColumns(table, join_table, parsed_query->join_condition);
+        if (join_columns == NULL) {
+            return NULL;
+        }
+        parsed_query->columns = UnionColumns(parsed_query->columns, join_columns);
+    }
+    if (parsed_query->order != NULL) {
+        ColumnList *order_columns = GetColumns(table, join_table, parsed_query->order);
+        if (order_columns == NULL) {
+            return NULL;
+        }
+        parsed_query->columns = UnionColumns(parsed_query->columns, order_columns);
+    }
     return parsed_query;
 }
 
+// Finds the column a (possibly qualified) column name refers to
+// join_table is NULL for queries on a single table
+static Column *
+ResolveColumn(Table *table, Table *join_table, const char *name, Table **column_table) {
+    const char *dot = strchr(name, '.');
+    if (dot) {
+        // qualified name: table.column
+        char *table_name;
+        create_substring(&table_name, (char*) name, 0, dot - name);
+        Table *qualified = NULL;
+        if (strcmp(table_name, table->name) == 0) {
+            qualified = table;
+        } else if (join_table && strcmp(table_name, join_table->name) == 0) {
+            qualified = join_table;
+        }
+        free(table_name);
+        if (!qualified) return NULL;
+        *column_table = qualified;
+        return GetColumn(qualified, (char*) dot + 1);
+    }
+    Column *column = GetColumn(table, (char*) name);
+    Column *join_column = join_table ? GetColumn(join_table, (char*) name) : NULL;
+    if (column && join_column) {
+        fprintf(stderr, "Ambiguous column name %s\n", name);
+        return NULL;
+    }
+    *column_table = column ? table : join_table;
+    return column ? column : join_column;
+}
+
 bool
-_GetColumns(Table *table, Operation *op, ColumnList *current) {
+_GetColumns(Table *table, Table *join_table, Operation *op, ColumnList *current) {
     if (!op) return true;
     if (op->type== OPTYPE_binop) {
-        return _GetColumns(table, ((BinaryOperation*)op)->left, current) && _GetColumns(table, ((BinaryOperation*)op)->right, current);
+        return _GetColumns(table, join_table, ((BinaryOperation*)op)->left, current) && _GetColumns(table, join_table, ((BinaryOperation*)op)->right, current);
+    } else if (op->type == OPTYPE_func) {
+        FunctionOperation *function = (FunctionOperation*) op;
+        for(size_t i = 0; i < function->argument_count; i++) {
+            if (!_GetColumns(table, join_table, function->arguments[i], current)) return false;
+        }
+        return true;
+    } else if (op->type == OPTYPE_case) {
+        CaseOperation *case_op = (CaseOperation*) op;
+        for(size_t i = 0; i < case_op->count; i++) {
+            if (!_GetColumns(table, join_table, case_op->conditions[i], current)) return false;
+            if (!_GetColumns(table, join_table, case_op->results[i], current)) return false;
+        }
+        return _GetColumns(table, join_table, case_op->otherwise, current);
     } else if (op->type == OPTYPE_colmn) {
-        Column *column = GetColumn(table, ((ColumnOperation*)op)->name);
+        Column *column = ResolveColumn(table, join_table, ((ColumnOperation*)op)->name, &table);
         if (!column) {
             fprintf(stderr, "Unrecognized column name %s\n", ((ColumnOperation*)op)->name);
             return false; //unrecognized column
         }
-        // this column is used in a query, read the column data into memory if it is not already there
-        ReadColumnData(column);
+        ((ColumnOperation*)op)->table = table;
         ((ColumnOperation*)op)->column = column;
         for(; current->next != NULL; current = current->next)  {
             if (current->column == column) return true;
@@ -565,11 +1499,11 @@ _GetColumns(Table *table, Operation *op, ColumnList *current) {
 }
 
 static ColumnList*
-GetColumns(Table *table, Operation *op) {
+GetColumns(Table *table, Table *join_table, Operation *op) {
     ColumnList *list = (ColumnList*) malloc(sizeof(ColumnList));
     list->column = NULL;
     list->next = NULL;
-    if (!_GetColumns(table, op, list)) return NULL; //unrecognized column
+    if (!_GetColumns(table, join_table, op, list)) return NULL; //unrecognized column
     return list;
 }
 
@@ -0,0 +1,209 @@
+
+
+#ifndef _PASSES_H_
+#define _PASSES_H_
+
+// Optimization profiles: the pass pipeline that is run on the generated code of a query
+//   none:   no passes, and code generation without optimizations (the default)
+//   fast:   a few cheap passes that clean up the generated loops, for short queries where compile time dominates
+//   full:   the full pipeline (-opt)
+//   custom: a comma-separated list of passes, e.g. 'mem2reg,instcombine,loop-vectorize'
+// The default profile is set with -opt or -opt-profile, a session can change it with SET OPTIMIZE profile and a
+// single query with a trailing OPTIMIZE profile clause.
+// PROFILE SELECT ... runs every pass of the pipeline on its own, and prints the time it took and how it changed
+// the amount of instructions of the query.
+
+typedef void (*AddPassFunction)(LLVMPassManagerRef);
+
+typedef struct {
+    const char *name;
+    AddPassFunction add;
+} PassInfo;
+
+static PassInfo available_passes[] = {
+    { "adce", LLVMAddAggressiveDCEPass },
+    { "bdce", LLVMAddBitTrackingDCEPass },
+    { "correlated-propagation", LLVMAddCorrelatedValuePropagationPass },
+    { "dce", LLVMAddDCEPass },
+    { "dse", LLVMAddDeadStoreEliminationPass },
+    { "early-cse", LLVMAddEarlyCSEPass },
+    { "gvn", LLVMAddGVNPass },
+    { "indvars", LLVMAddIndVarSimplifyPass },
+    { "instcombine", LLVMAddInstructionCombiningPass },
+    { "instsimplify", LLVMAddInstructionSimplifyPass },
+    { "jump-threading", LLVMAddJumpThreadingPass },
+    { "licm", LLVMAddLICMPass },
+    { "loop-deletion", LLVMAddLoopDeletionPass },
+    { "loop-idiom", LLVMAddLoopIdiomPass },
+    { "loop-rotate", LLVMAddLoopRotatePass },
+    { "loop-unroll", LLVMAddLoopUnrollPass },
+    { "loop-unswitch", LLVMAddLoopUnswitchPass },
+    { "loop-vectorize", LLVMAddLoopVectorizePass },
+    { "mem2reg", LLVMAddPromoteMemoryToRegisterPass },
+    { "memcpyopt", LLVMAddMemCpyOptPass },
+    { "newgvn", LLVMAddNewGVNPass },
+    { "reassociate", LLVMAddReassociatePass },
+    { "sccp", LLVMAddSCCPPass },
+    { "simplifycfg", LLVMAddCFGSimplificationPass },
+    { "slp-vectorize", LLVMAddSLPVectorizePass },
+    { "sroa", LLVMAddScalarReplAggregatesPass },
+    { "sroa-ssa", LLVMAddScalarReplAggregatesPassSSA },
+    { "tailcallelim", LLVMAddTailCallEliminationPass },
+};
+
+#define MAX_PROFILE_PASSES 128
+
+typedef struct _OptimizationProfile {
+    char *name;
+    size_t passes[MAX_PROFILE_PASSES];  // indices in available_passes
+    size_t pass_count;
+    int codegen_level;                  // optimization level of the code generator of MCJIT
+    char *description;                  // code generator level and passes, part of the key of the code cache
+    struct _OptimizationProfile *next;
+} OptimizationProfile;
+
+// This set of passes was copied from the Julia people (who probably know what they're doing)
+// Julia Passes: https://github.com/JuliaLang/julia/blob/master/src/jitlayers.cpp
+#define FULL_PASSES "simplifycfg,mem2reg,instcombine,sroa,sroa-ssa,instcombine,jump-threading,instcombine," \
+    "reassociate,early-cse,loop-idiom,loop-rotate,licm,loop-unswitch,instcombine,indvars,loop-deletion,loop-unroll," \
+    "loop-vectorize,instcombine,gvn,memcpyopt,sccp,instcombine,slp-vectorize,adce,instcombine"
+#define FAST_PASSES "mem2reg,simplifycfg,early-cse,instcombine,licm"
+
+// all profiles that have been created, they are never freed so queries and sessions can keep pointers to them
+static OptimizationProfile *optimization_profiles = NULL;
+static pthread_mutex_t optimization_profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+static OptimizationProfile *default_profile = NULL;  // NULL means the none profile
+static __thread OptimizationProfile *session_profile = NULL;  // SET OPTIMIZE, NULL means the default profile
+
+// Parses a comma-separated list of passes, returns NULL if the list contains an unknown pass
+static OptimizationProfile *CreateProfile(const char *name, const char *pass_list, int codegen_level) {
+    OptimizationProfile *profile = (OptimizationProfile*) calloc(1, sizeof(OptimizationProfile));
+    profile->name = strdup(name);
+    profile->codegen_level = codegen_level;
+    size_t length = strlen(pass_list);
+    profile->description = (char*) malloc(length + 10);
+    snprintf(profile->description, length + 10, "O%d %s", codegen_level, pass_list);
+    const char *start = pass_list;
+    while (*start) {
+        const char *end = strchr(start, ',');
+        size_t name_length = end ? (size_t) (end - start) : strlen(start);
+        while (name_length > 0 && isspace(*start)) {
+            start++;
+            name_length--;
+        }
+        while (name_length > 0 && isspace(start[name_length - 1])) {
+            name_length--;
+        }
+        size_t pass = 0;
+        size_t pass_total = sizeof(available_passes) / sizeof(PassInfo);
+        while (pass < pass_total && (strlen(available_passes[pass].name) != name_length ||
+            strncmp(available_passes[pass].name, start, name_length) != 0)) {
+            pass++;
+        }
+        if (pass == pass_total || profile->pass_count == MAX_PROFILE_PASSES) {
+            fprintf(stdout, "Unknown optimization pass \"%.*s\".\n", (int) name_length, start);
+            free(profile->name);
+            free(profile->description);
+            free(profile);
+            return NULL;
+        }
+        profile->passes[profile->pass_count++] = pass;
+        if (!end) break;
+        start = end + 1;
+    }
+    return profile;
+}
+
+// Returns the profile none, fast, full or the custom profile with the given list of passes
+// Returns NULL (and prints an error) if the name is not a valid profile
+static OptimizationProfile *GetOptimizationProfile(const char *name) {
+    pthread_mutex_lock(&optimization_profiles_lock);
+    OptimizationProfile *profile = optimization_profiles;
+    while (profile && strcmp(profile->name, name) != 0) {
+        profile = profile->next;
+    }
+    if (!profile) {
+        if (strcmp(name, "none") == 0) {
+            profile = CreateProfile(name, "", 0);
+        } else if (strcmp(name, "fast") == 0) {
+            profile = CreateProfile(name, FAST_PASSES, 1);
+        } else if (strcmp(name, "full") == 0) {
+            profile = CreateProfile(name, FULL_PASSES, 2);
+        } else {
+            profile = CreateProfile(name, name, 2);
+        }
+        if (profile) {
+            profile->next = optimization_profiles;
+            optimization_profiles = profile;
+        }
+    }
+    pthread_mutex_unlock(&optimization_profiles_lock);
+    return profile;
+}
+
+// Returns the profile of the current session
+static OptimizationProfile *SessionProfile(void) {
+    if (session_profile) return session_profile;
+    return default_profile ? default_profile : GetOptimizationProfile("none");
+}
+
+static lng CountInstructions(LLVMModuleRef module) {
+    lng count = 0;
+    for(LLVMValueRef function = LLVMGetFirstFunction(module); function; function = LLVMGetNextFunction(function)) {
+        for(LLVMBasicBlockRef block = LLVMGetFirstBasicBlock(function); block; block = LLVMGetNextBasicBlock(block)) {
+            for(LLVMValueRef instruction = LLVMGetFirstInstruction(block); instruction; instruction = LLVMGetNextInstruction(instruction)) {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+// Runs the passes [first, last) of the profile on all functions of the module
+static void RunPasses(LLVMModuleRef module, OptimizationProfile *profile, size_t first, size_t last) {
+    LLVMPassManagerRef passManager = LLVMCreateFunctionPassManagerForModule(module);
+    LLVMAddTargetMachinePasses(passManager);
+    for(size_t i = first; i < last; i++) {
+        available_passes[profile->passes[i]].add(passManager);
+    }
+    LLVMInitializeFunctionPassManager(passManager);
+    for(LLVMValueRef function = LLVMGetFirstFunction(module); function; function = LLVMGetNextFunction(function)) {
+        if (!LLVMIsDeclaration(function)) {
+            LLVMRunFunctionPassManager(passManager, function);
+        }
+    }
+    LLVMFinalizeFunctionPassManager(passManager);
+    LLVMDisposePassManager(passManager);
+}
+
+static double ElapsedMilliseconds(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Optimizes the module with the passes of the profile
+// If report is set every pass runs on its own, and its time and the change in instructions are printed
+static void OptimizeModule(LLVMModuleRef module, OptimizationProfile *profile, bool report) {
+    if (!report) {
+        if (profile->pass_count > 0) RunPasses(module, profile, 0, profile->pass_count);
+        return;
+    }
+    lng initial = CountInstructions(module), before = initial;
+    double total = 0;
+    fprintf(stdout, "Optimization profile %s (%zu passes)\n", profile->name, profile->pass_count);
+    fprintf(stdout, "  %-24s %10s %14s %8s\n", "Pass", "Time (ms)", "Instructions", "Change");
+    for(size_t i = 0; i < profile->pass_count; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        RunPasses(module, profile, i, i + 1);
+        double elapsed = ElapsedMilliseconds(&start);
+        lng after = CountInstructions(module);
+        fprintf(stdout, "  %-24s %10.3f %14lld %+8lld\n", available_passes[profile->passes[i]].name, elapsed, after, after - before);
+        total += elapsed;
+        before = after;
+    }
+    fprintf(stdout, "  %-24s %10.3f %14lld %+8lld\n", "Total", total, before, before - initial);
+}
+
+#endif
@@ -0,0 +1,203 @@
+
+
+#ifndef _PAX_H_
+#define _PAX_H_
+
+// PAX layout: ALTER TABLE table SET LAYOUT [PAX | COLUMNAR]
+// A PAX table stores its rows in row groups of BUFFER_CHUNK_SIZE rows (the chunks of the buffer manager, and the
+// morsels of a scan) in a single file, Tables/table/data.pax. A row group holds a mini-page with the values of every
+// column (see SetTableLayout in table.h). A row group is read with a single request and its mini-pages are adjacent
+// in memory, so a scan over many columns walks one region instead of keeping a separate stream (and TLB entries)
+// per column. The price is that a row group is always read completely, also the columns a query does not use.
+// The kernels are the same for both layouts: when a morsel is pinned, the pointer to the mini-page of every column
+// is computed from the base of its row group (see PinChunk in buffer.h).
+// PAX tables are read-only, COPY and INSERT ask to convert them back to the columnar layout first. A conversion
+// writes the new files next to the old ones and renames them, then rewrites the .tbl file and removes the old files.
+
+static bool PaxWrite(int fd, const char *data, size_t bytes, off_t offset) {
+    while (bytes > 0) {
+        ssize_t written = pwrite(fd, data, bytes, offset);
+        if (written <= 0) return false;
+        data += written;
+        offset += written;
+        bytes -= written;
+    }
+    return true;
+}
+
+// Returns the columns of a table in the order of the .tbl file (the list is in reverse order)
+static Column **TableColumnArray(Table *table, size_t *count) {
+    *count = 0;
+    for(Column *column = table->columns; column; column = column->next) {
+        (*count)++;
+    }
+    Column **columns = (Column**) malloc((*count + 1) * sizeof(Column*));
+    size_t i = *count;
+    for(Column *column = table->columns; column; column = column->next) {
+        columns[--i] = column;
+    }
+    return columns;
+}
+
+// Writes the row groups of a columnar table to path
+// Must be called while holding the table lock for writing, with the layout already set to PAX (for the offsets)
+static bool WritePaxFile(Table *table, Column **columns, size_t column_count, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("Failed to create file %s.\n", path);
+        return false;
+    }
+    Column *row_groups = table->row_groups;
+    char *buffer = (char*) malloc((size_t) BUFFER_CHUNK_SIZE * row_groups->elsize + 1);
+    bool success = true;
+    for(size_t group = 0; success && group < BufferChunkCount(row_groups->size); group++) {
+        lng rows = BufferChunkRows(row_groups, group);
+        for(size_t i = 0; success && i < column_count; i++) {
+            // the column is still in its own file, which BufferReadChunk reads without the PAX offsets
+            Column column = *columns[i];
+            column.row_groups = NULL;
+            success = BufferReadChunk(&column, group, buffer + rows * columns[i]->pax_offset, rows * columns[i]->elsize);
+        }
+        off_t offset = (off_t) group * BUFFER_CHUNK_SIZE * row_groups->elsize;
+        if (success && !PaxWrite(fd, buffer, rows * row_groups->elsize, offset)) {
+            printf("Failed to write file %s.\n", path);
+            success = false;
+        }
+    }
+    free(buffer);
+    close(fd);
+    return success;
+}
+
+// Writes every column of a PAX table to its own file (at paths)
+// Must be called while holding the table lock for writing
+static bool WriteColumnFiles(Table *table, Column **columns, size_t column_count, char **paths) {
+    Column *row_groups = table->row_groups;
+    int *fds = (int*) malloc((column_count + 1) * sizeof(int));
+    bool success = true;
+    for(size_t i = 0; i < column_count; i++) {
+        fds[i] = success ? open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+        if (success && fds[i] < 0) {
+            printf("Failed to create file %s.\n", paths[i]);
+            success = false;
+        }
+    }
+    char *buffer = (char*) malloc((size_t) BUFFER_CHUNK_SIZE * row_groups->elsize + 1);
+    for(size_t group = 0; success && group < BufferChunkCount(row_groups->size); group++) {
+        lng rows = BufferChunkRows(row_groups, group);
+        success = BufferReadChunk(row_groups, group, buffer, rows * row_groups->elsize);
+        for(size_t i = 0; success && i < column_count; i++) {
+            off_t offset = (off_t) group * BUFFER_CHUNK_SIZE * columns[i]->elsize;
+            if (!PaxWrite(fds[i], buffer + rows * columns[i]->pax_offset, rows * columns[i]->elsize, offset)) {
+                printf("Failed to write file %s.\n", paths[i]);
+                success = false;
+            }
+        }
+    }
+    for(size_t i = 0; i < column_count; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    free(buffer);
+    free(fds);
+    return success;
+}
+
+// Removes the files of a table in the given layout (paths are the files of its columns)
+static void RemoveLayoutFiles(int layout, char **paths, size_t column_count, const char *pax_file) {
+    if (layout == LAYOUT_pax) {
+        unlink(pax_file);
+        return;
+    }
+    for(size_t i = 0; i < column_count; i++) {
+        unlink(paths[i]);
+    }
+}
+
+// Converts the column data of a table to the given layout, returns false if it could not be converted
+// The files of the old layout are only removed once the metadata points to the new ones, so whenever the conversion
+// fails the table keeps (or gets back) its old layout, of which the files are still complete
+static bool ConvertTableLayout(Table *table, int layout) {
+    const char *name = layout == LAYOUT_pax ? "PAX" : "columnar";
+    // the statement does not interleave with a COPY, INSERT or another ALTER TABLE of the table
+    pthread_mutex_lock(&table->writer_lock);
+    Delta *delta = table->delta;
+    if (delta) {
+        // the appended rows are merged into the old layout first, and the merge thread is kept away
+        DeltaMerge(table);
+        pthread_mutex_lock(&delta->merge_lock);
+    }
+    pthread_rwlock_wrlock(&table->lock);
+    // the layout is checked while holding all locks of the table, another conversion can not have started since
+    int old_layout = table->layout;
+    if (old_layout == layout || DeltaRows(table) > 0) {
+        if (old_layout == layout) {
+            fprintf(stdout, "Table %s already has the %s layout.\n", table->name, name);
+        } else {
+            fprintf(stdout, "Rows were appended to table %s during the conversion, try again.\n", table->name);
+        }
+        pthread_rwlock_unlock(&table->lock);
+        if (delta) pthread_mutex_unlock(&delta->merge_lock);
+        pthread_mutex_unlock(&table->writer_lock);
+        return old_layout == layout;
+    }
+    // the chunks of the old layout are dropped, the conversion reads the files directly
+    for(Column *column = table->columns; column; column = column->next) {
+        BufferDropColumn(column);
+    }
+    if (table->row_groups) BufferDropColumn(table->row_groups);
+
+    size_t column_count;
+    Column **columns = TableColumnArray(table, &column_count);
+    char pax_file[500], temporary[520];
+    snprintf(pax_file, 500, "Tables/%s/data.pax", table->name);
+    snprintf(temporary, 520, "%s.tmp", pax_file);
+    char **paths = (char**) calloc(column_count + 1, sizeof(char*));
+    char **temporaries = (char**) calloc(column_count + 1, sizeof(char*));
+    for(size_t i = 0; i < column_count; i++) {
+        size_t length = strlen(columns[i]->data_location) + 5;
+        paths[i] = strdup(columns[i]->data_location);
+        temporaries[i] = (char*) malloc(length);
+        snprintf(temporaries[i], length, "%s.tmp", columns[i]->data_location);
+    }
+    bool success;
+    if (layout == LAYOUT_pax) {
+        // the offsets of the mini-pages are those of the new layout
+        SetTableLayout(table, LAYOUT_pax);
+        success = WritePaxFile(table, columns, column_count, temporary) && rename(temporary, pax_file) == 0;
+        unlink(temporary);
+    } else {
+        success = WriteColumnFiles(table, columns, column_count, temporaries);
+        for(size_t i = 0; success && i < column_count; i++) {
+            success = rename(temporaries[i], paths[i]) == 0;
+        }
+        for(size_t i = 0; i < column_count; i++) {
+            unlink(temporaries[i]);
+        }
+        if (success) SetTableLayout(table, LAYOUT_columnar);
+    }
+    if (success) success = WriteTableMetadata(table);
+    if (success) {
+        RemoveLayoutFiles(old_layout, paths, column_count, pax_file);
+        __atomic_add_fetch(&table->version, 1, __ATOMIC_RELEASE);
+        fprintf(stdout, "Converted table %s to the %s layout (%zu row groups).\n", table->name, name,
+            BufferChunkCount(table->columns ? table->columns->size : 0));
+    } else {
+        // back to the old layout, whose files were not touched; the (partial) files of the new layout are removed
+        SetTableLayout(table, old_layout);
+        RemoveLayoutFiles(layout, paths, column_count, pax_file);
+        fprintf(stdout, "Failed to convert table %s to the %s layout.\n", table->name, name);
+    }
+    pthread_rwlock_unlock(&table->lock);
+    if (delta) pthread_mutex_unlock(&delta->merge_lock);
+    pthread_mutex_unlock(&table->writer_lock);
+    for(size_t i = 0; i < column_count; i++) {
+        free(paths[i]);
+        free(temporaries[i]);
+    }
+    free(paths);
+    free(temporaries);
+    free(columns);
+    return success;
+}
+
+#endif
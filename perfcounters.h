@@ -0,0 +1,166 @@
+
+
+#ifndef _PERFCOUNTERS_H_
+#define _PERFCOUNTERS_H_
+
+// Hardware performance counters per query (-perf-counters)
+// The counters are read with perf_event_open around every phase of a query: compilation, execution (the generated
+// kernels over all morsels) and finishing the result (aggregation, sorting or collecting the outputs). The counters
+// count the thread that runs the phase and the worker threads that it starts (they are inherited), so the execution
+// phase covers the kernels in all workers. After the query a report with the counters of every phase is printed,
+// followed by derived metrics of the execution: instructions per cycle, cycles per tuple and bytes per cycle, and the
+// misses per 1000 tuples. Few instructions per cycle with many cache misses per tuple means the kernel waits for
+// memory, a high IPC means it is bound by computation.
+// Counters that the CPU (or the virtual machine, or perf_event_paranoid) does not provide are reported as "-".
+// Only user space is counted. With shared scans, workers of other queries can run some of the morsels of a query.
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#define PERF_COUNTERS 7
+
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} PerfCounterInfo;
+
+#define PERF_CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static PerfCounterInfo perf_counter_info[PERF_COUNTERS] = {
+    { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "L1D-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    { "LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "dTLB-misses", PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB) },
+};
+
+enum { PERF_task_clock, PERF_cycles, PERF_instructions, PERF_l1d_misses, PERF_llc_misses, PERF_branch_misses, PERF_dtlb_misses };
+
+#define PERF_PHASES 3
+static const char *perf_phase_names[PERF_PHASES] = { "compile", "execute", "finish" };
+enum { PERF_compile, PERF_execute, PERF_finish };
+
+static bool perf_counters_enabled = false;  // -perf-counters
+static bool perf_counters_warned = false;
+
+typedef struct {
+    int fds[PERF_COUNTERS];
+    lng values[PERF_PHASES][PERF_COUNTERS];  // -1 if the counter is not available
+    bool measured[PERF_PHASES];
+} PerfCounters;
+
+// Opens the counters for the calling thread (and the threads it creates), disabled
+static void PerfOpen(PerfCounters *counters) {
+    int error = 0;
+    bool hardware = false;
+    for(size_t i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_counter_info[i].type;
+        attr.config = perf_counter_info[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // the counters are not in a group (inherited counters can not be read as a group), so they can be multiplexed
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (counters->fds[i] < 0) {
+            error = errno;
+        } else if (attr.type != PERF_TYPE_SOFTWARE) {
+            hardware = true;
+        }
+    }
+    if (!hardware && !__atomic_exchange_n(&perf_counters_warned, true, __ATOMIC_RELAXED)) {
+        fprintf(stdout, "Hardware performance counters are not available (%s), only task-clock is reported.\n", strerror(error));
+    }
+}
+
+static void PerfStart(PerfCounters *counters) {
+    for(size_t i = 0; i < PERF_COUNTERS; i++) {
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+// Stops the counters and stores their values (scaled if they were multiplexed) as the values of the phase
+static void PerfStop(PerfCounters *counters, size_t phase) {
+    for(size_t i = 0; i < PERF_COUNTERS; i++) {
+        counters->values[phase][i] = -1;
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t data[3];  // value, time enabled, time running
+        if (read(counters->fds[i], data, sizeof(data)) != sizeof(data)) continue;
+        if (data[2] > 0 && data[2] < data[1]) {
+            data[0] = (uint64_t) ((double) data[0] * data[1] / data[2]);
+        }
+        counters->values[phase][i] = (lng) data[0];
+    }
+    counters->measured[phase] = true;
+}
+
+static void PerfClose(PerfCounters *counters) {
+    for(size_t i = 0; i < PERF_COUNTERS; i++) {
+        if (counters->fds[i] >= 0) close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+}
+
+static void PrintPerfValue(lng value) {
+    if (value < 0) {
+        fprintf(stdout, " %14s", "-");
+    } else {
+        fprintf(stdout, " %14lld", value);
+    }
+}
+
+// Prints the counters of the phases of a query, tuples and bytes are the rows and bytes of the inputs of the kernels
+static void PrintPerfCounters(PerfCounters *counters, lng tuples, lng bytes) {
+    fprintf(stdout, "Performance counters\n");
+    fprintf(stdout, "  %-10s %10s", "Phase", "CPU (ms)");
+    for(size_t i = 1; i < PERF_COUNTERS; i++) {
+        fprintf(stdout, " %14s", perf_counter_info[i].name);
+    }
+    fprintf(stdout, " %6s\n", "IPC");
+    for(size_t phase = 0; phase < PERF_PHASES; phase++) {
+        if (!counters->measured[phase]) continue;
+        lng *values = counters->values[phase];
+        if (values[PERF_task_clock] < 0) {
+            fprintf(stdout, "  %-10s %10s", perf_phase_names[phase], "-");
+        } else {
+            fprintf(stdout, "  %-10s %10.3f", perf_phase_names[phase], values[PERF_task_clock] / 1000000.0);
+        }
+        for(size_t i = 1; i < PERF_COUNTERS; i++) {
+            PrintPerfValue(values[i]);
+        }
+        if (values[PERF_cycles] > 0 && values[PERF_instructions] >= 0) {
+            fprintf(stdout, " %6.2f\n", (double) values[PERF_instructions] / values[PERF_cycles]);
+        } else {
+            fprintf(stdout, " %6s\n", "-");
+        }
+    }
+    if (!counters->measured[PERF_execute]) return;
+    lng *values = counters->values[PERF_execute];
+    fprintf(stdout, "  execute: %lld tuples, %.1f MB", tuples, bytes / (1024.0 * 1024.0));
+    if (values[PERF_task_clock] > 0) {
+        fprintf(stdout, ", %.2f CPU ns/tuple", tuples > 0 ? (double) values[PERF_task_clock] / tuples : 0.0);
+    }
+    if (values[PERF_cycles] > 0) {
+        fprintf(stdout, ", %.2f cycles/tuple, %.2f bytes/cycle", tuples > 0 ? (double) values[PERF_cycles] / tuples : 0.0,
+            (double) bytes / values[PERF_cycles]);
+    }
+    for(size_t i = PERF_l1d_misses; i < PERF_COUNTERS; i++) {
+        if (values[i] >= 0 && tuples > 0) {
+            fprintf(stdout, ", %.2f %s/1000 tuples", values[i] * 1000.0 / tuples, perf_counter_info[i].name);
+        }
+    }
+    fprintf(stdout, "\n");
+}
+
+#endif
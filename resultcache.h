@@ -0,0 +1,216 @@
+
+
+#ifndef _RESULTCACHE_H_
+#define _RESULTCACHE_H_
+
+// Query result cache
+// The results of SELECT queries are cached in memory, keyed by the normalized text of the query (see
+// NormalizeQueryText) and the versions of the tables it reads. The version of a table is bumped by every COPY and
+// INSERT, so a result of an older version is never returned (it is dropped when it is found). A cached result is
+// returned without compiling the query or reading any column data.
+// Results are only admitted if computing them took at least -result-cache-min-cost milliseconds (compilation and
+// execution), so cheap queries do not push out expensive ones. Once the results exceed -result-cache-size the least
+// recently used results are evicted. Queries over a random sample (TABLESAMPLE without REPEATABLE) and PROFILE
+// queries are not cached. The cache holds its own copy of every result, callers own the tables they get.
+// The entries are found through a hash map on the normalized text, and kept in a list in LRU order for eviction.
+
+static bool result_cache_enabled = true;
+static size_t result_cache_size = 64 * 1024 * 1024;
+static double result_cache_min_cost = 1.0;  // milliseconds
+static lng result_cache_hits = 0;
+static lng result_cache_misses = 0;
+
+typedef struct _ResultCacheEntry {
+    char *key;                  // the normalized text of the query
+    Table *tables[2];           // the tables the query reads (the second one is NULL without a join)
+    lng versions[2];            // their versions when the query ran
+    Table *result;
+    size_t size;                // bytes of result data
+    double cost;                // milliseconds it took to compute the result
+    struct _ResultCacheEntry *prev, *next;
+} ResultCacheEntry;
+
+typedef struct {
+    HashMap *entries;               // normalized text -> entry
+    ResultCacheEntry *head, *tail;  // most recently used first
+    size_t size;
+    pthread_mutex_t lock;
+} ResultCache;
+
+static ResultCache result_cache = { NULL, NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static bool IsWordCharacter(char c) {
+    return isalnum(c) || c == '_' || c == '.' || c == '\'';
+}
+
+// Normalizes the text of a query: whitespace is collapsed into a single space between words and removed elsewhere,
+// a trailing ; is removed. Quoted strings are kept as they are
+static char *NormalizeQueryText(const char *text) {
+    char *normalized = (char*) malloc(strlen(text) + 1);
+    size_t length = 0;
+    bool quoted = false, space = false;
+    for(const char *ptr = text; *ptr; ptr++) {
+        if (!quoted && isspace(*ptr)) {
+            space = true;
+            continue;
+        }
+        if (space && length > 0 && IsWordCharacter(normalized[length - 1]) && IsWordCharacter(*ptr)) {
+            normalized[length++] = ' ';
+        }
+        space = false;
+        if (*ptr == '\'') quoted = !quoted;
+        normalized[length++] = *ptr;
+    }
+    while (length > 0 && normalized[length - 1] == ';') length--;
+    normalized[length] = '\0';
+    return normalized;
+}
+
+// Gets the tables of a query and their current versions, returns false if the result of the query can not be cached
+static bool ResultCacheTables(Query *query, Table **tables, lng *versions) {
+    if (!result_cache_enabled || !query->text || query->type != QUERY_select || query->profile) return false;
+    // without a seed every execution scans a different sample
+    if (query->sample > 0 && query->sample_seed < 0) return false;
+    tables[0] = GetTable(query->table);
+    tables[1] = query->join_table ? GetTable(query->join_table) : NULL;
+    if (!tables[0] || (query->join_table && !tables[1])) return false;
+    for(size_t i = 0; i < 2; i++) {
+        versions[i] = tables[i] ? __atomic_load_n(&tables[i]->version, __ATOMIC_ACQUIRE) : 0;
+    }
+    return true;
+}
+
+static size_t ResultSize(Table *result) {
+    size_t size = sizeof(Table);
+    for(Column *column = result->columns; column; column = column->next) {
+        size += sizeof(Column) + column->size * column->elsize;
+    }
+    return size;
+}
+
+static Table *CopyResult(Table *result) {
+    Column *columns = NULL, *tail = NULL;
+    for(Column *column = result->columns; column; column = column->next) {
+        size_t size = column->size * column->elsize;
+        void *data = malloc(size > 0 ? size : 1);
+        memcpy(data, column->data, size);
+        Column *copy = CreateColumn((double*) data, column->size);
+        copy->type = column->type;
+        copy->elsize = column->elsize;
+        free(copy->name);
+        copy->name = strdup(column->name);
+        if (tail) {
+            tail->next = copy;
+        } else {
+            columns = copy;
+        }
+        tail = copy;
+    }
+    return CreateTable(result->name, columns);
+}
+
+// Must be called while holding the lock of the cache
+static void ResultCacheUnlink(ResultCacheEntry *entry) {
+    if (entry->prev) entry->prev->next = entry->next; else result_cache.head = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else result_cache.tail = entry->prev;
+    result_cache.size -= entry->size;
+}
+
+// Must be called while holding the lock of the cache
+static void ResultCachePushFront(ResultCacheEntry *entry) {
+    entry->prev = NULL;
+    entry->next = result_cache.head;
+    if (result_cache.head) result_cache.head->prev = entry; else result_cache.tail = entry;
+    result_cache.head = entry;
+    result_cache.size += entry->size;
+}
+
+static void ResultCacheFree(ResultCacheEntry *entry) {
+    FreeResult(entry->result);
+    free(entry->key);
+    free(entry);
+}
+
+// Must be called while holding the lock of the cache, returns the entry of the key or NULL
+static ResultCacheEntry *ResultCacheFind(const char *key) {
+    if (!result_cache.entries) result_cache.entries = HashMapCreate(64);
+    return (ResultCacheEntry*) HashMapGet(result_cache.entries, key);
+}
+
+// Must be called while holding the lock of the cache, the caller frees the entry
+static void ResultCacheRemove(ResultCacheEntry *entry) {
+    ResultCacheUnlink(entry);
+    HashMapRemove(result_cache.entries, entry->key);
+}
+
+// Returns a copy of the cached result of the query, or NULL if it is not cached (or the tables have changed)
+static Table *ResultCacheLookup(Query *query) {
+    Table *tables[2];
+    lng versions[2];
+    if (!ResultCacheTables(query, tables, versions)) return NULL;
+    char *key = NormalizeQueryText(query->text);
+    Table *result = NULL;
+    ResultCacheEntry *stale = NULL;
+    pthread_mutex_lock(&result_cache.lock);
+    ResultCacheEntry *entry = ResultCacheFind(key);
+    if (entry) {
+        if (entry->tables[0] == tables[0] && entry->versions[0] == versions[0] &&
+            entry->tables[1] == tables[1] && entry->versions[1] == versions[1]) {
+            ResultCacheUnlink(entry);
+            ResultCachePushFront(entry);
+            result = CopyResult(entry->result);
+        } else {
+            ResultCacheRemove(entry);
+            stale = entry;
+        }
+    }
+    if (result) {
+        result_cache_hits++;
+    } else {
+        result_cache_misses++;
+    }
+    pthread_mutex_unlock(&result_cache.lock);
+    if (stale) ResultCacheFree(stale);
+    free(key);
+    return result;
+}
+
+// Adds the result of a query to the cache, if it was expensive enough and fits
+// versions are the versions of the tables before the query ran (see ResultCacheTables)
+static void ResultCacheInsert(Query *query, Table **tables, lng *versions, Table *result, double cost) {
+    if (!result || cost < result_cache_min_cost) return;
+    size_t size = ResultSize(result);
+    if (size > result_cache_size) return;
+    ResultCacheEntry *entry = (ResultCacheEntry*) malloc(sizeof(ResultCacheEntry));
+    entry->key = NormalizeQueryText(query->text);
+    memcpy(entry->tables, tables, sizeof(entry->tables));
+    memcpy(entry->versions, versions, sizeof(entry->versions));
+    entry->result = CopyResult(result);
+    entry->size = size;
+    entry->cost = cost;
+
+    ResultCacheEntry *evicted = NULL;
+    pthread_mutex_lock(&result_cache.lock);
+    ResultCacheEntry *existing = ResultCacheFind(entry->key);
+    if (existing) {
+        ResultCacheRemove(existing);
+        existing->next = evicted;
+        evicted = existing;
+    }
+    ResultCachePushFront(entry);
+    HashMapInsert(result_cache.entries, entry->key, entry);
+    while (result_cache.size > result_cache_size) {
+        ResultCacheEntry *last = result_cache.tail;
+        ResultCacheRemove(last);
+        last->next = evicted;
+        evicted = last;
+    }
+    pthread_mutex_unlock(&result_cache.lock);
+    while (evicted) {
+        ResultCacheEntry *next = evicted->next;
+        ResultCacheFree(evicted);
+        evicted = next;
+    }
+}
+
+#endif
@@ -0,0 +1,236 @@
+
+
+#ifndef _SCRIPT_H_
+#define _SCRIPT_H_
+
+// Script mode: -f script.sql runs the statements of a file in order, and exits
+// The file is split into statements (separated by ;, -- starts a comment) before anything runs. While a statement
+// runs, SCRIPT_COMPILE_THREADS background threads parse and compile the SELECT statements after it (up to
+// SCRIPT_COMPILE_AHEAD statements ahead), so compilation is not on the critical path of the script.
+// COPY, INSERT, SET, CREATE INDEX and ALTER TABLE change the tables or the session, so the statements after them are only
+// compiled once they have run. Every statement reports how long it was compiled, how long the script waited for its
+// compilation and how long it ran; the totals are reported at the end.
+
+#define SCRIPT_COMPILE_THREADS 2
+#define SCRIPT_COMPILE_AHEAD 8
+
+typedef struct _PreparedQuery PreparedQuery;
+static PreparedQuery *PrepareQuery(Query *query);
+static Table *RunPreparedQuery(PreparedQuery *prepared);
+
+static char *script_file = NULL;
+
+typedef struct {
+    char *text;
+    bool compiled_ahead;      // SELECT statements are compiled by the background threads
+    bool ready;               // the background compilation has finished
+    PreparedQuery *prepared;  // the compiled query, or NULL if it could not be parsed or compiled
+    double compile_ms;
+} ScriptStatement;
+
+typedef struct {
+    ScriptStatement *statements;
+    size_t count;
+    size_t next;      // next statement that has to be compiled
+    size_t executed;  // amount of statements that have run
+    OptimizationProfile *profile;  // set by SET OPTIMIZE in the script, NULL for the default profile
+    size_t thread_count;           // threads used by every query
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Script;
+
+// Splits the text of a script into statements, returns the amount of statements
+static size_t SplitScript(char *text, ScriptStatement **statements) {
+    size_t count = 0, capacity = 16;
+    *statements = (ScriptStatement*) malloc(capacity * sizeof(ScriptStatement));
+    char *start = text;
+    bool quoted = false;
+    for(char *ptr = text; ; ptr++) {
+        if (*ptr == '\'') {
+            quoted = !quoted;
+        } else if (!quoted && ptr[0] == '-' && ptr[1] == '-') {
+            // comments are replaced by spaces
+            while (*ptr && *ptr != '\n') {
+                *ptr++ = ' ';
+            }
+        }
+        if (*ptr != '\0' && (quoted || *ptr != ';')) continue;
+        bool end = *ptr == '\0';
+        *ptr = '\0';
+        while (isspace(*start)) start++;
+        if (*start) {
+            if (count == capacity) {
+                capacity *= 2;
+                *statements = (ScriptStatement*) realloc(*statements, capacity * sizeof(ScriptStatement));
+            }
+            ScriptStatement *statement = &(*statements)[count++];
+            memset(statement, 0, sizeof(ScriptStatement));
+            statement->text = start;
+            size_t index = 0;
+            Token token = PeekToken(start, &index);
+            statement->compiled_ahead = token == tok_select || token == tok_profile;
+        }
+        if (end) break;
+        start = ptr + 1;
+    }
+    return count;
+}
+
+static void *ScriptCompileThread(void *arg) {
+    Script *script = (Script*) arg;
+    pthread_mutex_lock(&script->lock);
+    while (true) {
+        // statements after a statement that has not run yet can depend on it
+        while (script->next < script->count && !script->statements[script->next].compiled_ahead &&
+            script->next < script->executed) {
+            script->next++;
+        }
+        if (script->next == script->count) break;
+        if (!script->statements[script->next].compiled_ahead || script->next >= script->executed + SCRIPT_COMPILE_AHEAD) {
+            pthread_cond_wait(&script->changed, &script->lock);
+            continue;
+        }
+        ScriptStatement *statement = &script->statements[script->next++];
+        session_profile = script->profile;
+        pthread_mutex_unlock(&script->lock);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        Query *query = ParseQuery(statement->text);
+        PreparedQuery *prepared = query ? PrepareQuery(query) : NULL;
+        double elapsed = ElapsedMilliseconds(&start);
+
+        pthread_mutex_lock(&script->lock);
+        statement->prepared = prepared;
+        statement->compile_ms = elapsed;
+        statement->ready = true;
+        pthread_cond_broadcast(&script->changed);
+    }
+    pthread_mutex_unlock(&script->lock);
+    return NULL;
+}
+
+// Runs a statement that is not compiled ahead (COPY, INSERT, SET, CREATE INDEX or ALTER TABLE),
+// returns false if it could not be parsed or failed
+static bool RunScriptStatement(Script *script, ScriptStatement *statement) {
+    Query *query = ParseQuery(statement->text);
+    if (!query) return false;
+    if (query->type == QUERY_copy) {
+        return CopyTable(query->table, query->file, script->thread_count) != NULL;
+    } else if (query->type == QUERY_set) {
+        OptimizationProfile *profile = GetOptimizationProfile(query->optimize);
+        if (!profile) return false;
+        pthread_mutex_lock(&script->lock);
+        script->profile = profile;
+        pthread_mutex_unlock(&script->lock);
+        fprintf(stdout, "Optimization profile set to %s.\n", profile->name);
+    } else if (query->type == QUERY_insert) {
+        Table *table = GetTable(query->table);
+        if (!DeltaAppend(table, query->columns, query->values, query->rows)) return false;
+        fprintf(stdout, "Inserted %lld rows into table %s.\n", query->rows, table->name);
+    } else if (query->type == QUERY_index) {
+        return CreateImprints(GetTable(query->table), query->columns);
+    } else if (query->type == QUERY_layout) {
+        return ConvertTableLayout(GetTable(query->table), query->layout);
+    }
+    return true;
+}
+
+// Runs all statements of the script file, returns false if the file could not be read
+static bool RunScript(const char *path, size_t thread_count, bool print_result) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stdout, "Failed to open script %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    size_t length = 0, capacity = 4096;
+    char *text = (char*) malloc(capacity);
+    size_t read;
+    while ((read = fread(text + length, 1, capacity - length - 1, file)) > 0) {
+        length += read;
+        if (length + 1 == capacity) {
+            capacity *= 2;
+            text = (char*) realloc(text, capacity);
+        }
+    }
+    fclose(file);
+    text[length] = '\0';
+
+    Script script;
+    script.count = SplitScript(text, &script.statements);
+    script.next = 0;
+    script.executed = 0;
+    script.profile = NULL;
+    script.thread_count = thread_count;
+    pthread_mutex_init(&script.lock, NULL);
+    pthread_cond_init(&script.changed, NULL);
+    pthread_t threads[SCRIPT_COMPILE_THREADS];
+    for(size_t i = 0; i < SCRIPT_COMPILE_THREADS; i++) {
+        pthread_create(&threads[i], NULL, ScriptCompileThread, &script);
+    }
+
+    struct timespec script_start;
+    clock_gettime(CLOCK_MONOTONIC, &script_start);
+    double total_compile = 0, total_wait = 0, total_run = 0;
+    size_t failed = 0;
+    for(size_t i = 0; i < script.count; i++) {
+        ScriptStatement *statement = &script.statements[i];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!statement->compiled_ahead) {
+            bool success = RunScriptStatement(&script, statement);
+            double elapsed = ElapsedMilliseconds(&start);
+            if (success) {
+                fprintf(stdout, "[%zu] ran in %.3f ms\n", i + 1, elapsed);
+            } else {
+                fprintf(stdout, "[%zu] failed in %.3f ms: %s\n", i + 1, elapsed, statement->text);
+                failed++;
+            }
+            total_run += elapsed;
+        } else {
+            pthread_mutex_lock(&script.lock);
+            while (!statement->ready) {
+                pthread_cond_wait(&script.changed, &script.lock);
+            }
+            pthread_mutex_unlock(&script.lock);
+            double waited = ElapsedMilliseconds(&start);
+            total_compile += statement->compile_ms;
+            total_wait += waited;
+            if (!statement->prepared) {
+                fprintf(stdout, "[%zu] failed to compile: %s\n", i + 1, statement->text);
+                failed++;
+            } else {
+                clock_gettime(CLOCK_MONOTONIC, &start);
+                Table *result = RunPreparedQuery(statement->prepared);
+                double elapsed = ElapsedMilliseconds(&start);
+                total_run += elapsed;
+                fprintf(stdout, "[%zu] compiled in %.3f ms (waited %.3f ms), ran in %.3f ms\n",
+                    i + 1, statement->compile_ms, waited, elapsed);
+                if (!result) {
+                    failed++;
+                } else {
+                    if (print_result) PrintTable(result);
+                    FreeResult(result);
+                }
+            }
+        }
+        pthread_mutex_lock(&script.lock);
+        script.executed = i + 1;
+        pthread_cond_broadcast(&script.changed);
+        pthread_mutex_unlock(&script.lock);
+    }
+    double total = ElapsedMilliseconds(&script_start);
+
+    for(size_t i = 0; i < SCRIPT_COMPILE_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    fprintf(stdout, "Script: %zu statements (%zu failed) in %.3f ms: compilation %.3f ms (%.3f ms waited), execution %.3f ms\n",
+        script.count, failed, total, total_compile, total_wait, total_run);
+    pthread_mutex_destroy(&script.lock);
+    pthread_cond_destroy(&script.changed);
+    free(script.statements);
+    free(text);
+    return true;
+}
+
+#endif
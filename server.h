@@ -0,0 +1,430 @@
+
+
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+// Server mode: clients connect over a Unix domain socket (-socket path) and/or TCP on the loopback interface (-port n)
+// Every connection is a session, all sessions share the catalog, so tables are only loaded once. The server polls the
+// idle sessions and hands a session with a request to one thread of a pool of session threads (-sessions n), which
+// serves that request and gives the session back; so idle clients do not hold on to a thread.
+// The protocol is length-prefixed, all integers are little-endian:
+//   request:  uint32 length, followed by the statement (without the terminating ;)
+//             a request of length zero closes the session
+//   response: uint32 status (SERVER_OK or SERVER_ERROR)
+//             error:  uint32 length, followed by the error message
+//             ok:     uint32 column count, uint64 row count, followed by every column:
+//                     uint8 type (TYPE_int, TYPE_lng, TYPE_flt or TYPE_dbl), uint32 name length, name,
+//                     row count values of the column in its binary representation
+// COPY, INSERT, CREATE INDEX and ALTER TABLE return zero columns, the row count is the amount of rows in the table after
+// the statement.
+// SET returns zero columns and zero rows, it only changes the session.
+
+#include <endian.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SERVER_OK 0
+#define SERVER_ERROR 1
+#define SERVER_MAX_REQUEST (64 * 1024 * 1024)
+
+static Table *ExecuteQuery(Query *query);
+
+static char *server_socket = NULL;
+static int server_port = 0;
+static size_t server_sessions = 8;
+
+typedef struct {
+    int fd;
+    bool busy;                     // the session has a request that is queued or being served
+    OptimizationProfile *profile;  // set with SET OPTIMIZE, moves with the session between session threads
+} Session;
+
+typedef struct {
+    Session **requests;  // queue of sessions with a request that wait for a session thread
+    size_t head;
+    size_t count;
+    size_t capacity;
+    Session **sessions;  // every open connection
+    size_t session_count;
+    size_t session_capacity;
+    bool stopping;
+    size_t thread_count;  // threads used by every query
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Server;
+
+static Server server;
+static int server_wakeup[2] = { -1, -1 };
+
+static bool SendAll(int fd, const void *data, size_t length) {
+    const char *ptr = (const char*) data;
+    while (length > 0) {
+        ssize_t written = send(fd, ptr, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return false;
+        ptr += written;
+        length -= written;
+    }
+    return true;
+}
+
+static bool ReceiveAll(int fd, void *data, size_t length) {
+    char *ptr = (char*) data;
+    while (length > 0) {
+        ssize_t read = recv(fd, ptr, length, 0);
+        if (read < 0 && errno == EINTR) continue;
+        if (read <= 0) return false;
+        ptr += read;
+        length -= read;
+    }
+    return true;
+}
+
+static bool SendUInt32(int fd, uint32_t value) {
+    value = htole32(value);
+    return SendAll(fd, &value, sizeof(value));
+}
+
+static bool SendError(int fd, const char *message) {
+    return SendUInt32(fd, SERVER_ERROR) && SendUInt32(fd, strlen(message)) && SendAll(fd, message, strlen(message));
+}
+
+static bool SendResult(int fd, Table *table, lng rows) {
+    uint32_t column_count = 0;
+    for(Column *column = table ? table->columns : NULL; column; column = column->next) {
+        column_count++;
+    }
+    if (table && table->columns) rows = table->columns->size;
+    uint64_t row_count = htole64((uint64_t) rows);
+    if (!SendUInt32(fd, SERVER_OK) || !SendUInt32(fd, column_count) || !SendAll(fd, &row_count, sizeof(row_count))) {
+        return false;
+    }
+    for(Column *column = table ? table->columns : NULL; column; column = column->next) {
+        uint8_t type = column->type;
+        const char *name = column->name ? column->name : "";
+        if (!SendAll(fd, &type, sizeof(type)) || !SendUInt32(fd, strlen(name)) || !SendAll(fd, name, strlen(name))) {
+            return false;
+        }
+        if (!SendAll(fd, column->data, column->size * column->elsize)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Executes a single statement of a session and sends the response, returns false if the connection is lost
+static bool ServeStatement(int fd, char *statement) {
+    Query *query = ParseQuery(statement);
+    if (!query) {
+        return SendError(fd, "Failed to parse query.");
+    }
+    if (query->type == QUERY_copy) {
+        Table *table = CopyTable(query->table, query->file, server.thread_count);
+        if (!table) return SendError(fd, "Failed to load file.");
+        return SendResult(fd, NULL, GetRowCount(table));
+    }
+    if (query->type == QUERY_set) {
+        OptimizationProfile *profile = GetOptimizationProfile(query->optimize);
+        if (!profile) return SendError(fd, "Unknown optimization profile.");
+        session_profile = profile;
+        return SendResult(fd, NULL, 0);
+    }
+    if (query->type == QUERY_insert) {
+        Table *table = GetTable(query->table);
+        if (!DeltaAppend(table, query->columns, query->values, query->rows)) {
+            return SendError(fd, "Failed to insert rows.");
+        }
+        return SendResult(fd, NULL, GetRowCount(table));
+    }
+    if (query->type == QUERY_index) {
+        Table *table = GetTable(query->table);
+        if (!CreateImprints(table, query->columns)) {
+            return SendError(fd, "Failed to create index.");
+        }
+        return SendResult(fd, NULL, GetRowCount(table));
+    }
+    if (query->type == QUERY_layout) {
+        Table *table = GetTable(query->table);
+        if (!ConvertTableLayout(table, query->layout)) {
+            return SendError(fd, "Failed to convert table layout.");
+        }
+        return SendResult(fd, NULL, GetRowCount(table));
+    }
+    Table *result = ExecuteQuery(query);
+    if (!result) {
+        return SendError(fd, "Failed to execute query.");
+    }
+    bool sent = SendResult(fd, result, 0);
+    FreeResult(result);
+    return sent;
+}
+
+// Receives and serves a single request of a session, returns false if the session is closed or the connection is lost
+static bool ServeRequest(Session *session) {
+    uint32_t length;
+    if (!ReceiveAll(session->fd, &length, sizeof(length))) return false;
+    length = le32toh(length);
+    if (length == 0) return false;
+    if (length > SERVER_MAX_REQUEST) {
+        SendError(session->fd, "Request too large.");
+        return false;
+    }
+    char *statement = (char*) malloc(length + 1);
+    if (!ReceiveAll(session->fd, statement, length)) {
+        free(statement);
+        return false;
+    }
+    statement[length] = '\0';
+    session_profile = session->profile;
+    bool connected = ServeStatement(session->fd, statement);
+    session->profile = session_profile;
+    free(statement);
+    return connected;
+}
+
+// Must be called while holding the server lock
+static void RemoveSession(Session *session) {
+    for(size_t i = 0; i < server.session_count; i++) {
+        if (server.sessions[i] != session) continue;
+        server.sessions[i] = server.sessions[--server.session_count];
+        break;
+    }
+    close(session->fd);
+    free(session);
+}
+
+static void *SessionThread(void *arg) {
+    (void) arg;
+    while (true) {
+        pthread_mutex_lock(&server.lock);
+        while (server.count == 0 && !server.stopping) {
+            pthread_cond_wait(&server.cond, &server.lock);
+        }
+        if (server.stopping) {
+            pthread_mutex_unlock(&server.lock);
+            return NULL;
+        }
+        Session *session = server.requests[server.head];
+        server.head = (server.head + 1) % server.capacity;
+        server.count--;
+        pthread_mutex_unlock(&server.lock);
+
+        bool connected = ServeRequest(session);
+
+        pthread_mutex_lock(&server.lock);
+        if (connected) {
+            session->busy = false;
+        } else {
+            RemoveSession(session);
+        }
+        pthread_mutex_unlock(&server.lock);
+        // the server polls the session again for its next request
+        char byte = 2;
+        if (connected && write(server_wakeup[1], &byte, 1) < 0) {
+            // the server is stopping
+        }
+    }
+}
+
+// Must be called while holding the server lock
+static void EnqueueRequest(Session *session) {
+    if (server.count == server.capacity) {
+        // grow the ring buffer, moving the entries to the front
+        size_t capacity = server.capacity * 2;
+        Session **requests = (Session**) malloc(capacity * sizeof(Session*));
+        for(size_t i = 0; i < server.count; i++) {
+            requests[i] = server.requests[(server.head + i) % server.capacity];
+        }
+        free(server.requests);
+        server.requests = requests;
+        server.capacity = capacity;
+        server.head = 0;
+    }
+    session->busy = true;
+    server.requests[(server.head + server.count) % server.capacity] = session;
+    server.count++;
+    pthread_cond_signal(&server.cond);
+}
+
+static void AddSession(int fd) {
+    Session *session = (Session*) calloc(1, sizeof(Session));
+    session->fd = fd;
+    pthread_mutex_lock(&server.lock);
+    if (server.session_count == server.session_capacity) {
+        server.session_capacity *= 2;
+        server.sessions = (Session**) realloc(server.sessions, server.session_capacity * sizeof(Session*));
+    }
+    server.sessions[server.session_count++] = session;
+    pthread_mutex_unlock(&server.lock);
+}
+
+// SIGINT and SIGTERM stop the server, SIGUSR1 writes the statistics (see stats.h) to stdout
+// (the session threads write 2 when a session is idle again)
+static void WakeServer(int signal) {
+    char byte = signal == SIGUSR1;
+    if (write(server_wakeup[1], &byte, 1) < 0) {
+        // nothing we can do in a signal handler
+    }
+}
+
+static int ListenUnix(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long.\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int ListenTCP(int port) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    // only local clients can connect
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (fd < 0 || bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Failed to listen on port %d: %s\n", port, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Accepts connections and polls the idle sessions until the server receives SIGINT or SIGTERM,
+// returns false if the server could not be started
+static bool RunServer(size_t thread_count) {
+    int listening[2];
+    size_t listeners = 0;
+    if (server_socket) {
+        int fd = ListenUnix(server_socket);
+        if (fd < 0) return false;
+        listening[listeners++] = fd;
+        fprintf(stdout, "# Listening for connections on %s\n", server_socket);
+    }
+    if (server_port > 0) {
+        int fd = ListenTCP(server_port);
+        if (fd < 0) return false;
+        listening[listeners++] = fd;
+        fprintf(stdout, "# Listening for connections on 127.0.0.1:%d\n", server_port);
+    }
+    if (pipe(server_wakeup) < 0) return false;
+    signal(SIGINT, WakeServer);
+    signal(SIGTERM, WakeServer);
+    signal(SIGUSR1, WakeServer);
+    fflush(stdout);
+
+    server.capacity = 16;
+    server.requests = (Session**) malloc(server.capacity * sizeof(Session*));
+    server.head = 0;
+    server.count = 0;
+    server.session_capacity = 16;
+    server.sessions = (Session**) malloc(server.session_capacity * sizeof(Session*));
+    server.session_count = 0;
+    server.stopping = false;
+    server.thread_count = thread_count;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.cond, NULL);
+    pthread_t *threads = (pthread_t*) malloc(server_sessions * sizeof(pthread_t));
+    for(size_t i = 0; i < server_sessions; i++) {
+        pthread_create(&threads[i], NULL, SessionThread, NULL);
+    }
+
+    // the listeners, the wakeup pipe and the idle sessions are polled (polled[i] is the session of fds[listeners + 1 + i])
+    size_t capacity = 16;
+    struct pollfd *fds = (struct pollfd*) malloc((listeners + 1 + capacity) * sizeof(struct pollfd));
+    Session **polled = (Session**) malloc(capacity * sizeof(Session*));
+    for(size_t i = 0; i < listeners; i++) {
+        fds[i].fd = listening[i];
+        fds[i].events = POLLIN;
+    }
+    fds[listeners].fd = server_wakeup[0];
+    fds[listeners].events = POLLIN;
+    while (true) {
+        size_t idle = 0;
+        pthread_mutex_lock(&server.lock);
+        if (server.session_count > capacity) {
+            capacity = server.session_capacity;
+            fds = (struct pollfd*) realloc(fds, (listeners + 1 + capacity) * sizeof(struct pollfd));
+            polled = (Session**) realloc(polled, capacity * sizeof(Session*));
+        }
+        for(size_t i = 0; i < server.session_count; i++) {
+            if (server.sessions[i]->busy) continue;
+            fds[listeners + 1 + idle].fd = server.sessions[i]->fd;
+            fds[listeners + 1 + idle].events = POLLIN;
+            polled[idle++] = server.sessions[i];
+        }
+        pthread_mutex_unlock(&server.lock);
+
+        if (poll(fds, listeners + 1 + idle, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[listeners].revents) {
+            char byte = 0;
+            if (read(server_wakeup[0], &byte, 1) == 1 && byte != 0) {
+                if (byte == 1) PrintStats(stdout, true);
+                continue;
+            }
+            break;
+        }
+        // a session that is readable has a request (or was closed, which its session thread finds out)
+        pthread_mutex_lock(&server.lock);
+        for(size_t i = 0; i < idle; i++) {
+            if (fds[listeners + 1 + i].revents) EnqueueRequest(polled[i]);
+        }
+        pthread_mutex_unlock(&server.lock);
+        for(size_t i = 0; i < listeners; i++) {
+            if (!(fds[i].revents & POLLIN)) continue;
+            int fd = accept(fds[i].fd, NULL, NULL);
+            if (fd >= 0) {
+                AddSession(fd);
+            }
+        }
+    }
+
+    // stop accepting connections, and wake up the session threads that are waiting for a request
+    for(size_t i = 0; i < listeners; i++) {
+        close(listening[i]);
+    }
+    if (server_socket) unlink(server_socket);
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    for(size_t i = 0; i < server.session_count; i++) {
+        shutdown(server.sessions[i]->fd, SHUT_RDWR);
+    }
+    server.count = 0;
+    pthread_cond_broadcast(&server.cond);
+    pthread_mutex_unlock(&server.lock);
+    for(size_t i = 0; i < server_sessions; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    while (server.session_count > 0) {
+        RemoveSession(server.sessions[0]);
+    }
+    free(threads);
+    free(fds);
+    free(polled);
+    free(server.requests);
+    free(server.sessions);
+    return true;
+}
+
+#endif
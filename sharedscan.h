@@ -0,0 +1,168 @@
+
+
+#ifndef _SHAREDSCAN_H_
+#define _SHAREDSCAN_H_
+
+// Shared scans: concurrent queries on the same table attach to a single cursor over the morsels of the table
+// The workers of all attached queries take the morsel at the cursor and run the kernel of every attached query
+// that still needs it, so the morsel is read from memory (or disk, see buffer.h) once and stays in cache for all of them.
+// A query that attaches while a scan is running starts at the current cursor and wraps around to the start,
+// it is finished once it has seen every morsel.
+// Only the morsels over the columns are shared, the (small) delta of a table is scanned by every query on its own.
+// Queries hold the table lock for reading while they are attached, so all of them see the same columns.
+
+typedef struct _ScanClient {
+    MorselList *list;
+    MorselFunction function;
+    void *state;
+    bool *claimed;        // column morsels that have been taken by a worker for this query
+    size_t remaining;     // amount of column morsels that have not been taken
+    size_t running;       // amount of taken column morsels that are still running
+    size_t next_private;  // next delta morsel
+    struct _ScanClient *next;
+} ScanClient;
+
+typedef struct _SharedScan {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    size_t morsel_count;  // amount of column morsels of the attached queries
+    size_t cursor;
+    ScanClient *clients;
+} SharedScan;
+
+typedef struct {
+    SharedScan *scan;
+    ScanClient *client;
+    size_t read_ahead;
+} SharedScanTask;
+
+static SharedScan *GetSharedScan(Table *table) {
+    SharedScan *scan = __atomic_load_n(&table->shared_scan, __ATOMIC_ACQUIRE);
+    if (scan) return scan;
+    scan = (SharedScan*) calloc(1, sizeof(SharedScan));
+    pthread_mutex_init(&scan->lock, NULL);
+    pthread_cond_init(&scan->finished, NULL);
+    SharedScan *expected = NULL;
+    if (!__atomic_compare_exchange_n(&table->shared_scan, &expected, scan, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        // another thread created the shared scan first
+        free(scan);
+        return expected;
+    }
+    return scan;
+}
+
+static void RunSharedScanWorker(void *state, size_t task) {
+    (void) task;
+    SharedScan *scan = ((SharedScanTask*) state)->scan;
+    ScanClient *client = ((SharedScanTask*) state)->client;
+    size_t read_ahead = ((SharedScanTask*) state)->read_ahead;
+    size_t client_count = 0;
+    ScanClient **claimed = NULL;
+    ScanClient **prefetch = NULL;  // claimed clients that still need the morsel that is read ahead
+
+    pthread_mutex_lock(&scan->lock);
+    while (client->remaining > 0) {
+        size_t morsel = scan->cursor;
+        scan->cursor = (scan->cursor + 1) % scan->morsel_count;
+        size_t count = 0;
+        for(ScanClient *c = scan->clients; c; c = c->next) {
+            count++;
+        }
+        if (count > client_count) {
+            client_count = count;
+            claimed = (ScanClient**) realloc(claimed, client_count * sizeof(ScanClient*));
+            prefetch = (ScanClient**) realloc(prefetch, client_count * sizeof(ScanClient*));
+        }
+        count = 0;
+        for(ScanClient *c = scan->clients; c; c = c->next) {
+            if (c->claimed[morsel]) continue;
+            c->claimed[morsel] = true;
+            c->remaining--;
+            c->running++;
+            claimed[count++] = c;
+        }
+        if (count == 0) continue;
+        size_t next = (morsel + read_ahead) % scan->morsel_count;
+        size_t prefetch_count = 0;
+        for(size_t i = 0; i < count; i++) {
+            if (!claimed[i]->claimed[next]) prefetch[prefetch_count++] = claimed[i];
+        }
+        pthread_mutex_unlock(&scan->lock);
+        for(size_t i = 0; i < prefetch_count; i++) {
+            PrefetchMorsel(prefetch[i]->list, next);
+        }
+        for(size_t i = 0; i < count; i++) {
+            RunMorsel(claimed[i]->list, claimed[i]->function, claimed[i]->state, &claimed[i]->list->morsels[morsel]);
+        }
+        pthread_mutex_lock(&scan->lock);
+        for(size_t i = 0; i < count; i++) {
+            if (--claimed[i]->running == 0 && claimed[i]->remaining == 0) {
+                pthread_cond_broadcast(&scan->finished);
+            }
+        }
+    }
+    pthread_mutex_unlock(&scan->lock);
+    free(claimed);
+    free(prefetch);
+
+    // the morsels of the delta are not shared
+    size_t morsel;
+    while ((morsel = __atomic_fetch_add(&client->next_private, 1, __ATOMIC_RELAXED)) < client->list->count) {
+        RunMorsel(client->list, client->function, client->state, &client->list->morsels[morsel]);
+    }
+}
+
+// Runs the function on every morsel of the list, the first shared_count morsels are the column morsels of the table
+// Must be called while holding the table lock for reading
+static void RunSharedScan(Table *table, MorselList *list, size_t shared_count, MorselFunction function, void *state, size_t thread_count) {
+    SharedScan *scan = GetSharedScan(table);
+    ScanClient client;
+    client.list = list;
+    client.function = function;
+    client.state = state;
+    client.claimed = (bool*) calloc(shared_count + 1, sizeof(bool));
+    client.remaining = shared_count;
+    client.running = 0;
+    client.next_private = shared_count;
+    client.next = NULL;
+
+    pthread_mutex_lock(&scan->lock);
+    if (!scan->clients) {
+        scan->morsel_count = shared_count;
+        scan->cursor = shared_count > 0 ? scan->cursor % shared_count : 0;
+    }
+    bool shared = shared_count > 0 && shared_count == scan->morsel_count;
+    size_t cursor = scan->cursor;
+    if (shared) {
+        client.next = scan->clients;
+        scan->clients = &client;
+    }
+    pthread_mutex_unlock(&scan->lock);
+    if (!shared) {
+        // nothing to share
+        free(client.claimed);
+        RunMorsels(list, function, state, thread_count, -1);
+        return;
+    }
+
+    SharedScanTask task = { scan, &client, MORSEL_READ_AHEAD * thread_count };
+    for(size_t i = 0; i < task.read_ahead && i < shared_count; i++) {
+        PrefetchMorsel(list, (cursor + i) % shared_count);
+    }
+    RunParallel(thread_count, RunSharedScanWorker, &task, thread_count);
+
+    // workers of other queries can still be running some of our morsels
+    pthread_mutex_lock(&scan->lock);
+    while (client.running > 0) {
+        pthread_cond_wait(&scan->finished, &scan->lock);
+    }
+    ScanClient **entry = &scan->clients;
+    while (*entry != &client) {
+        entry = &(*entry)->next;
+    }
+    *entry = client.next;
+    pthread_mutex_unlock(&scan->lock);
+    free(client.claimed);
+}
+
+#endif
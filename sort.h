@@ -0,0 +1,277 @@
+
+
+#ifndef _SORT_H_
+#define _SORT_H_
+
+// ORDER BY [expr] [DESC] [LIMIT n]
+// The scan (or join probe) writes the ORDER BY expression as an extra output behind the SELECT expression.
+// Every morsel output is sorted on its own (in parallel), and the sorted runs are merged afterwards.
+// The values of every type are mapped to unsigned integers with the same order (flipping all bits for DESC),
+// so all types are sorted by the same LSD radix sort over the bytes of the key (4 bytes for int/flt, 8 for lng/dbl).
+// With a LIMIT that is small compared to the input every morsel only keeps its first n rows in a bounded heap,
+// and the merge stops after n rows.
+// Ties are ordered by their position in the input, so the result does not depend on the amount of threads.
+
+typedef struct {
+    uint64_t key;
+    uint32_t index;  // row in the morsel output
+} SortEntry;
+
+typedef struct {
+    SortEntry *entries;
+    lng count;
+} SortRun;
+
+typedef struct {
+    MorselList *morsels;
+    SortRun *runs;
+    int type;        // type of the ORDER BY expression
+    bool descending;
+    lng limit;
+} SortState;
+
+static inline uint64_t SortKeyInt(int value) {
+    return (uint32_t) value ^ 0x80000000U;
+}
+
+static inline uint64_t SortKeyLng(lng value) {
+    return (uint64_t) value ^ 0x8000000000000000ULL;
+}
+
+// positive floats are ordered by their bits, negative floats in reverse, adding zero turns -0.0 into 0.0
+static inline uint64_t SortKeyFlt(flt value) {
+    uint32_t bits;
+    value += 0.0f;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits & 0x80000000U ? (uint32_t) ~bits : bits | 0x80000000U;
+}
+
+static inline uint64_t SortKeyDbl(dbl value) {
+    uint64_t bits;
+    value += 0.0;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits & 0x8000000000000000ULL ? ~bits : bits | 0x8000000000000000ULL;
+}
+
+#define SORT_KEYS(TYPE, KEY_FUNCTION) \
+    for(lng i = 0; i < count; i++) { \
+        entries[i].key = KEY_FUNCTION(((TYPE*)data)[i]) ^ flip; \
+        entries[i].index = (uint32_t) i; \
+    }
+
+static void ComputeSortKeys(SortEntry *entries, void *data, lng count, int type, bool descending) {
+    uint64_t flip = 0;
+    if (descending) {
+        flip = type == TYPE_int || type == TYPE_flt ? 0xFFFFFFFFULL : 0xFFFFFFFFFFFFFFFFULL;
+    }
+    switch(type) {
+        case TYPE_int: SORT_KEYS(int, SortKeyInt); break;
+        case TYPE_lng: SORT_KEYS(lng, SortKeyLng); break;
+        case TYPE_flt: SORT_KEYS(flt, SortKeyFlt); break;
+        case TYPE_dbl: SORT_KEYS(dbl, SortKeyDbl); break;
+    }
+}
+
+static inline bool SortEntryLess(SortEntry *a, SortEntry *b) {
+    return a->key < b->key || (a->key == b->key && a->index < b->index);
+}
+
+// Stable LSD radix sort on the lowest key_bytes bytes of the keys, returns either entries or buffer
+// Passes in which every key has the same byte are skipped
+static SortEntry *RadixSort(SortEntry *entries, SortEntry *buffer, lng count, int key_bytes) {
+    lng (*histogram)[256] = calloc(key_bytes, sizeof(*histogram));
+    for(lng i = 0; i < count; i++) {
+        uint64_t key = entries[i].key;
+        for(int b = 0; b < key_bytes; b++) {
+            histogram[b][(key >> (8 * b)) & 0xFF]++;
+        }
+    }
+    for(int b = 0; b < key_bytes; b++) {
+        int shift = 8 * b;
+        if (histogram[b][(entries[0].key >> shift) & 0xFF] == count) continue;
+        lng offset = 0;
+        for(int digit = 0; digit < 256; digit++) {
+            lng amount = histogram[b][digit];
+            histogram[b][digit] = offset;
+            offset += amount;
+        }
+        for(lng i = 0; i < count; i++) {
+            buffer[histogram[b][(entries[i].key >> shift) & 0xFF]++] = entries[i];
+        }
+        SortEntry *swap = entries;
+        entries = buffer;
+        buffer = swap;
+    }
+    free(histogram);
+    return entries;
+}
+
+static void SiftDown(SortEntry *heap, lng count, lng position) {
+    while (true) {
+        lng largest = position, left = 2 * position + 1, right = left + 1;
+        if (left < count && SortEntryLess(&heap[largest], &heap[left])) largest = left;
+        if (right < count && SortEntryLess(&heap[largest], &heap[right])) largest = right;
+        if (largest == position) return;
+        SortEntry swap = heap[position];
+        heap[position] = heap[largest];
+        heap[largest] = swap;
+        position = largest;
+    }
+}
+
+// Keeps the first limit entries in a max-heap and sorts them, returns the amount of entries
+static lng TopN(SortEntry *entries, lng count, lng limit) {
+    lng size = 0;
+    for(lng i = 0; i < count; i++) {
+        if (size < limit) {
+            // sift up
+            lng position = size++;
+            entries[position] = entries[i];
+            while (position > 0 && SortEntryLess(&entries[(position - 1) / 2], &entries[position])) {
+                SortEntry swap = entries[position];
+                entries[position] = entries[(position - 1) / 2];
+                entries[(position - 1) / 2] = swap;
+                position = (position - 1) / 2;
+            }
+        } else if (SortEntryLess(&entries[i], &entries[0])) {
+            entries[0] = entries[i];
+            SiftDown(entries, size, 0);
+        }
+    }
+    // heap sort
+    for(lng end = size - 1; end > 0; end--) {
+        SortEntry swap = entries[0];
+        entries[0] = entries[end];
+        entries[end] = swap;
+        SiftDown(entries, end, 0);
+    }
+    return size;
+}
+
+static void SortMorsel(void *state, size_t task) {
+    SortState *sort = (SortState*) state;
+    QueryOutput *output = &sort->morsels->morsels[task].output;
+    SortRun *run = &sort->runs[task];
+    lng count = output->count;
+    run->entries = NULL;
+    run->count = 0;
+    if (count == 0) return;
+    SortEntry *entries = (SortEntry*) malloc(count * sizeof(SortEntry));
+    ComputeSortKeys(entries, output->data[output->output_count - 1], count, sort->type, sort->descending);
+    if (sort->limit >= 0 && sort->limit < count / 8) {
+        // a partial sort only touches the rows that can end up in the result
+        run->count = TopN(entries, count, sort->limit);
+    } else {
+        SortEntry *buffer = (SortEntry*) malloc(count * sizeof(SortEntry));
+        SortEntry *sorted = RadixSort(entries, buffer, count, GetTypeSize(sort->type));
+        free(sorted == entries ? buffer : entries);
+        entries = sorted;
+        run->count = sort->limit >= 0 && sort->limit < count ? sort->limit : count;
+    }
+    run->entries = entries;
+}
+
+// Heap of the runs that still have entries, ordered by their current entry (and then by run, for stability)
+typedef struct {
+    SortRun *runs;
+    lng *positions;
+    size_t *heap;
+    size_t size;
+} RunMerger;
+
+static inline bool RunLess(RunMerger *merger, size_t a, size_t b) {
+    uint64_t key_a = merger->runs[a].entries[merger->positions[a]].key;
+    uint64_t key_b = merger->runs[b].entries[merger->positions[b]].key;
+    return key_a < key_b || (key_a == key_b && a < b);
+}
+
+static void RunSiftDown(RunMerger *merger, size_t position) {
+    while (true) {
+        size_t smallest = position, left = 2 * position + 1, right = left + 1;
+        if (left < merger->size && RunLess(merger, merger->heap[left], merger->heap[smallest])) smallest = left;
+        if (right < merger->size && RunLess(merger, merger->heap[right], merger->heap[smallest])) smallest = right;
+        if (smallest == position) return;
+        size_t swap = merger->heap[position];
+        merger->heap[position] = merger->heap[smallest];
+        merger->heap[smallest] = swap;
+        position = smallest;
+    }
+}
+
+// Sorts the outputs of all morsels on their last output, and returns a result table with the other outputs
+static Table *SortOutputs(MorselList *list, OperationList *outputs, int type, bool descending, lng limit, size_t thread_count) {
+    SortState sort;
+    sort.morsels = list;
+    sort.runs = (SortRun*) calloc(list->count + 1, sizeof(SortRun));
+    sort.type = type;
+    sort.descending = descending;
+    sort.limit = limit;
+    RunParallel(list->count, SortMorsel, &sort, thread_count);
+
+    lng total = 0;
+    RunMerger merger;
+    merger.runs = sort.runs;
+    merger.positions = (lng*) calloc(list->count + 1, sizeof(lng));
+    merger.heap = (size_t*) malloc((list->count + 1) * sizeof(size_t));
+    merger.size = 0;
+    for(size_t i = 0; i < list->count; i++) {
+        total += sort.runs[i].count;
+        if (sort.runs[i].count > 0) {
+            merger.heap[merger.size++] = i;
+        }
+    }
+    for(size_t i = merger.size / 2; i-- > 0; ) {
+        RunSiftDown(&merger, i);
+    }
+    if (limit >= 0 && limit < total) total = limit;
+
+    // the result contains all outputs except for the ORDER BY expression
+    size_t column_count = 0;
+    for(OperationList *entry = outputs; entry->next; entry = entry->next) {
+        column_count++;
+    }
+    char **result = (char**) malloc((column_count + 1) * sizeof(char*));
+    unsigned char *sizes = (unsigned char*) malloc(column_count + 1);
+    OperationList *entry = outputs;
+    for(size_t k = 0; k < column_count; k++, entry = entry->next) {
+        sizes[k] = GetTypeSize(GetResultType(entry->operation));
+        result[k] = malloc((total > 0 ? total : 1) * sizes[k]);
+    }
+    for(lng i = 0; i < total; i++) {
+        size_t run = merger.heap[0];
+        QueryOutput *output = &list->morsels[run].output;
+        uint32_t index = sort.runs[run].entries[merger.positions[run]].index;
+        for(size_t k = 0; k < column_count; k++) {
+            memcpy(result[k] + i * sizes[k], (char*) output->data[k] + index * sizes[k], sizes[k]);
+        }
+        if (++merger.positions[run] == sort.runs[run].count) {
+            merger.heap[0] = merger.heap[--merger.size];
+        }
+        RunSiftDown(&merger, 0);
+    }
+
+    Column *columns = NULL, *tail = NULL;
+    entry = outputs;
+    for(size_t k = 0; k < column_count; k++, entry = entry->next) {
+        Column *column = CreateColumn((double*) result[k], total);
+        column->type = GetResultType(entry->operation);
+        column->elsize = sizes[k];
+        if (tail) {
+            tail->next = column;
+        } else {
+            columns = column;
+        }
+        tail = column;
+    }
+    for(size_t i = 0; i < list->count; i++) {
+        free(sort.runs[i].entries);
+    }
+    free(sort.runs);
+    free(merger.positions);
+    free(merger.heap);
+    free(result);
+    free(sizes);
+    return CreateTable("Result", columns);
+}
+
+#endif
@@ -0,0 +1,305 @@
+
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+// Runtime statistics: \stats prints them, \stats json [file] writes them as JSON (to stdout or the file), a server
+// writes the JSON to stdout when it receives SIGUSR1.
+// Queries are grouped by their shape: the normalized text of the query with every constant replaced by ?, so
+// "a < 5" and "a < 7" are the same shape. Every shape keeps a latency histogram of compilation and execution,
+// and the amount of results that came from the result cache.
+// The histograms are log-linear (like HDR histograms): every power of two is divided into STATS_SUB_BUCKETS
+// buckets, so a percentile is accurate to within 1 / STATS_SUB_BUCKETS of its value, with a fixed amount of memory.
+// The memory statistics are the JIT code and data of the compiled queries that are alive, the column chunks in
+// memory (per table, see buffer.h), the appended rows (see delta.h) and the heap, with their high-water marks.
+
+#include <malloc.h>
+#include <sys/resource.h>
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (64 * STATS_SUB_BUCKETS)
+
+typedef struct {
+    lng counts[STATS_BUCKETS];  // values in microseconds
+    lng count;
+    lng sum;
+    lng max;
+} Histogram;
+
+typedef struct {
+    char *shape;
+    lng cached;  // results that came from the result cache
+    Histogram compile;
+    Histogram execute;
+} QueryShapeStats;
+
+static HashMap *stats_shapes = NULL;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t stats_heap_peak = 0;
+
+static size_t HistogramBucket(lng value) {
+    if (value < STATS_SUB_BUCKETS) return value < 0 ? 0 : (size_t) value;
+    size_t magnitude = 63 - __builtin_clzll((uint64_t) value);
+    size_t sub = (size_t) (value >> (magnitude - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return (magnitude - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS + sub;
+}
+
+// Returns the largest value of a bucket
+static lng HistogramBucketValue(size_t bucket) {
+    if (bucket < STATS_SUB_BUCKETS) return (lng) bucket;
+    size_t magnitude = bucket / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+    lng sub = bucket % STATS_SUB_BUCKETS;
+    return ((STATS_SUB_BUCKETS + sub + 1) << (magnitude - STATS_SUB_BITS)) - 1;
+}
+
+static void HistogramRecord(Histogram *histogram, double milliseconds) {
+    lng value = (lng) (milliseconds * 1000);
+    histogram->counts[HistogramBucket(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max) histogram->max = value;
+}
+
+// Returns the percentile of the histogram in milliseconds
+static double HistogramPercentile(Histogram *histogram, double percentile) {
+    if (histogram->count == 0) return 0;
+    lng rank = (lng) ceil(percentile / 100 * histogram->count);
+    if (rank < 1) rank = 1;
+    lng seen = 0;
+    for(size_t i = 0; i < STATS_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            lng value = HistogramBucketValue(i);
+            return (value < histogram->max ? value : histogram->max) / 1000.0;
+        }
+    }
+    return histogram->max / 1000.0;
+}
+
+// Replaces the constants in the normalized text of a query by ?
+static char *QueryShape(const char *text) {
+    char *shape = NormalizeQueryText(text);
+    size_t length = 0;
+    for(size_t i = 0; shape[i]; ) {
+        bool word = length > 0 && (isalnum(shape[length - 1]) || shape[length - 1] == '_');
+        if (shape[i] == '\'') {
+            i++;
+            while (shape[i] && shape[i] != '\'') i++;
+            if (shape[i]) i++;
+            shape[length++] = '?';
+        } else if (isdigit(shape[i]) && !word) {
+            while (isdigit(shape[i]) || shape[i] == '.' ||
+                ((shape[i] == 'e' || shape[i] == 'E') && (isdigit(shape[i + 1]) || shape[i + 1] == '-' || shape[i + 1] == '+'))) {
+                i += shape[i] == 'e' || shape[i] == 'E' ? 2 : 1;
+            }
+            shape[length++] = '?';
+        } else {
+            shape[length++] = shape[i++];
+        }
+    }
+    shape[length] = '\0';
+    return shape;
+}
+
+// Returns the statistics of the shape of a query, must be called while holding stats_lock
+static QueryShapeStats *GetShapeStats(Query *query) {
+    if (!stats_shapes) stats_shapes = HashMapCreate(64);
+    char *shape = QueryShape(query->text);
+    QueryShapeStats *stats = (QueryShapeStats*) HashMapGet(stats_shapes, shape);
+    if (stats) {
+        free(shape);
+        return stats;
+    }
+    stats = (QueryShapeStats*) calloc(1, sizeof(QueryShapeStats));
+    stats->shape = shape;
+    HashMapInsert(stats_shapes, stats->shape, stats);
+    return stats;
+}
+
+static void StatsSampleHeap(void) {
+    struct mallinfo2 info = mallinfo2();
+    size_t heap = info.uordblks + info.hblkhd;
+    if (heap > stats_heap_peak) stats_heap_peak = heap;
+}
+
+// Records the compilation and execution time of a query
+static void StatsRecordQuery(Query *query, double compile_ms, double execute_ms) {
+    if (!query->text) return;
+    pthread_mutex_lock(&stats_lock);
+    QueryShapeStats *stats = GetShapeStats(query);
+    HistogramRecord(&stats->compile, compile_ms);
+    HistogramRecord(&stats->execute, execute_ms);
+    // the heap is largest right after a query, when its result still exists
+    StatsSampleHeap();
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Records a query whose result came from the result cache
+static void StatsRecordCacheHit(Query *query) {
+    if (!query->text) return;
+    pthread_mutex_lock(&stats_lock);
+    GetShapeStats(query)->cached++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static size_t DeltaBytes(Table *table) {
+    Delta *delta = __atomic_load_n(&table->delta, __ATOMIC_ACQUIRE);
+    if (!delta) return 0;
+    size_t row_width = 0;
+    for(Column *column = table->columns; column; column = column->next) {
+        row_width += column->elsize;
+    }
+    size_t chunks = 0;
+    pthread_mutex_lock(&delta->append_lock);
+    for(DeltaChunk *chunk = delta->head; chunk; chunk = chunk->next) {
+        chunks++;
+    }
+    pthread_mutex_unlock(&delta->append_lock);
+    return chunks * DELTA_CHUNK_SIZE * row_width;
+}
+
+static void WriteJSONString(FILE *out, const char *str) {
+    fputc('"', out);
+    for(; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(out, "\\%c", *str);
+        } else if ((unsigned char) *str < 0x20) {
+            fprintf(out, "\\u%04x", *str);
+        } else {
+            fputc(*str, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static void WriteJSONHistogram(FILE *out, const char *name, Histogram *histogram) {
+    fprintf(out, "\"%s\": {\"count\": %lld, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+        name, histogram->count, histogram->count > 0 ? histogram->sum / 1000.0 / histogram->count : 0,
+        HistogramPercentile(histogram, 50), HistogramPercentile(histogram, 90),
+        HistogramPercentile(histogram, 99), histogram->max / 1000.0);
+}
+
+static double Megabytes(size_t bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+// Prints the statistics as text, or as JSON
+static void PrintStats(FILE *out, bool json) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    struct mallinfo2 info = mallinfo2();
+    size_t heap = info.uordblks + info.hblkhd;
+    pthread_mutex_lock(&buffer_lock);
+    size_t buffers = buffer_used, buffers_peak = buffer_peak;
+    lng loads = buffer_loads, evictions = buffer_evictions;
+    pthread_mutex_unlock(&buffer_lock);
+
+    pthread_mutex_lock(&stats_lock);
+    if (heap > stats_heap_peak) stats_heap_peak = heap;
+    if (json) {
+        fprintf(out, "{\"queries\": [");
+    } else {
+        fprintf(out, "Queries (latency in ms)\n");
+        fprintf(out, "  %8s %8s %10s %10s %10s %10s %10s %10s  %s\n", "Count", "Cached", "Comp p50", "Comp p99",
+            "Exec p50", "Exec p90", "Exec p99", "Exec max", "Shape");
+    }
+    bool first = true;
+    for(size_t i = 0; stats_shapes && i < stats_shapes->capacity; i++) {
+        QueryShapeStats *stats = (QueryShapeStats*) stats_shapes->entries[i].value;
+        if (!stats_shapes->entries[i].key) continue;
+        if (json) {
+            fprintf(out, "%s\n  {\"shape\": ", first ? "" : ",");
+            WriteJSONString(out, stats->shape);
+            fprintf(out, ", \"cached\": %lld, ", stats->cached);
+            WriteJSONHistogram(out, "compile_ms", &stats->compile);
+            fprintf(out, ", ");
+            WriteJSONHistogram(out, "execute_ms", &stats->execute);
+            fprintf(out, "}");
+        } else {
+            fprintf(out, "  %8lld %8lld %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f  %s\n", stats->execute.count,
+                stats->cached, HistogramPercentile(&stats->compile, 50), HistogramPercentile(&stats->compile, 99),
+                HistogramPercentile(&stats->execute, 50), HistogramPercentile(&stats->execute, 90),
+                HistogramPercentile(&stats->execute, 99), stats->execute.max / 1000.0, stats->shape);
+        }
+        first = false;
+    }
+    size_t heap_peak = stats_heap_peak;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_mutex_lock(&result_cache.lock);
+    size_t result_bytes = result_cache.size;
+    lng result_hits = result_cache_hits, result_misses = result_cache_misses;
+    pthread_mutex_unlock(&result_cache.lock);
+    pthread_mutex_lock(&code_cache_lock);
+    lng code_hits = code_cache_hits, code_misses = code_cache_misses;
+    pthread_mutex_unlock(&code_cache_lock);
+    pthread_mutex_lock(&jit_cache.lock);
+    size_t jit_queries = jit_cache.count, jit_bytes = jit_cache.bytes;
+    lng jit_hits = jit_cache_hits, jit_misses = jit_cache_misses, jit_evictions = jit_cache_evictions;
+    pthread_mutex_unlock(&jit_cache.lock);
+    if (json) {
+        fprintf(out, "],\n \"memory\": {\"jit_bytes\": %zu, \"jit_peak_bytes\": %zu, \"buffer_bytes\": %zu, "
+            "\"buffer_peak_bytes\": %zu, \"buffer_budget_bytes\": %zu, \"result_cache_bytes\": %zu, \"heap_bytes\": %zu, "
+            "\"heap_peak_bytes\": %zu, \"max_rss_bytes\": %lld},\n",
+            LLVMJITMemoryUsed(), LLVMJITMemoryPeak(), buffers, buffers_peak, buffer_budget, result_bytes, heap,
+            heap_peak, (lng) usage.ru_maxrss * 1024);
+        fprintf(out, " \"buffer\": {\"loads\": %lld, \"evictions\": %lld},\n", loads, evictions);
+        fprintf(out, " \"result_cache\": {\"hits\": %lld, \"misses\": %lld},\n", result_hits, result_misses);
+        fprintf(out, " \"code_cache\": {\"hits\": %lld, \"misses\": %lld},\n", code_hits, code_misses);
+        fprintf(out, " \"jit_cache\": {\"queries\": %zu, \"bytes\": %zu, \"hits\": %lld, \"misses\": %lld, \"evictions\": %lld},\n",
+            jit_queries, jit_bytes, jit_hits, jit_misses, jit_evictions);
+        fprintf(out, " \"tables\": [");
+    } else {
+        fprintf(out, "Memory (MB)\n");
+        fprintf(out, "  JIT code and data   %10.1f (peak %.1f)\n", Megabytes(LLVMJITMemoryUsed()), Megabytes(LLVMJITMemoryPeak()));
+        fprintf(out, "  Column buffers      %10.1f (peak %.1f, budget %.1f), %lld loads, %lld evictions\n",
+            Megabytes(buffers), Megabytes(buffers_peak), Megabytes(buffer_budget), loads, evictions);
+        fprintf(out, "  Result cache        %10.1f, %lld hits, %lld misses\n", Megabytes(result_bytes), result_hits, result_misses);
+        fprintf(out, "  Heap                %10.1f (peak %.1f), max RSS %.1f\n", Megabytes(heap), Megabytes(heap_peak),
+            usage.ru_maxrss / 1024.0);
+        fprintf(out, "  Code cache          %lld hits, %lld misses\n", code_hits, code_misses);
+        fprintf(out, "  Compiled queries    %10.1f, %zu cached, %lld hits, %lld misses, %lld evictions\n",
+            Megabytes(jit_bytes), jit_queries, jit_hits, jit_misses, jit_evictions);
+        fprintf(out, "Tables (MB)\n");
+        fprintf(out, "  %-20s %12s %10s %10s %10s\n", "Table", "Rows", "Columns", "Resident", "Delta");
+    }
+
+    // tables are never freed, so they can be used after the catalog lock is released
+    pthread_mutex_lock(&catalog_lock);
+    size_t table_count = 0;
+    Table **tables = (Table**) malloc(((catalog ? catalog->count : 0) + 1) * sizeof(Table*));
+    for(size_t i = 0; catalog && i < catalog->capacity; i++) {
+        if (catalog->entries[i].key && catalog->entries[i].value) tables[table_count++] = (Table*) catalog->entries[i].value;
+    }
+    pthread_mutex_unlock(&catalog_lock);
+    first = true;
+    for(size_t i = 0; i < table_count; i++) {
+        Table *table = tables[i];
+        // the columns do not change while holding the table lock
+        pthread_rwlock_rdlock(&table->lock);
+        size_t bytes = 0, resident = 0;
+        for(Column *column = table->columns; column; column = column->next) {
+            bytes += column->size * column->elsize;
+            resident += BufferResidentBytes(column);
+        }
+        lng rows = GetRowCount(table);
+        size_t delta = DeltaBytes(table);
+        pthread_rwlock_unlock(&table->lock);
+        if (json) {
+            fprintf(out, "%s\n  {\"name\": ", first ? "" : ",");
+            WriteJSONString(out, table->name);
+            fprintf(out, ", \"rows\": %lld, \"column_bytes\": %zu, \"resident_bytes\": %zu, \"delta_bytes\": %zu}",
+                rows, bytes, resident, delta);
+        } else {
+            fprintf(out, "  %-20s %12lld %10.1f %10.1f %10.1f\n", table->name, rows, Megabytes(bytes),
+                Megabytes(resident), Megabytes(delta));
+        }
+        first = false;
+    }
+    free(tables);
+    if (json) fprintf(out, "]}\n");
+    fflush(out);
+}
+
+#endif
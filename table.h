@@ -5,6 +5,10 @@
 #define _TABLE_H_
 
 #include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define TYPE_int 1
 #define TYPE_lng 2
@@ -12,6 +16,9 @@
 #define TYPE_dbl 4
 #define TYPE_str 5
 
+#define LAYOUT_columnar 0  // every column in its own file (Tables/table/column.col)
+#define LAYOUT_pax 1       // row groups of all columns in one file (Tables/table/data.pax, see pax.h)
+
 typedef long long lng;
 typedef float flt;
 typedef double dbl;
@@ -19,50 +26,189 @@ typedef double dbl;
 unsigned char elsize[] = { 4, 8, 4, 8 };
 
 struct _Column;
+struct _BufferChunk;
+struct _Imprint;
 typedef struct _Column Column;
 struct _Column {
     char *name;
     unsigned char type;
-    unsigned char elsize;
+    unsigned int elsize;          // bytes per value, or per row for the row groups of a PAX table
     lng base_oid;
     lng size;
-    void *data;
+    void *data;                   // only used for result columns, table columns are read in chunks (see buffer.h)
+    struct _BufferChunk *chunks;
+    size_t chunk_count;
+    struct _Imprint *imprint;     // the imprint of the column, or NULL if it has not been used (see imprint.h)
     Column *next;
     char *data_location;
     LLVMValueRef llvm_ptr;
+    Column *row_groups;           // PAX layout: the row groups that hold the column, or NULL (see pax.h)
+    size_t pax_offset;            // PAX layout: bytes per row of the columns before it in a row group
 };
 
+// String-keyed hash map (open addressing with linear probing), used for the catalog and for column lookups
+typedef struct {
+    char *key;
+    void *value;
+} HashMapEntry;
+
+typedef struct {
+    HashMapEntry *entries;
+    size_t capacity;  // always a power of two
+    size_t count;
+} HashMap;
+
+static uint64_t HashString(const char *str) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for(; *str; str++) {
+        hash ^= (unsigned char) *str;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static HashMap *HashMapCreate(size_t capacity) {
+    HashMap *map = (HashMap*) calloc(1, sizeof(HashMap));
+    map->capacity = 8;
+    while (map->capacity < capacity * 2) {
+        map->capacity *= 2;
+    }
+    map->entries = (HashMapEntry*) calloc(map->capacity, sizeof(HashMapEntry));
+    return map;
+}
+
+static void *HashMapGet(HashMap *map, const char *key) {
+    for(size_t i = HashString(key) & (map->capacity - 1); map->entries[i].key; i = (i + 1) & (map->capacity - 1)) {
+        if (strcmp(map->entries[i].key, key) == 0) {
+            return map->entries[i].value;
+        }
+    }
+    return NULL;
+}
+
+static void HashMapInsert(HashMap *map, char *key, void *value) {
+    if ((map->count + 1) * 2 > map->capacity) {
+        // grow to keep the load factor below 0.5
+        HashMapEntry *entries = map->entries;
+        size_t capacity = map->capacity;
+        map->capacity *= 2;
+        map->entries = (HashMapEntry*) calloc(map->capacity, sizeof(HashMapEntry));
+        map->count = 0;
+        for(size_t i = 0; i < capacity; i++) {
+            if (entries[i].key) {
+                HashMapInsert(map, entries[i].key, entries[i].value);
+            }
+        }
+        free(entries);
+    }
+    size_t i = HashString(key) & (map->capacity - 1);
+    for(; map->entries[i].key; i = (i + 1) & (map->capacity - 1)) {
+        if (strcmp(map->entries[i].key, key) == 0) {
+            map->entries[i].value = value;
+            return;
+        }
+    }
+    map->entries[i].key = key;
+    map->entries[i].value = value;
+    map->count++;
+}
+
+// Removes the entry of the key if there is one (the key of the entry is not freed)
+static void HashMapRemove(HashMap *map, const char *key) {
+    size_t mask = map->capacity - 1;
+    size_t i = HashString(key) & mask;
+    while (map->entries[i].key && strcmp(map->entries[i].key, key) != 0) {
+        i = (i + 1) & mask;
+    }
+    if (!map->entries[i].key) return;
+    // the entries behind it are moved back into the gap, unless that would put them in front of their first slot
+    for(size_t j = (i + 1) & mask; map->entries[j].key; j = (j + 1) & mask) {
+        size_t first = HashString(map->entries[j].key) & mask;
+        if (((j - first) & mask) >= ((j - i) & mask)) {
+            map->entries[i] = map->entries[j];
+            i = j;
+        }
+    }
+    map->entries[i].key = NULL;
+    map->entries[i].value = NULL;
+    map->count--;
+}
+
+struct _Delta;
+struct _SharedScan;
+
 typedef struct {
     char *name;
     Column *columns;
+    HashMap *column_map;     // column name -> column
+    struct _Delta *delta;    // appended rows that are not yet merged into the columns (see delta.h)
+    struct _SharedScan *shared_scan;  // cursor shared by concurrent scans (see sharedscan.h)
+    pthread_rwlock_t lock;   // held for reading while the column data is used, and for writing while it is replaced
+    pthread_mutex_t writer_lock;  // held for the whole statement by COPY, INSERT and ALTER TABLE, so they do not interleave
+    lng version;             // bumped by every COPY and INSERT into the table (see resultcache.h)
+    int layout;              // LAYOUT_columnar or LAYOUT_pax
+    Column *row_groups;      // PAX layout: one chunk per row group with the values of all columns, or NULL
 } Table;
 
-#define MAX_TABLES 100
+// The catalog maps table names to tables
+// Tables are registered lazily: the first reference to a table reads its metadata file (Tables/[name].tbl),
+// and the column data is only read when a column is used in a query. Startup does not touch the Tables directory.
+static HashMap *catalog = NULL;
+static pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static Table *tables[MAX_TABLES];
-static int current_table = 0;
+static Table* ReadTable(const char *table_name, char *name);
 
 static Column *GetColumn(Table *table, char *name) {
-    Column *column;
-    for(column = table->columns; column; column = column->next) {
-        if (strcmp(column->name, name) == 0) {
-            return column;
-        }
-    }
-    return NULL;
+    return (Column*) HashMapGet(table->column_map, name);
+}
+
+// Adds a column to the front of the column list of a table
+static void AddColumn(Table *table, Column *column) {
+    column->next = table->columns;
+    table->columns = column;
+    HashMapInsert(table->column_map, column->name, column);
+}
+
+static void RegisterTable(Table *table) {
+    pthread_mutex_lock(&catalog_lock);
+    if (!catalog) catalog = HashMapCreate(64);
+    HashMapInsert(catalog, table->name, table);
+    pthread_mutex_unlock(&catalog_lock);
 }
 
 static Table *GetTable(const char *name) {
-    for(int i = 0; i < current_table; i++) {
-        if (tables[i] && strcmp(tables[i]->name, name) == 0) {
-            return tables[i];
+    pthread_mutex_lock(&catalog_lock);
+    if (!catalog) catalog = HashMapCreate(64);
+    Table *table = (Table*) HashMapGet(catalog, name);
+    if (!table) {
+        // the table might exist on disk without being loaded yet
+        char table_file[500];
+        snprintf(table_file, 500, "Tables/%s.tbl", name);
+        if (access(table_file, F_OK) == 0) {
+            printf("# Load table %s from file %s.\n", name, table_file);
+            table = ReadTable(name, table_file);
+            if (table) {
+                HashMapInsert(catalog, table->name, table);
+            }
         }
     }
-    return NULL;
+    pthread_mutex_unlock(&catalog_lock);
+    return table;
 }
 
-static void RegisterTable(Table *table) {
-    tables[current_table++] = table;
+// Returns all tables that are loaded, the caller has to free the result
+static Table **GetLoadedTables(size_t *count) {
+    pthread_mutex_lock(&catalog_lock);
+    *count = 0;
+    Table **result = (Table**) malloc(((catalog ? catalog->count : 0) + 1) * sizeof(Table*));
+    for(size_t i = 0; catalog && i < catalog->capacity; i++) {
+        if (catalog->entries[i].key) {
+            result[(*count)++] = (Table*) catalog->entries[i].value;
+        }
+    }
+    pthread_mutex_unlock(&catalog_lock);
+    return result;
 }
 
 static void create_substring(char **res, char *str, size_t start, size_t end) {
@@ -91,6 +237,13 @@ static char** split(char *string, char delimiter, size_t *splits) {
     return split_values;
 }
 
+static void free_split(char **split_values, size_t splits) {
+    for(size_t i = 0; i < splits; i++) {
+        free(split_values[i]);
+    }
+    free(split_values);
+}
+
 static Column* CreateColumn(double *data, long long count) {
     Column *c = (Column*) calloc(1, sizeof(Column));
     c->data = data;
@@ -108,26 +261,132 @@ static Table *CreateTable(const char *name, Column *c) {
     Table *t = (Table*) calloc(1, sizeof(Table));
     t->name = strdup(name);
     t->columns = c;
+    t->column_map = HashMapCreate(8);
+    for(; c; c = c->next) {
+        HashMapInsert(t->column_map, c->name, c);
+    }
+    pthread_rwlock_init(&t->lock, NULL);
+    pthread_mutex_init(&t->writer_lock, NULL);
     return t;
 }
 
-static void 
-ReadColumnData(Column *column) {
-    if (!column) return;
-    if (column->data) return;
+// Frees a result table (result tables own their column data)
+static void FreeResult(Table *table) {
+    Column *column = table->columns;
+    while (column) {
+        Column *next = column->next;
+        free(column->data);
+        free(column->name);
+        free(column);
+        column = next;
+    }
+    free(table->column_map->entries);
+    free(table->column_map);
+    pthread_rwlock_destroy(&table->lock);
+    pthread_mutex_destroy(&table->writer_lock);
+    free(table->name);
+    free(table);
+}
 
-    FILE *fp = fopen(column->data_location, "r");
-    column->data = malloc(column->size * column->elsize);
-    if (column->data == NULL) {
-        printf("Failed to allocate memory for column.\n");
-        return;
+// Frees a table that was never registered in the catalog (such as a new table of which the COPY failed)
+static void FreeTable(Table *table) {
+    Column *column = table->columns;
+    while (column) {
+        Column *next = column->next;
+        free(column->name);
+        free(column->data_location);
+        free(column);
+        column = next;
     }
-    size_t elements_read = fread(column->data, column->elsize, column->size, fp);
-    if (elements_read != (size_t) (column->size)) {
-        printf("Read incorrect number of elements from file %s, expected %lld elements but read %zu elements.\n", column->data_location, column->size, elements_read);
-        return;
+    free(table->column_map->entries);
+    free(table->column_map);
+    pthread_rwlock_destroy(&table->lock);
+    pthread_mutex_destroy(&table->writer_lock);
+    free(table->name);
+    free(table);
+}
+
+static bool SetColumnType(Column *column, const char *type) {
+    if (strcmp(type, "int") == 0) {
+        column->type = TYPE_int;
+        column->elsize = 4;
+    } else if (strcmp(type, "lng") == 0) {
+        column->type = TYPE_lng;
+        column->elsize = 8;
+    }  else if (strcmp(type, "flt") == 0) {
+        column->type = TYPE_flt;
+        column->elsize = 4;
+    }  else if (strcmp(type, "dbl") == 0) {
+        column->type = TYPE_dbl;
+        column->elsize = 8;
+    } else {
+        return false;
     }
-    fclose(fp);
+    return true;
+}
+
+static const char *GetTypeName(int type) {
+    switch(type) {
+        case TYPE_int:
+            return "int";
+        case TYPE_lng:
+            return "lng";
+        case TYPE_flt:
+            return "flt";
+        case TYPE_dbl:
+            return "dbl";
+        case TYPE_str:
+            return "str";
+    }
+    return NULL;
+}
+
+// Sets the layout of the column data of a table
+// A PAX table stores row groups of BUFFER_CHUNK_SIZE rows in Tables/table/data.pax: a row group holds the values of
+// every column in turn (a mini-page per column), the columns with 8-byte values first so every value is aligned.
+// The row groups are the chunks of a hidden column that is as wide as a row (see PinChunk in buffer.h)
+static void SetTableLayout(Table *table, int layout) {
+    Column *row_groups = table->row_groups;
+    if (row_groups) {
+        free(row_groups->name);
+        free(row_groups->data_location);
+        free(row_groups);
+    }
+    table->layout = layout;
+    table->row_groups = NULL;
+    size_t column_count = 0;
+    for(Column *column = table->columns; column; column = column->next) {
+        column->row_groups = NULL;
+        column->pax_offset = 0;
+        column_count++;
+    }
+    if (layout != LAYOUT_pax) return;
+
+    row_groups = (Column*) calloc(1, sizeof(Column));
+    row_groups->name = strdup("row groups");
+    row_groups->type = TYPE_lng;
+    row_groups->size = table->columns ? table->columns->size : 0;
+    char file_name[500];
+    snprintf(file_name, 500, "Tables/%s/data.pax", table->name);
+    row_groups->data_location = strdup(file_name);
+    // the columns are prepended when the table is read, so the list is walked back-to-front for the order of the .tbl
+    Column **columns = (Column**) malloc((column_count + 1) * sizeof(Column*));
+    size_t i = column_count;
+    for(Column *column = table->columns; column; column = column->next) {
+        columns[--i] = column;
+    }
+    size_t offset = 0;
+    for(unsigned int width = 8; width >= 4; width -= 4) {
+        for(i = 0; i < column_count; i++) {
+            if (columns[i]->elsize != width) continue;
+            columns[i]->row_groups = row_groups;
+            columns[i]->pax_offset = offset;
+            offset += width;
+        }
+    }
+    free(columns);
+    row_groups->elsize = offset;
+    table->row_groups = row_groups;
 }
 
 // Reads a Table from a CSV file (the CSV file must have header information + type information included)
@@ -137,61 +396,71 @@ static Table* ReadTable(const char *table_name, char *name) {
         printf("Failed to open file %s.\n", name);
         return NULL;
     }
-    Table *table = (Table*) calloc(1, sizeof(Table));
-    table->name = strdup(table_name);
-    table->columns = NULL;
+    Table *table = CreateTable(table_name, NULL);
 
     char *line = NULL;
     size_t linecap = 0;
     ssize_t linelen;
+    int layout = LAYOUT_columnar;
     while ((linelen = getline(&line, &linecap, fp)) > 0) {
         size_t split_count;
         char **splits = split(line, ' ', &split_count);
+        if (split_count == 2 && strcmp(splits[0], "layout") == 0) {
+            // the optional first line is the layout of the column data: layout [columnar | pax]
+            layout = strncmp(splits[1], "pax", 3) == 0 ? LAYOUT_pax : LAYOUT_columnar;
+            continue;
+        }
         if (split_count < 3) {
             printf("Expected [name] [type] [size].\n");
             return NULL;
         }
         Column *column = (Column*) calloc(1, sizeof(Column));
         column->name = strdup(splits[0]);
-        column->next = table->columns;
-
-        if (strcmp(splits[1], "int") == 0) {
-            column->type = TYPE_int;
-            column->elsize = 4;
-        } else if (strcmp(splits[1], "lng") == 0) {
-            column->type = TYPE_lng;
-            column->elsize = 8;
-        }  else if (strcmp(splits[1], "flt") == 0) {
-            column->type = TYPE_flt;
-            column->elsize = 4;
-        }  else if (strcmp(splits[1], "dbl") == 0) {
-            column->type = TYPE_dbl;
-            column->elsize = 8;
-        }
+
+        SetColumnType(column, splits[1]);
         column->base_oid = 0;
         column->size = atoll(splits[2]);
         char column_file_name[500];
         snprintf(column_file_name, 500, "Tables/%s/%s.col", table->name, column->name);
-        FILE *fp = fopen(column_file_name, "r");
-        if (fp == NULL) {
-            printf("Unable to open file %s\n", column_file_name);
-            return NULL;
-        }
-        fclose(fp);
+        // the column data is read in chunks when a query uses it (see buffer.h)
         column->data = NULL;
         column->data_location = strdup(column_file_name);
-        table->columns = column;
-        ReadColumnData(column);
+        AddColumn(table, column);
     }
+    free(line);
+    fclose(fp);
+    SetTableLayout(table, layout);
     return table;
 }
 
-
-static void InitializeTable(const char *name) {
+// Writes the metadata file (.tbl) of a table
+// ReadTable() prepends columns, so the list is written back-to-front to preserve the column order of the file
+static bool WriteTableMetadata(Table *table) {
     char table_file[500];
-    snprintf(table_file, 500, "Tables/%s.tbl", name); 
-    printf("# Load table %s from file Tables/%s.tbl.\n", name, name);
-    RegisterTable(ReadTable(name, table_file));
+    snprintf(table_file, 500, "Tables/%s.tbl", table->name);
+    FILE *fp = fopen(table_file, "w+");
+    if (fp == NULL) {
+        printf("Failed to open file %s.\n", table_file);
+        return false;
+    }
+    size_t column_count = 0;
+    for(Column *column = table->columns; column; column = column->next) {
+        column_count++;
+    }
+    Column **columns = (Column**) malloc(column_count * sizeof(Column*));
+    size_t i = column_count;
+    for(Column *column = table->columns; column; column = column->next) {
+        columns[--i] = column;
+    }
+    if (table->layout == LAYOUT_pax) {
+        fprintf(fp, "layout pax\n");
+    }
+    for(i = 0; i < column_count; i++) {
+        fprintf(fp, "%s %s %lld\n", columns[i]->name, GetTypeName(columns[i]->type), columns[i]->size);
+    }
+    free(columns);
+    fclose(fp);
+    return true;
 }
 
 
@@ -238,26 +507,45 @@ static size_t GetWidth(Column *col) {
     return max(GetWidthType(col->type), strlen(col->name));
 }
 
+static int CompareStrings(const void *a, const void *b) {
+    return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
 static void PrintTables() {
-    size_t width = 0;
-    for(int i = 0; i < current_table; i++) {
-        if (tables[i]) {
-            width = max(width, strlen(tables[i]->name) + 4);
+    // list every table in the Tables directory, without loading any of them
+    size_t count = 0, capacity = 16;
+    char **names = (char**) malloc(capacity * sizeof(char*));
+    DIR *directory = opendir("Tables");
+    struct dirent *entry;
+    while (directory && (entry = readdir(directory)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length <= 4 || strcmp(entry->d_name + length - 4, ".tbl") != 0) continue;
+        if (count == capacity) {
+            capacity *= 2;
+            names = (char**) realloc(names, capacity * sizeof(char*));
         }
+        create_substring(&names[count++], entry->d_name, 0, length - 4);
+    }
+    if (directory) closedir(directory);
+    qsort(names, count, sizeof(char*), CompareStrings);
+
+    size_t width = strlen("Tables") + 4;
+    for(size_t i = 0; i < count; i++) {
+        width = max(width, strlen(names[i]) + 4);
     }
     PrintPaddedString("", width, '-'); printf("\n");
     PrintPaddedString("Tables", width, '-'); printf("\n");
     PrintPaddedString("", width, '-'); printf("\n");
 
-    for(int i = 0; i < current_table; i++) {
-        if (tables[i]) {
-            printf("|");
-            PrintPaddedString(tables[i]->name, width - 2, ' ');
-            printf("|\n");
-        }
+    for(size_t i = 0; i < count; i++) {
+        printf("|");
+        PrintPaddedString(names[i], width - 2, ' ');
+        printf("|\n");
+        free(names[i]);
     }
     PrintPaddedString("", width, '-');
     printf("\n");
+    free(names);
 }
 
 static void PrintTable(Table *table) {
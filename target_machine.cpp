@@ -8,12 +8,24 @@
 
 #include "target_machine.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include <llvm/Analysis/TargetLibraryInfo.h>
 #include <llvm/Analysis/TargetTransformInfo.h>
+#include <atomic>
 
-// compile: clang++ -std=c++11 `llvm-config --cxxflags` -c target_machine.cpp  -O3 -o target_machine.o
+// compile: clang++ -std=c++14 `llvm-config --cxxflags` -c target_machine.cpp  -O3 -o target_machine.o
 // library: ar rs libLLVMTargetMachineExtra.a  target_machine.o
-// both: clang++ -std=c++11 `llvm-config --cxxflags` -c target_machine.cpp  -O3 -o target_machine.o && ar rs libLLVMTargetMachineExtra.a target_machine.o
+// both: clang++ -std=c++14 `llvm-config --cxxflags` -c target_machine.cpp  -O3 -o target_machine.o && ar rs libLLVMTargetMachineExtra.a target_machine.o
 
 using namespace llvm;
 
@@ -27,18 +39,220 @@ inline legacy::FunctionPassManager *unwrap_pm(LLVMPassManagerRef P) {
 
 TargetMachine *tm = NULL;
 
+// CPU and features that the generated code is compiled for
+// EngineBuilder (and so MCJIT) targets a generic CPU unless it is told otherwise, so we detect the host CPU and
+// add it to the target machine and to the attributes of every generated function (which the code generator uses)
+static std::string target_cpu;
+static std::string target_features;
+static std::string target_description;
+
+// x86-64 micro-architecture levels, from the newest to the oldest
+static const char *portable_cpus[] = { "x86-64-v4", "x86-64-v3", "x86-64-v2", "x86-64", NULL };
+
+static std::string FeatureString(const StringMap<bool> &features) {
+	std::string result;
+	for (auto &feature : features) {
+		if (!result.empty()) result += ",";
+		result += (feature.second ? "+" : "-") + feature.first().str();
+	}
+	return result;
+}
+
+// Returns true if the host supports every instruction set extension of the cpu
+// Only the features that the host reports are compared, the other features of a CPU describe its tuning
+static bool HostSupports(const Target *target, const std::string &triple, const char *cpu, const StringMap<bool> &host) {
+	std::unique_ptr<MCSubtargetInfo> info(target->createMCSubtargetInfo(triple, "", ""));
+	if (!info || !info->isCPUStringValid(cpu)) return false;
+	std::unique_ptr<MCSubtargetInfo> other(target->createMCSubtargetInfo(triple, cpu, ""));
+	for (auto &feature : host) {
+		if (!feature.second && other->checkFeatures("+" + feature.first().str())) return false;
+	}
+	return true;
+}
+
+// Selects the CPU to generate code for, must be called before the target optimizer is initialized
+//   native:   the host CPU with all of its features
+//   portable: the newest x86-64 micro-architecture level that the host supports (x86-64-v2, v3, v4),
+//             so compiled (and cached) code can be shared by machines with different CPUs of the same level
+//   cpu:      a specific CPU (e.g. skylake or x86-64-v3), if the host does not support it the portable level is used
+// Returns a description of the selected CPU
+const char *LLVMSelectTargetCPU(const char *cpu) {
+	std::string triple = sys::getProcessTriple();
+	std::string error;
+	const Target *target = TargetRegistry::lookupTarget(triple, error);
+	StringMap<bool> host_features;
+	sys::getHostCPUFeatures(host_features);
+	target_cpu = sys::getHostCPUName().str();
+	target_features = FeatureString(host_features);
+	if (target && strcmp(cpu, "native") != 0) {
+		bool portable = strcmp(cpu, "portable") == 0;
+		if (!portable && !HostSupports(target, triple, cpu, host_features)) {
+			fprintf(stderr, "The host does not support CPU %s, using the portable level instead.\n", cpu);
+			portable = true;
+		}
+		if (portable) {
+			for (size_t i = 0; portable_cpus[i]; i++) {
+				if (HostSupports(target, triple, portable_cpus[i], host_features)) {
+					target_cpu = portable_cpus[i];
+					target_features = "";
+					break;
+				}
+			}
+		} else {
+			target_cpu = cpu;
+			target_features = "";
+		}
+	}
+	target_description = target_cpu + (target_features.empty() ? "" : " (host features)");
+	return target_description.c_str();
+}
+
 void LLVMInitializeTargetOptimizer() {
 	if (tm) return;
-	tm = EngineBuilder().selectTarget();
+	if (target_cpu.empty()) LLVMSelectTargetCPU("native");
+	SmallVector<std::string, 64> attributes;
+	SmallVector<StringRef, 64> features;
+	StringRef(target_features).split(features, ",", -1, false);
+	for (auto &feature : features) {
+		attributes.push_back(feature.str());
+	}
+	tm = EngineBuilder().setMCPU(target_cpu).setMAttrs(attributes).selectTarget();
 	tm->setOptLevel(CodeGenOpt::Aggressive);
 }
 
 void LLVMOptimizeModuleForTarget(LLVMModuleRef module) {
 	if (!tm) LLVMInitializeTargetOptimizer();
 	unwrap_mod(module)->setDataLayout(tm->createDataLayout());
+	unwrap_mod(module)->setTargetTriple(tm->getTargetTriple().str());
+}
+
+// Adds the selected CPU and its features to every function of the module, so both the optimization passes and
+// the code generator of MCJIT use them
+void LLVMAddTargetAttributes(LLVMModuleRef module) {
+	if (!tm) LLVMInitializeTargetOptimizer();
+	for (Function &function : *unwrap_mod(module)) {
+		if (function.isDeclaration()) continue;
+		function.addFnAttr("target-cpu", target_cpu);
+		if (!target_features.empty()) function.addFnAttr("target-features", target_features);
+	}
+}
+
+// Returns true if the selected CPU supports the (x86) feature, e.g. avx2 or avx512f
+int LLVMTargetHasFeature(const char *feature) {
+	if (!tm) LLVMInitializeTargetOptimizer();
+	if (!tm->getTargetTriple().isX86()) return false;
+	return tm->getMCSubtargetInfo()->checkFeatures(std::string("+") + feature);
+}
+
+static bool vector_math_library = false;
+
+// Loads glibc's vector math library (libmvec), so vectorized code can call vector variants of exp, log and pow
+// Returns false if the library is not available
+int LLVMLoadVectorMathLibrary() {
+	std::string error;
+	vector_math_library = !sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1", &error);
+	return vector_math_library;
 }
 
 void LLVMAddTargetMachinePasses(LLVMPassManagerRef passManager) {
 	if (!tm) LLVMInitializeTargetOptimizer();
 	unwrap_pm(passManager)->add(createTargetTransformInfoWrapperPass(tm->getTargetIRAnalysis()));
-}
\ No newline at end of file
+	if (vector_math_library) {
+		// tells the loop vectorizer which math functions have vector variants
+		TargetLibraryInfoImpl library(tm->getTargetTriple());
+		library.addVectorizableFunctionsFromVecLib(TargetLibraryInfoImpl::LIBMVEC_X86);
+		unwrap_pm(passManager)->add(new TargetLibraryInfoWrapperPass(library));
+	}
+}
+
+// MCJIT can load the machine code of a module from an object cache instead of generating it, but the C API does not
+// expose object caches. This cache stores the object of a module in the file named by its module identifier
+// (the key of the query in the code cache, see codecache.h).
+class FileObjectCache : public ObjectCache {
+public:
+	void notifyObjectCompiled(const Module *module, MemoryBufferRef object) override {
+		const std::string &path = module->getModuleIdentifier();
+		// write a temporary file and rename it, so other processes never read a partial object
+		int fd;
+		SmallString<256> temp;
+		if (sys::fs::createUniqueFile(path + ".%%%%%%.tmp", fd, temp)) return;
+		{
+			raw_fd_ostream out(fd, true);
+			out << object.getBuffer();
+			out.close();
+			if (out.has_error()) {
+				out.clear_error();
+				sys::fs::remove(temp);
+				return;
+			}
+		}
+		if (sys::fs::rename(temp, path)) sys::fs::remove(temp);
+	}
+
+	std::unique_ptr<MemoryBuffer> getObject(const Module *module) override {
+		auto buffer = MemoryBuffer::getFile(module->getModuleIdentifier(), false, false);
+		if (!buffer) return nullptr;
+		return std::move(*buffer);
+	}
+};
+
+static FileObjectCache object_cache;
+
+void LLVMSetFileObjectCache(LLVMExecutionEngineRef engine) {
+	unwrap(engine)->setObjectCache(&object_cache);
+}
+// The memory manager of MCJIT allocates the code and data sections of the compiled modules, and frees them when the
+// execution engine is disposed. This one counts the bytes of the sections, so the JIT memory in use can be reported.
+static std::atomic<size_t> jit_memory_used(0);
+static std::atomic<size_t> jit_memory_peak(0);
+
+class CountingMemoryManager : public SectionMemoryManager {
+public:
+	~CountingMemoryManager() override {
+		jit_memory_used -= allocated;
+	}
+
+	uint8_t *allocateCodeSection(uintptr_t size, unsigned alignment, unsigned id, StringRef name) override {
+		Count(size + alignment);
+		return SectionMemoryManager::allocateCodeSection(size, alignment, id, name);
+	}
+
+	uint8_t *allocateDataSection(uintptr_t size, unsigned alignment, unsigned id, StringRef name, bool read_only) override {
+		Count(size + alignment);
+		return SectionMemoryManager::allocateDataSection(size, alignment, id, name, read_only);
+	}
+
+	size_t Allocated() const {
+		return allocated;
+	}
+
+private:
+	std::atomic<size_t> allocated{0};
+
+	void Count(size_t size) {
+		allocated += size;
+		size_t used = jit_memory_used += size;
+		size_t peak = jit_memory_peak;
+		while (used > peak && !jit_memory_peak.compare_exchange_weak(peak, used)) {
+		}
+	}
+};
+
+LLVMMCJITMemoryManagerRef LLVMCreateCountingMemoryManager() {
+	// the execution engine takes ownership of the memory manager
+	RTDyldMemoryManager *manager = new CountingMemoryManager();
+	return reinterpret_cast<LLVMMCJITMemoryManagerRef>(manager);
+}
+
+size_t LLVMJITMemoryOf(LLVMMCJITMemoryManagerRef manager) {
+	RTDyldMemoryManager *base = reinterpret_cast<RTDyldMemoryManager*>(manager);
+	return static_cast<CountingMemoryManager*>(base)->Allocated();
+}
+
+size_t LLVMJITMemoryUsed() {
+	return jit_memory_used;
+}
+
+size_t LLVMJITMemoryPeak() {
+	return jit_memory_peak;
+}
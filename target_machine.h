@@ -8,10 +8,20 @@ extern "C" {
 #endif
 
 #include "llvm-c/Types.h"
+#include "llvm-c/ExecutionEngine.h"
 
+const char *LLVMSelectTargetCPU(const char *cpu);
 void LLVMInitializeTargetOptimizer();
 void LLVMOptimizeModuleForTarget(LLVMModuleRef module);
+void LLVMAddTargetAttributes(LLVMModuleRef module);
+int LLVMTargetHasFeature(const char *feature);
+int LLVMLoadVectorMathLibrary();
 void LLVMAddTargetMachinePasses(LLVMPassManagerRef passManager);
+void LLVMSetFileObjectCache(LLVMExecutionEngineRef engine);
+LLVMMCJITMemoryManagerRef LLVMCreateCountingMemoryManager();
+size_t LLVMJITMemoryOf(LLVMMCJITMemoryManagerRef manager);
+size_t LLVMJITMemoryUsed();
+size_t LLVMJITMemoryPeak();
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,129 @@
+# Helpers for the tests: start a RembranDB server on a temporary directory and talk to it over its Unix socket
+# (see the protocol in server.h)
+
+import json
+import os
+import shutil
+import signal
+import socket
+import struct
+import subprocess
+import tempfile
+import time
+
+BINARY = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'rembrandb')
+FORMATS = {1: 'i', 2: 'q', 3: 'f', 4: 'd'}
+
+
+class QueryError(Exception):
+    pass
+
+
+class Server:
+    def __init__(self, *args):
+        self.directory = tempfile.mkdtemp(prefix='rembrandb-test-')
+        self.socket_path = os.path.join(self.directory, 'socket')
+        self.output_path = os.path.join(self.directory, 'output')
+        self.args = list(args)
+        self.process = None
+        self.sessions = []
+
+    def write_csv(self, name, header, rows):
+        path = os.path.join(self.directory, name)
+        with open(path, 'w') as f:
+            f.write(header + '\n')
+            for row in rows:
+                f.write(','.join(str(value) for value in row) + '\n')
+        return path
+
+    def start(self):
+        if os.path.exists(self.socket_path):
+            os.unlink(self.socket_path)
+        with open(self.output_path, 'w') as output:
+            self.process = subprocess.Popen([BINARY, '-socket', self.socket_path, '-no-print'] + self.args,
+                                            cwd=self.directory, stdout=output, stderr=subprocess.DEVNULL)
+        for _ in range(200):
+            if os.path.exists(self.socket_path):
+                return self
+            if self.process.poll() is not None:
+                raise RuntimeError('server exited with status %d' % self.process.returncode)
+            time.sleep(0.05)
+        raise RuntimeError('server did not start')
+
+    def stop(self):
+        if self.process and self.process.poll() is None:
+            self.process.terminate()
+            self.process.wait()
+        return self.process.returncode
+
+    # Returns the statistics the server writes on SIGUSR1 (see stats.h)
+    def stats(self):
+        with open(self.output_path) as f:
+            start = len(f.read())
+        self.process.send_signal(signal.SIGUSR1)
+        for _ in range(200):
+            with open(self.output_path) as f:
+                output = f.read()[start:]
+            begin = output.find('{"queries"')
+            if begin >= 0:
+                try:
+                    return json.loads(output[begin:])
+                except ValueError:
+                    pass
+            time.sleep(0.05)
+        raise RuntimeError('server did not write its statistics')
+
+    def connect(self):
+        session = Session(self.socket_path)
+        self.sessions.append(session)
+        return session
+
+    def __enter__(self):
+        return self.start()
+
+    def __exit__(self, *exception):
+        for session in self.sessions:
+            session.close()
+        self.stop()
+        shutil.rmtree(self.directory, ignore_errors=True)
+
+
+class Session:
+    def __init__(self, path):
+        self.socket = socket.socket(socket.AF_UNIX)
+        self.socket.connect(path)
+
+    def receive(self, length):
+        data = b''
+        while len(data) < length:
+            chunk = self.socket.recv(length - len(data))
+            if not chunk:
+                raise EOFError('connection closed')
+            data += chunk
+        return data
+
+    # Runs a statement, returns (row count, [(name, values)]) or raises QueryError
+    def query(self, statement):
+        data = statement.encode()
+        self.socket.sendall(struct.pack('<I', len(data)) + data)
+        status, = struct.unpack('<I', self.receive(4))
+        if status != 0:
+            length, = struct.unpack('<I', self.receive(4))
+            raise QueryError(self.receive(length).decode())
+        column_count, row_count = struct.unpack('<IQ', self.receive(12))
+        columns = []
+        for _ in range(column_count):
+            column_type, = struct.unpack('<B', self.receive(1))
+            length, = struct.unpack('<I', self.receive(4))
+            name = self.receive(length).decode()
+            fmt = FORMATS[column_type]
+            values = struct.unpack('<%d%s' % (row_count, fmt), self.receive(row_count * struct.calcsize(fmt)))
+            columns.append((name, list(values)))
+        return row_count, columns
+
+    # Runs a query and returns the values of its first column
+    def values(self, statement):
+        return self.query(statement)[1][0][1]
+
+    def close(self):
+        self.socket.close()
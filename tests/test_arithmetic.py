@@ -0,0 +1,70 @@
+# Integer arithmetic that traps in hardware (division by zero, the minimum divided by -1) must not crash the server
+
+import os
+import sys
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from rembrandb import Server
+
+INT_MIN = -2 ** 31
+LLONG_MIN = -2 ** 63
+
+
+class DivisionTest(unittest.TestCase):
+    def run_queries(self, *args):
+        with Server('-no-code-cache', *args) as server:
+            server.write_csv('e.csv', 'x:int,y:lng', [(INT_MIN, LLONG_MIN), (7, 7), (-8, 9)])
+            session = server.connect()
+            session.query("COPY e FROM 'e.csv'")
+            # x / -1 wraps for the minimum, as -x does
+            self.assertEqual(session.values('SELECT x / (0 - 1) FROM e'), [INT_MIN, -7, 8])
+            self.assertEqual(session.values('SELECT y / (0 - 1) FROM e'), [LLONG_MIN, -7, -9])
+            self.assertEqual(session.values('SELECT x % (0 - 1) FROM e'), [0, 0, 0])
+            self.assertEqual(session.values('SELECT y % (0 - 1) FROM e'), [0, 0, 0])
+            self.assertEqual(session.values('SELECT x / 0 FROM e'), [0, 0, 0])
+            self.assertEqual(session.values('SELECT y / x FROM e'), [2 ** 32, 1, -1])
+            self.assertEqual(session.values('SELECT x FROM e WHERE x / (0 - 1) < 0'), [INT_MIN, 7])
+            self.assertIsNone(server.process.poll())
+
+    def test_division(self):
+        self.run_queries()
+
+    def test_division_optimized(self):
+        self.run_queries('-opt')
+
+    def test_division_scalar(self):
+        self.run_queries('-no-simd')
+
+
+class BooleanComparisonTest(unittest.TestCase):
+    # true orders above false, as 1 > 0
+    def run_queries(self, *args):
+        rows = [(x, y) for x in (-1, 0, 1, 2) for y in (0, 50, 51, 100)]
+        expected = {
+            '>': sum(1 for x, y in rows if x > 0 and y <= 50),
+            '<': sum(1 for x, y in rows if x <= 0 and y > 50),
+            '>=': sum(1 for x, y in rows if x > 0 or y <= 50),
+            '<=': sum(1 for x, y in rows if x <= 0 or y > 50),
+        }
+        with Server('-no-code-cache', *args) as server:
+            server.write_csv('b.csv', 'x:int,y:dbl', rows)
+            session = server.connect()
+            session.query("COPY b FROM 'b.csv'")
+            for operator, count in expected.items():
+                query = 'SELECT COUNT(*) FROM b WHERE (x > 0) %s (y > 50)' % operator
+                self.assertEqual(session.values(query), [count], query)
+            self.assertEqual(session.values('SELECT x FROM b WHERE (x > 0) > (y > 50) AND y = 0'), [1, 2])
+
+    def test_boolean_comparison(self):
+        self.run_queries()
+
+    def test_boolean_comparison_optimized(self):
+        self.run_queries('-opt')
+
+    def test_boolean_comparison_scalar(self):
+        self.run_queries('-no-simd')
+
+
+if __name__ == '__main__':
+    unittest.main()
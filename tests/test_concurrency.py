@@ -0,0 +1,121 @@
+# Statements that change a table (COPY, INSERT and ALTER TABLE) from concurrent sessions must not interleave
+
+import os
+import sys
+import threading
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from rembrandb import Server, QueryError
+
+ROWS = 1000000
+
+
+# Runs the statement in every session at the same time, returns the results (or errors) in the order of the sessions
+def run_concurrently(sessions, statement):
+    results = [None] * len(sessions)
+    barrier = threading.Barrier(len(sessions))
+
+    def run(i):
+        barrier.wait()
+        try:
+            results[i] = sessions[i].query(statement)
+        except QueryError as error:
+            results[i] = error
+    threads = [threading.Thread(target=run, args=(i,)) for i in range(len(sessions))]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    return results
+
+
+def column_file_rows(server, table, column, width):
+    return os.path.getsize(os.path.join(server.directory, 'Tables', table, column + '.col')) // width
+
+
+def table_file_rows(server, table):
+    with open(os.path.join(server.directory, 'Tables', table + '.tbl')) as f:
+        return [int(line.split()[2]) for line in f if len(line.split()) == 3]
+
+
+class ConcurrentCopyTest(unittest.TestCase):
+    def test_concurrent_copy(self):
+        with Server('-threads', '2') as server:
+            server.write_csv('u.csv', 'k:lng,v:int', ((i, i % 1000) for i in range(ROWS)))
+            sessions = [server.connect() for _ in range(3)]
+            sessions[0].query("COPY u FROM 'u.csv'")
+            results = run_concurrently(sessions, "COPY u FROM 'u.csv'")
+            # every COPY appends all rows, and reports the rows of the table after it
+            self.assertEqual(sorted(result[0] for result in results), [2 * ROWS, 3 * ROWS, 4 * ROWS])
+            self.assertEqual(table_file_rows(server, 'u'), [4 * ROWS, 4 * ROWS])
+            self.assertEqual(column_file_rows(server, 'u', 'k', 8), 4 * ROWS)
+            self.assertEqual(column_file_rows(server, 'u', 'v', 4), 4 * ROWS)
+            self.assertEqual(sessions[0].values('SELECT COUNT(k) FROM u'), [4 * ROWS])
+            self.assertEqual(sessions[0].values('SELECT SUM(k) FROM u'), [4 * ROWS * (ROWS - 1) // 2])
+
+    def test_concurrent_copy_new_table(self):
+        with Server('-threads', '2') as server:
+            server.write_csv('n.csv', 'k:lng', ((i,) for i in range(ROWS)))
+            sessions = [server.connect() for _ in range(3)]
+            results = run_concurrently(sessions, "COPY n FROM 'n.csv'")
+            self.assertEqual(sorted(result[0] for result in results), [ROWS, 2 * ROWS, 3 * ROWS])
+            self.assertEqual(column_file_rows(server, 'n', 'k', 8), 3 * ROWS)
+            self.assertEqual(sessions[0].values('SELECT COUNT(k) FROM n'), [3 * ROWS])
+
+    def test_concurrent_copy_and_insert(self):
+        with Server('-threads', '2') as server:
+            server.write_csv('u.csv', 'k:lng,v:int', ((i, 1) for i in range(ROWS)))
+            sessions = [server.connect() for _ in range(3)]
+            sessions[0].query("COPY u FROM 'u.csv'")
+            inserts = []
+
+            def insert():
+                for i in range(200):
+                    inserts.append(sessions[2].query('INSERT INTO u VALUES (%d, 2)' % i))
+            thread = threading.Thread(target=insert)
+            thread.start()
+            sessions[1].query("COPY u FROM 'u.csv'")
+            thread.join()
+            self.assertEqual(sessions[0].values('SELECT COUNT(k) FROM u'), [2 * ROWS + 200])
+            self.assertEqual(sessions[0].values('SELECT SUM(v) FROM u'), [2 * ROWS + 400])
+
+
+class ConcurrentLayoutTest(unittest.TestCase):
+    def assert_table(self, server, session, layout):
+        files = os.listdir(os.path.join(server.directory, 'Tables', 'p'))
+        with open(os.path.join(server.directory, 'Tables', 'p.tbl')) as f:
+            pax = f.readline().split() == ['layout', 'pax']
+        if layout == 'pax':
+            self.assertTrue(pax)
+            self.assertEqual(sorted(files), ['data.pax'])
+        else:
+            self.assertFalse(pax)
+            self.assertEqual(sorted(files), ['a.col', 'b.col', 'c.col'])
+        self.assertEqual(session.values('SELECT COUNT(a) FROM p'), [ROWS])
+        self.assertEqual(session.values('SELECT SUM(a) FROM p'), [ROWS * (ROWS - 1) // 2])
+        self.assertEqual(session.values('SELECT SUM(b) FROM p'), [ROWS])
+        self.assertEqual(session.values('SELECT SUM(c) FROM p'), [2 * ROWS])
+
+    def test_concurrent_conversion(self):
+        with Server('-threads', '2') as server:
+            server.write_csv('p.csv', 'a:lng,b:int,c:lng', ((i, 1, 2) for i in range(ROWS)))
+            sessions = [server.connect() for _ in range(3)]
+            sessions[0].query("COPY p FROM 'p.csv'")
+            # every conversion succeeds, the ones that come second find the table already converted
+            results = run_concurrently(sessions, 'ALTER TABLE p SET LAYOUT PAX')
+            self.assertEqual([result[0] for result in results], [ROWS] * 3)
+            self.assert_table(server, sessions[0], 'pax')
+            results = run_concurrently(sessions, 'ALTER TABLE p SET LAYOUT COLUMNAR')
+            self.assertEqual([result[0] for result in results], [ROWS] * 3)
+            self.assert_table(server, sessions[0], 'columnar')
+            # the files are complete: a new server reads the same table
+            for session in sessions:
+                session.close()
+            server.stop()
+            server.start()
+            self.assert_table(server, server.connect(), 'columnar')
+
+
+if __name__ == '__main__':
+    unittest.main()
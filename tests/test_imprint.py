@@ -0,0 +1,91 @@
+# Scans that skip cache lines with column imprints return the same rows as scans without them
+
+import os
+import sys
+import time
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from rembrandb import Server
+
+# more rows than IMPRINT_MIN_ROWS, the chunks hold 65536 rows
+ROWS = 300000
+CHUNK = 65536
+
+# WHERE clauses and the same predicate on a row (z, w, l); z is clustered, so most of its cache lines are skipped
+PREDICATES = [
+    ('z >= %d AND z < %d' % (CHUNK, 2 * CHUNK), lambda z, w, l: CHUNK <= z < 2 * CHUNK),
+    ('z > %d' % (CHUNK - 1), lambda z, w, l: z > CHUNK - 1),
+    ('z <= %d' % CHUNK, lambda z, w, l: z <= CHUNK),
+    ('z = %d' % (2 * CHUNK - 1), lambda z, w, l: z == 2 * CHUNK - 1),
+    ('z > %d AND z < %d' % (3 * CHUNK - 20, 3 * CHUNK + 20), lambda z, w, l: 3 * CHUNK - 20 < z < 3 * CHUNK + 20),
+    # the constant on the left side
+    ('100 > z', lambda z, w, l: 100 > z),
+    ('%d <= z AND %d > z' % (CHUNK, CHUNK + 16), lambda z, w, l: CHUNK <= z < CHUNK + 16),
+    ('%d = z' % (4 * CHUNK), lambda z, w, l: z == 4 * CHUNK),
+    # fractional constants on an int column
+    ('z < 100.5', lambda z, w, l: z < 100.5),
+    ('z >= %d.5' % (CHUNK - 1), lambda z, w, l: z >= CHUNK - 0.5),
+    ('z > 1000.5 AND z <= 1003.5', lambda z, w, l: 1000.5 < z <= 1003.5),
+    ('z = 70000.5', lambda z, w, l: z == 70000.5),
+    ('z > 0 - 0.5 AND z < 0.5', lambda z, w, l: -0.5 < z < 0.5),
+    # dbl and lng columns, and predicates on several columns
+    ('w < 0 - 999', lambda z, w, l: w < -999),
+    ('w >= %d.25' % (CHUNK // 2 - 1000), lambda z, w, l: w >= CHUNK // 2 - 1000 + 0.25),
+    ('l > %d AND z < %d' % (3 * CHUNK * 3, 4 * CHUNK), lambda z, w, l: l > 3 * CHUNK * 3 and z < 4 * CHUNK),
+    ('%d < l AND w < %d' % (2 * CHUNK * 3, CHUNK), lambda z, w, l: 2 * CHUNK * 3 < l and w < CHUNK),
+]
+
+# appended rows in front of, inside and behind the range of the column
+INSERTED = [(z, z * 0.5 - 1000, z * 3) for z in list(range(-50, 0)) + list(range(CHUNK - 5, CHUNK + 5)) +
+            list(range(ROWS, ROWS + 100))]
+
+
+def row(z):
+    return (z, z * 0.5 - 1000, z * 3)
+
+
+class ImprintTest(unittest.TestCase):
+    def run_queries(self, server, session):
+        results = []
+        for where, _ in PREDICATES:
+            results.append(sorted(session.values('SELECT z FROM t WHERE %s' % where)))
+        return results
+
+    def expected(self, rows):
+        return [sorted(r[0] for r in rows if predicate(*r)) for _, predicate in PREDICATES]
+
+    def run_server(self, *args):
+        with Server('-no-result-cache', '-merge-threshold', '10', *args) as server:
+            server.write_csv('t.csv', 'z:int,w:dbl,l:lng', (row(z) for z in range(ROWS)))
+            session = server.connect()
+            session.query("COPY t FROM 't.csv'")
+            session.query('CREATE INDEX ON t (z, w, l)')
+            before = self.run_queries(server, session)
+            values = ', '.join('(%d, %r, %d)' % r for r in INSERTED)
+            session.query('INSERT INTO t VALUES %s' % values)
+            # wait for the background merge, after which the imprints have to be extended with the appended rows
+            path = os.path.join(server.directory, 'Tables', 't', 'z.col')
+            for _ in range(200):
+                if os.path.getsize(path) == 4 * (ROWS + len(INSERTED)):
+                    break
+                time.sleep(0.05)
+            self.assertEqual(os.path.getsize(path), 4 * (ROWS + len(INSERTED)))
+            after = self.run_queries(server, session)
+            return before, after
+
+    def test_imprints(self):
+        rows = [row(z) for z in range(ROWS)]
+        expected_before = self.expected(rows)
+        expected_after = self.expected(rows + INSERTED)
+        with_imprints = self.run_server()
+        without_imprints = self.run_server('-no-imprints')
+        for results in (with_imprints, without_imprints):
+            for (where, _), result, expected in zip(PREDICATES, results[0], expected_before):
+                self.assertEqual(result, expected, where)
+            for (where, _), result, expected in zip(PREDICATES, results[1], expected_after):
+                self.assertEqual(result, expected, 'after the merge: ' + where)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,78 @@
+# Hash joins return every matching pair exactly once, whichever table is the build side
+
+import os
+import sys
+import unittest
+from collections import defaultdict
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from rembrandb import Server
+
+LARGE = 150000
+SMALL = 5000
+# every pair (a.id, b.id) is returned as one lng
+PAIR = 'a.id * 1000000 + b.id'
+
+
+def large_rows():
+    return [(i, (i * 7) % 3000, i % 100, ((i * 13) % 600) * 0.5 - 100) for i in range(LARGE)]
+
+
+def small_rows():
+    # every key occurs several times on the build side
+    return [(i, i % 1000, (i * 3) % 100, ((i * 11) % 800) * 0.5 - 100) for i in range(SMALL)]
+
+
+def join(left, right, left_key, right_key, condition=lambda l, r: True):
+    index = defaultdict(list)
+    for r in right:
+        index[r[right_key]].append(r)
+    return sorted(l[0] * 1000000 + r[0] for l in left for r in index[l[left_key]] if condition(l, r))
+
+
+class JoinTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.large = large_rows()
+        cls.small = small_rows()
+
+    def check(self, session, query, expected):
+        self.assertEqual(sorted(session.values(query)), expected, query)
+
+    def run_joins(self, large, small, *args):
+        with Server('-no-result-cache', *args) as server:
+            server.write_csv('large.csv', 'id:lng,k:int,v:int,f:dbl', self.large)
+            server.write_csv('small.csv', 'id:lng,k:int,v:int,f:dbl', self.small)
+            session = server.connect()
+            session.query("COPY %s FROM 'large.csv'" % large)
+            session.query("COPY %s FROM 'small.csv'" % small)
+            a, b = (self.large, self.small) if large == 'a' else (self.small, self.large)
+            self.check(session, 'SELECT %s FROM a JOIN b ON a.k = b.k' % PAIR, join(a, b, 1, 1))
+            self.check(session, 'SELECT %s FROM a, b WHERE a.k = b.k' % PAIR, join(a, b, 1, 1))
+            self.check(session, 'SELECT %s FROM b JOIN a ON b.k = a.k' % PAIR, join(a, b, 1, 1))
+            # conjuncts on one side are filters, the ones that use both tables are evaluated for every match
+            self.check(session, 'SELECT %s FROM a JOIN b ON a.k = b.k WHERE a.v < b.v' % PAIR,
+                       join(a, b, 1, 1, lambda l, r: l[2] < r[2]))
+            self.check(session, 'SELECT %s FROM a, b WHERE a.v > 10 AND a.k = b.k AND b.v < 50 AND a.v + b.v > 90' % PAIR,
+                       join(a, b, 1, 1, lambda l, r: l[2] > 10 and r[2] < 50 and l[2] + r[2] > 90))
+            self.check(session, 'SELECT %s FROM a JOIN b ON a.f = b.f' % PAIR, join(a, b, 3, 3))
+            self.check(session, 'SELECT %s FROM a JOIN b ON a.f = b.f WHERE a.k > b.k' % PAIR,
+                       join(a, b, 3, 3, lambda l, r: l[1] > r[1]))
+            matches = len(join(a, b, 1, 1))
+            self.assertEqual(len(session.values('SELECT a.v FROM a JOIN b ON a.k = b.k')), matches)
+
+    def test_build_right(self):
+        self.run_joins('a', 'b')
+
+    def test_build_left(self):
+        self.run_joins('b', 'a')
+
+    def test_build_right_threads(self):
+        self.run_joins('a', 'b', '-threads', '4')
+
+    def test_build_left_optimized(self):
+        self.run_joins('b', 'a', '-opt')
+
+
+if __name__ == '__main__':
+    unittest.main()
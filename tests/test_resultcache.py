@@ -0,0 +1,78 @@
+# The result cache returns its copy of a result while the tables of the query do not change, and never a stale one
+
+import os
+import sys
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from rembrandb import Server
+
+ROWS = 1000
+
+
+class ResultCacheTest(unittest.TestCase):
+    def cache_counts(self, server):
+        stats = server.stats()['result_cache']
+        return stats['hits'], stats['misses']
+
+    # Runs the query and returns its values and whether the result came from the cache
+    def run_query(self, server, session, query):
+        hits, misses = self.cache_counts(server)
+        values = session.values(query)
+        new_hits, new_misses = self.cache_counts(server)
+        self.assertEqual(new_hits + new_misses, hits + misses + 1)
+        return values, new_hits > hits
+
+    def test_invalidation(self):
+        with Server('-result-cache-min-cost', '0') as server:
+            server.write_csv('r.csv', 'k:int', ((i,) for i in range(ROWS)))
+            server.write_csv('s.csv', 'k:int,v:int', ((i, 2) for i in range(10)))
+            session = server.connect()
+            session.query("COPY r FROM 'r.csv'")
+            session.query("COPY s FROM 's.csv'")
+            total = ROWS * (ROWS - 1) // 2
+            query = 'SELECT SUM(k) FROM r'
+            self.assertEqual(self.run_query(server, session, query), ([total], False))
+            self.assertEqual(self.run_query(server, session, query), ([total], True))
+            # the key is the normalized text of the query
+            self.assertEqual(self.run_query(server, session, 'SELECT  SUM(k)\n  FROM r'), ([total], True))
+            # a cached result stays valid for other sessions
+            self.assertEqual(self.run_query(server, server.connect(), query), ([total], True))
+
+            session.query('INSERT INTO r VALUES (5000), (6000)')
+            total += 11000
+            self.assertEqual(self.run_query(server, session, query), ([total], False))
+            self.assertEqual(self.run_query(server, session, query), ([total], True))
+
+            session.query("COPY r FROM 'r.csv'")
+            total += ROWS * (ROWS - 1) // 2
+            self.assertEqual(self.run_query(server, session, query), ([total], False))
+            self.assertEqual(self.run_query(server, session, query), ([total], True))
+
+            # a join is invalidated by changes to either table
+            join = 'SELECT r.k * s.v FROM r JOIN s ON r.k = s.k WHERE r.k < 3'
+            self.assertEqual(sorted(self.run_query(server, session, join)[0]), [0, 0, 2, 2, 4, 4])
+            self.assertEqual(self.run_query(server, session, join)[1], True)
+            session.query('INSERT INTO s VALUES (1, 10)')
+            values, hit = self.run_query(server, session, join)
+            self.assertEqual((sorted(values), hit), ([0, 0, 2, 2, 4, 4, 10, 10], False))
+
+    def test_many_queries(self):
+        # every query has its own entry, and the entries are found again after others were added and evicted
+        with Server('-result-cache-min-cost', '0', '-result-cache-size', '20K') as server:
+            server.write_csv('r.csv', 'k:int', ((i,) for i in range(ROWS)))
+            session = server.connect()
+            session.query("COPY r FROM 'r.csv'")
+            for i in range(200):
+                self.assertEqual(session.values('SELECT COUNT(k) FROM r WHERE k < %d' % i), [i])
+            hits, _ = self.cache_counts(server)
+            # the most recent results are still cached, the oldest ones were evicted
+            for i in reversed(range(200)):
+                self.assertEqual(session.values('SELECT COUNT(k) FROM r WHERE k < %d' % i), [i])
+            new_hits, _ = self.cache_counts(server)
+            self.assertGreater(new_hits, hits)
+            self.assertLess(new_hits, hits + 200)
+
+
+if __name__ == '__main__':
+    unittest.main()
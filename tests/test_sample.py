@@ -0,0 +1,63 @@
+# Estimates of aggregates over TABLESAMPLE and their confidence intervals
+
+import math
+import os
+import sys
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from rembrandb import Server
+
+BLOCK = 65536
+BLOCKS = 5
+
+
+class SampleTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.server = Server('-no-result-cache')
+        cls.server.start()
+        # the values are clustered: every block holds a single value
+        cls.server.write_csv('s.csv', 'b:int', ((i // BLOCK,) for i in range(BLOCKS * BLOCK)))
+        cls.session = cls.server.connect()
+        cls.session.query("COPY s FROM 's.csv'")
+
+    @classmethod
+    def tearDownClass(cls):
+        cls.server.__exit__(None, None, None)
+
+    def estimate(self, statement):
+        columns = self.session.query(statement)[1]
+        self.assertEqual([name for name, _ in columns], ['estimate', 'lower', 'upper'])
+        return [values[0] for _, values in columns]
+
+    def test_small_sample_is_not_nan(self):
+        # 10% of 5 blocks usually selects no block, the sample then has one block
+        for seed in range(20):
+            estimate, lower, upper = self.estimate('SELECT COUNT(*) FROM s TABLESAMPLE (10 PERCENT) REPEATABLE (%d)' % seed)
+            self.assertEqual(estimate, BLOCKS * BLOCK)
+            for value in self.estimate('SELECT SUM(b) FROM s TABLESAMPLE (10 PERCENT) REPEATABLE (%d)' % seed):
+                self.assertFalse(math.isnan(value))
+
+    def test_single_block_interval_is_unbounded(self):
+        estimate, lower, upper = self.estimate('SELECT SUM(b) FROM s TABLESAMPLE (1 PERCENT) REPEATABLE (7)')
+        self.assertEqual((lower, upper), (-math.inf, math.inf))
+
+    def test_full_sample_is_exact(self):
+        total = sum(range(BLOCKS)) * BLOCK
+        self.assertEqual(self.estimate('SELECT SUM(b) FROM s TABLESAMPLE (100 PERCENT)'), [total] * 3)
+
+    def test_interval_covers_clustered_values(self):
+        # the blocks are the units of the sample, so the interval reflects the spread between blocks
+        total = sum(range(BLOCKS)) * BLOCK
+        for seed in range(20):
+            estimate, lower, upper = self.estimate('SELECT SUM(b) FROM s TABLESAMPLE (60 PERCENT) REPEATABLE (%d)' % seed)
+            self.assertLessEqual(lower, estimate)
+            self.assertLessEqual(estimate, upper)
+            # unless every block was sampled (then the estimate is exact), the blocks differ so the interval is not empty
+            if math.isfinite(lower) and estimate != total:
+                self.assertGreater(upper - lower, 0)
+
+
+if __name__ == '__main__':
+    unittest.main()
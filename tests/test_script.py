@@ -0,0 +1,57 @@
+# A script (-f) reports every statement that fails, also the ones that are not compiled ahead
+
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from rembrandb import BINARY
+
+
+class ScriptTest(unittest.TestCase):
+    def run_script(self, statements):
+        directory = tempfile.mkdtemp(prefix='rembrandb-test-')
+        try:
+            with open(os.path.join(directory, 's.csv'), 'w') as f:
+                f.write('k:int\n' + ''.join('%d\n' % i for i in range(100)))
+            with open(os.path.join(directory, 'script.sql'), 'w') as f:
+                f.write(''.join(statement + ';\n' for statement in statements))
+            output = subprocess.run([BINARY, '-f', 'script.sql'], cwd=directory, stdout=subprocess.PIPE,
+                                    stderr=subprocess.STDOUT, universal_newlines=True, timeout=120).stdout
+        finally:
+            shutil.rmtree(directory, ignore_errors=True)
+        summary = re.search(r'Script: (\d+) statements \((\d+) failed\)', output)
+        self.assertIsNotNone(summary, output)
+        failed = [int(number) for number in re.findall(r'^\[(\d+)\] failed', output, re.MULTILINE)]
+        return int(summary.group(1)), int(summary.group(2)), failed
+
+    def test_failed_statements(self):
+        count, failed, statements = self.run_script([
+            "COPY s FROM 's.csv'",
+            "COPY s FROM 'missing.csv'",
+            "ALTER TABLE s SET LAYOUT PAX",
+            "INSERT INTO s VALUES (1)",
+            "SET OPTIMIZE 'no-such-pass'",
+            "SELECT SUM(k) FROM s",
+        ])
+        self.assertEqual((count, failed), (6, 3))
+        self.assertEqual(statements, [2, 4, 5])
+
+    def test_successful_statements(self):
+        count, failed, statements = self.run_script([
+            "COPY s FROM 's.csv'",
+            "INSERT INTO s VALUES (1), (2)",
+            "CREATE INDEX ON s (k)",
+            "SET OPTIMIZE fast",
+            "SELECT k FROM s WHERE k > 50",
+        ])
+        self.assertEqual((count, failed), (5, 0))
+        self.assertEqual(statements, [])
+
+
+if __name__ == '__main__':
+    unittest.main()
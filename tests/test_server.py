@@ -0,0 +1,35 @@
+# Sessions only hold on to a session thread while one of their requests runs, so idle clients do not starve the others
+
+import os
+import sys
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from rembrandb import Server
+
+
+class SessionTest(unittest.TestCase):
+    def test_more_connections_than_sessions(self):
+        with Server('-sessions', '2') as server:
+            server.write_csv('s.csv', 'k:int', ((i,) for i in range(1000)))
+            idle = [server.connect() for _ in range(8)]
+            active = [server.connect() for _ in range(2)]
+            for session in idle + active:
+                # a request that never gets a session thread fails the test instead of hanging it
+                session.socket.settimeout(10)
+            active[0].query("COPY s FROM 's.csv'")
+            for _ in range(20):
+                for session in active:
+                    self.assertEqual(session.values('SELECT SUM(k) FROM s'), [499500])
+            # the idle sessions are still served, also after some of them disconnect
+            for session in idle[:4]:
+                session.close()
+            for session in idle[4:]:
+                self.assertEqual(session.values('SELECT COUNT(k) FROM s'), [1000])
+            late = server.connect()
+            late.socket.settimeout(10)
+            self.assertEqual(late.values('SELECT MAX(k) FROM s'), [999])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,70 @@
+# ORDER BY sorts every type in both directions, keeps ties in the order of the input and agrees with LIMIT (top-N)
+
+import os
+import sys
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from rembrandb import Server
+
+# more rows than a morsel (65536 rows), so several sorted runs are merged
+ROWS = 200000
+
+
+def table_rows():
+    rows = []
+    for p in range(ROWS):
+        i = (p * 7919) % 2001 - 1000
+        l = ((p * 104729) % 100003 - 50000) * 10 ** 10
+        f = ((p * 31) % 401 - 200) * 0.25
+        d = ((p * 17) % 1001 - 500) * 0.5
+        # both zeros occur, they compare equal
+        if p % 2 == 1:
+            f = -f if f == 0 else f
+            d = -d if d == 0 else d
+        rows.append((p, i, l, f, d))
+    return rows
+
+
+class SortTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        cls.rows = table_rows()
+
+    # positions in the order of ORDER BY column (ties in the order of the input)
+    def expected(self, column, descending):
+        index = 'pilfd'.index(column)
+        sign = -1 if descending else 1
+        return [row[0] for row in sorted(self.rows, key=lambda row: sign * row[index])]
+
+    def run_sorts(self, *args):
+        with Server('-no-result-cache', *args) as server:
+            server.write_csv('t.csv', 'p:lng,i:int,l:lng,f:flt,d:dbl', self.rows)
+            session = server.connect()
+            session.query("COPY t FROM 't.csv'")
+            for column in 'ilfd':
+                for direction in ('', ' ASC', ' DESC'):
+                    query = 'SELECT p FROM t ORDER BY %s%s' % (column, direction)
+                    expected = self.expected(column, direction == ' DESC')
+                    self.assertEqual(session.values(query), expected, query)
+                    # top-N keeps a heap per morsel (LIMIT < rows / 8), a larger LIMIT truncates the full sort
+                    for limit in (1, 100, 20000):
+                        query_limit = '%s LIMIT %d' % (query, limit)
+                        self.assertEqual(session.values(query_limit), expected[:limit], query_limit)
+            ordered = session.values('SELECT f FROM t ORDER BY f')
+            self.assertEqual(ordered, sorted(row[3] for row in self.rows))
+            ordered = session.values('SELECT d FROM t WHERE d < 0 ORDER BY d DESC')
+            self.assertEqual(ordered, sorted((row[4] for row in self.rows if row[4] < 0), reverse=True))
+
+    def test_single_thread(self):
+        self.run_sorts('-threads', '1')
+
+    def test_two_threads(self):
+        self.run_sorts('-threads', '2')
+
+    def test_four_threads(self):
+        self.run_sorts('-threads', '4')
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,38 @@
+# Queries over column data that can not be read must fail instead of returning a partial result
+
+import os
+import sys
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from rembrandb import Server, QueryError
+
+ROWS = 300000
+
+
+class UnreadableColumnTest(unittest.TestCase):
+    def test_truncated_column(self):
+        with Server('-threads', '2', '-no-result-cache') as server:
+            server.write_csv('u.csv', 'k:lng,v:int', ((i, i % 10) for i in range(ROWS)))
+            server.write_csv('d.csv', 'v:int,w:int', ((i, i) for i in range(10)))
+            session = server.connect()
+            session.query("COPY u FROM 'u.csv'")
+            session.query("COPY d FROM 'd.csv'")
+            self.assertEqual(session.values('SELECT COUNT(k) FROM u'), [ROWS])
+            server.stop()
+            # the column file is shorter than the table file says
+            path = os.path.join(server.directory, 'Tables', 'u', 'k.col')
+            os.truncate(path, os.path.getsize(path) - 4096)
+            server.start()
+            session = server.connect()
+            for statement in ['SELECT COUNT(k) FROM u', 'SELECT SUM(k) FROM u', 'SELECT k FROM u WHERE v = 3',
+                              'SELECT k FROM u ORDER BY k LIMIT 5', 'SELECT u.k FROM u JOIN d ON u.v = d.v']:
+                with self.assertRaises(QueryError, msg=statement):
+                    session.query(statement)
+            # the columns that can be read are not affected
+            self.assertEqual(session.values('SELECT COUNT(v) FROM u'), [ROWS])
+            self.assertIsNone(server.process.poll())
+
+
+if __name__ == '__main__':
+    unittest.main()